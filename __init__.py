@@ -1,4 +1,8 @@
-from .wrappers import SINGLE, CHILDREN, WHOLE
+from .wrappers import SINGLE, CHILDREN, WHOLE, DETAILED
 from .wrappers import ignore_function, ignore_module, ignore_package
-from .wrappers import traced, log
+from .wrappers import ignore_functions_named, clear_ignore_rules
+from .wrappers import capture_function
+from .wrappers import traced, log, dump, dump_on_signal
+from .wrappers import (MAP_POPULATE, MAP_LOCKED, MAP_SEQUENTIAL,
+    MAP_MSYNC_RETIRED, MAP_DONTNEED_RETIRED, MAP_COLD_RETIRED)
 
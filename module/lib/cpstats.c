@@ -0,0 +1,204 @@
+/*
+ * Codepoint statistics -- a call count, the total inclusive and exclusive
+ * times and a histogram of the inclusive times of every codepoint, kept in
+ * a file that's mapped shared, so other processes can map it too and watch
+ * the numbers change while the program runs.
+ *
+ * the file is a header (one page) followed by an entry per codepoint,
+ * indexed by its ID. it grows a segment of entries at a time, and each
+ * segment is mapped on its own the first time an ID in it is used, so
+ * nothing that was handed out ever moves. readers should map as much of the
+ * file as the header's capacity says.
+ *
+ * the histogram is log-linear (like HdrHistogram): values below
+ * 1 << CPSTATS_SUB_BUCKET_BITS have a bucket each, and every power of two
+ * above them is split into that many buckets, so a bucket's width is
+ * within 25% of its values.
+ *
+ * when calls are sampled, the entries only cover the sampled ones, so the
+ * header also counts the calls made at the sampling depth, sampled or not,
+ * for readers to tell what share of them the entries cover.
+ *
+ * entries are updated without atomics -- all tracing happens under the GIL.
+ * readers may see an entry in the middle of an update (e.g., calls already
+ * incremented but not the histogram), which only matters to a single call.
+ */
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cpstats.h"
+
+
+#define CPSTATS_SEGMENT_SIZE  (CPSTATS_SEGMENT_ENTRIES * sizeof(cpstats_entry_t))
+#define CPSTATS_SEGMENT_OFFSET(index) \
+	(CPSTATS_HEADER_SIZE + (off_t)(index) * CPSTATS_SEGMENT_SIZE)
+
+
+errcode_t cpstats_open(cpstats_t * self, const char * filename)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+
+	memset((void*)self->segments, 0, sizeof(self->segments));
+	self->header = NULL;
+	self->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (self->fd < 0) {
+		retcode = ERR_CPSTATS_OPEN_FAILED;
+		goto error1;
+	}
+	if (ftruncate(self->fd, CPSTATS_HEADER_SIZE) != 0) {
+		retcode = ERR_CPSTATS_FTRUNCATE_FAILED;
+		goto error2;
+	}
+	self->header = mmap(NULL, CPSTATS_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			self->fd, 0);
+	if (self->header == MAP_FAILED) {
+		self->header = NULL;
+		retcode = ERR_CPSTATS_MMAP_FAILED;
+		goto error2;
+	}
+	if (pthread_mutex_init(&self->lock, NULL) != 0) {
+		retcode = ERR_CPSTATS_MUTEX_INIT_FAILED;
+		goto error3;
+	}
+	self->header->version = CPSTATS_VERSION;
+	self->header->sub_bucket_bits = CPSTATS_SUB_BUCKET_BITS;
+	self->header->bucket_count = CPSTATS_BUCKETS;
+	self->header->entry_size = sizeof(cpstats_entry_t);
+	self->header->segment_entries = CPSTATS_SEGMENT_ENTRIES;
+	self->header->capacity = 0;
+	self->header->sampled_calls = 0;
+	self->header->skipped_calls = 0;
+	self->header->sample_depth = 0;
+	// written last, so a reader that sees it sees the rest
+	__sync_synchronize();
+	self->header->magic = CPSTATS_MAGIC;
+	RETURN_SUCCESSFUL;
+
+error3:
+	munmap(self->header, CPSTATS_HEADER_SIZE);
+	self->header = NULL;
+error2:
+	close(self->fd);
+	self->fd = -1;
+error1:
+	return retcode;
+}
+
+errcode_t cpstats_close(cpstats_t * self)
+{
+	int i;
+
+	if (self->fd < 0) {
+		RETURN_SUCCESSFUL;
+	}
+	for (i = 0; i < CPSTATS_MAX_SEGMENTS; i++) {
+		if (self->segments[i] != NULL) {
+			munmap(self->segments[i], CPSTATS_SEGMENT_SIZE);
+			self->segments[i] = NULL;
+		}
+	}
+	munmap(self->header, CPSTATS_HEADER_SIZE);
+	self->header = NULL;
+	pthread_mutex_destroy(&self->lock);
+	close(self->fd);
+	self->fd = -1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * maps the segment, growing the file to hold it if it doesn't already
+ */
+static errcode_t _cpstats_map_segment(cpstats_t * self, uint32_t index)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+	void * addr;
+	uint32_t capacity;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->segments[index] != NULL) {
+		// another thread got here first
+		retcode = ERR_SUCCESS;
+		goto cleanup;
+	}
+	capacity = (index + 1) * CPSTATS_SEGMENT_ENTRIES;
+	if (capacity > self->header->capacity &&
+			ftruncate(self->fd, CPSTATS_SEGMENT_OFFSET(index + 1)) != 0) {
+		retcode = ERR_CPSTATS_FTRUNCATE_FAILED;
+		goto cleanup;
+	}
+	addr = mmap(NULL, CPSTATS_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			self->fd, CPSTATS_SEGMENT_OFFSET(index));
+	if (addr == MAP_FAILED) {
+		retcode = ERR_CPSTATS_MMAP_FAILED;
+		goto cleanup;
+	}
+	if (capacity > self->header->capacity) {
+		self->header->capacity = capacity;
+	}
+	self->segments[index] = (cpstats_entry_t*)addr;
+	retcode = ERR_SUCCESS;
+
+cleanup:
+	pthread_mutex_unlock(&self->lock);
+	return retcode;
+}
+
+int cpstats_bucket(uint64_t value)
+{
+	int exponent;
+	int index;
+
+	if (value < (1 << CPSTATS_SUB_BUCKET_BITS)) {
+		return (int)value;
+	}
+	exponent = 63 - __builtin_clzll(value);
+	index = ((exponent - CPSTATS_SUB_BUCKET_BITS + 1) << CPSTATS_SUB_BUCKET_BITS) |
+			(int)((value >> (exponent - CPSTATS_SUB_BUCKET_BITS)) &
+			((1 << CPSTATS_SUB_BUCKET_BITS) - 1));
+	return (index < CPSTATS_BUCKETS) ? index : CPSTATS_BUCKETS - 1;
+}
+
+/*
+ * accounts for a single call of the codepoint (times in nsec)
+ */
+errcode_t cpstats_add(cpstats_t * self, uint32_t id, uint64_t inclusive, uint64_t exclusive)
+{
+	uint32_t index = id / CPSTATS_SEGMENT_ENTRIES;
+	cpstats_entry_t * entry;
+
+	if (index >= CPSTATS_MAX_SEGMENTS) {
+		return ERR_CPSTATS_TOO_MANY_CODEPOINTS;
+	}
+	if (self->segments[index] == NULL) {
+		PROPAGATE(_cpstats_map_segment(self, index));
+	}
+	entry = &self->segments[index][id % CPSTATS_SEGMENT_ENTRIES];
+	entry->calls += 1;
+	entry->inclusive += inclusive;
+	entry->exclusive += exclusive;
+	if (inclusive > entry->max_inclusive) {
+		entry->max_inclusive = inclusive;
+	}
+	entry->histogram[cpstats_bucket(inclusive)] += 1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * accounts for a call made at the sampling depth, whether it was sampled
+ * (and so accounted for in the entries) or skipped
+ */
+void cpstats_add_sampled(cpstats_t * self, int sample_depth, int sampled)
+{
+	self->header->sample_depth = sample_depth;
+	if (sampled) {
+		self->header->sampled_calls += 1;
+	}
+	else {
+		self->header->skipped_calls += 1;
+	}
+}
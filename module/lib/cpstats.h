@@ -0,0 +1,67 @@
+/*
+ * Codepoint statistics, in a shared file
+ */
+
+#ifndef CPSTATS_H_INCLUDED
+#define CPSTATS_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "errors.h"
+
+
+#define CPSTATS_MAGIC            (0x54535650)  // "PVST"
+#define CPSTATS_VERSION          (2)
+#define CPSTATS_HEADER_SIZE      (4096)
+// every power of two is split into 1 << CPSTATS_SUB_BUCKET_BITS buckets
+#define CPSTATS_SUB_BUCKET_BITS  (2)
+// the last bucket starts at 2**40 nsec (about 18 minutes)
+#define CPSTATS_BUCKETS          (160)
+// the file grows by this many entries at a time (a whole number of pages)
+#define CPSTATS_SEGMENT_ENTRIES  (1024)
+#define CPSTATS_MAX_SEGMENTS     (4096)
+
+typedef struct _cpstats_header_t {
+	uint32_t   magic;
+	uint16_t   version;
+	uint16_t   sub_bucket_bits;
+	uint32_t   bucket_count;
+	uint32_t   entry_size;
+	uint32_t   segment_entries;
+	// entries in the file (whole segments); only ever grows
+	volatile uint32_t capacity;
+	// with sampling, only the calls made at sample_depth that were sampled
+	// (and their subtrees) are accounted for in the entries; the skipped
+	// ones are only counted here. sample_depth is 0 if nothing was sampled
+	uint64_t   sampled_calls;
+	uint64_t   skipped_calls;
+	uint32_t   sample_depth;
+} cpstats_header_t;
+
+// times are in nsec
+typedef struct _cpstats_entry_t {
+	uint64_t   calls;
+	uint64_t   inclusive;
+	uint64_t   exclusive;
+	uint64_t   max_inclusive;
+	uint64_t   histogram[CPSTATS_BUCKETS];   // of the inclusive times
+} cpstats_entry_t;
+
+typedef struct _cpstats_t {
+	int                  fd;
+	cpstats_header_t *   header;
+	// segments are mapped when first used, and stay until finalized
+	cpstats_entry_t * volatile segments[CPSTATS_MAX_SEGMENTS];
+	// protects growing the file
+	pthread_mutex_t      lock;
+} cpstats_t;
+
+errcode_t cpstats_open(cpstats_t * self, const char * filename);
+errcode_t cpstats_close(cpstats_t * self);
+errcode_t cpstats_add(cpstats_t * self, uint32_t id, uint64_t inclusive, uint64_t exclusive);
+void cpstats_add_sampled(cpstats_t * self, int sample_depth, int sampled);
+int cpstats_bucket(uint64_t value);
+
+
+#endif /* CPSTATS_H_INCLUDED */
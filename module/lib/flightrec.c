@@ -0,0 +1,203 @@
+/*
+ * Flight recorder -- keeps the most recent records in memory, so they can be
+ * dumped (written somewhere else) only when something interesting happens.
+ *
+ * the ring is made of equal-sized chunks, which are filled one after the
+ * other; when the last one is full, the oldest is reused. chunks are
+ * numbered by a free-running sequence number (from 1), and chunk seq lives
+ * in slot seq % chunk_count. a record never spans chunks, so every chunk
+ * can be read on its own -- the user is told when a new chunk is started
+ * (generation changes), and may begin it with whatever its records need to
+ * be decoded (e.g., absolute values that later records are relative to).
+ *
+ * records are prefixed by their length and padded to FLIGHTREC_ALIGNMENT.
+ * a dump selects the most recent chunks by size and time (always whole
+ * chunks), starting no earlier than where the previous dump ended, and
+ * iterates their records.
+ */
+#include <string.h>
+
+#include "flightrec.h"
+
+
+#define FLIGHTREC_ALIGNMENT    (4)
+#define FLIGHTREC_ALIGN(size) \
+	(((size) + FLIGHTREC_ALIGNMENT - 1) & ~((size_t)FLIGHTREC_ALIGNMENT - 1))
+#define FLIGHTREC_SLOT(self, seq)    ((int)((seq) % (self)->chunk_count))
+#define FLIGHTREC_CHUNK(self, seq)   (&(self)->chunks[FLIGHTREC_SLOT(self, seq)])
+#define FLIGHTREC_DATA(self, seq) \
+	((self)->buffer + (size_t)FLIGHTREC_SLOT(self, seq) * (self)->chunk_size)
+
+
+/*
+ * size -- the total size of the ring, rounded down to whole chunks (there
+ * must be at least two)
+ */
+errcode_t flightrec_init(flightrec_t * self, size_t size, size_t chunk_size)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+
+	if (chunk_size <= sizeof(flightrec_recsize_t) || size / chunk_size < 2) {
+		return ERR_FLIGHTREC_TOO_SMALL;
+	}
+	self->chunk_size = chunk_size;
+	self->chunk_count = size / chunk_size;
+	self->buffer = malloc(self->chunk_count * chunk_size);
+	if (self->buffer == NULL) {
+		retcode = ERR_FLIGHTREC_MALLOC_FAILED;
+		goto error1;
+	}
+	self->chunks = calloc(self->chunk_count, sizeof(flightrec_chunk_t));
+	if (self->chunks == NULL) {
+		retcode = ERR_FLIGHTREC_MALLOC_FAILED;
+		goto error2;
+	}
+	self->generation = 1;
+	FLIGHTREC_CHUNK(self, 1)->seq = 1;
+	self->reserved = NULL;
+	self->reserved_size = 0;
+	self->dumped.seq = 0;
+	self->dumped.offset = 0;
+	RETURN_SUCCESSFUL;
+
+error2:
+	free(self->buffer);
+	self->buffer = NULL;
+error1:
+	return retcode;
+}
+
+errcode_t flightrec_fini(flightrec_t * self)
+{
+	if (self->chunks != NULL) {
+		free(self->chunks);
+		self->chunks = NULL;
+	}
+	if (self->buffer != NULL) {
+		free(self->buffer);
+		self->buffer = NULL;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * reserves room for a record of up to `size` bytes, starting a new chunk
+ * (overwriting the oldest one) if the current one doesn't have room.
+ * nothing is visible until flightrec_commit() is called with the actual size
+ */
+errcode_t flightrec_reserve(flightrec_t * self, size_t size, OUT void ** outbuf)
+{
+	size_t used = sizeof(flightrec_recsize_t) + FLIGHTREC_ALIGN(size);
+	flightrec_chunk_t * chunk = FLIGHTREC_CHUNK(self, self->generation);
+	uint64_t last_timestamp;
+
+	if (used > self->chunk_size) {
+		return ERR_FLIGHTREC_SIZE_TOO_LARGE;
+	}
+	if (chunk->length + used > self->chunk_size) {
+		last_timestamp = chunk->last_timestamp;
+		self->generation += 1;
+		chunk = FLIGHTREC_CHUNK(self, self->generation);
+		chunk->seq = self->generation;
+		chunk->length = 0;
+		chunk->last_timestamp = last_timestamp;
+	}
+	self->reserved = FLIGHTREC_DATA(self, self->generation) + chunk->length;
+	self->reserved_size = size;
+	*outbuf = (char *)self->reserved + sizeof(flightrec_recsize_t);
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * timestamp is that of the record, which tells how old the chunk is
+ */
+errcode_t flightrec_commit(flightrec_t * self, size_t size, uint64_t timestamp)
+{
+	flightrec_chunk_t * chunk = FLIGHTREC_CHUNK(self, self->generation);
+
+	if (self->reserved == NULL) {
+		return ERR_FLIGHTREC_NOTHING_RESERVED;
+	}
+	if (size > self->reserved_size) {
+		return ERR_FLIGHTREC_COMMIT_EXCEEDS_RESERVED;
+	}
+	*((flightrec_recsize_t*)self->reserved) = size;
+	chunk->length += sizeof(flightrec_recsize_t) + FLIGHTREC_ALIGN(size);
+	chunk->last_timestamp = timestamp;
+	self->reserved = NULL;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns a cursor at the first record to dump: the most recent chunks are
+ * taken until they hold at least max_size bytes, and as long as they have
+ * records from min_timestamp on (0 means no limit), but nothing that was
+ * already dumped
+ */
+void flightrec_select(flightrec_t * self, size_t max_size, uint64_t min_timestamp,
+		OUT flightrec_cursor_t * outcursor)
+{
+	uint64_t seq;
+	uint64_t oldest = 1;
+	size_t total = 0;
+	size_t offset;
+	flightrec_chunk_t * chunk;
+
+	if (self->generation > (uint64_t)self->chunk_count) {
+		oldest = self->generation - self->chunk_count + 1;
+	}
+	if (self->dumped.seq > oldest) {
+		oldest = self->dumped.seq;
+	}
+	// nothing, unless some chunks are taken
+	outcursor->seq = self->generation;
+	outcursor->offset = FLIGHTREC_CHUNK(self, self->generation)->length;
+
+	for (seq = self->generation; seq >= oldest; seq--) {
+		chunk = FLIGHTREC_CHUNK(self, seq);
+		if (max_size > 0 && total >= max_size) {
+			break;
+		}
+		if (min_timestamp > 0 && chunk->last_timestamp < min_timestamp) {
+			break;
+		}
+		offset = (seq == self->dumped.seq) ? self->dumped.offset : 0;
+		if (offset < chunk->length) {
+			total += chunk->length - offset;
+		}
+		outcursor->seq = seq;
+		outcursor->offset = offset;
+	}
+}
+
+/*
+ * returns the record at the cursor and advances it. records returned here
+ * are never selected again
+ */
+errcode_t flightrec_next(flightrec_t * self, flightrec_cursor_t * cursor,
+		OUT void ** outbuf, OUT size_t * outsize)
+{
+	flightrec_chunk_t * chunk;
+	char * record;
+
+	while (cursor->seq <= self->generation) {
+		chunk = FLIGHTREC_CHUNK(self, cursor->seq);
+		if (chunk->seq != cursor->seq) {
+			return ERR_FLIGHTREC_CHUNK_OVERWRITTEN;
+		}
+		if (cursor->offset < chunk->length) {
+			record = FLIGHTREC_DATA(self, cursor->seq) + cursor->offset;
+			*outsize = *((flightrec_recsize_t*)record);
+			*outbuf = record + sizeof(flightrec_recsize_t);
+			cursor->offset += sizeof(flightrec_recsize_t) + FLIGHTREC_ALIGN(*outsize);
+			self->dumped = *cursor;
+			RETURN_SUCCESSFUL;
+		}
+		if (cursor->seq == self->generation) {
+			break;
+		}
+		cursor->seq += 1;
+		cursor->offset = 0;
+	}
+	return ERR_FLIGHTREC_END;
+}
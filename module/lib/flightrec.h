@@ -0,0 +1,53 @@
+/*
+ * Flight recorder -- an in-memory ring of records
+ */
+
+#ifndef FLIGHTREC_H_INCLUDED
+#define FLIGHTREC_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "errors.h"
+
+
+typedef uint32_t flightrec_recsize_t;
+
+typedef struct _flightrec_chunk_t {
+	uint64_t   seq;            // 0 if the chunk was never used
+	size_t     length;         // of the committed records
+	uint64_t   last_timestamp; // of the last committed record
+} flightrec_chunk_t;
+
+// a position in the ring: a chunk (by its sequence number) and an offset
+// into it
+typedef struct _flightrec_cursor_t {
+	uint64_t   seq;
+	size_t     offset;
+} flightrec_cursor_t;
+
+typedef struct _flightrec_t {
+	char *              buffer;
+	size_t              chunk_size;
+	int                 chunk_count;
+	flightrec_chunk_t * chunks;
+	// the chunk being written. it changes whenever a new chunk is started,
+	// so the user can tell (like rotrec's generation)
+	uint64_t            generation;
+	void *              reserved;
+	size_t              reserved_size;
+	// where the last dump ended
+	flightrec_cursor_t  dumped;
+} flightrec_t;
+
+errcode_t flightrec_init(flightrec_t * self, size_t size, size_t chunk_size);
+errcode_t flightrec_fini(flightrec_t * self);
+errcode_t flightrec_reserve(flightrec_t * self, size_t size, OUT void ** outbuf);
+errcode_t flightrec_commit(flightrec_t * self, size_t size, uint64_t timestamp);
+void flightrec_select(flightrec_t * self, size_t max_size, uint64_t min_timestamp,
+		OUT flightrec_cursor_t * outcursor);
+errcode_t flightrec_next(flightrec_t * self, flightrec_cursor_t * cursor,
+		OUT void ** outbuf, OUT size_t * outsize);
+
+
+#endif /* FLIGHTREC_H_INCLUDED */
@@ -13,7 +13,9 @@
  * time.
  *
  * FWindow (file window) -- a sliding window over fmap. it advances the
- * window's position every time you write to it, like a stream.
+ * window's position every time you write to it, like a stream. instead of
+ * writing a buffer, you can also reserve a region at the current position,
+ * fill it in place, and then fwindow_advance() over the part you've used.
  */
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -24,13 +26,18 @@
 #include <string.h>
 
 #include "fmap.h"
+#include "reaper.h"
 
 static long _fmap_page_size = 0;
 
 
 /*
  * fd - an open file descriptor, with the right mode (reading/writing/etc)
- * flags - a combination of FMAP_{READ|WRITE|LOCK|NOSWAP|READ_AHEAD}
+ * flags - a combination of FMAP_{READ|WRITE|LOCK|NOSWAP|READ_AHEAD}, the
+ *   advice FMAP_SEQUENTIAL for new maps, and FMAP_{MSYNC|DONTNEED|COLD}_RETIRED
+ *   for what's done with a map that's moved away
+ * max_file_size - if nonzero, the file is never grown past this size, even
+ *   if a map extends beyond it (nothing may be written there, though)
  * map_size - the total size of the mapped portion (usually ~5MB)
  * map_ahead_size - a hint used to determine where to start the maping,
  * relative to the user's desired offset:
@@ -41,7 +48,8 @@ static long _fmap_page_size = 0;
  *     |-------------- total map size ---------------|
  *                |--------- map_ahead_size ---------|
  */
-errcode_t fmap_init(fmap_t * self, int fd, int flags, size_t map_size, size_t map_ahead_size)
+errcode_t fmap_init(fmap_t * self, int fd, int flags, off_t max_file_size,
+		size_t map_size, size_t map_ahead_size)
 {
 	if (_fmap_page_size == 0) {
 		_fmap_page_size = sysconf(_SC_PAGE_SIZE);
@@ -52,6 +60,7 @@ errcode_t fmap_init(fmap_t * self, int fd, int flags, size_t map_size, size_t ma
 	}
 
 	self->fd = fd;
+	self->max_file_size = max_file_size;
 	self->map_size = map_size;
 	self->physical_map_size = map_size + _fmap_page_size;
 	if (self->physical_map_size % _fmap_page_size != 0) {
@@ -68,54 +77,21 @@ errcode_t fmap_init(fmap_t * self, int fd, int flags, size_t map_size, size_t ma
 	              ((flags & FMAP_READ_AHEAD) ? MAP_POPULATE : 0) |
 	              ((flags & FMAP_LOCKED) ? MAP_LOCKED : 0) |
 	              ((flags & FMAP_NOSWAP) ? MAP_NORESERVE : 0);
+	self->retire_flags = ((flags & FMAP_MSYNC_RETIRED) ? REAPER_MSYNC : 0) |
+	              ((flags & FMAP_DONTNEED_RETIRED) ? REAPER_DONTNEED : 0) |
+	              ((flags & FMAP_COLD_RETIRED) ? REAPER_COLD : 0);
+	self->advice = flags & FMAP_SEQUENTIAL;
 	RETURN_SUCCESSFUL;
 }
 
 //#define FMAP_BACKGROUND_MUNMAP
 
-#ifdef FMAP_BACKGROUND_MUNMAP
-#include <pthread.h>
-
-typedef struct
-{
-	void * addr;
-	size_t length;
-} _munmap_args_t;
-
-static void * _threaded_munmap(void * arg)
-{
-	_munmap_args_t munmap_args = *((_munmap_args_t*)arg);
-	free(arg);
-	munmap(munmap_args.addr, munmap_args.length);
-	return NULL;
-}
-
-static inline void nonblocking_munmap(void * addr, size_t length)
-{
-	_munmap_args_t * munmap_args = (_munmap_args_t *)malloc(sizeof(_munmap_args_t));
-	pthread_t t;
-
-	if (munmap_args != NULL) {
-		munmap_args->addr = addr;
-		munmap_args->length = length;
-		if (pthread_create(&t, NULL, _threaded_munmap, munmap_args) == 0) {
-			return; // great success
-		}
-		// thread creation failed, release resources
-		free(munmap_args);
-	}
-
-	// sorry, we have to block
-	munmap(addr, length);
-}
-#endif // FMAP_BACKGROUND_MUNMAP
-
 static inline void _fmap_unmap(fmap_t * self)
 {
 	#ifdef FMAP_BACKGROUND_MUNMAP
-	nonblocking_munmap(self->addr, self->physical_map_size);
+	reaper_unmap(self->addr, self->physical_map_size, self->retire_flags);
 	#else
-	munmap(self->addr, self->physical_map_size);
+	reaper_unmap_now(self->addr, self->physical_map_size, self->retire_flags);
 	#endif
 	self->addr = NULL;
 }
@@ -144,6 +120,29 @@ static inline errcode_t _fmap_ensure_file_capacity(int fd, off_t length)
 	RETURN_SUCCESSFUL;
 }
 
+/*
+ * maps physical_map_size bytes of the file at `offset`, and applies the
+ * advice
+ */
+static inline errcode_t _fmap_mmap(fmap_t * self, off_t offset, OUT void ** outaddr)
+{
+	size_t size = self->physical_map_size;
+	char * addr;
+
+	addr = mmap(NULL, size, self->prot, self->flags, self->fd, offset);
+	if (addr == MAP_FAILED) {
+		return ERR_FMAP_MMAP_FAILED; // check errno
+	}
+
+	// advice is only a hint, so failures are ignored
+	if (self->advice & FMAP_SEQUENTIAL) {
+		madvise(addr, size, MADV_SEQUENTIAL);
+	}
+
+	*outaddr = addr;
+	RETURN_SUCCESSFUL;
+}
+
 errcode_t fmap_map(fmap_t * self, off_t offset, size_t size, OUT void ** outaddr)
 {
 	off_t abs_offset, page_offset, end_offset, back_size, fwd_size;
@@ -177,12 +176,10 @@ errcode_t fmap_map(fmap_t * self, off_t offset, size_t size, OUT void ** outaddr
 			// is rounded up
 			return ERR_FMAP_ALIGNMENT_ERROR;
 		}
-		PROPAGATE(_fmap_ensure_file_capacity(self->fd, end_offset));
-		addr = mmap(NULL, self->physical_map_size, self->prot, self->flags,
-				self->fd, page_offset);
-		if (addr == MAP_FAILED) {
-			return ERR_FMAP_MMAP_FAILED; // check errno
-		}
+		PROPAGATE(_fmap_ensure_file_capacity(self->fd,
+				(self->max_file_size > 0 && end_offset > self->max_file_size) ?
+				self->max_file_size : end_offset));
+		PROPAGATE(_fmap_mmap(self, page_offset, &addr));
 		self->map_offset = page_offset;
 		self->addr = addr;
 	}
@@ -194,10 +191,15 @@ errcode_t fmap_map(fmap_t * self, off_t offset, size_t size, OUT void ** outaddr
 /*
  * sliding window over fmap
  */
-errcode_t fwindow_init(fwindow_t * self, int fd, size_t map_size)
+/*
+ * flags -- extra FMAP_* flags (the window is always writable)
+ * max_file_size -- if nonzero, how far the window may go (see fmap_init)
+ */
+errcode_t fwindow_init(fwindow_t * self, int fd, off_t max_file_size, size_t map_size,
+		int flags)
 {
 	self->pos = 0;
-	return fmap_init(&self->map, fd, FMAP_WRITE, map_size, map_size);
+	return fmap_init(&self->map, fd, FMAP_WRITE | flags, max_file_size, map_size, map_size);
 }
 
 errcode_t fwindow_fini(fwindow_t * self)
@@ -216,6 +218,43 @@ errcode_t fwindow_write(fwindow_t * self, const void * buf, size_t size)
 	return 0;
 }
 
+/*
+ * maps `size` bytes at the current position and returns a pointer to them,
+ * without advancing the position. the caller fills the region directly and
+ * then calls fwindow_advance() with the number of bytes actually used. the
+ * pointer is valid until the next call that moves the window.
+ */
+errcode_t fwindow_reserve(fwindow_t * self, size_t size, OUT void ** outaddr)
+{
+	return fmap_map(&self->map, self->pos, size, outaddr);
+}
+
+/*
+ * maps the window at the current position and writes to every page of it,
+ * so that the page faults (and the file's block allocation) are taken by
+ * the caller rather than by whoever writes there next. the content of the
+ * file is left intact. pages past max_file_size aren't in the file, so
+ * they're left alone
+ */
+errcode_t fwindow_prefault(fwindow_t * self)
+{
+	volatile char * addr;
+	void * unused;
+	size_t i, size;
+
+	PROPAGATE(fmap_map(&self->map, self->pos, 0, &unused));
+	addr = (volatile char *)self->map.addr;
+	size = self->map.physical_map_size;
+	if (self->map.max_file_size > 0 &&
+			self->map.map_offset + (off_t)size > self->map.max_file_size) {
+		size = self->map.max_file_size - self->map.map_offset;
+	}
+	for (i = 0; i < size; i += _fmap_page_size) {
+		addr[i] = addr[i];
+	}
+	RETURN_SUCCESSFUL;
+}
+
 inline off_t fwindow_tell(fwindow_t * self)
 {
 	return self->pos;
@@ -238,7 +277,7 @@ int main()
 		printf("open failed\n");
 		return 1;
 	}
-	ASSERT(fwindow_init(&w, fd, 4000));
+	ASSERT(fwindow_init(&w, fd, 0, 4000, 0));
 	for (i = 0; i < 100; i++) {
 		printf("%d\n", i);
 		ASSERT(fwindow_write(&w, buf, sizeof(buf)));
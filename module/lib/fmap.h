@@ -6,6 +6,7 @@
 #define FMAP_H_INCLUDED
 
 #include <stdlib.h>
+#include <sys/types.h>
 #include "errors.h"
 
 #define FMAP_READ       (1)
@@ -13,20 +14,28 @@
 #define FMAP_READ_AHEAD (4)
 #define FMAP_LOCKED     (16)
 #define FMAP_NOSWAP     (32)
+#define FMAP_MSYNC_RETIRED     (64)
+#define FMAP_DONTNEED_RETIRED  (128)
+#define FMAP_COLD_RETIRED      (256)
+#define FMAP_SEQUENTIAL        (1024)
 
 typedef struct _fmap_t
 {
 	int    fd;
+	off_t  max_file_size;
 	size_t map_size;
 	size_t physical_map_size;
 	size_t map_ahead_size;
 	off_t  map_offset;
 	int    prot;
 	int    flags;
+	int    retire_flags;
+	int    advice;
 	void * addr;
 } fmap_t;
 
-errcode_t fmap_init(fmap_t * self, int fd, int flags, size_t map_size, size_t map_ahead_size);
+errcode_t fmap_init(fmap_t * self, int fd, int flags, off_t max_file_size,
+		size_t map_size, size_t map_ahead_size);
 errcode_t fmap_fini(fmap_t * self);
 errcode_t fmap_map(fmap_t * self, off_t offset, size_t size, OUT void ** outaddr);
 
@@ -36,9 +45,12 @@ typedef struct _fwindow_t
 	off_t  pos;
 } fwindow_t;
 
-errcode_t fwindow_init(fwindow_t * self, int fd, size_t map_size);
+errcode_t fwindow_init(fwindow_t * self, int fd, off_t max_file_size, size_t map_size,
+		int flags);
 errcode_t fwindow_fini(fwindow_t * self);
 errcode_t fwindow_write(fwindow_t * self, const void * buf, size_t size);
+errcode_t fwindow_reserve(fwindow_t * self, size_t size, OUT void ** outaddr);
+errcode_t fwindow_prefault(fwindow_t * self);
 inline off_t fwindow_tell(fwindow_t * self);
 inline void fwindow_advance(fwindow_t * self, off_t delta);
 
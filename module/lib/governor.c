@@ -0,0 +1,187 @@
+/*
+ * Rate governor -- counts the calls of every ID (e.g., a codepoint) over a
+ * sliding window, and suppresses IDs that are called more than max_count
+ * times per window_size. the sliding window is approximated by two fixed
+ * windows: the calls of the current one, plus the calls of the previous one
+ * weighted by how much of it the sliding window still covers.
+ *
+ * suppression lasts for the governor's lifetime. instead of being recorded,
+ * the calls of a suppressed ID are counted and their durations summed,
+ * until the summary is taken. a return is matched to a suppressed call only
+ * if such a call is in flight: calls return in reverse order, so the returns
+ * of calls made before the ID was suppressed come after those of the calls
+ * made since.
+ *
+ * a governor is not thread safe; every tracer has its own.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "governor.h"
+
+
+errcode_t governor_init(governor_t * self, uint64_t window_size, uint64_t max_count)
+{
+	self->window_size = window_size;
+	self->max_count = max_count;
+	// entries start out (zeroed) in window 0, which is never current
+	self->window = 1;
+	self->window_end = 0;
+	self->entries = NULL;
+	self->capacity = 0;
+	self->suppressed = NULL;
+	self->suppressed_count = 0;
+	self->suppressed_capacity = 0;
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t governor_fini(governor_t * self)
+{
+	free(self->entries);
+	self->entries = NULL;
+	self->capacity = 0;
+	free(self->suppressed);
+	self->suppressed = NULL;
+	self->suppressed_count = 0;
+	self->suppressed_capacity = 0;
+	RETURN_SUCCESSFUL;
+}
+
+static errcode_t _governor_grow(governor_t * self, uint32_t id)
+{
+	uint32_t capacity = self->capacity > 0 ? self->capacity : GOVERNOR_MIN_CAPACITY;
+	governor_entry_t * entries;
+
+	while (capacity <= id) {
+		capacity *= 2;
+	}
+	entries = (governor_entry_t*)realloc(self->entries, capacity * sizeof(governor_entry_t));
+	if (entries == NULL) {
+		return ERR_GOVERNOR_MALLOC_FAILED;
+	}
+	memset(entries + self->capacity, 0,
+			(capacity - self->capacity) * sizeof(governor_entry_t));
+	self->entries = entries;
+	self->capacity = capacity;
+	RETURN_SUCCESSFUL;
+}
+
+static errcode_t _governor_suppress(governor_t * self, uint32_t id)
+{
+	uint32_t * suppressed;
+	uint32_t capacity;
+
+	if (self->suppressed_count >= self->suppressed_capacity) {
+		capacity = self->suppressed_capacity > 0 ? self->suppressed_capacity * 2 : 64;
+		suppressed = (uint32_t*)realloc(self->suppressed, capacity * sizeof(uint32_t));
+		if (suppressed == NULL) {
+			return ERR_GOVERNOR_MALLOC_FAILED;
+		}
+		self->suppressed = suppressed;
+		self->suppressed_capacity = capacity;
+	}
+	self->suppressed[self->suppressed_count] = id;
+	self->suppressed_count += 1;
+	self->entries[id].suppressed = 1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * moves on to the window that `now` is in (call it once now reaches
+ * window_end)
+ */
+void governor_next_window(governor_t * self, uint64_t now)
+{
+	uint64_t count;
+
+	if (self->window_end == 0) {
+		self->window_end = now + self->window_size;
+		return;
+	}
+	if (now < self->window_end) {
+		return;
+	}
+	count = (now - self->window_end) / self->window_size + 1;
+	self->window += count;
+	self->window_end += count * self->window_size;
+}
+
+/*
+ * counts a call of id, which the caller must not record if *outsuppressed
+ * is set. the caller is expected to have moved on to the current window
+ */
+errcode_t governor_call(governor_t * self, uint32_t id, uint64_t now, OUT int * outsuppressed)
+{
+	governor_entry_t * entry;
+	uint64_t remaining;
+
+	if (id >= self->capacity) {
+		PROPAGATE(_governor_grow(self, id));
+	}
+	entry = &self->entries[id];
+	if (!entry->suppressed) {
+		if (entry->window != self->window) {
+			entry->prev_count = (entry->window + 1 == self->window) ? entry->count : 0;
+			entry->count = 0;
+			entry->window = self->window;
+		}
+		entry->count += 1;
+		remaining = (self->window_end > now) ? self->window_end - now : 0;
+		if ((uint64_t)entry->count * self->window_size +
+				(uint64_t)entry->prev_count * remaining <= self->max_count * self->window_size) {
+			*outsuppressed = 0;
+			RETURN_SUCCESSFUL;
+		}
+		PROPAGATE(_governor_suppress(self, id));
+	}
+	entry->inflight += 1;
+	entry->pending -= now;
+	entry->calls += 1;
+	*outsuppressed = 1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns whether this return (or raise) of id belongs to a suppressed call
+ */
+int governor_return(governor_t * self, uint32_t id, uint64_t now)
+{
+	governor_entry_t * entry;
+
+	if (id >= self->capacity) {
+		return 0;
+	}
+	entry = &self->entries[id];
+	if (entry->inflight == 0) {
+		return 0;
+	}
+	entry->inflight -= 1;
+	entry->pending += now;
+	if (entry->inflight == 0) {
+		entry->time += entry->pending;
+		entry->pending = 0;
+	}
+	return 1;
+}
+
+/*
+ * returns the calls and total time of the index'th suppressed ID since its
+ * summary was last taken, and resets them. returns 0 if index is past the
+ * last suppressed ID
+ */
+int governor_take_summary(governor_t * self, uint32_t index, OUT uint32_t * outid,
+		OUT uint64_t * outcalls, OUT uint64_t * outtime)
+{
+	governor_entry_t * entry;
+
+	if (index >= self->suppressed_count) {
+		return 0;
+	}
+	*outid = self->suppressed[index];
+	entry = &self->entries[*outid];
+	*outcalls = entry->calls;
+	*outtime = entry->time;
+	entry->calls = 0;
+	entry->time = 0;
+	return 1;
+}
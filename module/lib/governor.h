@@ -0,0 +1,48 @@
+/*
+ * Rate governor
+ */
+
+#ifndef GOVERNOR_H_INCLUDED
+#define GOVERNOR_H_INCLUDED
+
+#include <stdint.h>
+
+#include "errors.h"
+
+
+#define GOVERNOR_MIN_CAPACITY  (1024)
+
+typedef struct _governor_entry_t {
+	uint64_t   window;      // the window count is of
+	uint32_t   count;       // calls in that window
+	uint32_t   prev_count;  // calls in the window before it
+	int        suppressed;
+	uint32_t   inflight;    // suppressed calls that didn't return yet
+	uint64_t   pending;     // sum(returns) - sum(calls) of the calls in flight
+	// since the summary was last taken (see governor_take_summary)
+	uint64_t   calls;
+	uint64_t   time;
+} governor_entry_t;
+
+typedef struct _governor_t {
+	uint64_t            window_size;  // in the units of the times given
+	uint64_t            max_count;    // calls per window_size
+	uint64_t            window;
+	uint64_t            window_end;   // 0 until the first call
+	governor_entry_t *  entries;      // indexed by ID
+	uint32_t            capacity;
+	uint32_t *          suppressed;   // the IDs suppressed so far
+	uint32_t            suppressed_count;
+	uint32_t            suppressed_capacity;
+} governor_t;
+
+errcode_t governor_init(governor_t * self, uint64_t window_size, uint64_t max_count);
+errcode_t governor_fini(governor_t * self);
+errcode_t governor_call(governor_t * self, uint32_t id, uint64_t now, OUT int * outsuppressed);
+int governor_return(governor_t * self, uint32_t id, uint64_t now);
+void governor_next_window(governor_t * self, uint64_t now);
+int governor_take_summary(governor_t * self, uint32_t index, OUT uint32_t * outid,
+		OUT uint64_t * outcalls, OUT uint64_t * outtime);
+
+
+#endif /* GOVERNOR_H_INCLUDED */
@@ -1,5 +1,13 @@
 /*
  * High Performance Time
+ *
+ * time is read from the TSC if it's invariant (ticks at a constant rate,
+ * regardless of frequency scaling and sleep states), and otherwise from
+ * CLOCK_MONOTONIC (the coarse clock is cheaper, but it only ticks every few
+ * msec, which is longer than most calls take). the TSC rate is calibrated against
+ * CLOCK_MONOTONIC when the module is initialized, and converting ticks to
+ * microseconds is a fixed point multiplication. everything here is written
+ * only by hptime_init, so reading the time from many threads is safe.
  */
 
 #include <string.h>
@@ -7,77 +15,143 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 #include "hptime.h"
 
 
-static double hptime_cpu_freq_usec = 0;
-static usec_t hptime_boot_time = 0;
-static usec_t hptime_last_wall_time = 0;
+// usec = base_usec + ((ticks - base_ticks) * usec_mult) >> HPTIME_MULT_SHIFT
+#define HPTIME_MULT_SHIFT  (32)
+
+static int hptime_source = 0;
+static uint64_t hptime_ticks_per_sec = 0;
+static uint64_t hptime_usec_mult = 0;
+static uint64_t hptime_nsec_mult = 0;
+static hptime_ticks_t hptime_base_ticks = 0;
+static usec_t hptime_base_usec = 0;
 
 static inline uint64_t hptime_get_cpu_cycles(void)
 {
-#ifdef __x86_64__
+#if defined(__x86_64__)
 	unsigned int __a,__d;
 	asm volatile("rdtsc" : "=a" (__a), "=d" (__d));
 	return (((unsigned long)__a) | (((unsigned long)__d)<<32));
-#else
+#elif defined(__i386__)
 	unsigned long long val = 0;
 	__asm__ __volatile__("rdtsc" : "=A" (val));
 	return val;
+#else
+	return 0;
 #endif
 }
 
-static inline errcode_t hptime_get_cpu_freq(double * out)
+static inline int hptime_has_invariant_tsc(void)
 {
-	char line[1000];
-	double mhz = -1;
-	FILE * f = fopen("/proc/cpuinfo", "r");
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
 
-	if (f == NULL) {
-		return ERR_HPTIME_FOPEN_FAILED;
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+		return 0;
 	}
-
-	while (fgets(line, sizeof(line) - 1, f) != NULL) {
-		if (strstr(line, "cpu MHz") != NULL) {
-			mhz = atof(strstr(line, ":") + 2);
-			break;
-		}
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+		return 0;
 	}
+	return (edx >> 8) & 1;
+#else
+	return 0;
+#endif
+}
 
-	fclose(f);
-	*out = mhz * 1000000;
-	RETURN_SUCCESSFUL;
+static inline uint64_t hptime_get_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static inline usec_t hptime_get_usec_since_boot(void)
+inline hptime_ticks_t hptime_get_ticks(void)
 {
-	return (usec_t)(hptime_get_cpu_cycles() / hptime_cpu_freq_usec);
+	if (hptime_source == HPTIME_SOURCE_TSC) {
+		return hptime_get_cpu_cycles();
+	}
+	return hptime_get_clock_ns(CLOCK_MONOTONIC);
 }
 
-static inline usec_t hptime_get_wall_time(void)
+/*
+ * reads the ticks and the system clocks as close together as possible: the
+ * clocks are read between two tick readings, and the attempt where these
+ * were closest wins
+ */
+static void hptime_sample(OUT hptime_clocksync_t * sync)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (unsigned long long)tv.tv_usec +
-		((unsigned long long)1000000) * tv.tv_sec;
+	hptime_ticks_t before, after, best = (hptime_ticks_t)-1;
+	uint64_t monotonic_ns, realtime_ns;
+	int i;
+
+	for (i = 0; i < HPTIME_SAMPLE_ATTEMPTS; i++) {
+		before = hptime_get_ticks();
+		monotonic_ns = hptime_get_clock_ns(CLOCK_MONOTONIC);
+		realtime_ns = hptime_get_clock_ns(CLOCK_REALTIME);
+		after = hptime_get_ticks();
+		if (after - before < best) {
+			best = after - before;
+			sync->ticks = before + (after - before) / 2;
+			sync->monotonic_ns = monotonic_ns;
+			sync->realtime_ns = realtime_ns;
+		}
+	}
+	sync->ticks_per_sec = hptime_ticks_per_sec;
 }
 
-static inline usec_t hptime_get_fast_time(void)
+static inline errcode_t hptime_calibrate(void)
 {
-	return hptime_boot_time + hptime_get_usec_since_boot();
+	hptime_clocksync_t start, end;
+	uint64_t elapsed_ns;
+
+	hptime_sample(&start);
+	do {
+		hptime_sample(&end);
+		elapsed_ns = end.monotonic_ns - start.monotonic_ns;
+	} while (elapsed_ns < HPTIME_CALIBRATION_NSEC);
+
+	if (end.ticks <= start.ticks) {
+		return ERR_HPTIME_CALIBRATION_FAILED;
+	}
+	hptime_ticks_per_sec = (uint64_t)((double)(end.ticks - start.ticks) *
+			1000000000.0 / elapsed_ns);
+	RETURN_SUCCESSFUL;
 }
 
 errcode_t hptime_init(void)
 {
-	if (hptime_boot_time != 0) {
+	hptime_clocksync_t sync;
+	struct timespec res;
+
+	if (hptime_source != 0) {
 		RETURN_SUCCESSFUL; // already initialized
 	}
-	double freq;
-	PROPAGATE(hptime_get_cpu_freq(&freq));
-	hptime_cpu_freq_usec = freq / 1000000;
-	hptime_last_wall_time = hptime_get_wall_time();
-	hptime_boot_time = hptime_last_wall_time - hptime_get_usec_since_boot();
+	if (clock_getres(CLOCK_MONOTONIC, &res) != 0) {
+		return ERR_HPTIME_CLOCK_FAILED;
+	}
+
+	if (hptime_has_invariant_tsc()) {
+		hptime_source = HPTIME_SOURCE_TSC;
+		PROPAGATE(hptime_calibrate());
+	}
+	else {
+		hptime_source = HPTIME_SOURCE_MONOTONIC;
+		hptime_ticks_per_sec = 1000000000ULL;
+	}
+	hptime_usec_mult = (uint64_t)((1000000.0 * (1ULL << HPTIME_MULT_SHIFT)) /
+			hptime_ticks_per_sec);
+	hptime_nsec_mult = (uint64_t)((1000000000.0 * (1ULL << HPTIME_MULT_SHIFT)) /
+			hptime_ticks_per_sec);
+
+	hptime_sample(&sync);
+	hptime_base_ticks = sync.ticks;
+	hptime_base_usec = sync.realtime_ns / 1000;
 	RETURN_SUCCESSFUL;
 }
 
@@ -86,15 +160,51 @@ errcode_t hptime_fini(void)
 	RETURN_SUCCESSFUL;
 }
 
+inline usec_t hptime_ticks_to_usec(hptime_ticks_t ticks)
+{
+	uint64_t delta = ticks - hptime_base_ticks;
+	// the multiplier is below 2**32 (there are more than a million ticks a
+	// second), so multiplying each half of delta by it can't overflow
+	return hptime_base_usec + (delta >> HPTIME_MULT_SHIFT) * hptime_usec_mult +
+			(((delta & 0xffffffffULL) * hptime_usec_mult) >> HPTIME_MULT_SHIFT);
+}
+
+/*
+ * converts a duration (not a point in time) to ticks
+ */
+hptime_ticks_t hptime_usec_to_ticks(usec_t usec)
+{
+	return (hptime_ticks_t)((double)usec * hptime_ticks_per_sec / 1000000.0);
+}
+
+/*
+ * converts a duration in ticks to nanoseconds. the multiplier is at most
+ * 2**32 (there are at least a billion ticks a second), so, like above,
+ * neither half of the multiplication can overflow
+ */
+inline uint64_t hptime_ticks_to_nsec(hptime_ticks_t ticks)
+{
+	return (ticks >> HPTIME_MULT_SHIFT) * hptime_nsec_mult +
+			(((ticks & 0xffffffffULL) * hptime_nsec_mult) >> HPTIME_MULT_SHIFT);
+}
+
+/*
+ * the wall time, in microseconds. since it's derived from the ticks, it's
+ * monotonic, but it doesn't follow adjustments of the system clock made
+ * after hptime_init
+ */
 inline usec_t hptime_get_time(void)
 {
-	usec_t curr_time = hptime_get_fast_time();
+	return hptime_ticks_to_usec(hptime_get_ticks());
+}
 
-	if (hptime_last_wall_time + HPTIME_SYNC_INTERVAL < curr_time) {
-		hptime_last_wall_time = hptime_get_wall_time();
-		return hptime_last_wall_time;
-	}
+void hptime_get_clocksync(OUT hptime_clocksync_t * sync)
+{
+	hptime_sample(sync);
+}
 
-	return curr_time;
+int hptime_get_source(void)
+{
+	return hptime_source;
 }
 
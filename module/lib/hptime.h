@@ -10,10 +10,34 @@
 
 
 typedef uint64_t usec_t;
-#define HPTIME_SYNC_INTERVAL    (1000000)
+// raw time, in the units of the underlying source (see hptime_get_ticks)
+typedef uint64_t hptime_ticks_t;
+
+#define HPTIME_SOURCE_TSC        (1) // an invariant TSC
+#define HPTIME_SOURCE_MONOTONIC  (2) // nanoseconds of CLOCK_MONOTONIC
+
+#define HPTIME_CALIBRATION_NSEC  (20 * 1000 * 1000)
+#define HPTIME_SAMPLE_ATTEMPTS   (16)
+
+/*
+ * a reading of the ticks and the system clocks, taken together, so that
+ * ticks can be converted to wall time after the fact
+ */
+typedef struct {
+	hptime_ticks_t ticks;
+	uint64_t       ticks_per_sec;
+	uint64_t       monotonic_ns;
+	uint64_t       realtime_ns;
+} hptime_clocksync_t;
 
 errcode_t hptime_init(void);
 errcode_t hptime_fini(void);
 usec_t hptime_get_time(void);
+hptime_ticks_t hptime_get_ticks(void);
+usec_t hptime_ticks_to_usec(hptime_ticks_t ticks);
+hptime_ticks_t hptime_usec_to_ticks(usec_t usec);
+uint64_t hptime_ticks_to_nsec(hptime_ticks_t ticks);
+void hptime_get_clocksync(OUT hptime_clocksync_t * sync);
+int hptime_get_source(void);
 
 #endif /* HPTIME_H_INCLUDED */
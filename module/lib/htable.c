@@ -1,27 +1,116 @@
 #include <stdint.h>
+#include <string.h>
 #include <malloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "htable.h"
 
-//#define HTABLE_BOOST_GETS
-//#define HTABLE_BOOST_MINIMAL_LENGTH  (2)
 //#define HTABLE_COLLECT_STATS
 
+#define HTABLE_BARRIER()  __sync_synchronize()
+#define HTABLE_H1(hash)   ((uint32_t)((hash) >> 7))
+#define HTABLE_H2(hash)   ((int8_t)((hash) & 0x7f))
 
-errcode_t htable_init(htable_t * self, int size)
+// a bit per slot of a group, set for the slots whose control byte matched
+typedef uint32_t htable_mask_t;
+
+
+static inline uint64_t _htable_hash(htable_key_t key)
+{
+	// keys are pointers, whose low bits are always the same, so the bits are
+	// mixed (murmur3's finalizer) before splitting the hash into H1 and H2
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline htable_mask_t _htable_match(const int8_t * group, int8_t h)
 {
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (htable_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h)));
+#else
+	htable_mask_t mask = 0;
 	int i;
+	for (i = 0; i < HTABLE_GROUP_SIZE; i++) {
+		mask |= (htable_mask_t)(group[i] == h) << i;
+	}
+	return mask;
+#endif
+}
+
+static inline void _htable_set_ctrl(htable_t * self, uint32_t index, int8_t h)
+{
+	self->ctrl[index] = h;
+	if (index < HTABLE_GROUP_SIZE) {
+		self->ctrl[self->capacity + index] = h;
+	}
+}
+
+static errcode_t _htable_alloc(htable_t * self, uint32_t capacity)
+{
+	self->ctrl = (int8_t*)malloc(capacity + HTABLE_GROUP_SIZE);
+	if (self->ctrl == NULL) {
+		return ERR_HTABLE_MALLOC_FAILED;
+	}
+	self->slots = (htable_slot_t*)malloc(sizeof(htable_slot_t) * capacity);
+	if (self->slots == NULL) {
+		free(self->ctrl);
+		self->ctrl = NULL;
+		return ERR_HTABLE_MALLOC_FAILED;
+	}
+	memset(self->ctrl, HTABLE_CTRL_EMPTY, capacity + HTABLE_GROUP_SIZE);
+	self->capacity = capacity;
+	self->count = 0;
+	self->growth_left = capacity - capacity / 8;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the first empty slot in the probe sequence of hash. since the
+ * table is never full, there always is one
+ */
+static inline uint32_t _htable_find_empty(htable_t * self, uint64_t hash,
+		OUT int * outprobes)
+{
+	uint32_t mask = self->capacity - 1;
+	uint32_t pos = HTABLE_H1(hash) & mask;
+	uint32_t step = 0;
+	htable_mask_t empty;
+	int probes = 0;
+
+	while (1) {
+		empty = _htable_match(self->ctrl + pos, HTABLE_CTRL_EMPTY);
+		if (empty != 0) {
+			*outprobes = probes;
+			return (pos + __builtin_ctz(empty)) & mask;
+		}
+		probes += 1;
+		step += HTABLE_GROUP_SIZE;
+		pos = (pos + step) & mask;
+	}
+}
+
+errcode_t htable_init(htable_t * self, int size)
+{
+	uint32_t capacity = HTABLE_MIN_CAPACITY;
 
 	if (size <= 0) {
 		return ERR_HTABLE_INVALID_SIZE;
 	}
-	self->size = size;
-	self->count = 0;
-	self->next_free_index = 0;
+	// room for `size` entries without growing
+	while (capacity - capacity / 8 < (uint32_t)size) {
+		capacity *= 2;
+	}
 
 	#ifdef HTABLE_COLLECT_STATS
+	int i;
 	self->total_gets = 0;
-	self->total_get_boosts = 0;
 	for (i = 0; i < HTABLE_HISTOGRAM_SIZE; i++) {
 		self->get_histogram[i] = 0;
 		self->set_histogram[i] = 0;
@@ -31,186 +120,203 @@ errcode_t htable_init(htable_t * self, int size)
 	self->total_set_replaces = 0;
 	self->total_set_collisions = 0;
 	self->total_set_fails = 0;
+	self->total_grows = 0;
 	#endif
 
-	self->heads = (int*)malloc(sizeof(int) * size);
-	if (self->heads == NULL) {
-		return ERR_HTABLE_MALLOC_FAILED;
-	}
-
-	self->buckets = (htable_bucket_t*)malloc(sizeof(htable_bucket_t) * size);
-	if (self->buckets == NULL) {
-		free(self->heads);
-		self->heads = NULL;
-		return ERR_HTABLE_MALLOC_FAILED;
-	}
-	for (i = 0; i < size; i++) {
-		self->heads[i] = -1;
-		self->buckets[i].next = -1;
-	}
-
-	RETURN_SUCCESSFUL;
+	return _htable_alloc(self, capacity);
 }
 
-void htable_print_stats(htable_t * self);
-
 errcode_t htable_fini(htable_t * self)
 {
-	if (self->heads != NULL) {
+	if (self->ctrl != NULL) {
 		#ifdef HTABLE_COLLECT_STATS
 		htable_print_stats(self);
 		#endif
 
-		free(self->heads);
-		self->heads = NULL;
+		free(self->ctrl);
+		self->ctrl = NULL;
 	}
-	if (self->buckets != NULL) {
-		free(self->buckets);
-		self->buckets = NULL;
+	if (self->slots != NULL) {
+		free(self->slots);
+		self->slots = NULL;
 	}
 	RETURN_SUCCESSFUL;
 }
 
-inline errcode_t htable_get(htable_t * self, int hash, htable_key_t key,
-		OUT htable_value_t * value)
+static void _htable_copy_entries(htable_t * self, htable_t * other)
 {
-	int size = self->size;
-	int index = self->heads[((unsigned)hash) % size];
-	htable_bucket_t * bucket;
-	#ifdef HTABLE_BOOST_GETS
-	htable_bucket_t * last_bucket = NULL;
-	#endif
-	#if defined(HTABLE_COLLECT_STATS) || defined(HTABLE_BOOST_GETS)
-	int length = 0;
-	#endif
+	uint64_t hash;
+	uint32_t i, index;
+	int probes;
 
-	while (index >= 0) {
-		bucket = &self->buckets[index];
-		if (bucket->key == key) {
-			#ifdef HTABLE_COLLECT_STATS
-			int histindex = length;
-			if (histindex >= HTABLE_HISTOGRAM_SIZE) {
-				histindex = HTABLE_HISTOGRAM_SIZE - 1;
-			}
-			self->get_histogram[histindex] += 1;
-			self->total_gets += 1;
-			#endif
-
-			#ifdef HTABLE_BOOST_GETS
-			if (last_bucket != NULL && length >= HTABLE_BOOST_MINIMAL_LENGTH) {
-				// in order to make finding this key faster next time, lift
-				// it up one spot in the linked-list (last_bucket != NULL
-				// means it is not the head already)
-				#ifdef HTABLE_COLLECT_STATS
-				self->total_get_boosts += 1;
-				#endif
-				*value = bucket->value;
-				bucket->key = last_bucket->key;
-				bucket->value = last_bucket->key;
-				last_bucket->key = key;
-				last_bucket->value = *value;
-				RETURN_SUCCESSFUL;
-			}
-			#endif
-			*value = bucket->value;
-			RETURN_SUCCESSFUL;
+	for (i = 0; i < other->capacity; i++) {
+		if (other->ctrl[i] == HTABLE_CTRL_EMPTY) {
+			continue;
 		}
-		#ifdef HTABLE_BOOST_GETS
-		last_bucket = bucket;
-		#endif
-		#if defined(HTABLE_COLLECT_STATS) || defined(HTABLE_BOOST_GETS)
-		length += 1;
-		#endif
-		index = bucket->next;
+		hash = _htable_hash(other->slots[i].key);
+		index = _htable_find_empty(self, hash, &probes);
+		_htable_set_ctrl(self, index, HTABLE_H2(hash));
+		self->slots[index] = other->slots[i];
 	}
+	self->count += other->count;
+	self->growth_left -= other->count;
+}
+
+/*
+ * doubles the capacity, and moves all entries over to their new places
+ */
+static errcode_t _htable_grow(htable_t * self)
+{
+	htable_t grown = *self;
 
+	PROPAGATE(_htable_alloc(&grown, self->capacity * 2));
+	_htable_copy_entries(&grown, self);
 	#ifdef HTABLE_COLLECT_STATS
-	self->total_get_fails += 1;
+	grown.total_grows += 1;
 	#endif
-	return ERR_HTABLE_GET_KEY_MISSING;
+
+	free(self->ctrl);
+	free(self->slots);
+	*self = grown;
+	RETURN_SUCCESSFUL;
 }
 
-inline int htable_contains(htable_t * self, int hash, htable_key_t key)
+/*
+ * whether setting a new key would grow the table (and free its arrays)
+ */
+int htable_is_full(htable_t * self)
 {
-	htable_value_t v;
-	return htable_get(self, hash, key, &v) != ERR_HTABLE_GET_KEY_MISSING;
+	return self->growth_left == 0;
 }
 
-static inline errcode_t _htable_add(htable_t * self, htable_key_t key, htable_value_t value, OUT int * outindex)
+/*
+ * initializes self with room for `size` entries (at least), and copies
+ * all the entries of other into it
+ */
+errcode_t htable_init_copy(htable_t * self, htable_t * other, int size)
 {
-	int index = self->next_free_index;
-
-	if (self->count >= self->size) {
-		#ifdef HTABLE_COLLECT_STATS
-		self->total_set_fails += 1;
-		#endif
-		return ERR_HTABLE_TABLE_FULL;
+	if (size < (int)other->count) {
+		return ERR_HTABLE_INVALID_SIZE;
 	}
-	#ifdef HTABLE_COLLECT_STATS
-	self->total_sets += 1;
-	#endif
-	self->next_free_index += 1;
-	self->count += 1;
-	self->buckets[index].key = key;
-	self->buckets[index].value = value;
-
-	*outindex = index;
+	PROPAGATE(htable_init(self, size));
+	_htable_copy_entries(self, other);
 	RETURN_SUCCESSFUL;
 }
 
-inline errcode_t htable_set(htable_t * self, int hash, htable_key_t key,
-		htable_key_t value)
+/*
+ * looks up key, returning its slot index, or -1 if it's missing. probes
+ * is the number of groups examined past the first one
+ */
+static inline int64_t _htable_lookup(htable_t * self, uint64_t hash, htable_key_t key,
+		OUT int * outprobes)
+{
+	uint32_t mask = self->capacity - 1;
+	uint32_t pos = HTABLE_H1(hash) & mask;
+	uint32_t step = 0;
+	uint32_t index;
+	const int8_t * group;
+	htable_mask_t matches;
+	int8_t h2 = HTABLE_H2(hash);
+	int probes = 0;
+
+	while (1) {
+		group = self->ctrl + pos;
+		matches = _htable_match(group, h2);
+		while (matches != 0) {
+			// the slot is read through an address that depends on its
+			// control byte, so it can't be read before that was set
+			index = (pos + __builtin_ctz(matches)) & mask;
+			if (self->slots[index].key == key) {
+				*outprobes = probes;
+				return index;
+			}
+			matches &= matches - 1;
+		}
+		if (_htable_match(group, HTABLE_CTRL_EMPTY) != 0) {
+			// the key would have been placed in this group
+			*outprobes = probes;
+			return -1;
+		}
+		probes += 1;
+		step += HTABLE_GROUP_SIZE;
+		pos = (pos + step) & mask;
+	}
+}
+
+inline errcode_t htable_get(htable_t * self, htable_key_t key, OUT htable_value_t * value)
 {
-	int size = self->size;
-	htable_bucket_t * bucket;
-	int head_index = ((unsigned)hash) % size;
-	int index = self->heads[head_index];
+	int probes;
+	int64_t index = _htable_lookup(self, _htable_hash(key), key, &probes);
 
 	if (index < 0) {
-		// no collision -- this bucket is free
-		PROPAGATE(_htable_add(self, key, value, &index));
-		self->heads[head_index] = index;
-	}
-	else {
-		// a collision -- find the terminal bucket. if we find that the key
-		// already exists, just replace the value
 		#ifdef HTABLE_COLLECT_STATS
-		int length = 0;
+		self->total_get_fails += 1;
 		#endif
+		return ERR_HTABLE_GET_KEY_MISSING;
+	}
 
-		while (index >= 0) {
-			bucket = &self->buckets[index];
-			if (key == bucket->key) {
-				// replace existing key
-				#ifdef HTABLE_COLLECT_STATS
-				self->total_set_replaces += 1;
-				#endif
-				bucket->value = value;
-				RETURN_SUCCESSFUL;
-			}
-			index = bucket->next;
-			#ifdef HTABLE_COLLECT_STATS
-			length += 1;
-			#endif
-		}
+	#ifdef HTABLE_COLLECT_STATS
+	if (probes >= HTABLE_HISTOGRAM_SIZE) {
+		probes = HTABLE_HISTOGRAM_SIZE - 1;
+	}
+	self->get_histogram[probes] += 1;
+	self->total_gets += 1;
+	#endif
+	*value = self->slots[index].value;
+	RETURN_SUCCESSFUL;
+}
 
-		// we have found the terminal bucket
-		PROPAGATE(_htable_add(self, key, value, &index));
+inline int htable_contains(htable_t * self, htable_key_t key)
+{
+	htable_value_t v;
+	return htable_get(self, key, &v) != ERR_HTABLE_GET_KEY_MISSING;
+}
+
+errcode_t htable_set(htable_t * self, htable_key_t key, htable_value_t value)
+{
+	uint64_t hash = _htable_hash(key);
+	int probes;
+	int64_t index = _htable_lookup(self, hash, key, &probes);
 
+	if (index >= 0) {
+		// replace existing key
 		#ifdef HTABLE_COLLECT_STATS
-		self->total_set_collisions += 1;
+		self->total_set_replaces += 1;
 		#endif
-		bucket->next = index;
+		self->slots[index].value = value;
+		RETURN_SUCCESSFUL;
+	}
 
+	if (self->growth_left == 0) {
 		#ifdef HTABLE_COLLECT_STATS
-		int histindex = length;
-		if (histindex >= HTABLE_HISTOGRAM_SIZE) {
-			histindex = HTABLE_HISTOGRAM_SIZE - 1;
+		errcode_t retcode = _htable_grow(self);
+		if (IS_ERROR(retcode)) {
+			self->total_set_fails += 1;
+			return retcode;
 		}
-		self->set_histogram[histindex] += 1;
+		#else
+		PROPAGATE(_htable_grow(self));
 		#endif
 	}
+	index = _htable_find_empty(self, hash, &probes);
+	self->slots[index].key = key;
+	self->slots[index].value = value;
+	// concurrent readers must not see the control byte before the slot
+	HTABLE_BARRIER();
+	_htable_set_ctrl(self, index, HTABLE_H2(hash));
+	self->count += 1;
+	self->growth_left -= 1;
 
+	#ifdef HTABLE_COLLECT_STATS
+	self->total_sets += 1;
+	if (index != (HTABLE_H1(hash) & (self->capacity - 1))) {
+		self->total_set_collisions += 1;
+	}
+	if (probes >= HTABLE_HISTOGRAM_SIZE) {
+		probes = HTABLE_HISTOGRAM_SIZE - 1;
+	}
+	self->set_histogram[probes] += 1;
+	#endif
 	RETURN_SUCCESSFUL;
 }
 
@@ -220,12 +326,12 @@ inline errcode_t htable_set(htable_t * self, int hash, htable_key_t key,
 void htable_print_stats(htable_t * self)
 {
 	int i;
-	printf("statistics for htable %p (size = %d, count = %d)\n", self, self->size, self->count);
+	printf("statistics for htable %p (capacity = %u, count = %u)\n", self,
+			self->capacity, self->count);
 	printf("  gets:\n");
 	printf("    successful = %d\n", self->total_gets);
 	printf("    failed = %d\n", self->total_get_fails);
-	printf("    boosts = %d\n", self->total_get_boosts);
-	printf("    histogram:\n");
+	printf("    histogram (extra groups probed):\n");
 	for (i = 0; i < HTABLE_HISTOGRAM_SIZE - 1; i++) {
 		printf("      (%d)     %d\n", i, self->get_histogram[i]);
 	}
@@ -235,6 +341,7 @@ void htable_print_stats(htable_t * self)
 	printf("    replaces = %d\n", self->total_set_replaces);
 	printf("    failed = %d\n", self->total_set_fails);
 	printf("    collisions = %d\n", self->total_set_collisions);
+	printf("    grows = %d\n", self->total_grows);
 	for (i = 0; i < HTABLE_HISTOGRAM_SIZE - 1; i++) {
 		printf("      (%d)     %d\n", i, self->set_histogram[i]);
 	}
@@ -247,35 +354,33 @@ int main()
 {
 	htable_t ht;
 	htable_value_t v;
+	int i;
 
-	ASSERT(htable_init(&ht, 65535));
-	if (htable_get(&ht, 771622341, 771622341, &v) != ERR_HTABLE_GET_KEY_MISSING) {
+	ASSERT(htable_init(&ht, 16));
+	if (htable_get(&ht, 771622341, &v) != ERR_HTABLE_GET_KEY_MISSING) {
 		printf("nonexistent key was found!\n");
 		abort();
 	}
-	ASSERT(htable_set(&ht, 771622341, 771622341, 1));
-	ASSERT(htable_set(&ht, 771622343, 771622343, 2));
-	ASSERT(htable_set(&ht, 771622343, 771622343, 3));
-	ASSERT(htable_set(&ht, 771622341, 771622345, 4));
-	ASSERT(htable_get(&ht, 771622341, 771622341, &v));
+	ASSERT(htable_set(&ht, 771622341, 1));
+	ASSERT(htable_set(&ht, 771622343, 2));
+	ASSERT(htable_set(&ht, 771622343, 3));
+	ASSERT(htable_get(&ht, 771622341, &v));
 	printf("v1 = %d\n", v);
-	ASSERT(htable_get(&ht, 771622343, 771622343, &v));
+	ASSERT(htable_get(&ht, 771622343, &v));
 	printf("v2 = %d\n", v);
-	ASSERT(htable_get(&ht, 771622341, 771622345, &v));
-	printf("v3 = %d\n", v);
-	ASSERT(htable_get(&ht, 771622341, 771622345, &v));
-	printf("v3 = %d\n", v);
-	ASSERT(htable_get(&ht, 771622341, 771622345, &v));
-	printf("v3 = %d\n", v);
+	for (i = 0; i < 100000; i++) {
+		ASSERT(htable_set(&ht, 0x10000000 + i * 16, i & 0xffff));
+	}
+	for (i = 0; i < 100000; i++) {
+		ASSERT(htable_get(&ht, 0x10000000 + i * 16, &v));
+		if (v != (i & 0xffff)) {
+			printf("wrong value for %d: %d\n", i, v);
+			abort();
+		}
+	}
+	printf("count = %u, capacity = %u\n", ht.count, ht.capacity);
 	ASSERT(htable_fini(&ht));
 
 	return 0;
 }
 */
-
-
-
-
-
-
-
@@ -1,11 +1,9 @@
 #ifndef HTABLE_H_INCLUDED
 #define HTABLE_H_INCLUDED
 
+#include <stdint.h>
 #include "errors.h"
 
-// comment this out to disable propagating matched buckets up
-//#define HTABLE_BOOST_GETS
-#define HTABLE_BOOST_MINIMAL_LENGTH  (2)
 // comment this out to disable statistics collecting
 //#define HTABLE_COLLECT_STATS
 
@@ -13,24 +11,43 @@
 #define HTABLE_HISTOGRAM_SIZE   (10)
 #endif
 
+/*
+ * an open addressing table (a la Swiss tables): every slot has a control
+ * byte, which is either HTABLE_CTRL_EMPTY or the low 7 bits of the key's
+ * hash. a lookup hashes the key once, and compares the control bytes of a
+ * group of HTABLE_GROUP_SIZE slots at a time (with SSE2, if available),
+ * so only slots whose control byte matches are actually looked at. the table
+ * grows (doubles and rehashes) once it's 7/8 full, and entries are never
+ * removed, so there are no tombstones.
+ *
+ * a table may be read by any number of threads while a single thread sets
+ * entries, as long as the table doesn't need to grow (see htable_is_full
+ * and htable_init_copy): a slot is filled before its control byte is set,
+ * and replacing a value is a single (aligned, 64 bit) store.
+ */
+#define HTABLE_GROUP_SIZE       (16)
+#define HTABLE_MIN_CAPACITY     (HTABLE_GROUP_SIZE)
+#define HTABLE_CTRL_EMPTY       ((int8_t)-128)
+
 typedef uint64_t htable_key_t;
-typedef uint16_t htable_value_t;
+// slots are padded to 16 bytes anyway, so values might as well be 64 bits
+typedef uint64_t htable_value_t;
 
-typedef struct _htable_bucket_t {
+typedef struct _htable_slot_t {
 	htable_key_t      key;
 	htable_value_t    value;
-	int               next;
-} htable_bucket_t;
+} htable_slot_t;
 
 typedef struct _htable_t {
-	int               size;
-	int               count;
-	int *             heads;
-	htable_bucket_t * buckets;
-	int               next_free_index;
+	uint32_t          capacity; // always a power of two
+	uint32_t          count;
+	uint32_t          growth_left;
+	// capacity + HTABLE_GROUP_SIZE control bytes: the last group repeats the
+	// first one, so a group can be loaded from any slot without wrapping
+	int8_t *          ctrl;
+	htable_slot_t *   slots;
     #ifdef HTABLE_COLLECT_STATS
 	int               total_gets;
-	int               total_get_boosts;
 	int               get_histogram[HTABLE_HISTOGRAM_SIZE];
 	int               total_get_fails;
 	int               total_sets;
@@ -38,14 +55,17 @@ typedef struct _htable_t {
 	int               set_histogram[HTABLE_HISTOGRAM_SIZE];
 	int               total_set_collisions;
 	int               total_set_fails;
+	int               total_grows;
     #endif
 } htable_t;
 
-int htable_init(htable_t * self, int size);
-int htable_fini(htable_t * self);
-int htable_get(htable_t * self, int hash, htable_key_t key, htable_value_t * value);
-int htable_contains(htable_t * self, int hash, htable_key_t key);
-int htable_set(htable_t * self, int hash, htable_key_t key, htable_key_t value);
+errcode_t htable_init(htable_t * self, int size);
+errcode_t htable_fini(htable_t * self);
+errcode_t htable_get(htable_t * self, htable_key_t key, OUT htable_value_t * value);
+int htable_contains(htable_t * self, htable_key_t key);
+errcode_t htable_set(htable_t * self, htable_key_t key, htable_value_t value);
+int htable_is_full(htable_t * self);
+errcode_t htable_init_copy(htable_t * self, htable_t * other, int size);
 #ifdef HTABLE_COLLECT_STATS
 void htable_print_stats(htable_t * self);
 #endif
@@ -11,7 +11,7 @@ errcode_t listfile_init(listfile_t * self, int fd)
 {
 	self->fd = fd;
 	self->next_index = 0;
-	return fwindow_init(&self->head, fd, 1024 * 1024);
+	return fwindow_init(&self->head, fd, 0, 1024 * 1024, 0);
 }
 
 errcode_t listfile_fini(listfile_t * self)
@@ -20,8 +20,11 @@ errcode_t listfile_fini(listfile_t * self)
 }
 
 errcode_t listfile_append(listfile_t * self, const void * buffer,
-		listfile_recsize_t size, int * outindex)
+		listfile_recsize_t size, uint32_t * outindex)
 {
+	if (self->next_index == UINT32_MAX) {
+		return ERR_LISTFILE_TOO_MANY_RECORDS;
+	}
 	if (outindex != NULL) {
 		*outindex = self->next_index;
 	}
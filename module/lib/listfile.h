@@ -9,7 +9,7 @@
 
 typedef struct _listfile_t {
 	int        fd;
-	int        next_index;
+	uint32_t   next_index;
 	fwindow_t  head;
 } listfile_t;
 
@@ -18,7 +18,7 @@ typedef uint16_t listfile_recsize_t;
 errcode_t listfile_init(listfile_t * self, int fd);
 errcode_t listfile_fini(listfile_t * self);
 errcode_t listfile_append(listfile_t * self, const void * buffer,
-		listfile_recsize_t size, int * outindex);
+		listfile_recsize_t size, uint32_t * outindex);
 errcode_t listfile_open(listfile_t * self, const char * filename);
 errcode_t listfile_close(listfile_t * self);
 
@@ -0,0 +1,221 @@
+/*
+ * LZBlock -- a small LZ77 codec, using the LZ4 block format: a sequence of
+ * (token, literals, match) where the token's high nibble is the number of
+ * literals and its low nibble is the match length minus LZBLOCK_MIN_MATCH
+ * (15 means more length bytes follow, each adding up to 255), and the match
+ * is a 16 bit little-endian back-offset. the last sequence has only
+ * literals. matches are found with a single-entry hash table of 4-byte
+ * sequences, which is fast and good enough for trace data, that repeats
+ * the same few byte patterns over and over.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lzblock.h"
+
+
+#define LZBLOCK_MIN_MATCH     (4)
+#define LZBLOCK_HASH_BITS     (12)
+#define LZBLOCK_LAST_LITERALS (5)  // the block always ends with literals
+#define LZBLOCK_MFLIMIT       (12) // no match starts this close to the end
+
+static inline uint32_t _lzblock_read32(const uint8_t * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t _lzblock_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZBLOCK_HASH_BITS);
+}
+
+static inline uint8_t * _lzblock_dump_length(uint8_t * op, size_t length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+/*
+ * dst must hold at least LZBLOCK_BOUND(srcsize) bytes, otherwise
+ * ERR_LZBLOCK_DEST_TOO_SMALL may be returned
+ */
+errcode_t lzblock_compress(const void * src, size_t srcsize, void * dst, size_t dstsize,
+		OUT size_t * outsize)
+{
+	uint32_t table[1 << LZBLOCK_HASH_BITS];
+	const uint8_t * base = (const uint8_t *)src;
+	const uint8_t * ip = base;
+	const uint8_t * anchor = base;
+	const uint8_t * end = base + srcsize;
+	const uint8_t * match_limit = end - LZBLOCK_LAST_LITERALS;
+	const uint8_t * ref;
+	uint8_t * op = (uint8_t *)dst;
+	uint8_t * token;
+	size_t literals, length;
+	uint32_t h;
+
+	if (dstsize < LZBLOCK_BOUND(srcsize)) {
+		return ERR_LZBLOCK_DEST_TOO_SMALL;
+	}
+	memset(table, 0, sizeof(table));
+
+	if (srcsize >= LZBLOCK_MFLIMIT) {
+		while (ip < end - LZBLOCK_MFLIMIT) {
+			h = _lzblock_hash(_lzblock_read32(ip));
+			ref = base + table[h];
+			table[h] = (uint32_t)(ip - base);
+			if (ref >= ip || ip - ref > LZBLOCK_MAX_OFFSET ||
+					_lzblock_read32(ref) != _lzblock_read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			// extend the match backwards over pending literals
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			literals = ip - anchor;
+			token = op++;
+			if (literals >= 15) {
+				*token = 15 << 4;
+				op = _lzblock_dump_length(op, literals - 15);
+			}
+			else {
+				*token = (uint8_t)(literals << 4);
+			}
+			memcpy(op, anchor, literals);
+			op += literals;
+
+			*op++ = (uint8_t)((ip - ref) & 0xff);
+			*op++ = (uint8_t)((ip - ref) >> 8);
+
+			ip += LZBLOCK_MIN_MATCH;
+			ref += LZBLOCK_MIN_MATCH;
+			while (ip < match_limit && *ip == *ref) {
+				ip++;
+				ref++;
+			}
+			length = ip - anchor - literals - LZBLOCK_MIN_MATCH;
+			if (length >= 15) {
+				*token |= 15;
+				op = _lzblock_dump_length(op, length - 15);
+			}
+			else {
+				*token |= (uint8_t)length;
+			}
+			anchor = ip;
+		}
+	}
+
+	literals = end - anchor;
+	token = op++;
+	if (literals >= 15) {
+		*token = 15 << 4;
+		op = _lzblock_dump_length(op, literals - 15);
+	}
+	else {
+		*token = (uint8_t)(literals << 4);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	*outsize = op - (uint8_t *)dst;
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _lzblock_load_length(const uint8_t ** ip, const uint8_t * end,
+		size_t * length)
+{
+	uint8_t b;
+	do {
+		if (*ip >= end) {
+			return ERR_LZBLOCK_CORRUPT;
+		}
+		b = *(*ip)++;
+		*length += b;
+	} while (b == 255);
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t lzblock_decompress(const void * src, size_t srcsize, void * dst, size_t dstsize,
+		OUT size_t * outsize)
+{
+	const uint8_t * ip = (const uint8_t *)src;
+	const uint8_t * end = ip + srcsize;
+	uint8_t * op = (uint8_t *)dst;
+	uint8_t * op_end = op + dstsize;
+	const uint8_t * ref;
+	size_t length, offset;
+	uint8_t token;
+
+	while (ip < end) {
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15) {
+			PROPAGATE(_lzblock_load_length(&ip, end, &length));
+		}
+		if (length > (size_t)(end - ip) || length > (size_t)(op_end - op)) {
+			return ERR_LZBLOCK_CORRUPT;
+		}
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+		if (ip == end) {
+			break; // the last sequence has no match
+		}
+
+		if (end - ip < 2) {
+			return ERR_LZBLOCK_CORRUPT;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+			return ERR_LZBLOCK_CORRUPT;
+		}
+		length = token & 15;
+		if (length == 15) {
+			PROPAGATE(_lzblock_load_length(&ip, end, &length));
+		}
+		length += LZBLOCK_MIN_MATCH;
+		if (length > (size_t)(op_end - op)) {
+			return ERR_LZBLOCK_CORRUPT;
+		}
+		// the match may overlap the output, so it's copied byte by byte
+		ref = op - offset;
+		while (length-- > 0) {
+			*op++ = *ref++;
+		}
+	}
+
+	*outsize = op - (uint8_t *)dst;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+#include <stdio.h>
+
+int main()
+{
+	char src[100000], dst[LZBLOCK_BOUND(100000)], out[100000];
+	size_t csize, dsize;
+	int i;
+
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (i % 1000 < 500) ? (i % 13) : (rand() & 0xff);
+	}
+	ASSERT(lzblock_compress(src, sizeof(src), dst, sizeof(dst), &csize));
+	ASSERT(lzblock_decompress(dst, csize, out, sizeof(out), &dsize));
+	printf("%d -> %d, %s\n", (int)sizeof(src), (int)csize,
+			(dsize == sizeof(src) && memcmp(src, out, dsize) == 0) ? "ok" : "MISMATCH");
+	return 0;
+}
+*/
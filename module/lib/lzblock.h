@@ -0,0 +1,22 @@
+/*
+ * LZ block compression
+ */
+
+#ifndef LZBLOCK_H_INCLUDED
+#define LZBLOCK_H_INCLUDED
+
+#include <stdlib.h>
+
+#include "errors.h"
+
+// worst case size of compressing `size` bytes (incompressible data)
+#define LZBLOCK_BOUND(size)    ((size) + (size) / 255 + 16)
+#define LZBLOCK_MAX_OFFSET     (65535)
+
+errcode_t lzblock_compress(const void * src, size_t srcsize, void * dst, size_t dstsize,
+		OUT size_t * outsize);
+errcode_t lzblock_decompress(const void * src, size_t srcsize, void * dst, size_t dstsize,
+		OUT size_t * outsize);
+
+
+#endif /* LZBLOCK_H_INCLUDED */
@@ -0,0 +1,219 @@
+/*
+ * Reaper -- unmaps regions in the background. unmapping a large shared
+ * mapping can take a while (the kernel has to tear down the page tables and
+ * write-protect the dirty pages), so instead of doing it inline, callers
+ * queue the region and a single long-lived thread (per process) unmaps it.
+ *
+ * the queue is a bounded lock-free multi-producer single-consumer queue:
+ * every cell carries a sequence number, which tells whether it's free for
+ * the producer that claimed its position, or published for the consumer.
+ * producers claim positions with a CAS on the tail, so queueing a region
+ * never takes a lock or makes a system call (other than waking the reaper
+ * up, if it's asleep). when the queue is full, or the reaper thread can't
+ * be started, the caller unmaps the region itself.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "reaper.h"
+
+
+#define REAPER_QUEUE_MASK    (REAPER_QUEUE_SIZE - 1)
+#define REAPER_BARRIER()     __sync_synchronize()
+
+#define REAPER_NOT_STARTED   (0)
+#define REAPER_RUNNING       (1)
+#define REAPER_FAILED        (2)
+
+typedef struct {
+	volatile size_t sequence;
+	void *          addr;
+	size_t          length;
+	int             flags;
+	uint64_t        queued_at;
+} _reaper_cell_t;
+
+static _reaper_cell_t _reaper_queue[REAPER_QUEUE_SIZE];
+static volatile size_t _reaper_tail = 0; // claimed by producers
+static size_t _reaper_head = 0;          // owned by the reaper thread
+static sem_t _reaper_sem;
+static volatile int _reaper_state = REAPER_NOT_STARTED;
+static pthread_mutex_t _reaper_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint64_t _reaper_queued = 0;
+static reaper_stats_t _reaper_stats;
+
+
+static inline uint64_t _reaper_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * unmaps the region right away, on the calling thread
+ */
+void reaper_unmap_now(void * addr, size_t length, int flags)
+{
+	if (flags & REAPER_MSYNC) {
+		msync(addr, length, MS_SYNC);
+	}
+	if (flags & REAPER_DONTNEED) {
+		madvise(addr, length, MADV_DONTNEED);
+	}
+	#ifdef MADV_COLD
+	if (flags & REAPER_COLD) {
+		madvise(addr, length, MADV_COLD);
+	}
+	#endif
+	munmap(addr, length);
+}
+
+static void * _reaper_main(void * arg)
+{
+	_reaper_cell_t * cell;
+	uint64_t depth, latency;
+
+	while (1) {
+		while (sem_wait(&_reaper_sem) != 0) {
+			// interrupted by a signal
+		}
+		cell = &_reaper_queue[_reaper_head & REAPER_QUEUE_MASK];
+		while (cell->sequence != _reaper_head + 1) {
+			// the producer claimed the cell but hasn't published it yet
+			sched_yield();
+		}
+		REAPER_BARRIER();
+		reaper_unmap_now(cell->addr, cell->length, cell->flags);
+		latency = _reaper_now_ns() - cell->queued_at;
+		REAPER_BARRIER();
+		cell->sequence = _reaper_head + REAPER_QUEUE_SIZE; // free for the next lap
+		_reaper_head += 1;
+
+		depth = _reaper_queued - _reaper_stats.reaped;
+		if (depth > _reaper_stats.max_queue_depth) {
+			_reaper_stats.max_queue_depth = depth;
+		}
+		_reaper_stats.reaped += 1;
+		_reaper_stats.total_latency_ns += latency;
+		if (latency > _reaper_stats.max_latency_ns) {
+			_reaper_stats.max_latency_ns = latency;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * a forked child has only the thread that called fork(), so it has to start
+ * a reaper of its own. whatever was queued is still mapped in the child, and
+ * will be reaped by the new thread
+ */
+static void _reaper_atfork_child(void)
+{
+	if (_reaper_state == REAPER_RUNNING) {
+		sem_init(&_reaper_sem, 0, _reaper_queued - _reaper_stats.reaped);
+		_reaper_state = REAPER_NOT_STARTED;
+	}
+	pthread_mutex_init(&_reaper_start_mutex, NULL);
+}
+
+static void _reaper_start(void)
+{
+	static int atfork_registered = 0;
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t i;
+
+	pthread_mutex_lock(&_reaper_start_mutex);
+	if (_reaper_state != REAPER_NOT_STARTED) {
+		goto cleanup;
+	}
+	if (!atfork_registered) {
+		for (i = 0; i < REAPER_QUEUE_SIZE; i++) {
+			_reaper_queue[i].sequence = i;
+		}
+		if (sem_init(&_reaper_sem, 0, 0) != 0 ||
+				pthread_atfork(NULL, NULL, _reaper_atfork_child) != 0) {
+			_reaper_state = REAPER_FAILED;
+			goto cleanup;
+		}
+		atfork_registered = 1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	_reaper_state = (pthread_create(&thread, &attr, _reaper_main, NULL) == 0) ?
+		REAPER_RUNNING : REAPER_FAILED;
+	pthread_attr_destroy(&attr);
+
+cleanup:
+	pthread_mutex_unlock(&_reaper_start_mutex);
+}
+
+/*
+ * queues the region to be unmapped by the reaper thread. flags is a
+ * combination of REAPER_{MSYNC|DONTNEED|COLD}
+ */
+void reaper_unmap(void * addr, size_t length, int flags)
+{
+	_reaper_cell_t * cell;
+	size_t pos;
+	long diff;
+
+	if (_reaper_state != REAPER_RUNNING) {
+		_reaper_start();
+		if (_reaper_state != REAPER_RUNNING) {
+			// sorry, we have to block
+			__sync_fetch_and_add(&_reaper_stats.inline_unmaps, 1);
+			reaper_unmap_now(addr, length, flags);
+			return;
+		}
+	}
+
+	pos = _reaper_tail;
+	while (1) {
+		cell = &_reaper_queue[pos & REAPER_QUEUE_MASK];
+		REAPER_BARRIER();
+		diff = (long)cell->sequence - (long)pos;
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&_reaper_tail, pos, pos + 1)) {
+				break;
+			}
+			pos = _reaper_tail;
+		}
+		else if (diff < 0) {
+			// the queue is full
+			__sync_fetch_and_add(&_reaper_stats.inline_unmaps, 1);
+			reaper_unmap_now(addr, length, flags);
+			return;
+		}
+		else {
+			pos = _reaper_tail; // another producer took this one
+		}
+	}
+
+	cell->addr = addr;
+	cell->length = length;
+	cell->flags = flags;
+	cell->queued_at = _reaper_now_ns();
+	__sync_fetch_and_add(&_reaper_queued, 1);
+	REAPER_BARRIER();
+	cell->sequence = pos + 1; // publish
+	sem_post(&_reaper_sem);
+}
+
+/*
+ * the counters are updated without locking, so they're only a snapshot
+ */
+errcode_t reaper_get_stats(OUT reaper_stats_t * stats)
+{
+	memcpy(stats, &_reaper_stats, sizeof(*stats));
+	stats->queue_depth = _reaper_queued - stats->reaped;
+	RETURN_SUCCESSFUL;
+}
+
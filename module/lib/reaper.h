@@ -0,0 +1,35 @@
+/*
+ * Background munmap
+ */
+
+#ifndef REAPER_H_INCLUDED
+#define REAPER_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "errors.h"
+
+// what to do with a region before unmapping it
+#define REAPER_MSYNC         (1)
+#define REAPER_DONTNEED      (2)
+#define REAPER_COLD          (4)
+
+#define REAPER_QUEUE_SIZE    (1024) // must be a power of two
+
+
+typedef struct {
+	uint64_t   queue_depth;
+	uint64_t   max_queue_depth;
+	uint64_t   reaped;
+	uint64_t   inline_unmaps;     // done by the caller, since the queue was full
+	uint64_t   total_latency_ns;  // from queueing to unmapping, over all regions
+	uint64_t   max_latency_ns;
+} reaper_stats_t;
+
+void reaper_unmap(void * addr, size_t length, int flags);
+void reaper_unmap_now(void * addr, size_t length, int flags);
+errcode_t reaper_get_stats(OUT reaper_stats_t * stats);
+
+
+#endif /* REAPER_H_INCLUDED */
@@ -0,0 +1,227 @@
+/*
+ * Registry -- assigns IDs to objects (by address), in the order they were
+ * first seen, and appends a record describing every new object to a
+ * listfile, so an object's ID is the index of its record. it's shared by
+ * all threads: finding an existing ID takes no lock (just a lookup in the
+ * current table), and only adding a new object takes the lock. when the
+ * table fills up, it's copied into one twice its size, which replaces it;
+ * the old tables are kept until the registry is finalized, since readers
+ * may still be looking at them.
+ *
+ * the record of a new object is made before taking the lock, so no code
+ * runs under it but the registry's own; if two threads add the same object
+ * at once, both make its record, and the one that takes the lock second
+ * throws its record away.
+ *
+ * every ID also has a 32 bit tag (0 when it's added), which is the caller's
+ * to set. it's kept next to the ID, in the same table value.
+ *
+ * keys are addresses, so a key must not be freed (and its address reused by
+ * something else) while the registry is around, or the new object would get
+ * the old one's ID. keys that aren't static can be held: the registry takes
+ * a reference to them (with the hold function it was given) when they're
+ * added, and drops it (with release) when it's finalized.
+ */
+#include <stdlib.h>
+
+#include "registry.h"
+
+
+#define REGISTRY_BARRIER()    __sync_synchronize()
+#define REGISTRY_VALUE(id, tag)  (((htable_value_t)(tag) << 32) | (id))
+#define REGISTRY_INITIAL_HELD    (256)
+
+
+errcode_t registry_init(registry_t * self, const char * filename, int size,
+		registry_ref_t hold, registry_ref_t release)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+
+	self->hold = hold;
+	self->release = release;
+	self->held = NULL;
+	self->held_count = 0;
+	self->held_capacity = 0;
+	self->table_count = 0;
+	self->tables[0] = (htable_t*)malloc(sizeof(htable_t));
+	if (self->tables[0] == NULL) {
+		retcode = ERR_REGISTRY_MALLOC_FAILED;
+		goto error1;
+	}
+	PROPAGATE_TO(error2, retcode = htable_init(self->tables[0], size));
+	PROPAGATE_TO(error3, retcode = listfile_open(&self->file, filename));
+	if (pthread_mutex_init(&self->lock, NULL) != 0) {
+		retcode = ERR_REGISTRY_MUTEX_INIT_FAILED;
+		goto error4;
+	}
+	self->table_count = 1;
+	self->table = self->tables[0];
+	RETURN_SUCCESSFUL;
+
+error4:
+	listfile_close(&self->file);
+error3:
+	htable_fini(self->tables[0]);
+error2:
+	free(self->tables[0]);
+error1:
+	return retcode;
+}
+
+errcode_t registry_fini(registry_t * self)
+{
+	int i;
+
+	if (self->table_count == 0) {
+		RETURN_SUCCESSFUL;
+	}
+	self->table = NULL;
+	for (i = 0; i < self->table_count; i++) {
+		htable_fini(self->tables[i]);
+		free(self->tables[i]);
+	}
+	self->table_count = 0;
+	for (i = 0; i < self->held_count; i++) {
+		self->release(self->held[i]);
+	}
+	free(self->held);
+	self->held = NULL;
+	self->held_count = 0;
+	self->held_capacity = 0;
+	pthread_mutex_destroy(&self->lock);
+	PROPAGATE(listfile_close(&self->file));
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * replaces the current table with one twice its size. called with the lock
+ * held
+ */
+static errcode_t _registry_grow(registry_t * self)
+{
+	htable_t * table;
+
+	if (self->table_count >= REGISTRY_MAX_TABLES) {
+		return ERR_REGISTRY_TOO_MANY_TABLES;
+	}
+	table = (htable_t*)malloc(sizeof(htable_t));
+	if (table == NULL) {
+		return ERR_REGISTRY_MALLOC_FAILED;
+	}
+	if (IS_ERROR(htable_init_copy(table, self->table, self->table->capacity))) {
+		free(table);
+		return ERR_REGISTRY_MALLOC_FAILED;
+	}
+	self->tables[self->table_count] = table;
+	self->table_count += 1;
+	// the copy must be complete before anyone can see it
+	REGISTRY_BARRIER();
+	self->table = table;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * makes room for one more held key. called with the lock held
+ */
+static errcode_t _registry_reserve_held(registry_t * self)
+{
+	const void ** held;
+	int capacity;
+
+	if (self->held_count < self->held_capacity) {
+		RETURN_SUCCESSFUL;
+	}
+	capacity = (self->held_capacity == 0) ? REGISTRY_INITIAL_HELD : self->held_capacity * 2;
+	held = (const void **)realloc(self->held, capacity * sizeof(*held));
+	if (held == NULL) {
+		return ERR_REGISTRY_MALLOC_FAILED;
+	}
+	self->held = held;
+	self->held_capacity = capacity;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * adds key with the record in stream, and tells whether it did (and so
+ * whether the key is to be held). called with the lock held
+ */
+static errcode_t _registry_add(registry_t * self, const void * key, int hold_key,
+		swriter_t * stream, OUT htable_value_t * outvalue, OUT int * outadded)
+{
+	uint32_t id;
+
+	// another thread may have added it since we looked
+	*outadded = 0;
+	if (htable_get(self->table, (htable_key_t)((uintptr_t)key), outvalue) == ERR_SUCCESS) {
+		RETURN_SUCCESSFUL;
+	}
+	if (htable_is_full(self->table)) {
+		PROPAGATE(_registry_grow(self));
+	}
+	if (hold_key) {
+		PROPAGATE(_registry_reserve_held(self));
+	}
+	PROPAGATE(listfile_append(&self->file, swriter_get_buffer(stream),
+			swriter_get_length(stream), &id));
+	*outvalue = REGISTRY_VALUE(id, 0);
+	PROPAGATE(htable_set(self->table, (htable_key_t)((uintptr_t)key), *outvalue));
+	if (hold_key) {
+		self->held[self->held_count] = key;
+		self->held_count += 1;
+		*outadded = 1;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the ID (and tag) of key, adding it if it's new. the record of a
+ * new key is made by passing obj to saver (key is usually obj itself, but
+ * may be anything obj is identified by). if hold_key is set, a new key is
+ * held until the registry is finalized; the caller must keep it alive until
+ * this returns
+ */
+errcode_t registry_get(registry_t * self, const void * key, int hold_key,
+		registry_saver_t saver, void * obj, OUT uint32_t * outid, OUT uint32_t * outtag)
+{
+	errcode_t retcode = ERR_SUCCESS;
+	htable_value_t value;
+	swriter_t stream;
+	int added;
+
+	if (htable_get(self->table, (htable_key_t)((uintptr_t)key), &value) != ERR_SUCCESS) {
+		PROPAGATE(swriter_init(&stream, NULL, REGISTRY_MAX_RECORD_SIZE));
+		retcode = saver(&stream, obj);
+		if (!IS_ERROR(retcode)) {
+			hold_key = hold_key && self->hold != NULL;
+			pthread_mutex_lock(&self->lock);
+			retcode = _registry_add(self, key, hold_key, &stream, &value, &added);
+			pthread_mutex_unlock(&self->lock);
+			if (added) {
+				self->hold(key);
+			}
+		}
+		swriter_fini(&stream);
+		PROPAGATE(retcode);
+	}
+	*outid = (uint32_t)value;
+	*outtag = (uint32_t)(value >> 32);
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * sets the tag of an existing key
+ */
+errcode_t registry_set_tag(registry_t * self, const void * key, uint32_t tag)
+{
+	errcode_t retcode;
+	htable_value_t value;
+
+	pthread_mutex_lock(&self->lock);
+	retcode = htable_get(self->table, (htable_key_t)((uintptr_t)key), &value);
+	if (!IS_ERROR(retcode)) {
+		retcode = htable_set(self->table, (htable_key_t)((uintptr_t)key),
+				REGISTRY_VALUE((uint32_t)value, tag));
+	}
+	pthread_mutex_unlock(&self->lock);
+	return retcode;
+}
@@ -0,0 +1,52 @@
+/*
+ * Registry of IDs, shared by threads
+ */
+
+#ifndef REGISTRY_H_INCLUDED
+#define REGISTRY_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "errors.h"
+#include "htable.h"
+#include "listfile.h"
+#include "swriter.h"
+
+// every table replaces one half its size, so there can't be more of these
+#define REGISTRY_MAX_TABLES        (32)
+#define REGISTRY_MAX_RECORD_SIZE   (16 * 1024)
+
+// serializes obj into the stream, which becomes the object's record. it's
+// called without the registry's lock held, so it may call into python (and
+// the GIL may change hands meanwhile)
+typedef errcode_t (*registry_saver_t)(swriter_t * stream, void * obj);
+
+// takes or drops a reference to a key that's held (see registry_get)
+typedef void (*registry_ref_t)(const void * key);
+
+typedef struct _registry_t {
+	// the table lookups use; replaced (never modified) when it fills up
+	htable_t * volatile  table;
+	// everything below is protected by the lock
+	pthread_mutex_t      lock;
+	htable_t *           tables[REGISTRY_MAX_TABLES];
+	int                  table_count;
+	listfile_t           file;
+	// the keys that are held, and dropped when the registry is finalized
+	registry_ref_t       hold;
+	registry_ref_t       release;
+	const void **        held;
+	int                  held_count;
+	int                  held_capacity;
+} registry_t;
+
+errcode_t registry_init(registry_t * self, const char * filename, int size,
+		registry_ref_t hold, registry_ref_t release);
+errcode_t registry_fini(registry_t * self);
+errcode_t registry_get(registry_t * self, const void * key, int hold_key,
+		registry_saver_t saver, void * obj, OUT uint32_t * outid, OUT uint32_t * outtag);
+errcode_t registry_set_tag(registry_t * self, const void * key, uint32_t tag);
+
+
+#endif /* REGISTRY_H_INCLUDED */
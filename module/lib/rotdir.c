@@ -7,9 +7,16 @@
 #include <unistd.h>
 
 #include "rotdir.h"
+#include "rotzip.h"
 
 
-errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files)
+static void * _rotdir_compressor_main(void * arg);
+
+/*
+ * compress -- if set, every file is compressed by a background thread once
+ * it's deallocated (see rotzip.c)
+ */
+errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files, int compress)
 {
 	errcode_t retcode = ERR_UNKNOWN;
 
@@ -17,7 +24,8 @@ errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files)
 		retcode = ERR_ROTDIR_PATH_TOO_LONG;
 		goto error1;
 	}
-	strncpy(self->path, path, sizeof(self->path));
+	strncpy(self->path, path, sizeof(self->path) - 1);
+	self->path[sizeof(self->path) - 1] = '\0';
 	self->max_files = max_files;
 	self->alloc_counter = 0;
 	self->dealloc_counter = 0;
@@ -34,8 +42,26 @@ errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files)
 		goto error2;
 	}
 
+	self->pid = getpid();
+	self->compress = compress;
+	self->stop_compressor = 0;
+	if (compress) {
+		if (pthread_cond_init(&self->compress_cond, NULL) != 0) {
+			retcode = ERR_ROTDIR_MUTEX_INIT_FAILED;
+			goto error3;
+		}
+		if (pthread_create(&self->compressor, NULL, _rotdir_compressor_main, self) != 0) {
+			retcode = ERR_ROTDIR_THREAD_CREATE_FAILED;
+			goto error4;
+		}
+	}
+
 	RETURN_SUCCESSFUL;
 
+error4:
+	pthread_cond_destroy(&self->compress_cond);
+error3:
+	pthread_mutex_destroy(&self->mutex);
 error2:
 	free(self->files);
 error1:
@@ -46,6 +72,19 @@ error1:
 
 errcode_t rotdir_fini(rotdir_t * self)
 {
+	if (self->files != NULL && self->compress) {
+		// a forked child has no compressor to stop
+		if (self->pid == getpid()) {
+			// files that weren't compressed yet are left as they are
+			pthread_mutex_lock(&self->mutex);
+			self->stop_compressor = 1;
+			pthread_cond_signal(&self->compress_cond);
+			pthread_mutex_unlock(&self->mutex);
+			pthread_join(self->compressor, NULL);
+			pthread_cond_destroy(&self->compress_cond);
+		}
+		self->compress = 0;
+	}
 	if (self->files != NULL) {
 		free(self->files);
 		self->files = NULL;
@@ -80,18 +119,29 @@ static inline errcode_t _rotdir_get_free_slot(rotdir_t * self, OUT int * slot)
 	if (oldest_index < 0) {
 		return ERR_ROTDIR_OUT_OF_SLOTS; // all slots are allocated
 	}
-	snprintf(filename, sizeof(filename), "%s/%s", self->path,
-			self->files[oldest_index].filename);
+	if (snprintf(filename, sizeof(filename), "%s/%s", self->path,
+			self->files[oldest_index].filename) >= sizeof(filename)) {
+		return ERR_ROTDIR_PATH_TOO_LONG;
+	}
 	if (unlink(filename) != 0) {
 		return ERR_ROTDIR_UNLINK_FAILED;
 	}
+	if (self->files[oldest_index].on_deleted != NULL) {
+		self->files[oldest_index].on_deleted(self->path, self->files[oldest_index].prefix,
+				self->files[oldest_index].tag);
+	}
 	self->files[oldest_index].filename[0] = '\0';
+	self->files[oldest_index].compress_pending = 0;
 	*slot = oldest_index;
 	RETURN_SUCCESSFUL;
 }
 
-errcode_t rotdir_allocate(rotdir_t * self, const char * prefix, OUT int * outslot,
-		OUT char * outfilename)
+/*
+ * on_deleted -- if not NULL, called when the file is deleted to make room
+ * for another (but not by rotdir_discard), with prefix and tag
+ */
+errcode_t rotdir_allocate(rotdir_t * self, const char * prefix, rotdir_deleted_t on_deleted,
+		uint64_t tag, OUT int * outslot, OUT char * outfilename)
 {
 	int slot;
 	errcode_t retcode = ERR_UNKNOWN;
@@ -104,10 +154,21 @@ errcode_t rotdir_allocate(rotdir_t * self, const char * prefix, OUT int * outslo
 	PROPAGATE_TO(cleanup, retcode = _rotdir_get_free_slot(self, &slot));
 
 	self->files[slot].allocated = 1;
-	snprintf(self->files[slot].filename, sizeof(self->files[slot].filename),
-		"%s.%06d.rot", prefix, self->alloc_counter);
+	self->files[slot].on_deleted = on_deleted;
+	self->files[slot].tag = tag;
+	// the prefix's length was checked, so neither of these truncates
+	strncpy(self->files[slot].prefix, prefix, sizeof(self->files[slot].prefix) - 1);
+	self->files[slot].prefix[sizeof(self->files[slot].prefix) - 1] = '\0';
+	if (snprintf(self->files[slot].filename, sizeof(self->files[slot].filename),
+			"%s.%06d.rot", prefix, self->alloc_counter) >= sizeof(self->files[slot].filename) ||
+			snprintf(outfilename, PATH_MAX, "%s/%s", self->path,
+			self->files[slot].filename) >= PATH_MAX) {
+		self->files[slot].allocated = 0;
+		self->files[slot].filename[0] = '\0';
+		retcode = ERR_ROTDIR_PREFIX_TOO_LONG;
+		goto cleanup;
+	}
 	self->alloc_counter += 1;
-	snprintf(outfilename, PATH_MAX, "%s/%s", self->path, self->files[slot].filename);
 
 	*outslot = slot;
 	retcode = ERR_SUCCESS;
@@ -127,10 +188,95 @@ errcode_t rotdir_deallocate(rotdir_t * self, int slot)
 	self->files[slot].allocated = 0;
 	self->files[slot].dealloc_order = self->dealloc_counter;
 	self->dealloc_counter += 1;
+	if (self->compress) {
+		self->files[slot].compress_pending = 1;
+		pthread_cond_signal(&self->compress_cond);
+	}
 	pthread_mutex_unlock(&self->mutex);
 	RETURN_SUCCESSFUL;
 }
 
+/*
+ * gives back a slot whose file was never used, removing the file. the slot
+ * becomes empty rather than joining the rotation
+ */
+errcode_t rotdir_discard(rotdir_t * self, int slot)
+{
+	char filename[PATH_MAX];
+	errcode_t retcode = ERR_SUCCESS;
+
+	if (slot < 0 || slot >= self->max_files) {
+		return ERR_ROTDIR_INVALID_SLOT;
+	}
+
+	pthread_mutex_lock(&self->mutex);
+	if (snprintf(filename, sizeof(filename), "%s/%s", self->path,
+			self->files[slot].filename) >= sizeof(filename)) {
+		retcode = ERR_ROTDIR_PATH_TOO_LONG;
+	}
+	else if (unlink(filename) != 0) {
+		retcode = ERR_ROTDIR_UNLINK_FAILED;
+	}
+	self->files[slot].allocated = 0;
+	self->files[slot].compress_pending = 0;
+	self->files[slot].filename[0] = '\0';
+	pthread_mutex_unlock(&self->mutex);
+	return retcode;
+}
+
+/*
+ * compresses deallocated files, one at a time, into a temporary file that
+ * then replaces the original. the mutex is not held while compressing, so
+ * the file may be rotated out meanwhile -- in which case the compressed
+ * file is simply thrown away
+ */
+static void * _rotdir_compressor_main(void * arg)
+{
+	rotdir_t * self = (rotdir_t *)arg;
+	char name[ROTDIR_MAX_FILENAME_LEN];
+	char filename[PATH_MAX];
+	char tmpfilename[PATH_MAX];
+	errcode_t retcode;
+	int i;
+
+	pthread_mutex_lock(&self->mutex);
+	while (!self->stop_compressor) {
+		for (i = 0; i < self->max_files; i++) {
+			if (self->files[i].compress_pending && !self->files[i].allocated) {
+				break;
+			}
+		}
+		if (i >= self->max_files) {
+			pthread_cond_wait(&self->compress_cond, &self->mutex);
+			continue;
+		}
+		self->files[i].compress_pending = 0;
+		strncpy(name, self->files[i].filename, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		pthread_mutex_unlock(&self->mutex);
+
+		if (snprintf(filename, sizeof(filename), "%s/%s", self->path, name) >=
+				sizeof(filename) ||
+				snprintf(tmpfilename, sizeof(tmpfilename), "%s.tmp", filename) >=
+				sizeof(tmpfilename)) {
+			// left uncompressed
+			pthread_mutex_lock(&self->mutex);
+			continue;
+		}
+		retcode = rotzip_compress_file(filename, tmpfilename);
+
+		pthread_mutex_lock(&self->mutex);
+		if (!IS_ERROR(retcode)) {
+			if (strcmp(self->files[i].filename, name) != 0 ||
+					rename(tmpfilename, filename) != 0) {
+				unlink(tmpfilename);
+			}
+		}
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
 /*
 #include <fcntl.h>
 
@@ -143,10 +289,10 @@ int main()
 
 	system("rm -rf /tmp/lalala");
 	system("mkdir /tmp/lalala");
-	ASSERT(rotdir_init(&rd, "/tmp/lalala", 7));
+	ASSERT(rotdir_init(&rd, "/tmp/lalala", 7, 0));
 
 	for (i = 0; i < 100; i++) {
-		ASSERT(rotdir_allocate(&rd, "moshe", &slot, fn));
+		ASSERT(rotdir_allocate(&rd, "moshe", NULL, 0, &slot, fn));
 		printf("file: %d, %s\n", slot, fn);
 		close(open(fn, O_RDWR | O_CREAT, 0700));
 		rotdir_deallocate(&rd, slot);
@@ -7,6 +7,8 @@
 
 #include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "errors.h"
 
@@ -14,9 +16,17 @@
 #define ROTDIR_MAX_FILEPREFIX_LEN  (ROTDIR_MAX_FILENAME_LEN - 20)
 
 
+// called, with the rotdir's lock held, when a file is deleted to make room
+// for another, with the prefix and tag it was allocated with
+typedef void (*rotdir_deleted_t)(const char * path, const char * prefix, uint64_t tag);
+
 typedef struct {
 	int      allocated;
+	int      compress_pending;
 	int      dealloc_order;
+	rotdir_deleted_t on_deleted;
+	uint64_t tag;
+	char     prefix[ROTDIR_MAX_FILEPREFIX_LEN + 1];
 	char     filename[ROTDIR_MAX_FILENAME_LEN];
 } _rotdir_fileinfo_t;
 
@@ -27,12 +37,20 @@ typedef struct {
 	int                    dealloc_counter;
 	_rotdir_fileinfo_t *   files;
 	pthread_mutex_t        mutex;
+	// compressor thread, which only the process that created the rotdir has
+	pid_t                  pid;
+	int                    compress;
+	int                    stop_compressor;
+	pthread_cond_t         compress_cond;
+	pthread_t              compressor;
 } rotdir_t;
 
-errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files);
+errcode_t rotdir_init(rotdir_t * self, const char * path, int max_files, int compress);
 errcode_t rotdir_fini(rotdir_t * self);
-errcode_t rotdir_allocate(rotdir_t * self, const char * prefix, OUT int * outslot, OUT char * outfilename);
+errcode_t rotdir_allocate(rotdir_t * self, const char * prefix, rotdir_deleted_t on_deleted,
+		uint64_t tag, OUT int * outslot, OUT char * outfilename);
 errcode_t rotdir_deallocate(rotdir_t * self, int slot);
+errcode_t rotdir_discard(rotdir_t * self, int slot);
 
 
 #endif /* ROTDIR_H_INCLUDED */
@@ -1,4 +1,7 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,95 +12,550 @@
 
 #define ROTREC_FLAG_WINDOW_OPENED          0x0001
 #define ROTREC_FLAG_INCREMENT_BASE_OFFSET  0x0002
-#define ROTREC_FILE_HEADER_SIZE            (sizeof(uint64_t))
+#define ROTREC_FILE_HEADER_SIZE            (sizeof(rotrec_file_header_t))
+#define ROTREC_FOOTER_SIZE(capacity)       (sizeof(rotret_record_size_t) + \
+		(capacity) * sizeof(rotrec_index_entry_t) + sizeof(rotrec_file_footer_t))
 
+#define ROTREC_NEXT_NONE                   0
+#define ROTREC_NEXT_REQUESTED              1
+#define ROTREC_NEXT_READY                  2
+#define ROTREC_NEXT_FAILED                 3
 
+
+/*
+ * preallocator -- a single thread (per process) that prepares the next file
+ * of every rotrec that asked for it: allocates it in the rotdir, fallocates
+ * it, maps its first window and faults it in. switching to the next file is
+ * then just a matter of taking it over, instead of doing all that inline.
+ * the thread runs as long as there are rotrecs that use preallocation.
+ * a forked child doesn't have the thread, so it starts from scratch
+ */
+static pthread_mutex_t _rotrec_prealloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _rotrec_prealloc_requested = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _rotrec_prealloc_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t _rotrec_prealloc_once = PTHREAD_ONCE_INIT;
+static pthread_t _rotrec_prealloc_thread;
+static int _rotrec_prealloc_users = 0;
+static long _rotrec_prealloc_epoch = 0;
+static rotrec_t * _rotrec_prealloc_pending = NULL;
+
+
+/*
+ * the top level index is written by its rotrec, and cleared by whichever
+ * thread has the rotdir delete one of its files (possibly after the rotrec
+ * is gone, so that goes by the index's filename)
+ */
+static pthread_mutex_t _rotrec_topindex_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static errcode_t _rotrec_pwrite(int fd, const void * buf, size_t size, off_t offset)
+{
+	ssize_t count;
+
+	while (size > 0) {
+		count = pwrite(fd, buf, size, offset);
+		if (count <= 0) {
+			return ERR_ROTREC_WRITE_FAILED;
+		}
+		buf = (const char *)buf + count;
+		size -= count;
+		offset += count;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * called by the rotdir when it deletes a file: clears the file's slot in the
+ * top level index of its prefix, unless the slot was taken by another file
+ */
+static void _rotrec_file_deleted(const char * path, const char * prefix, uint64_t base_offset)
+{
+	char filename[PATH_MAX];
+	rotrec_topindex_header_t header;
+	rotrec_topindex_entry_t entry;
+	off_t offset;
+	uint32_t i, count;
+	int fd;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s.timeindex", path, prefix) >=
+			sizeof(filename)) {
+		return; // never created, either
+	}
+	pthread_mutex_lock(&_rotrec_topindex_mutex);
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			header.magic != ROTREC_TOPINDEX_MAGIC) {
+		goto cleanup;
+	}
+	count = (header.count < header.capacity) ? header.count : header.capacity;
+	for (i = 0; i < count; i++) {
+		offset = sizeof(header) + i * sizeof(entry);
+		if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
+			break;
+		}
+		if (entry.base_offset == base_offset &&
+				entry.max_timestamp != ROTREC_DELETED_TIMESTAMP) {
+			memset(&entry, 0, sizeof(entry));
+			// nothing to do about a failure, readers skip missing files
+			(void)(_rotrec_pwrite(fd, &entry, sizeof(entry), offset));
+			break;
+		}
+	}
+
+cleanup:
+	if (fd >= 0) {
+		close(fd);
+	}
+	pthread_mutex_unlock(&_rotrec_topindex_mutex);
+}
+
+static errcode_t _rotrec_create_file(rotrec_t * self, off_t base_offset, int prepare,
+		OUT int * outslot, OUT int * outfd, OUT fwindow_t * outwindow)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+	char filename[PATH_MAX];
+	int fd;
+	int slot;
+
+	PROPAGATE_TO(error1, retcode = rotdir_allocate(self->rotdir, self->file_prefix,
+			_rotrec_file_deleted, (uint64_t)base_offset, &slot, filename));
+	fd = open(filename, O_RDWR | O_CREAT | O_EXCL,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		retcode = ERR_ROTREC_OPEN_FAILED;
+		goto error2;
+	}
+	if (prepare && posix_fallocate(fd, 0, self->total_file_size) != 0) {
+		retcode = ERR_ROTREC_FALLOCATE_FAILED;
+		goto error3;
+	}
+	PROPAGATE_TO(error3, retcode = fwindow_init(outwindow, fd, self->total_file_size,
+			self->map_size, self->map_flags));
+	if (prepare) {
+		PROPAGATE_TO(error4, retcode = fwindow_prefault(outwindow));
+	}
+
+	rotrec_file_header_t header;
+	header.base_offset = (uint64_t)base_offset;
+	header.marker = 0;
+	header.magic = ROTREC_MAGIC;
+	header.version = self->version;
+	header.flags = 0;
+
+	PROPAGATE_TO(error4, retcode = fwindow_write(outwindow, &header, sizeof(header)));
+
+	*outslot = slot;
+	*outfd = fd;
+	RETURN_SUCCESSFUL;
+
+error4:
+	fwindow_fini(outwindow);
+error3:
+	close(fd);
+error2:
+	rotdir_deallocate(self->rotdir, slot);
+error1:
+	return retcode;
+}
+
+static void _rotrec_prealloc_atfork_child(void)
+{
+	// the thread (and whoever held the mutex) is gone, and so are the
+	// requests; the child's rotrecs don't own their files anyway
+	pthread_mutex_init(&_rotrec_prealloc_mutex, NULL);
+	pthread_cond_init(&_rotrec_prealloc_requested, NULL);
+	pthread_cond_init(&_rotrec_prealloc_done, NULL);
+	_rotrec_prealloc_users = 0;
+	_rotrec_prealloc_epoch += 1;
+	_rotrec_prealloc_pending = NULL;
+}
+
+static void _rotrec_prealloc_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, _rotrec_prealloc_atfork_child);
+}
+
+static void * _rotrec_prealloc_main(void * arg)
+{
+	long epoch = (long)arg;
+	rotrec_t * self;
+	errcode_t retcode;
+
+	pthread_mutex_lock(&_rotrec_prealloc_mutex);
+	while (epoch == _rotrec_prealloc_epoch) {
+		if (_rotrec_prealloc_pending == NULL) {
+			pthread_cond_wait(&_rotrec_prealloc_requested, &_rotrec_prealloc_mutex);
+			continue;
+		}
+		self = _rotrec_prealloc_pending;
+		_rotrec_prealloc_pending = self->next_pending;
+		self->next_pending = NULL;
+		pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+
+		// the rotrec's owner doesn't touch the next_* fields while the
+		// request is pending, so they're ours for now
+		retcode = _rotrec_create_file(self, self->next_base_offset, 1,
+				&self->next_slot, &self->next_fd, &self->next_window);
+
+		pthread_mutex_lock(&_rotrec_prealloc_mutex);
+		self->next_state = IS_ERROR(retcode) ? ROTREC_NEXT_FAILED : ROTREC_NEXT_READY;
+		pthread_cond_broadcast(&_rotrec_prealloc_done);
+	}
+	pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+	return NULL;
+}
+
+static errcode_t _rotrec_prealloc_start(void)
+{
+	errcode_t retcode = ERR_SUCCESS;
+
+	pthread_once(&_rotrec_prealloc_once, _rotrec_prealloc_register_atfork);
+	pthread_mutex_lock(&_rotrec_prealloc_mutex);
+	if (_rotrec_prealloc_users == 0) {
+		if (pthread_create(&_rotrec_prealloc_thread, NULL, _rotrec_prealloc_main,
+				(void*)_rotrec_prealloc_epoch) != 0) {
+			retcode = ERR_ROTREC_THREAD_CREATE_FAILED;
+			goto cleanup;
+		}
+	}
+	_rotrec_prealloc_users += 1;
+
+cleanup:
+	pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+	return retcode;
+}
+
+static void _rotrec_prealloc_stop(void)
+{
+	pthread_t thread;
+	int stop = 0;
+
+	pthread_mutex_lock(&_rotrec_prealloc_mutex);
+	_rotrec_prealloc_users -= 1;
+	if (_rotrec_prealloc_users == 0) {
+		// the thread exits once the epoch moves on, even if a new one is
+		// started meanwhile
+		_rotrec_prealloc_epoch += 1;
+		pthread_cond_broadcast(&_rotrec_prealloc_requested);
+		thread = _rotrec_prealloc_thread;
+		stop = 1;
+	}
+	pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+
+	if (stop) {
+		pthread_join(thread, NULL);
+	}
+}
+
+static inline void _rotrec_request_next(rotrec_t * self)
+{
+	self->next_base_offset = self->base_offset + self->total_file_size;
+	pthread_mutex_lock(&_rotrec_prealloc_mutex);
+	self->next_state = ROTREC_NEXT_REQUESTED;
+	self->next_pending = _rotrec_prealloc_pending;
+	_rotrec_prealloc_pending = self;
+	pthread_cond_signal(&_rotrec_prealloc_requested);
+	pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+}
+
+/*
+ * waits for the pending request (if any) to be done, and returns whether
+ * the next file is ready
+ */
+static inline int _rotrec_wait_next(rotrec_t * self)
+{
+	int state;
+
+	pthread_mutex_lock(&_rotrec_prealloc_mutex);
+	while (self->next_state == ROTREC_NEXT_REQUESTED) {
+		pthread_cond_wait(&_rotrec_prealloc_done, &_rotrec_prealloc_mutex);
+	}
+	state = self->next_state;
+	self->next_state = ROTREC_NEXT_NONE;
+	pthread_mutex_unlock(&_rotrec_prealloc_mutex);
+
+	return state == ROTREC_NEXT_READY;
+}
+
+/*
+ * prealloc_percent -- once the current file is filled this much, the next
+ * one is prepared in the background. 0 means the next file is created only
+ * when it's needed
+ * map_flags -- FMAP_* flags for the windows over the files
+ */
 errcode_t rotrec_init(rotrec_t * self, rotdir_t * rotdir, const char * file_prefix,
-		size_t map_size, off_t file_data_size)
+		size_t map_size, off_t file_data_size, int version, int prealloc_percent,
+		int map_flags)
 {
+	errcode_t retcode = ERR_UNKNOWN;
+	char filename[PATH_MAX];
+	rotrec_topindex_header_t topheader;
+	int index_capacity;
+
 	if (map_size > file_data_size) {
 		return ERR_ROTREC_MAPSIZE_GREATER_THAN_FILESIZE;
 	}
-	if (strlen(file_prefix) > sizeof(self->file_prefix)) {
+	if (strlen(file_prefix) >= sizeof(self->file_prefix)) {
 		return ERR_ROTREC_FILEPREFIX_TOO_LONG;
 	}
+	// an even capacity, as the index is thinned out by halves
+	index_capacity = file_data_size / ROTREC_INDEX_DENSITY;
+	if (index_capacity > ROTREC_INDEX_CAPACITY) {
+		index_capacity = ROTREC_INDEX_CAPACITY;
+	}
+	index_capacity = index_capacity < 2 ? 2 : index_capacity & ~1;
+	if (file_data_size <= ROTREC_FOOTER_SIZE(index_capacity)) {
+		return ERR_ROTREC_FILESIZE_TOO_SMALL;
+	}
+	if (prealloc_percent < 0 || prealloc_percent > 100) {
+		return ERR_ROTREC_INVALID_PREALLOC_PERCENT;
+	}
 
 	self->flags = 0;
+	self->version = version;
+	self->generation = 0;
 	self->base_offset = 0;
 	self->rotdir_slot = -1;
 	self->rotdir = rotdir;
+	self->fd = -1;
 	self->file_data_size = file_data_size;
 	self->total_file_size = file_data_size + ROTREC_FILE_HEADER_SIZE;
+	self->data_limit = self->total_file_size - ROTREC_FOOTER_SIZE(index_capacity);
 	self->map_size = map_size;
-	strncpy(self->file_prefix, file_prefix, sizeof(self->file_prefix));
+	self->map_flags = map_flags;
+	self->reserved = NULL;
+	self->reserved_size = 0;
+	strncpy(self->file_prefix, file_prefix, sizeof(self->file_prefix) - 1);
+	self->file_prefix[sizeof(self->file_prefix) - 1] = '\0';
+	self->pid = getpid();
+
+	self->prealloc_offset = -1;
+	self->next_state = ROTREC_NEXT_NONE;
+	self->next_slot = -1;
+	self->next_fd = -1;
+	self->next_base_offset = 0;
+	self->next_pending = NULL;
+
+	self->index_capacity = index_capacity;
+	self->index_count = 0;
+	self->index_stride = 1;
+	self->index_skip = 0;
+	self->min_timestamp = 0;
+	self->last_timestamp = 0;
+	self->topindex_count = 0;
+	self->index = malloc(sizeof(rotrec_index_entry_t) * index_capacity);
+	if (self->index == NULL) {
+		retcode = ERR_ROTREC_MALLOC_FAILED;
+		goto error1;
+	}
+	if (snprintf(filename, sizeof(filename), "%s/%s.timeindex", rotdir->path, file_prefix) >=
+			sizeof(filename)) {
+		retcode = ERR_ROTREC_FILEPREFIX_TOO_LONG;
+		goto error2;
+	}
+	self->topindex_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (self->topindex_fd < 0) {
+		retcode = ERR_ROTREC_OPEN_FAILED;
+		goto error2;
+	}
+	topheader.magic = ROTREC_TOPINDEX_MAGIC;
+	topheader.version = ROTREC_TOPINDEX_VERSION;
+	topheader.reserved = 0;
+	topheader.capacity = rotdir->max_files;
+	topheader.count = 0;
+	PROPAGATE_TO(error3, retcode = _rotrec_pwrite(self->topindex_fd, &topheader,
+			sizeof(topheader), 0));
+
+	if (prealloc_percent > 0) {
+		PROPAGATE_TO(error3, retcode = _rotrec_prealloc_start());
+		self->prealloc_offset = self->total_file_size * prealloc_percent / 100;
+	}
 
 	RETURN_SUCCESSFUL;
+
+error3:
+	close(self->topindex_fd);
+	self->topindex_fd = -1;
+error2:
+	free(self->index);
+	self->index = NULL;
+error1:
+	return retcode;
+}
+
+/*
+ * writes the slot of the current file in the top level index, and the
+ * number of files in the header
+ */
+static inline errcode_t _rotrec_update_topindex(rotrec_t * self, uint64_t max_timestamp)
+{
+	errcode_t retcode;
+	rotrec_topindex_entry_t entry;
+	uint32_t capacity = self->rotdir->max_files;
+	uint32_t n = self->topindex_count - 1;
+
+	entry.base_offset = self->base_offset;
+	entry.min_timestamp = self->min_timestamp;
+	entry.max_timestamp = max_timestamp;
+	pthread_mutex_lock(&_rotrec_topindex_mutex);
+	retcode = _rotrec_pwrite(self->topindex_fd, &entry, sizeof(entry),
+			sizeof(rotrec_topindex_header_t) + (n % capacity) * sizeof(entry));
+	if (!IS_ERROR(retcode)) {
+		retcode = _rotrec_pwrite(self->topindex_fd, &self->topindex_count,
+				sizeof(self->topindex_count), offsetof(rotrec_topindex_header_t, count));
+	}
+	pthread_mutex_unlock(&_rotrec_topindex_mutex);
+	return retcode;
 }
 
+/*
+ * adds a (timestamp, offset) pair to the time index of the current file,
+ * where offset is one returned by rotrec_reserve() for this file, and
+ * timestamps never decrease. once the index is full, every other entry is
+ * dropped, and from then on only every other call adds an entry (and so on)
+ */
+errcode_t rotrec_index(rotrec_t * self, uint64_t timestamp, off_t offset)
+{
+	int i;
+
+	if (self->index_count == 0) {
+		// the first entry of the file
+		self->min_timestamp = timestamp;
+		self->topindex_count += 1;
+		PROPAGATE(_rotrec_update_topindex(self, ROTREC_OPEN_TIMESTAMP));
+	}
+	if (self->index_skip > 0) {
+		self->index_skip -= 1;
+		RETURN_SUCCESSFUL;
+	}
+	if (self->index_count >= self->index_capacity) {
+		for (i = 0; i < self->index_capacity / 2; i++) {
+			self->index[i] = self->index[i * 2];
+		}
+		self->index_count = self->index_capacity / 2;
+		self->index_stride *= 2;
+	}
+	self->index[self->index_count].timestamp = timestamp;
+	self->index[self->index_count].offset = offset;
+	self->index_count += 1;
+	self->index_skip = self->index_stride - 1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * seals the current file: writes its footer right after the records (in
+ * the room kept for it past data_limit), and trims the rest of the file
+ */
+static inline errcode_t _rotrec_write_footer(rotrec_t * self, off_t data_end)
+{
+	rotrec_file_footer_t footer;
+	rotret_record_size_t terminator = 0;
+	size_t index_size = sizeof(rotrec_index_entry_t) * self->index_count;
+	off_t pos = data_end;
+
+	footer.min_timestamp = self->min_timestamp;
+	footer.max_timestamp = self->last_timestamp;
+	footer.entry_count = self->index_count;
+	footer.magic = ROTREC_FOOTER_MAGIC;
+	footer.version = ROTREC_FOOTER_VERSION;
+
+	PROPAGATE(_rotrec_pwrite(self->fd, &terminator, sizeof(terminator), pos));
+	pos += sizeof(terminator);
+	PROPAGATE(_rotrec_pwrite(self->fd, self->index, index_size, pos));
+	pos += index_size;
+	PROPAGATE(_rotrec_pwrite(self->fd, &footer, sizeof(footer), pos));
+	pos += sizeof(footer);
+	if (ftruncate(self->fd, pos) != 0) {
+		return ERR_ROTREC_TRUNCATE_FAILED;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * the file is closed and given back to the rotdir even if sealing it fails
+ * (readers can still read its records), and the first error is returned
+ */
 static inline errcode_t _rotrec_close_window(rotrec_t * self)
 {
+	errcode_t retcode;
+	errcode_t retcode2;
+	off_t data_end = fwindow_tell(&self->window);
+
+	retcode = fwindow_fini(&self->window);
+	if (!IS_ERROR(retcode)) {
+		retcode = _rotrec_write_footer(self, data_end);
+	}
+	if (!IS_ERROR(retcode) && self->index_count > 0) {
+		retcode = _rotrec_update_topindex(self, self->last_timestamp);
+	}
+	close(self->fd);
+	self->fd = -1;
+
+	// the file is complete, the rotdir may do with it as it pleases
 	if (self->rotdir_slot >= 0) {
-		PROPAGATE(rotdir_deallocate(self->rotdir, self->rotdir_slot));
+		retcode2 = rotdir_deallocate(self->rotdir, self->rotdir_slot);
+		if (!IS_ERROR(retcode)) {
+			retcode = retcode2;
+		}
 		self->rotdir_slot = -1;
 	}
 
-	PROPAGATE(fwindow_fini(&self->window));
+	self->reserved = NULL;
 	self->flags &= ~ROTREC_FLAG_WINDOW_OPENED;
 	self->flags |= ROTREC_FLAG_INCREMENT_BASE_OFFSET;
 
-	RETURN_SUCCESSFUL;
+	return retcode;
 }
 
 static inline errcode_t _rotrec_open_window(rotrec_t * self)
 {
-	errcode_t retcode = ERR_UNKNOWN;
-	char filename[PATH_MAX];
-	int fd;
-	int slot;
-
-	PROPAGATE_TO(error1, retcode = rotdir_allocate(self->rotdir, self->file_prefix,
-			&slot, filename));
-	fd = open(filename, O_RDWR | O_CREAT | O_EXCL,
-			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-	if (fd < 0) {
-		retcode = ERR_ROTREC_OPEN_FAILED;
-		goto error2;
-	}
-	PROPAGATE_TO(error3, retcode = fwindow_init(&self->window, fd, self->map_size));
-
-	uint64_t base_offset = (uint64_t)(self->base_offset);
+	off_t base_offset = self->base_offset;
 
 	if (self->flags & ROTREC_FLAG_INCREMENT_BASE_OFFSET) {
-		self->flags &= ~ROTREC_FLAG_INCREMENT_BASE_OFFSET;
 		base_offset += self->total_file_size;
 	}
+	if (self->prealloc_offset >= 0 && _rotrec_wait_next(self)) {
+		// the next file was prepared in the background, just take it over
+		self->rotdir_slot = self->next_slot;
+		self->fd = self->next_fd;
+		self->window = self->next_window;
+		self->next_slot = -1;
+		self->next_fd = -1;
+	}
+	else {
+		// create it inline (also if preparing it in the background failed,
+		// which tells us nothing about how it would go now)
+		PROPAGATE(_rotrec_create_file(self, base_offset, 0, &self->rotdir_slot,
+				&self->fd, &self->window));
+	}
 
-	PROPAGATE_TO(error4, retcode = fwindow_write(&self->window, &base_offset,
-			sizeof(base_offset)));
-
+	self->flags &= ~ROTREC_FLAG_INCREMENT_BASE_OFFSET;
 	self->flags |= ROTREC_FLAG_WINDOW_OPENED;
-	self->rotdir_slot = slot;
 	self->base_offset = base_offset;
+	self->index_count = 0;
+	self->index_stride = 1;
+	self->index_skip = 0;
+	// lets the user tell that a new file has been started
+	self->generation += 1;
 
 	RETURN_SUCCESSFUL;
-
-error4:
-	fwindow_fini(&self->window);
-error3:
-	close(fd);
-error2:
-	rotdir_deallocate(self->rotdir, slot);
-error1:
-	return retcode;
 }
 
 static inline int _rotrec_ensure(rotrec_t * self, size_t size)
 {
 	if (self->flags & ROTREC_FLAG_WINDOW_OPENED) {
-		if (fwindow_tell(&self->window) + size > self->total_file_size) {
+		if (fwindow_tell(&self->window) + size > self->data_limit) {
 			// record will not fit in this file, so we need to close it
 			PROPAGATE(_rotrec_close_window(self));
 		}
+		else if (self->next_state == ROTREC_NEXT_NONE && self->prealloc_offset >= 0 &&
+				fwindow_tell(&self->window) >= self->prealloc_offset) {
+			_rotrec_request_next(self);
+		}
 	}
 	if (!(self->flags & ROTREC_FLAG_WINDOW_OPENED)) {
 		PROPAGATE(_rotrec_open_window(self));
@@ -106,30 +564,128 @@ static inline int _rotrec_ensure(rotrec_t * self, size_t size)
 	RETURN_SUCCESSFUL;
 }
 
+/*
+ * gives back a next file that was prepared but never used. it holds no
+ * records, so it's removed rather than left behind for readers
+ */
+static inline void _rotrec_discard_next(rotrec_t * self)
+{
+	if (!_rotrec_wait_next(self)) {
+		return;
+	}
+	fwindow_fini(&self->next_window);
+	close(self->next_fd);
+	rotdir_discard(self->rotdir, self->next_slot);
+	self->next_fd = -1;
+	self->next_slot = -1;
+}
+
+/*
+ * a forked child only lets go of what it inherited. the files, the top
+ * level index and the rotdir slots are the parent's, which keeps writing
+ * them, so they're left as they are (sealing or truncating them here would
+ * pull the pages from under the parent)
+ */
+static inline void _rotrec_release_inherited(rotrec_t * self)
+{
+	if (self->flags & ROTREC_FLAG_WINDOW_OPENED) {
+		fwindow_fini(&self->window);
+		close(self->fd);
+		self->fd = -1;
+		self->reserved = NULL;
+		self->flags &= ~ROTREC_FLAG_WINDOW_OPENED;
+	}
+	if (self->prealloc_offset >= 0) {
+		// a request in progress is the parent's thread's business
+		if (self->next_state == ROTREC_NEXT_READY) {
+			fwindow_fini(&self->next_window);
+			close(self->next_fd);
+			self->next_fd = -1;
+		}
+		self->next_state = ROTREC_NEXT_NONE;
+		self->prealloc_offset = -1;
+	}
+}
+
 errcode_t rotrec_fini(rotrec_t * self)
 {
+	errcode_t retcode = ERR_SUCCESS;
+
+	if (self->pid != getpid()) {
+		_rotrec_release_inherited(self);
+	}
 	if (self->flags & ROTREC_FLAG_WINDOW_OPENED) {
-		PROPAGATE(_rotrec_close_window(self));
+		retcode = _rotrec_close_window(self);
+	}
+	if (self->prealloc_offset >= 0) {
+		_rotrec_discard_next(self);
+		_rotrec_prealloc_stop();
+		self->prealloc_offset = -1;
+	}
+	if (self->topindex_fd >= 0) {
+		close(self->topindex_fd);
+		self->topindex_fd = -1;
+	}
+	if (self->index != NULL) {
+		free(self->index);
+		self->index = NULL;
 	}
 
 	self->flags = 0;
 	self->rotdir = NULL;
 	self->rotdir_slot = -1;
-	RETURN_SUCCESSFUL;
+	return retcode;
 }
 
 errcode_t rotrec_write(rotrec_t * self, const void * buf, rotret_record_size_t size, off_t * outoffset)
 {
-	if (size > self->file_data_size) {
+	void * addr;
+
+	PROPAGATE(rotrec_reserve(self, size, &addr, outoffset));
+	memcpy(addr, buf, size);
+	return rotrec_commit(self, size);
+}
+
+/*
+ * reserves room for a record of up to `size` bytes and returns a pointer
+ * into the mapped file, so the record can be encoded in place (no copying).
+ * nothing is visible until rotrec_commit() is called with the actual size;
+ * the length prefix is filled in only then. a reservation that is never
+ * committed is simply overwritten by the next one.
+ */
+errcode_t rotrec_reserve(rotrec_t * self, rotret_record_size_t size, OUT void ** outbuf,
+		off_t * outoffset)
+{
+	void * addr;
+
+	if (ROTREC_FILE_HEADER_SIZE + sizeof(size) + size > self->data_limit) {
 		return ERR_ROTREC_SIZE_TOO_LARGE;
 	}
 
-	PROPAGATE(_rotrec_ensure(self, size));
+	PROPAGATE(_rotrec_ensure(self, sizeof(size) + size));
+	PROPAGATE(fwindow_reserve(&self->window, sizeof(size) + size, &addr));
 	if (outoffset != NULL) {
 		*outoffset = self->base_offset + fwindow_tell(&self->window);
 	}
-	PROPAGATE(fwindow_write(&self->window, &size, sizeof(size)));
-	PROPAGATE(fwindow_write(&self->window, buf, size));
+	self->reserved = addr;
+	self->reserved_size = size;
+	*outbuf = addr + sizeof(size);
+
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t rotrec_commit(rotrec_t * self, rotret_record_size_t size)
+{
+	if (self->reserved == NULL) {
+		return ERR_ROTREC_NOTHING_RESERVED;
+	}
+	if (size > self->reserved_size) {
+		return ERR_ROTREC_COMMIT_EXCEEDS_RESERVED;
+	}
+
+	*((rotret_record_size_t*)self->reserved) = size;
+	fwindow_advance(&self->window, sizeof(size) + size);
+	self->reserved = NULL;
 
 	RETURN_SUCCESSFUL;
 }
@@ -144,7 +700,7 @@ int main()
 	system("rm -rf /tmp/lalala");
 	system("mkdir /tmp/lalala");
 	ASSERT(rotdir_init(&rd, "/tmp/lalala", 5));
-	ASSERT(rotrec_init(&rc, &rd, "thread-1", 4 * 1024, 40 * 1024));
+	ASSERT(rotrec_init(&rc, &rd, "thread-1", 4 * 1024, 40 * 1024, 1, 50, 0));
 
 	char data[500] = {0};
 	int i;
@@ -7,29 +7,137 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "fmap.h"
 #include "rotdir.h"
 
+/*
+ * every rotrec file starts with this header. `marker` is always 0, so that
+ * readers of the original format (a bare uint64 base offset followed by
+ * records) see an empty file instead of garbage
+ */
+#define ROTREC_MAGIC    (0x5650) // "PV"
+
+// header flags
+#define ROTREC_HEADER_COMPRESSED   (0x0001) // the records are in rotzip blocks
+
+typedef struct {
+	uint64_t   base_offset;
+	uint16_t   marker;
+	uint16_t   magic;
+	uint16_t   version;
+	uint16_t   flags;
+} rotrec_file_header_t;
+
+/*
+ * when a file is sealed, its records are followed by a zero length (so
+ * record readers stop there), a sparse time index of the file (up to
+ * ROTREC_INDEX_CAPACITY (timestamp, offset) pairs, in ascending order, each
+ * pointing at a record the user chose to index), and this footer, which
+ * ends the file. room for all of that is kept at the end of every file, so
+ * a sealed file is never larger than it was allocated; smaller files get a
+ * smaller index (one entry per ROTREC_INDEX_DENSITY bytes of data)
+ */
+#define ROTREC_FOOTER_MAGIC    (0x4650) // "PF"
+#define ROTREC_FOOTER_VERSION  (1)
+#define ROTREC_INDEX_CAPACITY  (4096)
+#define ROTREC_INDEX_DENSITY   (1024)
+
+typedef struct {
+	uint64_t   timestamp;
+	uint64_t   offset;
+} rotrec_index_entry_t;
 
 typedef struct {
+	uint64_t   min_timestamp;
+	uint64_t   max_timestamp;
+	uint32_t   entry_count;
+	uint16_t   magic;
+	uint16_t   version;
+} rotrec_file_footer_t;
+
+/*
+ * the top level index (<prefix>.timeindex) has a slot per file that may
+ * still exist -- a rotdir never keeps more than max_files files -- which
+ * are reused round robin, so entries of rotated-out files drop out. the
+ * slot of the file being written is updated when its first index entry is
+ * added (with max_timestamp of ROTREC_OPEN_TIMESTAMP) and when it's sealed,
+ * and cleared (to all zeros, so max_timestamp is ROTREC_DELETED_TIMESTAMP)
+ * when the rotdir deletes the file.
+ */
+#define ROTREC_TOPINDEX_MAGIC    (0x49545650) // "PVTI"
+#define ROTREC_TOPINDEX_VERSION  (2)
+#define ROTREC_OPEN_TIMESTAMP    ((uint64_t)-1)
+#define ROTREC_DELETED_TIMESTAMP (0)
+
+typedef struct {
+	uint32_t   magic;
+	uint16_t   version;
+	uint16_t   reserved;
+	uint32_t   capacity;
+	uint32_t   count;    // number of files ever indexed; file n is in slot n % capacity
+} rotrec_topindex_header_t;
+
+typedef struct {
+	uint64_t   base_offset;
+	uint64_t   min_timestamp;
+	uint64_t   max_timestamp;
+} rotrec_topindex_entry_t;
+
+typedef struct _rotrec_t {
 	int        flags;
+	int        version;
+	int        generation;
 	off_t      base_offset;
 	rotdir_t * rotdir;
 	int        rotdir_slot;
+	int        fd;
 	fwindow_t  window;
 	off_t      total_file_size;
 	off_t      file_data_size;
+	off_t      data_limit;     // records end before this, the footer follows
 	size_t     map_size;
+	int        map_flags;
+	void *     reserved;
+	size_t     reserved_size;
 	char       file_prefix[ROTDIR_MAX_FILEPREFIX_LEN];
+	// the process that created the rotrec. a forked child inherits the
+	// mappings and descriptors, but the files are still the parent's
+	pid_t      pid;
+
+	// time index of the current file, and the top level index
+	rotrec_index_entry_t * index;
+	int        index_capacity;
+	int        index_count;
+	int        index_stride;
+	int        index_skip;
+	uint64_t   min_timestamp;
+	uint64_t   last_timestamp; // kept up to date by the user
+	int        topindex_fd;
+	uint32_t   topindex_count;
+
+	// the next file, prepared by the preallocator thread once the current
+	// one is filled past prealloc_offset
+	off_t      prealloc_offset;
+	volatile int next_state;
+	int        next_slot;
+	int        next_fd;
+	off_t      next_base_offset;
+	fwindow_t  next_window;
+	struct _rotrec_t * next_pending;
 } rotrec_t;
 
 
 typedef uint16_t rotret_record_size_t;
 
 int rotrec_init(rotrec_t * self, rotdir_t * rotdir, const char * file_prefix,
-		size_t map_size, off_t file_data_size);
+		size_t map_size, off_t file_data_size, int version, int prealloc_percent,
+		int map_flags);
 int rotrec_fini(rotrec_t * self);
 int rotrec_write(rotrec_t * self, const void * buf, rotret_record_size_t size, off_t * outoffset);
+int rotrec_reserve(rotrec_t * self, rotret_record_size_t size, OUT void ** outbuf, off_t * outoffset);
+int rotrec_commit(rotrec_t * self, rotret_record_size_t size);
+errcode_t rotrec_index(rotrec_t * self, uint64_t timestamp, off_t offset);
 
 
 #endif /* ROTREC_H_INCLUDED */
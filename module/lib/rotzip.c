@@ -0,0 +1,196 @@
+/*
+ * RotZip -- rewrites a sealed rotrec file into blocks of LZBlock-compressed
+ * records, with a table of block offsets up front, so that a reader can
+ * seek to any offset of the original file and decompress just the block
+ * that holds it. the zero-filled tail of the original file is dropped, and
+ * its footer (if it has one) is copied as is to the end of the new file.
+ */
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "rotzip.h"
+#include "lzblock.h"
+
+
+static errcode_t _rotzip_write(int fd, const void * buf, size_t size, off_t offset)
+{
+	ssize_t count;
+
+	while (size > 0) {
+		count = pwrite(fd, buf, size, offset);
+		if (count <= 0) {
+			return ERR_ROTZIP_WRITE_FAILED;
+		}
+		buf = (const char *)buf + count;
+		size -= count;
+		offset += count;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the size of the records in the file (up to the first zero length)
+ */
+static size_t _rotzip_get_data_size(const char * data, size_t size)
+{
+	size_t pos = 0;
+	rotret_record_size_t length;
+
+	while (pos + sizeof(length) <= size) {
+		memcpy(&length, data + pos, sizeof(length));
+		if (length == 0 || pos + sizeof(length) + length > size) {
+			break;
+		}
+		pos += sizeof(length) + length;
+	}
+	return pos;
+}
+
+/*
+ * returns the size of the file's footer (time index and footer struct), or
+ * 0 if it has none. the footer directly follows the records' terminator
+ */
+static size_t _rotzip_get_footer_size(const char * data, size_t size, size_t data_size)
+{
+	rotrec_file_footer_t footer;
+	size_t footer_size;
+
+	if (size < data_size + sizeof(rotret_record_size_t) + sizeof(footer)) {
+		return 0;
+	}
+	memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+	footer_size = sizeof(footer) + sizeof(rotrec_index_entry_t) * (size_t)footer.entry_count;
+	if (footer.magic != ROTREC_FOOTER_MAGIC ||
+			data_size + sizeof(rotret_record_size_t) + footer_size != size) {
+		return 0;
+	}
+	return footer_size;
+}
+
+static errcode_t _rotzip_compress(const char * addr, size_t size, int outfd)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+	rotrec_file_header_t header;
+	rotzip_header_t zheader;
+	const char * data = addr + sizeof(header);
+	uint64_t * offsets = NULL;
+	char * block = NULL;
+	size_t i, blocksize, zsize, footer_size;
+	off_t pos;
+
+	memcpy(&header, addr, sizeof(header));
+	if (header.marker != 0 || header.magic != ROTREC_MAGIC) {
+		return ERR_ROTZIP_NOT_A_ROTREC; // the original format has no flags
+	}
+	if (header.flags & ROTREC_HEADER_COMPRESSED) {
+		return ERR_ROTZIP_ALREADY_COMPRESSED;
+	}
+	header.flags |= ROTREC_HEADER_COMPRESSED;
+
+	zheader.block_size = ROTZIP_BLOCK_SIZE;
+	zheader.data_size = _rotzip_get_data_size(data, size - sizeof(header));
+	footer_size = _rotzip_get_footer_size(data, size - sizeof(header), zheader.data_size);
+	zheader.block_count = (zheader.data_size + ROTZIP_BLOCK_SIZE - 1) / ROTZIP_BLOCK_SIZE;
+
+	offsets = malloc(sizeof(uint64_t) * (zheader.block_count + 1));
+	block = malloc(LZBLOCK_BOUND(ROTZIP_BLOCK_SIZE));
+	if (offsets == NULL || block == NULL) {
+		retcode = ERR_ROTZIP_MALLOC_FAILED;
+		goto cleanup;
+	}
+
+	PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd, &header, sizeof(header), 0));
+	PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd, &zheader, sizeof(zheader),
+			sizeof(header)));
+	pos = sizeof(header) + sizeof(zheader) + sizeof(uint64_t) * (zheader.block_count + 1);
+
+	for (i = 0; i < zheader.block_count; i++) {
+		blocksize = zheader.data_size - i * ROTZIP_BLOCK_SIZE;
+		if (blocksize > ROTZIP_BLOCK_SIZE) {
+			blocksize = ROTZIP_BLOCK_SIZE;
+		}
+		offsets[i] = pos;
+		PROPAGATE_TO(cleanup, retcode = lzblock_compress(data + i * ROTZIP_BLOCK_SIZE,
+				blocksize, block, LZBLOCK_BOUND(ROTZIP_BLOCK_SIZE), &zsize));
+		if (zsize < blocksize) {
+			PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd, block, zsize, pos));
+			pos += zsize;
+		}
+		else {
+			// incompressible, store it as is
+			PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd,
+					data + i * ROTZIP_BLOCK_SIZE, blocksize, pos));
+			pos += blocksize;
+		}
+	}
+	offsets[zheader.block_count] = pos;
+	PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd, addr + size - footer_size,
+			footer_size, pos));
+
+	PROPAGATE_TO(cleanup, retcode = _rotzip_write(outfd, offsets,
+			sizeof(uint64_t) * (zheader.block_count + 1), sizeof(header) + sizeof(zheader)));
+	retcode = ERR_SUCCESS;
+
+cleanup:
+	free(block);
+	free(offsets);
+	return retcode;
+}
+
+/*
+ * writes the compressed form of `filename` into `outfilename`. the original
+ * file is left intact -- replacing it is up to the caller
+ */
+errcode_t rotzip_compress_file(const char * filename, const char * outfilename)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+	struct stat sb;
+	void * addr;
+	int fd, outfd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		retcode = ERR_ROTZIP_OPEN_FAILED;
+		goto error1;
+	}
+	if (fstat(fd, &sb) != 0) {
+		retcode = ERR_ROTZIP_OPEN_FAILED;
+		goto error2;
+	}
+	if (sb.st_size < sizeof(rotrec_file_header_t)) {
+		retcode = ERR_ROTZIP_NOT_A_ROTREC;
+		goto error2;
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		retcode = ERR_ROTZIP_MMAP_FAILED;
+		goto error2;
+	}
+	madvise(addr, sb.st_size, MADV_SEQUENTIAL);
+	outfd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC,
+			S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (outfd < 0) {
+		retcode = ERR_ROTZIP_OPEN_FAILED;
+		goto error3;
+	}
+
+	PROPAGATE_TO(error4, retcode = _rotzip_compress(addr, sb.st_size, outfd));
+	retcode = ERR_SUCCESS;
+
+error4:
+	close(outfd);
+	if (IS_ERROR(retcode)) {
+		unlink(outfilename);
+	}
+error3:
+	munmap(addr, sb.st_size);
+error2:
+	close(fd);
+error1:
+	return retcode;
+}
+
@@ -0,0 +1,34 @@
+/*
+ * Compressed rotrec files
+ */
+
+#ifndef ROTZIP_H_INCLUDED
+#define ROTZIP_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "errors.h"
+#include "rotrec.h"
+
+#define ROTZIP_BLOCK_SIZE   (64 * 1024)
+
+/*
+ * a compressed file starts with the rotrec header (flagged with
+ * ROTREC_HEADER_COMPRESSED), followed by this header, a table of
+ * block_count + 1 uint64 file offsets (where each block starts, and where
+ * the last one ends), and the blocks. every block holds block_size bytes of
+ * the original file's records (the last one may hold less); a block whose
+ * stored size equals its original size is stored uncompressed. the blocks
+ * are followed by the original file's footer, if it had one.
+ */
+typedef struct {
+	uint32_t   block_size;
+	uint32_t   block_count;
+	uint64_t   data_size;   // the size of the original records
+} rotzip_header_t;
+
+errcode_t rotzip_compress_file(const char * filename, const char * outfilename);
+
+
+#endif /* ROTZIP_H_INCLUDED */
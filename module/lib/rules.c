@@ -0,0 +1,183 @@
+/*
+ * Rules -- flags by filename prefix, module name and function name glob.
+ * filename and module patterns are compiled into a trie each, so matching
+ * walks the name once, and the longest matching pattern wins. a module
+ * pattern matches the module and everything inside it ("a.b" matches "a.b"
+ * and "a.b.c", but not "a.bc"). function patterns are fnmatch globs, all of
+ * which are tried. the result is the union of the flags of the three.
+ *
+ * rules are meant to be matched once per object and the result cached;
+ * generation tells when the cached results are stale.
+ */
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rules.h"
+
+
+errcode_t rules_init(rules_t * self)
+{
+	// cached results start out as generation 0, which is never current
+	self->generation = 1;
+	self->count = 0;
+	self->filenames = NULL;
+	self->modules = NULL;
+	self->functions = NULL;
+	RETURN_SUCCESSFUL;
+}
+
+static void _rules_free_trie(rules_node_t * node)
+{
+	rules_node_t * next;
+
+	while (node != NULL) {
+		next = node->sibling;
+		_rules_free_trie(node->child);
+		free(node);
+		node = next;
+	}
+}
+
+static void _rules_free(rules_t * self)
+{
+	rules_glob_t * glob;
+
+	_rules_free_trie(self->filenames);
+	self->filenames = NULL;
+	_rules_free_trie(self->modules);
+	self->modules = NULL;
+	while (self->functions != NULL) {
+		glob = self->functions;
+		self->functions = glob->next;
+		free(glob->pattern);
+		free(glob);
+	}
+	self->count = 0;
+}
+
+errcode_t rules_fini(rules_t * self)
+{
+	_rules_free(self);
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t rules_clear(rules_t * self)
+{
+	_rules_free(self);
+	self->generation += 1;
+	RETURN_SUCCESSFUL;
+}
+
+static errcode_t _rules_insert(rules_node_t ** root, const char * pattern, uint32_t flags)
+{
+	rules_node_t ** link = root;
+	rules_node_t * node = NULL;
+
+	for (; *pattern != '\0'; pattern++) {
+		for (node = *link; node != NULL && node->ch != *pattern; node = node->sibling) {
+		}
+		if (node == NULL) {
+			node = (rules_node_t*)malloc(sizeof(rules_node_t));
+			if (node == NULL) {
+				return ERR_RULES_MALLOC_FAILED;
+			}
+			node->ch = *pattern;
+			node->terminal = 0;
+			node->flags = 0;
+			node->child = NULL;
+			node->sibling = *link;
+			*link = node;
+		}
+		link = &node->child;
+	}
+	// a pattern added again replaces the old one
+	node->terminal = 1;
+	node->flags = flags;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the flags of the longest pattern that's a prefix of name. if
+ * separator is given, a pattern must be followed by it (or by the end of
+ * name) to match
+ */
+static uint32_t _rules_match_trie(rules_node_t * node, const char * name, char separator)
+{
+	uint32_t flags = 0;
+
+	for (; *name != '\0' && node != NULL; name++) {
+		for (; node != NULL && node->ch != *name; node = node->sibling) {
+		}
+		if (node == NULL) {
+			break;
+		}
+		if (node->terminal && (separator == '\0' || name[1] == '\0' || name[1] == separator)) {
+			flags = node->flags;
+		}
+		node = node->child;
+	}
+	return flags;
+}
+
+errcode_t rules_add(rules_t * self, int kind, const char * pattern, uint32_t flags)
+{
+	rules_glob_t * glob;
+
+	if (pattern == NULL || *pattern == '\0') {
+		return ERR_RULES_EMPTY_PATTERN;
+	}
+	switch (kind) {
+		case RULES_FILENAME:
+			PROPAGATE(_rules_insert(&self->filenames, pattern, flags));
+			break;
+		case RULES_MODULE:
+			PROPAGATE(_rules_insert(&self->modules, pattern, flags));
+			break;
+		case RULES_FUNCTION:
+			glob = (rules_glob_t*)malloc(sizeof(rules_glob_t));
+			if (glob == NULL) {
+				return ERR_RULES_MALLOC_FAILED;
+			}
+			glob->pattern = strdup(pattern);
+			if (glob->pattern == NULL) {
+				free(glob);
+				return ERR_RULES_MALLOC_FAILED;
+			}
+			glob->flags = flags;
+			glob->next = self->functions;
+			self->functions = glob;
+			break;
+		default:
+			return ERR_RULES_INVALID_KIND;
+	}
+	self->count += 1;
+	self->generation += 1;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the flags that apply to the given function. any of the names may
+ * be NULL, if it's unknown
+ */
+uint32_t rules_match(rules_t * self, const char * filename, const char * module,
+		const char * function)
+{
+	uint32_t flags = 0;
+	rules_glob_t * glob;
+
+	if (filename != NULL) {
+		flags |= _rules_match_trie(self->filenames, filename, '\0');
+	}
+	if (module != NULL) {
+		flags |= _rules_match_trie(self->modules, module, '.');
+	}
+	if (function != NULL) {
+		for (glob = self->functions; glob != NULL; glob = glob->next) {
+			if (fnmatch(glob->pattern, function, 0) == 0) {
+				flags |= glob->flags;
+			}
+		}
+	}
+	return flags;
+}
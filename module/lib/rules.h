@@ -0,0 +1,48 @@
+/*
+ * Rule sets of filenames, module names and function names
+ */
+
+#ifndef RULES_H_INCLUDED
+#define RULES_H_INCLUDED
+
+#include <stdint.h>
+
+#include "errors.h"
+
+
+#define RULES_FILENAME  (1) // the filename starts with the pattern
+#define RULES_MODULE    (2) // the module is the pattern, or is inside it
+#define RULES_FUNCTION  (3) // the function name matches the pattern (a glob)
+
+typedef struct _rules_node_t {
+	char                    ch;
+	int                     terminal;   // a pattern ends here
+	uint32_t                flags;      // of that pattern
+	struct _rules_node_t *  child;
+	struct _rules_node_t *  sibling;
+} rules_node_t;
+
+typedef struct _rules_glob_t {
+	char *                  pattern;
+	uint32_t                flags;
+	struct _rules_glob_t *  next;
+} rules_glob_t;
+
+typedef struct _rules_t {
+	// changes whenever the rules do, so that results can be cached
+	uint32_t        generation;
+	int             count;
+	rules_node_t *  filenames;
+	rules_node_t *  modules;
+	rules_glob_t *  functions;
+} rules_t;
+
+errcode_t rules_init(rules_t * self);
+errcode_t rules_fini(rules_t * self);
+errcode_t rules_add(rules_t * self, int kind, const char * pattern, uint32_t flags);
+errcode_t rules_clear(rules_t * self);
+uint32_t rules_match(rules_t * self, const char * filename, const char * module,
+		const char * function);
+
+
+#endif /* RULES_H_INCLUDED */
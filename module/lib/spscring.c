@@ -0,0 +1,173 @@
+/*
+ * SPSCRing (single-producer single-consumer ring) -- a lock-free ring buffer
+ * of variable-sized records, for handing data from one thread to another.
+ * the producer reserves room for a record, fills it in place and commits
+ * it; the consumer peeks at the oldest record and releases it once it's
+ * done with it. neither side ever blocks or makes a system call -- when the
+ * ring is full, spscring_reserve() fails and the producer decides what to do.
+ *
+ * head and tail are free-running byte counters (they are never wrapped),
+ * so head - tail is always the number of bytes in use. every record is
+ * prefixed by its length, and its body is rounded up to a multiple of
+ * SPSCRING_ALIGNMENT bytes (the body itself is not aligned -- it follows
+ * the length prefix); records never wrap around the end of the buffer -- if
+ * a record doesn't fit there, a wrap marker is placed instead and the
+ * record starts at the beginning.
+ */
+#include <string.h>
+
+#include "spscring.h"
+
+
+#define SPSCRING_ALIGNMENT    (8)
+#define SPSCRING_WRAP_MARKER  ((spscring_recsize_t)-1)
+#define SPSCRING_ALIGN(size) \
+	(((size) + SPSCRING_ALIGNMENT - 1) & ~((size_t)SPSCRING_ALIGNMENT - 1))
+#define SPSCRING_BARRIER()    __sync_synchronize()
+
+
+/*
+ * capacity must be a power of two
+ */
+errcode_t spscring_init(spscring_t * self, size_t capacity)
+{
+	if (capacity < SPSCRING_ALIGNMENT || (capacity & (capacity - 1)) != 0) {
+		return ERR_SPSCRING_INVALID_CAPACITY;
+	}
+	self->buffer = malloc(capacity);
+	if (self->buffer == NULL) {
+		return ERR_SPSCRING_MALLOC_FAILED;
+	}
+	self->capacity = capacity;
+	self->head = 0;
+	self->reserved_head = 0;
+	self->tail = 0;
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t spscring_fini(spscring_t * self)
+{
+	if (self->buffer != NULL) {
+		free(self->buffer);
+		self->buffer = NULL;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * producer: returns a pointer to `size` contiguous bytes, which become
+ * visible to the consumer only after spscring_commit()
+ */
+errcode_t spscring_reserve(spscring_t * self, size_t size, OUT void ** outbuf)
+{
+	size_t head = self->head;
+	size_t tail = self->tail;
+	size_t used = sizeof(spscring_recsize_t) + SPSCRING_ALIGN(size);
+	size_t offset = head & (self->capacity - 1);
+	size_t till_end = self->capacity - offset;
+
+	SPSCRING_BARRIER(); // don't touch the buffer before reading tail
+
+	if (used > till_end) {
+		// the record must start at the beginning of the buffer, so the
+		// space till the end is lost
+		if (self->capacity - (head - tail) < till_end + used) {
+			return ERR_SPSCRING_FULL;
+		}
+		*((spscring_recsize_t*)(self->buffer + offset)) = SPSCRING_WRAP_MARKER;
+		head += till_end;
+		offset = 0;
+	}
+	else if (self->capacity - (head - tail) < used) {
+		return ERR_SPSCRING_FULL;
+	}
+
+	self->reserved_head = head;
+	*outbuf = self->buffer + offset + sizeof(spscring_recsize_t);
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t spscring_commit(spscring_t * self, size_t size)
+{
+	size_t head = self->reserved_head;
+	size_t offset = head & (self->capacity - 1);
+
+	*((spscring_recsize_t*)(self->buffer + offset)) = size;
+	SPSCRING_BARRIER(); // the record must be complete before it's published
+	self->head = head + sizeof(spscring_recsize_t) + SPSCRING_ALIGN(size);
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * consumer: returns the oldest record without removing it
+ */
+errcode_t spscring_peek(spscring_t * self, OUT void ** outbuf, OUT size_t * outsize)
+{
+	size_t tail = self->tail;
+	size_t head = self->head;
+	size_t offset;
+	spscring_recsize_t size;
+
+	SPSCRING_BARRIER(); // don't read the record before reading head
+
+	while (tail != head) {
+		offset = tail & (self->capacity - 1);
+		size = *((spscring_recsize_t*)(self->buffer + offset));
+		if (size == SPSCRING_WRAP_MARKER) {
+			tail += self->capacity - offset;
+			continue;
+		}
+		if (tail != self->tail) {
+			self->tail = tail; // skip the wrap marker for good
+		}
+		*outbuf = self->buffer + offset + sizeof(spscring_recsize_t);
+		*outsize = size;
+		RETURN_SUCCESSFUL;
+	}
+
+	return ERR_SPSCRING_EMPTY;
+}
+
+errcode_t spscring_release(spscring_t * self)
+{
+	size_t tail = self->tail;
+	size_t offset = tail & (self->capacity - 1);
+	spscring_recsize_t size = *((spscring_recsize_t*)(self->buffer + offset));
+
+	SPSCRING_BARRIER(); // done with the record before handing its space back
+	self->tail = tail + sizeof(spscring_recsize_t) + SPSCRING_ALIGN(size);
+	RETURN_SUCCESSFUL;
+}
+
+/*
+#include <stdio.h>
+
+int main()
+{
+	spscring_t ring;
+	void * buf;
+	size_t size;
+	int i, j;
+
+	ASSERT(spscring_init(&ring, 64));
+	for (i = 0; i < 100; i++) {
+		ASSERT(spscring_reserve(&ring, i % 20, &buf));
+		memset(buf, i, i % 20);
+		ASSERT(spscring_commit(&ring, i % 20));
+		ASSERT(spscring_peek(&ring, &buf, &size));
+		for (j = 0; j < size; j++) {
+			if (((unsigned char*)buf)[j] != i) {
+				printf("corrupt record %d\n", i);
+				abort();
+			}
+		}
+		ASSERT(spscring_release(&ring));
+	}
+	if (spscring_peek(&ring, &buf, &size) != ERR_SPSCRING_EMPTY) {
+		printf("ring should be empty\n");
+		abort();
+	}
+	ASSERT(spscring_fini(&ring));
+	return 0;
+}
+*/
@@ -0,0 +1,34 @@
+/*
+ * Single-producer single-consumer ring
+ */
+
+#ifndef SPSCRING_H_INCLUDED
+#define SPSCRING_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "errors.h"
+
+
+typedef uint32_t spscring_recsize_t;
+
+typedef struct _spscring_t {
+	char *            buffer;
+	size_t            capacity;
+	// written only by the producer
+	volatile size_t   head;
+	size_t            reserved_head;
+	// written only by the consumer
+	volatile size_t   tail;
+} spscring_t;
+
+errcode_t spscring_init(spscring_t * self, size_t capacity);
+errcode_t spscring_fini(spscring_t * self);
+errcode_t spscring_reserve(spscring_t * self, size_t size, OUT void ** outbuf);
+errcode_t spscring_commit(spscring_t * self, size_t size);
+errcode_t spscring_peek(spscring_t * self, OUT void ** outbuf, OUT size_t * outsize);
+errcode_t spscring_release(spscring_t * self);
+
+
+#endif /* SPSCRING_H_INCLUDED */
@@ -0,0 +1,86 @@
+/*
+ * SReader (stream reader) -- the counterpart of swriter: reads values back
+ * from a buffer, in the same encodings swriter dumps them
+ */
+#include <string.h>
+
+#include "sreader.h"
+
+
+errcode_t sreader_init(sreader_t * self, const void * buffer, size_t size)
+{
+	self->buffer = buffer;
+	self->size = size;
+	self->pos = buffer;
+	RETURN_SUCCESSFUL;
+}
+
+inline errcode_t sreader_load_buffer(sreader_t * self, void * buf, size_t size)
+{
+	if (size > ((self->buffer + self->size) - self->pos)) {
+		return ERR_SREADER_END_OF_BUFFER;
+	}
+	memcpy(buf, self->pos, size);
+	self->pos += size;
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t sreader_load_uint8(sreader_t * self, OUT uint8_t * value)
+{
+	return sreader_load_buffer(self, value, sizeof(*value));
+}
+
+errcode_t sreader_load_uint16(sreader_t * self, OUT uint16_t * value)
+{
+	return sreader_load_buffer(self, value, sizeof(*value));
+}
+
+errcode_t sreader_load_uint32(sreader_t * self, OUT uint32_t * value)
+{
+	return sreader_load_buffer(self, value, sizeof(*value));
+}
+
+errcode_t sreader_load_uint64(sreader_t * self, OUT uint64_t * value)
+{
+	return sreader_load_buffer(self, value, sizeof(*value));
+}
+
+inline errcode_t sreader_load_varint(sreader_t * self, OUT uint64_t * value)
+{
+	const uint8_t * p = (const uint8_t*)self->pos;
+	const uint8_t * end = (const uint8_t*)(self->buffer + self->size);
+	uint64_t result = 0;
+	int shift = 0;
+
+	while (p < end) {
+		result |= ((uint64_t)(*p & 0x7f)) << shift;
+		if (*p++ < 0x80) {
+			self->pos = p;
+			*value = result;
+			RETURN_SUCCESSFUL;
+		}
+		shift += 7;
+		if (shift >= 64) {
+			return ERR_SREADER_INVALID_VARINT;
+		}
+	}
+	return ERR_SREADER_END_OF_BUFFER;
+}
+
+inline errcode_t sreader_load_svarint(sreader_t * self, OUT int64_t * value)
+{
+	uint64_t zigzag;
+	PROPAGATE(sreader_load_varint(self, &zigzag));
+	*value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+	RETURN_SUCCESSFUL;
+}
+
+inline size_t sreader_get_offset(sreader_t * self)
+{
+	return (size_t)(self->pos - self->buffer);
+}
+
+inline size_t sreader_get_remaining(sreader_t * self)
+{
+	return (size_t)((self->buffer + self->size) - self->pos);
+}
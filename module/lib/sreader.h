@@ -0,0 +1,28 @@
+#ifndef SREADER_H_INCLUDED
+#define SREADER_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "errors.h"
+
+
+typedef struct _sreader_t {
+	const void * buffer;
+	size_t       size;
+	const void * pos;
+} sreader_t;
+
+
+errcode_t sreader_init(sreader_t * self, const void * buffer, size_t size);
+errcode_t sreader_load_buffer(sreader_t * self, void * buf, size_t size);
+errcode_t sreader_load_uint8(sreader_t * self, OUT uint8_t * value);
+errcode_t sreader_load_uint16(sreader_t * self, OUT uint16_t * value);
+errcode_t sreader_load_uint32(sreader_t * self, OUT uint32_t * value);
+errcode_t sreader_load_uint64(sreader_t * self, OUT uint64_t * value);
+errcode_t sreader_load_varint(sreader_t * self, OUT uint64_t * value);
+errcode_t sreader_load_svarint(sreader_t * self, OUT int64_t * value);
+size_t sreader_get_offset(sreader_t * self);
+size_t sreader_get_remaining(sreader_t * self);
+
+#endif
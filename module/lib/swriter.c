@@ -16,6 +16,7 @@ errcode_t swriter_init(swriter_t * self, void * buffer, size_t size)
 		if (self->buffer == NULL) {
 			return ERR_SWRITER_MALLOC_FAILED;
 		}
+		self->free = 1;
 	}
 	self->pos = self->buffer;
 	RETURN_SUCCESSFUL;
@@ -61,6 +62,45 @@ errcode_t swriter_dump_uint64(swriter_t * self, uint64_t value)
 	return swriter_dump_buffer(self, &value, sizeof(value));
 }
 
+/*
+ * LEB128-style varint: 7 bits per byte, least significant group first, the
+ * high bit of each byte is set if more bytes follow
+ */
+inline errcode_t swriter_dump_varint(swriter_t * self, uint64_t value)
+{
+	uint8_t buf[SWRITER_MAX_VARINT_SIZE];
+	int in_place = ((self->buffer + self->size) - self->pos) >= SWRITER_MAX_VARINT_SIZE;
+	// if there's not enough room for the worst case, encode aside and let
+	// swriter_dump_buffer do the bounds checking
+	uint8_t * p = in_place ? (uint8_t*)self->pos : buf;
+
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+
+	if (!in_place) {
+		return swriter_dump_buffer(self, buf, p - buf);
+	}
+	self->pos = p;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * signed varint, zigzag encoded (0, -1, 1, -2, 2, ... => 0, 1, 2, 3, 4, ...)
+ * so that small negative numbers are short too
+ */
+inline errcode_t swriter_dump_svarint(swriter_t * self, int64_t value)
+{
+	return swriter_dump_varint(self, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+errcode_t swriter_dump_double(swriter_t * self, double value)
+{
+	return swriter_dump_buffer(self, &value, sizeof(value));
+}
+
 inline errcode_t swriter_dump_pstr(swriter_t * self, const char * value, size_t length)
 {
 	if (length > 65535) {
@@ -69,7 +109,7 @@ inline errcode_t swriter_dump_pstr(swriter_t * self, const char * value, size_t
 	PROPAGATE(swriter_dump_uint16(self, length));
 	errcode_t retcode = swriter_dump_buffer(self, value, length);
 	if (IS_ERROR(retcode)) {
-		self->pos -= sizeof(length); // undo: remove length field
+		self->pos -= sizeof(uint16_t); // undo: remove length field
 		return retcode;
 	}
 
@@ -6,6 +6,7 @@
 
 #include "errors.h"
 
+#define SWRITER_MAX_VARINT_SIZE  (10)
 
 typedef struct _swriter_t {
 	void * buffer;
@@ -22,6 +23,9 @@ errcode_t swriter_dump_uint8(swriter_t * self, uint8_t value);
 errcode_t swriter_dump_uint16(swriter_t * self, uint16_t value);
 errcode_t swriter_dump_uint32(swriter_t * self, uint32_t value);
 errcode_t swriter_dump_uint64(swriter_t * self, uint64_t value);
+errcode_t swriter_dump_varint(swriter_t * self, uint64_t value);
+errcode_t swriter_dump_svarint(swriter_t * self, int64_t value);
+errcode_t swriter_dump_double(swriter_t * self, double value);
 errcode_t swriter_dump_pstr(swriter_t * self, const char * value, size_t length);
 errcode_t swriter_dump_cstr(swriter_t * self, const char * value);
 size_t swriter_get_length(swriter_t * self);
@@ -10,24 +10,36 @@ setup(
     ext_modules = [
         Extension("_passover",
             sources = [
+                "lib/cpstats.c",
                 "lib/errors.c",
+                "lib/flightrec.c",
                 "lib/fmap.c",
+                "lib/governor.c",
                 "lib/hptime.c",
                 "lib/htable.c",
                 "lib/listfile.c",
+                "lib/lzblock.c",
+                "lib/reaper.c",
+                "lib/registry.c",
                 "lib/rotdir.c",
                 "lib/rotrec.c",
+                "lib/rotzip.c",
+                "lib/rules.c",
+                "lib/spscring.c",
+                "lib/sreader.c",
                 "lib/swriter.c",
                 "tracer/tracer.c",
                 "tracer/tracefunc.c",
+                "tracer/flusher.c",
                 "tracer/rotdir_object.c",
                 "tracer/passover_object.c",
+                "tracer/decoder.c",
+                "tracer/decoder_object.c",
                 "tracer/_passover.c",
             ],
             define_macros = [
                 ("FMAP_BACKGROUND_MUNMAP", None),
                 #("HTABLE_COLLECT_STATS", None),
-                ("HTABLE_BOOST_GETS", None),
                 ("TRACER_DUMP_ABSPATH", None),
             ],
             extra_compile_args = ["-Werror"], #, "-g", "-O0"],
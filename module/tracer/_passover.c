@@ -5,14 +5,19 @@
 #include <unistd.h>
 
 #include "../lib/errors.h"
+#include "../lib/fmap.h"
 #include "../lib/hptime.h"
+#include "../lib/reaper.h"
+#include "../lib/rules.h"
 #include "rotdir_object.h"
 #include "passover_object.h"
+#include "decoder_object.h"
 
 
 PyObject * ErrorObject = NULL;
 PyFunctionObject * _passover_logfunc = NULL;
 PyCodeObject * _passover_logfunc_code = NULL;
+rules_t _passover_ignore_rules;
 
 
 /***************************************************************************
@@ -83,6 +88,87 @@ PyDoc_STRVAR(passover_clear_builtin_flags_doc, "\
 _clear_builtin_flags(codeobj, flags)\n\
     clears the flags of the given builtin function object\n");
 
+static PyObject * passover_add_ignore_rule(PyObject * self, PyObject * args)
+{
+	int kind;
+	char * pattern;
+	int flags;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTuple(args, "isi:add_ignore_rule", &kind, &pattern, &flags)) {
+		return NULL;
+	}
+	retcode = rules_add(&_passover_ignore_rules, kind, pattern, flags);
+	if (IS_ERROR(retcode)) {
+		PyErr_SetString(ErrorObject, errcode_get_name(retcode));
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(passover_add_ignore_rule_doc, "\
+add_ignore_rule(kind, pattern, flags)\n\
+    adds the flags (CO_PASSOVER_IGNORED_*) to every function that matches\n\
+    the pattern, including functions that don't exist yet. kind is one of\n\
+    IGNORE_FILENAME (a prefix of the filename), IGNORE_MODULE (the module or\n\
+    a package it's in) or IGNORE_FUNCTION (a glob of the function's name).\n\
+    rules are matched once per function (and again when they change)\n");
+
+static PyObject * passover_clear_ignore_rules(PyObject * self, PyObject * args)
+{
+	rules_clear(&_passover_ignore_rules);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(passover_clear_ignore_rules_doc, "\
+clear_ignore_rules()\n\
+    removes all the ignore rules\n");
+
+static PyObject * passover_reaper_stats(PyObject * self, PyObject * args)
+{
+	reaper_stats_t stats;
+
+	reaper_get_stats(&stats);
+	return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+		"queue_depth", (unsigned PY_LONG_LONG)stats.queue_depth,
+		"max_queue_depth", (unsigned PY_LONG_LONG)stats.max_queue_depth,
+		"reaped", (unsigned PY_LONG_LONG)stats.reaped,
+		"inline_unmaps", (unsigned PY_LONG_LONG)stats.inline_unmaps,
+		"total_latency_ns", (unsigned PY_LONG_LONG)stats.total_latency_ns,
+		"max_latency_ns", (unsigned PY_LONG_LONG)stats.max_latency_ns);
+}
+
+PyDoc_STRVAR(passover_reaper_stats_doc, "\
+reaper_stats()\n\
+    returns the counters of the background munmap thread, as a dict\n");
+
+static PyObject * passover_clock_info(PyObject * self, PyObject * args)
+{
+	hptime_clocksync_t sync;
+
+	hptime_get_clocksync(&sync);
+	return Py_BuildValue("{s:s,s:K}",
+		"source", (hptime_get_source() == HPTIME_SOURCE_TSC) ? "tsc" : "monotonic",
+		"ticks_per_sec", (unsigned PY_LONG_LONG)sync.ticks_per_sec);
+}
+
+PyDoc_STRVAR(passover_clock_info_doc, "\
+clock_info()\n\
+    returns the source of the raw timestamps ('tsc' if the TSC is invariant,\n\
+    'monotonic' otherwise) and its calibrated rate, as a dict\n");
+
+PyDoc_STRVAR(passover_load_codepoints_doc, "\
+load_codepoints(filename)\n\
+    returns the codepoints of a codepoints file, in order, as (1, format)\n\
+    for log lines, (2, filename, name, lineno) for python functions, and\n\
+    (3, module, name) for builtins\n");
+
+PyDoc_STRVAR(passover_load_timeindex_doc, "\
+load_timeindex(filename)\n\
+    returns (version, entries) of a timeindex file, where the entries are\n\
+    (base_offset, min_timestamp, max_timestamp) (version 2), or (timestamp,\n\
+    offset) (version 1)\n");
+
 static PyMethodDef moduleMethods[] = {
 	{"_set_code_flags", (PyCFunction)passover_set_code_flags,
 			METH_VARARGS, passover_set_code_flags_doc},
@@ -92,6 +178,18 @@ static PyMethodDef moduleMethods[] = {
 			METH_VARARGS, passover_clear_code_flags_doc},
 	{"_clear_builtin_flags", (PyCFunction)passover_clear_builtin_flags,
 			METH_VARARGS, passover_clear_builtin_flags_doc},
+	{"add_ignore_rule", (PyCFunction)passover_add_ignore_rule,
+			METH_VARARGS, passover_add_ignore_rule_doc},
+	{"clear_ignore_rules", (PyCFunction)passover_clear_ignore_rules,
+			METH_NOARGS, passover_clear_ignore_rules_doc},
+	{"reaper_stats", (PyCFunction)passover_reaper_stats,
+			METH_NOARGS, passover_reaper_stats_doc},
+	{"clock_info", (PyCFunction)passover_clock_info,
+			METH_NOARGS, passover_clock_info_doc},
+	{"load_codepoints", (PyCFunction)decoder_load_codepoints,
+			METH_VARARGS, passover_load_codepoints_doc},
+	{"load_timeindex", (PyCFunction)decoder_load_timeindex,
+			METH_VARARGS, passover_load_timeindex_doc},
 	{NULL, NULL}
 };
 
@@ -120,12 +218,24 @@ PyMODINIT_FUNC init_passover(void)
 		PyErr_SetString(ErrorObject, errcode_get_name(retcode));
 		return;
 	}
+	rules_init(&_passover_ignore_rules);
 
 	PyModule_AddIntConstant(module, "CO_PASSOVER_IGNORED_SINGLE", CO_PASSOVER_IGNORED_SINGLE);
 	PyModule_AddIntConstant(module, "CO_PASSOVER_IGNORED_CHILDREN", CO_PASSOVER_IGNORED_CHILDREN);
 	PyModule_AddIntConstant(module, "CO_PASSOVER_IGNORED_WHOLE", CO_PASSOVER_IGNORED_WHOLE);
 	PyModule_AddIntConstant(module, "CO_PASSOVER_DETAILED", CO_PASSOVER_DETAILED);
 
+	PyModule_AddIntConstant(module, "IGNORE_FILENAME", RULES_FILENAME);
+	PyModule_AddIntConstant(module, "IGNORE_MODULE", RULES_MODULE);
+	PyModule_AddIntConstant(module, "IGNORE_FUNCTION", RULES_FUNCTION);
+
+	PyModule_AddIntConstant(module, "MAP_POPULATE", FMAP_READ_AHEAD);
+	PyModule_AddIntConstant(module, "MAP_LOCKED", FMAP_LOCKED);
+	PyModule_AddIntConstant(module, "MAP_SEQUENTIAL", FMAP_SEQUENTIAL);
+	PyModule_AddIntConstant(module, "MAP_MSYNC_RETIRED", FMAP_MSYNC_RETIRED);
+	PyModule_AddIntConstant(module, "MAP_DONTNEED_RETIRED", FMAP_DONTNEED_RETIRED);
+	PyModule_AddIntConstant(module, "MAP_COLD_RETIRED", FMAP_COLD_RETIRED);
+
 	if (PyType_Ready(&Passover_Type) < 0) {
 		return;
 	}
@@ -134,6 +244,18 @@ PyMODINIT_FUNC init_passover(void)
 		return;
 	}
 	PyModule_AddObject(module, "Rotdir", (PyObject*) &Rotdir_Type);
+	if (PyType_Ready(&TraceFile_Type) < 0) {
+		return;
+	}
+	PyModule_AddObject(module, "TraceFile", (PyObject*) &TraceFile_Type);
+	if (PyType_Ready(&TraceColumns_Type) < 0) {
+		return;
+	}
+	PyModule_AddObject(module, "TraceColumns", (PyObject*) &TraceColumns_Type);
+	if (PyType_Ready(&Column_Type) < 0) {
+		return;
+	}
+	PyModule_AddObject(module, "Column", (PyObject*) &Column_Type);
 
 	Py_XDECREF(_passover_logfunc);
 	_passover_logfunc = NULL;
@@ -0,0 +1,559 @@
+/*
+ * Decoder -- reads the records of a trace file back. the file is mapped as
+ * is (or, if it's compressed, decompressed once into memory), and records
+ * are returned in place, without copying: the header is decoded, and the
+ * body is left for the caller, since what it holds depends on the type.
+ * sync records are consumed here -- they only update what the records after
+ * them are relative to (see "Trace records" in tracer.c).
+ *
+ * a file that's still being written can be decoded as far as it was when
+ * it was opened; records are only committed by filling in their length, so
+ * there's never a partial one in the way.
+ */
+#include "tracer.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "decoder.h"
+#include "../lib/lzblock.h"
+#include "../lib/rotzip.h"
+#include "../lib/sreader.h"
+
+
+#define DECODER_V1_HEADER_SIZE  (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint64_t) + \
+		sizeof(uint16_t))
+
+
+/*
+ * maps the whole file for reading
+ */
+errcode_t decoder_map_file(const char * filename, OUT void ** outaddr, OUT size_t * outsize)
+{
+	struct stat sb;
+	void * addr;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return ERR_DECODER_OPEN_FAILED;
+	}
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		return ERR_DECODER_OPEN_FAILED;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		*outaddr = NULL;
+		*outsize = 0;
+		RETURN_SUCCESSFUL;
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return ERR_DECODER_MMAP_FAILED;
+	}
+	madvise(addr, sb.st_size, MADV_SEQUENTIAL);
+	*outaddr = addr;
+	*outsize = sb.st_size;
+	RETURN_SUCCESSFUL;
+}
+
+void decoder_unmap_file(void * addr, size_t size)
+{
+	if (addr != NULL) {
+		munmap(addr, size);
+	}
+}
+
+static errcode_t _decoder_decompress(decoder_t * self)
+{
+	rotzip_header_t zheader;
+	const char * data = (const char *)self->map + self->header_size;
+	size_t size = self->map_size - self->header_size;
+	const uint64_t * offsets;
+	size_t i, blocksize, zsize, outsize;
+
+	if (size < sizeof(zheader)) {
+		return ERR_DECODER_CORRUPT_FILE;
+	}
+	memcpy(&zheader, data, sizeof(zheader));
+	offsets = (const uint64_t *)(data + sizeof(zheader));
+	// every block but the last is full, so the blocks must cover data_size
+	// exactly -- otherwise they'd be decompressed past the end of the buffer
+	if (zheader.block_size == 0 || zheader.block_count != zheader.data_size /
+			zheader.block_size + (zheader.data_size % zheader.block_size != 0)) {
+		return ERR_DECODER_CORRUPT_FILE;
+	}
+	if (sizeof(zheader) + sizeof(uint64_t) * ((size_t)zheader.block_count + 1) > size ||
+			offsets[zheader.block_count] > self->map_size) {
+		return ERR_DECODER_CORRUPT_FILE;
+	}
+	self->buffer = malloc(zheader.data_size > 0 ? zheader.data_size : 1);
+	if (self->buffer == NULL) {
+		return ERR_DECODER_MALLOC_FAILED;
+	}
+	for (i = 0; i < zheader.block_count; i++) {
+		blocksize = zheader.data_size - i * zheader.block_size;
+		if (blocksize > zheader.block_size) {
+			blocksize = zheader.block_size;
+		}
+		zsize = offsets[i + 1] - offsets[i];
+		if (offsets[i] > offsets[i + 1]) {
+			return ERR_DECODER_CORRUPT_FILE;
+		}
+		if (zsize == blocksize) {
+			// stored uncompressed
+			memcpy(self->buffer + i * zheader.block_size,
+					(const char *)self->map + offsets[i], blocksize);
+			continue;
+		}
+		PROPAGATE(lzblock_decompress((const char *)self->map + offsets[i], zsize,
+				self->buffer + i * zheader.block_size, blocksize, &outsize));
+		if (outsize != blocksize) {
+			return ERR_DECODER_CORRUPT_FILE;
+		}
+	}
+	self->records = self->buffer;
+	self->end = self->header_size + zheader.data_size;
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t decoder_open(decoder_t * self, const char * filename)
+{
+	errcode_t retcode = ERR_UNKNOWN;
+	rotrec_file_header_t header;
+
+	self->buffer = NULL;
+	self->pos = 0;
+	self->synced = 0;
+	self->depth = 0;
+	self->timestamp = 0;
+	self->has_clock = 0;
+	PROPAGATE(decoder_map_file(filename, &self->map, &self->map_size));
+
+	if (self->map_size < sizeof(uint64_t)) {
+		retcode = ERR_DECODER_NOT_A_ROTREC;
+		goto error;
+	}
+	memcpy(&header, self->map, (self->map_size < sizeof(header)) ? sizeof(uint64_t) :
+			sizeof(header));
+	self->base_offset = header.base_offset;
+	if (self->map_size >= sizeof(header) && header.marker == 0 &&
+			header.magic == ROTREC_MAGIC) {
+		self->version = header.version;
+		self->header_size = sizeof(header);
+		self->compressed = (header.flags & ROTREC_HEADER_COMPRESSED) != 0;
+	}
+	else {
+		// the original format: a bare base offset
+		self->version = 1;
+		self->header_size = sizeof(uint64_t);
+		self->compressed = 0;
+	}
+	if (self->compressed) {
+		PROPAGATE_TO(error, retcode = _decoder_decompress(self));
+	}
+	else {
+		self->records = (const char *)self->map + self->header_size;
+		self->end = self->map_size;
+	}
+	self->pos = self->header_size;
+	RETURN_SUCCESSFUL;
+
+error:
+	free(self->buffer);
+	self->buffer = NULL;
+	decoder_unmap_file(self->map, self->map_size);
+	self->map = NULL;
+	return retcode;
+}
+
+errcode_t decoder_close(decoder_t * self)
+{
+	free(self->buffer);
+	self->buffer = NULL;
+	decoder_unmap_file(self->map, self->map_size);
+	self->map = NULL;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * moves to the record at the given file offset. in version 2, records are
+ * only returned from the first sync record on
+ */
+errcode_t decoder_seek(decoder_t * self, size_t offset)
+{
+	if (offset < self->header_size || offset > self->end) {
+		return ERR_DECODER_OFFSET_OUT_OF_RANGE;
+	}
+	self->pos = offset;
+	self->synced = 0;
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _decoder_load_sync(decoder_t * self, sreader_t * stream)
+{
+	uint64_t value;
+
+	PROPAGATE(sreader_load_svarint(stream, &self->depth));
+	PROPAGATE(sreader_load_varint(stream, &self->timestamp));
+	if (sreader_get_remaining(stream) > 0) {
+		PROPAGATE(sreader_load_varint(stream, &value));
+		self->clock.ticks_per_sec = value;
+		PROPAGATE(sreader_load_varint(stream, &value));
+		self->clock.ticks = value;
+		PROPAGATE(sreader_load_varint(stream, &value));
+		self->clock.monotonic_ns = value;
+		PROPAGATE(sreader_load_varint(stream, &value));
+		self->clock.realtime_ns = value;
+		self->has_clock = (self->clock.ticks_per_sec > 0);
+	}
+	self->synced = 1;
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _decoder_load_v1(decoder_t * self, const char * data,
+		size_t size, OUT decoder_record_t * record)
+{
+	uint16_t depth, codepoint;
+	uint64_t timestamp;
+
+	if (size < DECODER_V1_HEADER_SIZE) {
+		return ERR_DECODER_CORRUPT_RECORD;
+	}
+	memcpy(&depth, data + 1, sizeof(depth));
+	memcpy(&timestamp, data + 3, sizeof(timestamp));
+	memcpy(&codepoint, data + 11, sizeof(codepoint));
+	record->type = *((const uint8_t *)data);
+	record->depth = depth;
+	record->timestamp = timestamp;
+	record->codepoint = codepoint;
+	record->body = data + DECODER_V1_HEADER_SIZE;
+	record->body_size = size - DECODER_V1_HEADER_SIZE;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * returns the data of the next record, or ERR_DECODER_END where the records
+ * end (a zero length, or the end of what was mapped)
+ */
+static inline errcode_t _decoder_next_frame(decoder_t * self, OUT const char ** outdata,
+		OUT size_t * outlength)
+{
+	rotret_record_size_t length;
+	const char * data;
+
+	if (self->pos + sizeof(length) > self->end) {
+		return ERR_DECODER_END;
+	}
+	data = self->records + (self->pos - self->header_size);
+	memcpy(&length, data, sizeof(length));
+	if (length == 0 || self->pos + sizeof(length) + length > self->end) {
+		return ERR_DECODER_END;
+	}
+	self->pos += sizeof(length) + length;
+	*outdata = data + sizeof(length);
+	*outlength = length;
+	RETURN_SUCCESSFUL;
+}
+
+static inline int64_t _decoder_depth_change(unsigned depth_code)
+{
+	// zigzag encoded
+	return (int64_t)(depth_code >> 1) ^ -(int64_t)(depth_code & 1);
+}
+
+/*
+ * returns the next record (sync records are consumed), or ERR_DECODER_END
+ */
+errcode_t decoder_next(decoder_t * self, OUT decoder_record_t * record)
+{
+	size_t length;
+	const char * data;
+	sreader_t stream;
+	uint8_t header;
+	int64_t change;
+	uint64_t value;
+	unsigned depth_code;
+
+	while (1) {
+		PROPAGATE(_decoder_next_frame(self, &data, &length));
+		if (self->version < 2) {
+			return _decoder_load_v1(self, data, length, record);
+		}
+		header = *((const uint8_t *)data);
+		PROPAGATE(sreader_init(&stream, data + 1, length - 1));
+		if ((header & TRACER_HEADER_TYPE_MASK) == TRACER_RECORD_SYNC) {
+			PROPAGATE(_decoder_load_sync(self, &stream));
+			continue;
+		}
+		if (!self->synced) {
+			// nothing to make it relative to
+			continue;
+		}
+		depth_code = header >> TRACER_HEADER_DEPTH_SHIFT;
+		if (depth_code == TRACER_HEADER_DEPTH_ESCAPE) {
+			PROPAGATE(sreader_load_svarint(&stream, &change));
+			self->depth += change;
+		}
+		else {
+			self->depth += _decoder_depth_change(depth_code);
+		}
+		PROPAGATE(sreader_load_svarint(&stream, &change));
+		self->timestamp += change;
+		PROPAGATE(sreader_load_varint(&stream, &value));
+
+		record->type = header & TRACER_HEADER_TYPE_MASK;
+		record->depth = self->depth;
+		record->timestamp = self->timestamp;
+		record->codepoint = (uint32_t)value;
+		record->body = (const char *)stream.pos;
+		record->body_size = sreader_get_remaining(&stream);
+		RETURN_SUCCESSFUL;
+	}
+}
+
+/*
+ * converts a timestamp to nsec of wall time, using the clock sync of the
+ * last sync record if the trace has raw timestamps (ticks)
+ */
+uint64_t decoder_get_time_ns(decoder_t * self, uint64_t timestamp)
+{
+	if (!self->has_clock) {
+		return timestamp * 1000;
+	}
+	return self->clock.realtime_ns + (int64_t)((double)(int64_t)(timestamp - self->clock.ticks) *
+			1000000000.0 / self->clock.ticks_per_sec);
+}
+
+/*
+ * converts a duration, in the units of the timestamps, to nsec
+ */
+uint64_t decoder_get_duration_ns(decoder_t * self, uint64_t duration)
+{
+	if (!self->has_clock) {
+		return duration * 1000;
+	}
+	return (uint64_t)((double)duration * 1000000000.0 / self->clock.ticks_per_sec);
+}
+
+/***************************************************************************
+**                           Columns
+***************************************************************************/
+
+/*
+ * columns hold a batch of records as arrays, one per field, and their bodies
+ * back to back in a heap. records are decoded in two passes: the first
+ * scatters the fields, leaving the depth and timestamp changes as they are
+ * in the file, and the second turns them into absolute values with a prefix
+ * sum per sync record, and converts the timestamps in tight loops
+ */
+errcode_t decoder_columns_init(decoder_columns_t * self, size_t capacity)
+{
+	self->capacity = capacity;
+	self->count = 0;
+	self->heap_capacity = capacity * DECODER_COLUMNS_BODY_SIZE_HINT + 1;
+	self->types = malloc(capacity * sizeof(*self->types) + 1);
+	self->depths = malloc(capacity * sizeof(*self->depths) + 1);
+	self->timestamps = malloc(capacity * sizeof(*self->timestamps) + 1);
+	self->codepoints = malloc(capacity * sizeof(*self->codepoints) + 1);
+	self->payload_offsets = malloc((capacity + 1) * sizeof(*self->payload_offsets));
+	self->heap = malloc(self->heap_capacity);
+	if (self->types == NULL || self->depths == NULL || self->timestamps == NULL ||
+			self->codepoints == NULL || self->payload_offsets == NULL || self->heap == NULL) {
+		decoder_columns_fini(self);
+		return ERR_DECODER_MALLOC_FAILED;
+	}
+	self->payload_offsets[0] = 0;
+	RETURN_SUCCESSFUL;
+}
+
+void decoder_columns_fini(decoder_columns_t * self)
+{
+	free(self->types);
+	free(self->depths);
+	free(self->timestamps);
+	free(self->codepoints);
+	free(self->payload_offsets);
+	free(self->heap);
+	self->types = NULL;
+	self->depths = NULL;
+	self->timestamps = NULL;
+	self->codepoints = NULL;
+	self->payload_offsets = NULL;
+	self->heap = NULL;
+	self->capacity = 0;
+	self->count = 0;
+}
+
+static inline errcode_t _decoder_columns_add_body(decoder_columns_t * columns, size_t index,
+		const void * body, size_t size)
+{
+	uint64_t offset = columns->payload_offsets[index];
+	size_t capacity;
+	char * heap;
+
+	if (offset + size > columns->heap_capacity) {
+		capacity = columns->heap_capacity * 2;
+		if (capacity < offset + size) {
+			capacity = offset + size;
+		}
+		heap = realloc(columns->heap, capacity);
+		if (heap == NULL) {
+			return ERR_DECODER_MALLOC_FAILED;
+		}
+		columns->heap = heap;
+		columns->heap_capacity = capacity;
+	}
+	memcpy(columns->heap + offset, body, size);
+	columns->payload_offsets[index + 1] = offset + size;
+	RETURN_SUCCESSFUL;
+}
+
+static void _decoder_columns_convert(decoder_t * self, uint64_t * timestamps, size_t count)
+{
+	uint64_t ticks, realtime_ns;
+	double ticks_per_sec;
+	size_t i;
+
+	if (!self->has_clock) {
+		for (i = 0; i < count; i++) {
+			timestamps[i] *= 1000;
+		}
+		return;
+	}
+	// as decoder_get_time_ns does
+	ticks = self->clock.ticks;
+	realtime_ns = self->clock.realtime_ns;
+	ticks_per_sec = (double)self->clock.ticks_per_sec;
+	for (i = 0; i < count; i++) {
+		timestamps[i] = realtime_ns + (int64_t)((double)(int64_t)(timestamps[i] - ticks) *
+				1000000000.0 / ticks_per_sec);
+	}
+}
+
+/*
+ * the second pass, over the records from a sync record (or the start of the
+ * batch) up to the next
+ */
+static void _decoder_columns_finish(decoder_t * self, decoder_columns_t * columns,
+		size_t start, size_t end)
+{
+	int32_t * depths = columns->depths;
+	uint64_t * timestamps = columns->timestamps;
+	int64_t depth = self->depth;
+	uint64_t timestamp = self->timestamp;
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		depth += depths[i];
+		depths[i] = (int32_t)depth;
+	}
+	for (i = start; i < end; i++) {
+		timestamp += timestamps[i];
+		timestamps[i] = timestamp;
+	}
+	self->depth = depth;
+	self->timestamp = timestamp;
+	_decoder_columns_convert(self, timestamps + start, end - start);
+}
+
+static errcode_t _decoder_read_columns_v1(decoder_t * self, decoder_columns_t * columns,
+		int payloads)
+{
+	decoder_record_t record;
+	size_t n = 0;
+	errcode_t retcode;
+
+	while (n < columns->capacity) {
+		retcode = decoder_next(self, &record);
+		if (retcode == ERR_DECODER_END) {
+			break;
+		}
+		PROPAGATE(retcode);
+		columns->types[n] = (uint8_t)record.type;
+		columns->depths[n] = (int32_t)record.depth;
+		columns->timestamps[n] = decoder_get_time_ns(self, record.timestamp);
+		columns->codepoints[n] = record.codepoint;
+		columns->payload_offsets[n + 1] = columns->payload_offsets[n];
+		if (payloads) {
+			PROPAGATE(_decoder_columns_add_body(columns, n, record.body, record.body_size));
+		}
+		n++;
+		columns->count = n;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * decodes up to columns->capacity records into the columns (replacing what
+ * they held). the bodies are copied to the heap only if payloads is set
+ */
+errcode_t decoder_read_columns(decoder_t * self, decoder_columns_t * columns, int payloads)
+{
+	size_t length, n = 0, start = 0;
+	const char * data;
+	sreader_t stream;
+	uint8_t header;
+	int64_t change;
+	uint64_t value;
+	unsigned depth_code;
+	errcode_t retcode = ERR_UNKNOWN;
+
+	columns->count = 0;
+	columns->payload_offsets[0] = 0;
+	if (self->version < 2) {
+		return _decoder_read_columns_v1(self, columns, payloads);
+	}
+
+	while (n < columns->capacity) {
+		retcode = _decoder_next_frame(self, &data, &length);
+		if (retcode == ERR_DECODER_END) {
+			break;
+		}
+		PROPAGATE_TO(error, retcode);
+		header = *((const uint8_t *)data);
+		PROPAGATE_TO(error, retcode = sreader_init(&stream, data + 1, length - 1));
+		if ((header & TRACER_HEADER_TYPE_MASK) == TRACER_RECORD_SYNC) {
+			_decoder_columns_finish(self, columns, start, n);
+			start = n;
+			PROPAGATE_TO(error, retcode = _decoder_load_sync(self, &stream));
+			continue;
+		}
+		if (!self->synced) {
+			continue;
+		}
+		depth_code = header >> TRACER_HEADER_DEPTH_SHIFT;
+		if (depth_code == TRACER_HEADER_DEPTH_ESCAPE) {
+			PROPAGATE_TO(error, retcode = sreader_load_svarint(&stream, &change));
+		}
+		else {
+			change = _decoder_depth_change(depth_code);
+		}
+		columns->depths[n] = (int32_t)change;
+		PROPAGATE_TO(error, retcode = sreader_load_svarint(&stream, &change));
+		columns->timestamps[n] = (uint64_t)change;
+		PROPAGATE_TO(error, retcode = sreader_load_varint(&stream, &value));
+		columns->types[n] = header & TRACER_HEADER_TYPE_MASK;
+		columns->codepoints[n] = (uint32_t)value;
+		columns->payload_offsets[n + 1] = columns->payload_offsets[n];
+		if (payloads) {
+			PROPAGATE_TO(error, retcode = _decoder_columns_add_body(columns, n, stream.pos,
+					sreader_get_remaining(&stream)));
+		}
+		n++;
+	}
+	_decoder_columns_finish(self, columns, start, n);
+	columns->count = n;
+	RETURN_SUCCESSFUL;
+
+error:
+	// keep the state consistent with the records that were decoded
+	_decoder_columns_finish(self, columns, start, n);
+	columns->count = n;
+	return retcode;
+}
@@ -0,0 +1,73 @@
+#ifndef DECODER_H_INCLUDED
+#define DECODER_H_INCLUDED
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../lib/errors.h"
+#include "../lib/hptime.h"
+
+
+// a record, as found in the file. the body (whose format depends on the
+// type) is left to the caller
+typedef struct _decoder_record_t {
+	int          type;
+	int64_t      depth;
+	uint64_t     timestamp;  // in the units of the trace (see decoder_get_time_ns)
+	uint32_t     codepoint;
+	const char * body;
+	size_t       body_size;
+} decoder_record_t;
+
+typedef struct _decoder_t {
+	void *       map;
+	size_t       map_size;
+	// the records of a compressed file, decompressed
+	char *       buffer;
+	// the records: file offset x is at records[x - header_size], up to end
+	const char * records;
+	size_t       header_size;
+	size_t       end;
+	uint64_t     base_offset;
+	int          version;
+	int          compressed;
+	size_t       pos;
+	// what records are relative to (version 2), as of the last sync record
+	int          synced;
+	int64_t      depth;
+	uint64_t     timestamp;
+	int          has_clock;
+	hptime_clocksync_t clock;
+} decoder_t;
+
+// a batch of records, a column per field (see decoder_read_columns)
+typedef struct _decoder_columns_t {
+	size_t       capacity;
+	size_t       count;
+	uint8_t *    types;
+	int32_t *    depths;
+	uint64_t *   timestamps;       // nsec of wall time
+	uint32_t *   codepoints;
+	// the body of record i is heap[payload_offsets[i]:payload_offsets[i + 1]]
+	uint64_t *   payload_offsets;
+	char *       heap;
+	size_t       heap_capacity;
+} decoder_columns_t;
+
+#define DECODER_COLUMNS_BODY_SIZE_HINT  (8)
+
+errcode_t decoder_map_file(const char * filename, OUT void ** outaddr, OUT size_t * outsize);
+void decoder_unmap_file(void * addr, size_t size);
+errcode_t decoder_open(decoder_t * self, const char * filename);
+errcode_t decoder_close(decoder_t * self);
+errcode_t decoder_seek(decoder_t * self, size_t offset);
+errcode_t decoder_next(decoder_t * self, OUT decoder_record_t * record);
+uint64_t decoder_get_time_ns(decoder_t * self, uint64_t timestamp);
+uint64_t decoder_get_duration_ns(decoder_t * self, uint64_t duration);
+
+errcode_t decoder_columns_init(decoder_columns_t * self, size_t capacity);
+void decoder_columns_fini(decoder_columns_t * self);
+errcode_t decoder_read_columns(decoder_t * self, decoder_columns_t * columns, int payloads);
+
+
+#endif // DECODER_H_INCLUDED
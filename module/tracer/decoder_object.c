@@ -0,0 +1,1045 @@
+#include "decoder_object.h"
+#include "tracer.h"
+#include "../lib/listfile.h"
+#include "../lib/rotrec.h"
+#include "../lib/sreader.h"
+
+
+#define DECODER_MAX_LONG_BYTES  ((TRACER_PYOBJ_MAX_LONG_LIMBS * 64 + 7) / 8)
+
+static inline PyObject * _decoder_raise(errcode_t retcode)
+{
+	PyErr_SetString(ErrorObject, errcode_get_name(retcode));
+	return NULL;
+}
+
+static inline PyObject * _decoder_uint(uint64_t value)
+{
+	if (value <= LONG_MAX) {
+		return PyInt_FromLong((long)value);
+	}
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static inline PyObject * _decoder_load_pstr(sreader_t * stream)
+{
+	uint16_t length;
+	PyObject * obj;
+	errcode_t retcode;
+
+	retcode = sreader_load_uint16(stream, &length);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	if (length > sreader_get_remaining(stream)) {
+		return _decoder_raise(ERR_SREADER_END_OF_BUFFER);
+	}
+	obj = PyString_FromStringAndSize((const char *)stream->pos, length);
+	stream->pos = (const char *)stream->pos + length;
+	return obj;
+}
+
+/*
+ * longs are dumped as their limbs (see _tracer_dump_long), which are put
+ * back together as a little endian byte array
+ */
+static PyObject * _decoder_load_long_limbs(sreader_t * stream)
+{
+	unsigned char bytes[DECODER_MAX_LONG_BYTES];
+	int64_t size;
+	uint8_t shift;
+	uint64_t limb;
+	size_t count, i, bit, bitpos = 0;
+	PyObject * value, * negated;
+	errcode_t retcode;
+
+	retcode = sreader_load_svarint(stream, &size);
+	if (!IS_ERROR(retcode)) {
+		retcode = sreader_load_uint8(stream, &shift);
+	}
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	count = (size < 0) ? -size : size;
+	if (count > TRACER_PYOBJ_MAX_LONG_LIMBS || shift > 64) {
+		return _decoder_raise(ERR_DECODER_CORRUPT_RECORD);
+	}
+	memset(bytes, 0, sizeof(bytes));
+	for (i = 0; i < count; i++) {
+		retcode = sreader_load_varint(stream, &limb);
+		if (IS_ERROR(retcode)) {
+			return _decoder_raise(retcode);
+		}
+		for (bit = 0; bit < shift; bit++, bitpos++) {
+			if ((limb >> bit) & 1) {
+				bytes[bitpos / 8] |= 1 << (bitpos % 8);
+			}
+		}
+	}
+	value = _PyLong_FromByteArray(bytes, sizeof(bytes), 1, 0);
+	if (value == NULL || size >= 0) {
+		return value;
+	}
+	negated = PyNumber_Negative(value);
+	Py_DECREF(value);
+	return negated;
+}
+
+/*
+ * the counterpart of _tracer_dump_argument
+ */
+static PyObject * _decoder_load_argument(TraceFileObject * self, sreader_t * stream)
+{
+	uint8_t type;
+	int64_t ivalue;
+	uint64_t uvalue;
+	double dvalue;
+	PyObject * str, * obj;
+	errcode_t retcode;
+
+	retcode = sreader_load_uint8(stream, &type);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	switch (type) {
+		case TRACER_PYOBJ_NONE:
+			Py_RETURN_NONE;
+		case TRACER_PYOBJ_UNDUMPABLE:
+			Py_INCREF(self->undumpable);
+			return self->undumpable;
+		case TRACER_PYOBJ_TRUE:
+			Py_RETURN_TRUE;
+		case TRACER_PYOBJ_FALSE:
+			Py_RETURN_FALSE;
+		case TRACER_PYOBJ_INT:
+		case TRACER_PYOBJ_LONG:
+		case TRACER_PYOBJ_FLOAT:
+			// these are dumped as their str()
+			str = _decoder_load_pstr(stream);
+			if (str == NULL) {
+				return NULL;
+			}
+			if (type == TRACER_PYOBJ_INT) {
+				obj = PyNumber_Int(str);
+			}
+			else if (type == TRACER_PYOBJ_LONG) {
+				obj = PyNumber_Long(str);
+			}
+			else {
+				obj = PyFloat_FromString(str, NULL);
+			}
+			Py_DECREF(str);
+			return obj;
+		case TRACER_PYOBJ_STR:
+			return _decoder_load_pstr(stream);
+		case TRACER_PYOBJ_VARINT:
+			retcode = sreader_load_svarint(stream, &ivalue);
+			if (IS_ERROR(retcode)) {
+				return _decoder_raise(retcode);
+			}
+			return PyInt_FromLong((long)ivalue);
+		case TRACER_PYOBJ_LONG_LIMBS:
+			return _decoder_load_long_limbs(stream);
+		case TRACER_PYOBJ_DOUBLE:
+			retcode = sreader_load_uint64(stream, &uvalue);
+			if (IS_ERROR(retcode)) {
+				return _decoder_raise(retcode);
+			}
+			memcpy(&dvalue, &uvalue, sizeof(dvalue));
+			return PyFloat_FromDouble(dvalue);
+		default:
+			if (type >= TRACER_PYOBJ_IMMINT_0 + TRACER_PYOBJ_MIN_IMM_INT &&
+					type <= TRACER_PYOBJ_IMMINT_0 + TRACER_PYOBJ_MAX_IMM_INT) {
+				return PyInt_FromLong((long)type - TRACER_PYOBJ_IMMINT_0);
+			}
+			return _decoder_raise(ERR_DECODER_UNKNOWN_ARGUMENT);
+	}
+}
+
+static inline errcode_t _decoder_load_count(TraceFileObject * self, sreader_t * stream,
+		OUT uint64_t * outcount)
+{
+	uint16_t count;
+
+	if (self->decoder.version >= 2) {
+		return sreader_load_varint(stream, outcount);
+	}
+	PROPAGATE(sreader_load_uint16(stream, &count));
+	*outcount = count;
+	RETURN_SUCCESSFUL;
+}
+
+static PyObject * _decoder_load_tuple(TraceFileObject * self, sreader_t * stream,
+		int arguments)
+{
+	uint64_t count, i;
+	PyObject * tuple, * item;
+	errcode_t retcode;
+
+	retcode = _decoder_load_count(self, stream, &count);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	if (count > sreader_get_remaining(stream)) {
+		// every item takes at least a byte
+		return _decoder_raise(ERR_DECODER_CORRUPT_RECORD);
+	}
+	tuple = PyTuple_New(count);
+	if (tuple == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		item = arguments ? _decoder_load_argument(self, stream) : _decoder_load_pstr(stream);
+		if (item == NULL) {
+			Py_DECREF(tuple);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(tuple, i, item);
+	}
+	return tuple;
+}
+
+/*
+ * what the body holds, depending on the type: the arguments of a python
+ * call (a tuple), the return value, the arguments of a log line (a tuple of
+ * strings), the number of calls skipped by sampling, or the calls and total
+ * duration (nsec) of a suppressed codepoint. None for the rest
+ */
+static PyObject * _decoder_load_payload(TraceFileObject * self, decoder_record_t * record)
+{
+	sreader_t stream;
+	uint64_t calls, duration;
+	errcode_t retcode;
+
+	sreader_init(&stream, record->body, record->body_size);
+	switch (record->type) {
+		case TRACER_RECORD_PYCALL:
+			return _decoder_load_tuple(self, &stream, 1);
+		case TRACER_RECORD_PYRET:
+			return _decoder_load_argument(self, &stream);
+		case TRACER_RECORD_LOG:
+			return _decoder_load_tuple(self, &stream, 0);
+		case TRACER_RECORD_SAMPLE:
+			retcode = sreader_load_varint(&stream, &calls);
+			if (IS_ERROR(retcode)) {
+				return _decoder_raise(retcode);
+			}
+			return _decoder_uint(calls);
+		case TRACER_RECORD_SUPPRESSED:
+			retcode = sreader_load_varint(&stream, &calls);
+			if (!IS_ERROR(retcode)) {
+				retcode = sreader_load_varint(&stream, &duration);
+			}
+			if (IS_ERROR(retcode)) {
+				return _decoder_raise(retcode);
+			}
+			return Py_BuildValue("(NN)", _decoder_uint(calls),
+					_decoder_uint(decoder_get_duration_ns(&self->decoder, duration)));
+		default:
+			Py_RETURN_NONE;
+	}
+}
+
+/*
+ * returns the next record as (type, depth, timestamp_ns, codepoint, payload),
+ * or NULL without an exception at the end
+ */
+static PyObject * _decoder_read(TraceFileObject * self, int payloads)
+{
+	decoder_record_t record;
+	PyObject * tuple, * payload;
+	errcode_t retcode;
+
+	retcode = decoder_next(&self->decoder, &record);
+	if (retcode == ERR_DECODER_END) {
+		return NULL;
+	}
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	if (payloads) {
+		payload = _decoder_load_payload(self, &record);
+		if (payload == NULL) {
+			return NULL;
+		}
+	}
+	else {
+		Py_INCREF(Py_None);
+		payload = Py_None;
+	}
+	tuple = PyTuple_New(5);
+	if (tuple == NULL) {
+		Py_DECREF(payload);
+		return NULL;
+	}
+	PyTuple_SET_ITEM(tuple, 0, PyInt_FromLong(record.type));
+	PyTuple_SET_ITEM(tuple, 1, PyInt_FromLong((long)record.depth));
+	PyTuple_SET_ITEM(tuple, 2, _decoder_uint(decoder_get_time_ns(&self->decoder,
+			record.timestamp)));
+	PyTuple_SET_ITEM(tuple, 3, PyInt_FromLong(record.codepoint));
+	PyTuple_SET_ITEM(tuple, 4, payload);
+	return tuple;
+}
+
+/***************************************************************************
+**                           TraceFile methods
+***************************************************************************/
+static PyObject * tracefile_new(PyTypeObject *type, PyObject * args, PyObject * kw)
+{
+	static char * kwlist[] = {"filename", "undumpable", NULL};
+	char * filename = NULL;
+	PyObject * undumpable = Py_None;
+	TraceFileObject * self = NULL;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "s|O:TraceFile", kwlist,
+	        &filename, &undumpable)) {
+		return NULL;
+	}
+
+	self = (TraceFileObject*)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->opened = 0;
+	Py_INCREF(undumpable);
+	self->undumpable = undumpable;
+
+	// compressed files are decompressed here
+	Py_BEGIN_ALLOW_THREADS
+	retcode = decoder_open(&self->decoder, filename);
+	Py_END_ALLOW_THREADS
+	if (IS_ERROR(retcode)) {
+		Py_DECREF(self);
+		return _decoder_raise(retcode);
+	}
+	self->opened = 1;
+	return (PyObject *)self;
+}
+
+static void tracefile_dealloc(TraceFileObject * self)
+{
+	if (self->opened) {
+		self->opened = 0;
+		decoder_close(&self->decoder);
+	}
+	Py_XDECREF(self->undumpable);
+	self->undumpable = NULL;
+	self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject * tracefile_seek(TraceFileObject * self, PyObject * args)
+{
+	unsigned PY_LONG_LONG offset;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTuple(args, "K:seek", &offset)) {
+		return NULL;
+	}
+	retcode = decoder_seek(&self->decoder, offset);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject * tracefile_read(TraceFileObject * self, PyObject * args, PyObject * kw)
+{
+	static char * kwlist[] = {"payloads", NULL};
+	int payloads = 1;
+	PyObject * record;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|i:read", kwlist, &payloads)) {
+		return NULL;
+	}
+	record = _decoder_read(self, payloads);
+	if (record == NULL && !PyErr_Occurred()) {
+		PyErr_SetNone(PyExc_EOFError);
+	}
+	return record;
+}
+
+static PyObject * tracefile_read_batch(TraceFileObject * self, PyObject * args, PyObject * kw)
+{
+	static char * kwlist[] = {"count", "payloads", NULL};
+	Py_ssize_t count, i;
+	int payloads = 1;
+	PyObject * list, * record;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "n|i:read_batch", kwlist, &count,
+	        &payloads)) {
+		return NULL;
+	}
+	list = PyList_New(0);
+	if (list == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		record = _decoder_read(self, payloads);
+		if (record == NULL) {
+			if (PyErr_Occurred()) {
+				Py_DECREF(list);
+				return NULL;
+			}
+			break;
+		}
+		if (PyList_Append(list, record) != 0) {
+			Py_DECREF(record);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(record);
+	}
+	return list;
+}
+
+static PyObject * tracefile_read_columns(TraceFileObject * self, PyObject * args,
+		PyObject * kw)
+{
+	static char * kwlist[] = {"count", "payloads", NULL};
+	Py_ssize_t count;
+	int payloads = 1;
+	TraceColumnsObject * columns;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "n|i:read_columns", kwlist, &count,
+	        &payloads)) {
+		return NULL;
+	}
+	if (count < 0) {
+		PyErr_SetString(PyExc_ValueError, "count must be >= 0");
+		return NULL;
+	}
+	columns = PyObject_New(TraceColumnsObject, &TraceColumns_Type);
+	if (columns == NULL) {
+		return NULL;
+	}
+	Py_INCREF(self);
+	columns->tracefile = self;
+	columns->payloads = payloads;
+	// no python objects are involved, so files can be decoded by several
+	// threads at once (but a TraceFile must not be shared between threads)
+	Py_BEGIN_ALLOW_THREADS
+	retcode = decoder_columns_init(&columns->columns, count);
+	if (!IS_ERROR(retcode)) {
+		retcode = decoder_read_columns(&self->decoder, &columns->columns, payloads);
+	}
+	Py_END_ALLOW_THREADS
+	if (IS_ERROR(retcode)) {
+		Py_DECREF(columns);
+		return _decoder_raise(retcode);
+	}
+	return (PyObject *)columns;
+}
+
+static PyObject * tracefile_iternext(TraceFileObject * self)
+{
+	return _decoder_read(self, 1);
+}
+
+static PyObject * tracefile_get_pos(TraceFileObject * self, void * closure)
+{
+	return _decoder_uint(self->decoder.pos);
+}
+
+static PyObject * tracefile_get_depth(TraceFileObject * self, void * closure)
+{
+	if (!self->decoder.synced) {
+		Py_RETURN_NONE;
+	}
+	return PyInt_FromLong((long)self->decoder.depth);
+}
+
+static PyObject * tracefile_get_timestamp_ns(TraceFileObject * self, void * closure)
+{
+	if (!self->decoder.synced) {
+		Py_RETURN_NONE;
+	}
+	return _decoder_uint(decoder_get_time_ns(&self->decoder, self->decoder.timestamp));
+}
+
+static PyObject * tracefile_get_clock(TraceFileObject * self, void * closure)
+{
+	if (!self->decoder.has_clock) {
+		Py_RETURN_NONE;
+	}
+	return Py_BuildValue("(KKKK)",
+		(unsigned PY_LONG_LONG)self->decoder.clock.ticks_per_sec,
+		(unsigned PY_LONG_LONG)self->decoder.clock.ticks,
+		(unsigned PY_LONG_LONG)self->decoder.clock.monotonic_ns,
+		(unsigned PY_LONG_LONG)self->decoder.clock.realtime_ns);
+}
+
+static PyMethodDef tracefile_methods[] = {
+	{"seek", (PyCFunction)tracefile_seek, METH_VARARGS,
+	 PyDoc_STR("seek(offset) -- moves to the record at the given file offset. "
+	           "records are returned from the first sync record on")},
+	{"read", (PyCFunction)tracefile_read, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("read(payloads = True) -- returns the next record, or raises EOFError")},
+	{"read_batch", (PyCFunction)tracefile_read_batch, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("read_batch(count, payloads = True) -- returns a list of up to count "
+	           "records (empty at the end)")},
+	{"read_columns", (PyCFunction)tracefile_read_columns, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("read_columns(count, payloads = True) -- returns up to count records "
+	           "as TraceColumns (empty at the end)")},
+	{NULL, NULL}
+};
+
+static PyGetSetDef tracefile_getset[] = {
+	{"pos", (getter)tracefile_get_pos, NULL,
+	 PyDoc_STR("The file offset of the next record"), NULL},
+	{"depth", (getter)tracefile_get_depth, NULL,
+	 PyDoc_STR("The depth of the last record (None before the first sync record)"), NULL},
+	{"timestamp_ns", (getter)tracefile_get_timestamp_ns, NULL,
+	 PyDoc_STR("The timestamp of the last record (None before the first sync record)"), NULL},
+	{"clock", (getter)tracefile_get_clock, NULL,
+	 PyDoc_STR("The last clock sync, (ticks_per_sec, ticks, monotonic_ns, realtime_ns), "
+	           "or None if the timestamps are in usec"), NULL},
+	{NULL}
+};
+
+static PyMemberDef tracefile_members[] = {
+	{"base_offset", T_ULONGLONG, offsetof(TraceFileObject, decoder) + offsetof(decoder_t, base_offset),
+	 READONLY, PyDoc_STR("The offset of the file in the rotdir")},
+	{"version", T_INT, offsetof(TraceFileObject, decoder) + offsetof(decoder_t, version),
+	 READONLY, PyDoc_STR("The format version of the records")},
+	{"header_size", T_PYSSIZET, offsetof(TraceFileObject, decoder) + offsetof(decoder_t, header_size),
+	 READONLY, PyDoc_STR("The file offset of the first record")},
+	{"end", T_PYSSIZET, offsetof(TraceFileObject, decoder) + offsetof(decoder_t, end),
+	 READONLY, PyDoc_STR("The file offset past which there are no records")},
+	{"compressed", T_INT, offsetof(TraceFileObject, decoder) + offsetof(decoder_t, compressed),
+	 READONLY, PyDoc_STR("Whether the file is compressed")},
+	{0}
+};
+
+PyDoc_STRVAR(tracefile_doc, "\
+TraceFile(filename, undumpable = None)\n\
+\n\
+Decodes the records of a trace (.rot) file. The file is mapped (or, if it's\n\
+compressed, decompressed into memory) and records are decoded as they're\n\
+read, as (type, depth, timestamp_ns, codepoint, payload) tuples, where the\n\
+timestamp is wall time in nsec, and the payload depends on the type: the\n\
+arguments of a python call, the return value, the arguments of a log line,\n\
+the number of unsampled calls, (calls, total_ns) of suppressed calls, or\n\
+None. Undumpable arguments decode to `undumpable`. Sync records are not\n\
+returned.\n\
+");
+
+PyTypeObject TraceFile_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                      /* ob_size */
+	"_passover.TraceFile" ,                 /* tp_name */
+	sizeof(TraceFileObject),                /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	(destructor)tracefile_dealloc,          /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as_number */
+	0,                                      /* tp_as_sequence */
+	0,                                      /* tp_as_mapping */
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	tracefile_doc,                          /* tp_doc */
+	0,                                      /* tp_traverse */
+	0,                                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	PyObject_SelfIter,                      /* tp_iter */
+	(iternextfunc)tracefile_iternext,       /* tp_iternext */
+	tracefile_methods,                      /* tp_methods */
+	tracefile_members,                      /* tp_members */
+	tracefile_getset,                       /* tp_getset */
+	0,                                      /* tp_base */
+	0,                                      /* tp_dict */
+	0,                                      /* tp_descr_get */
+	0,                                      /* tp_descr_set */
+	0,                                      /* tp_dictoffset */
+	0,                                      /* tp_init */
+	PyType_GenericAlloc,                    /* tp_alloc */
+	tracefile_new,                          /* tp_new */
+	PyObject_Del,                           /* tp_free */
+};
+
+/***************************************************************************
+**                           Column
+***************************************************************************/
+static PyObject * _column_new(PyObject * owner, void * data, Py_ssize_t length,
+		Py_ssize_t itemsize, char * format)
+{
+	ColumnObject * self = PyObject_New(ColumnObject, &Column_Type);
+	if (self == NULL) {
+		return NULL;
+	}
+	Py_INCREF(owner);
+	self->owner = owner;
+	self->data = data;
+	self->length = length;
+	self->itemsize = itemsize;
+	self->format = format;
+	return (PyObject *)self;
+}
+
+static void column_dealloc(ColumnObject * self)
+{
+	Py_XDECREF(self->owner);
+	self->owner = NULL;
+	PyObject_Del(self);
+}
+
+static Py_ssize_t column_length(ColumnObject * self)
+{
+	return self->length;
+}
+
+static PyObject * column_item(ColumnObject * self, Py_ssize_t index)
+{
+	if (index < 0 || index >= self->length) {
+		PyErr_SetString(PyExc_IndexError, "column index out of range");
+		return NULL;
+	}
+	switch (self->format[0]) {
+		case 'B':
+			return PyInt_FromLong(((uint8_t *)self->data)[index]);
+		case 'i':
+			return PyInt_FromLong(((int32_t *)self->data)[index]);
+		case 'I':
+			return PyInt_FromLong(((uint32_t *)self->data)[index]);
+		default:
+			return _decoder_uint(((uint64_t *)self->data)[index]);
+	}
+}
+
+static Py_ssize_t column_getreadbuffer(ColumnObject * self, Py_ssize_t segment, void ** ptr)
+{
+	if (segment != 0) {
+		PyErr_SetString(PyExc_SystemError, "columns have a single segment");
+		return -1;
+	}
+	*ptr = self->data;
+	return self->length * self->itemsize;
+}
+
+static Py_ssize_t column_getsegcount(ColumnObject * self, Py_ssize_t * lenp)
+{
+	if (lenp != NULL) {
+		*lenp = self->length * self->itemsize;
+	}
+	return 1;
+}
+
+static int column_getbuffer(ColumnObject * self, Py_buffer * view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "columns are read-only");
+		return -1;
+	}
+	Py_INCREF(self);
+	view->obj = (PyObject *)self;
+	view->buf = self->data;
+	view->len = self->length * self->itemsize;
+	view->readonly = 1;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+	view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &self->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyObject * column_get_format(ColumnObject * self, void * closure)
+{
+	return PyString_FromString(self->format);
+}
+
+static PyObject * column_get_itemsize(ColumnObject * self, void * closure)
+{
+	return PyInt_FromSsize_t(self->itemsize);
+}
+
+static PySequenceMethods column_as_sequence = {
+	(lenfunc)column_length,                 /* sq_length */
+	0,                                      /* sq_concat */
+	0,                                      /* sq_repeat */
+	(ssizeargfunc)column_item,              /* sq_item */
+};
+
+static PyBufferProcs column_as_buffer = {
+	(readbufferproc)column_getreadbuffer,   /* bf_getreadbuffer */
+	0,                                      /* bf_getwritebuffer */
+	(segcountproc)column_getsegcount,       /* bf_getsegcount */
+	0,                                      /* bf_getcharbuffer */
+	(getbufferproc)column_getbuffer,        /* bf_getbuffer */
+	0,                                      /* bf_releasebuffer */
+};
+
+static PyGetSetDef column_getset[] = {
+	{"format", (getter)column_get_format, NULL,
+	 PyDoc_STR("The struct format of the items"), NULL},
+	{"itemsize", (getter)column_get_itemsize, NULL,
+	 PyDoc_STR("The size of an item, in bytes"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(column_doc, "\
+A read-only column of TraceColumns. Columns export their items as a buffer\n\
+(with their format), so memoryview(), numpy.asarray() and the like can use\n\
+them without copying, and can also be indexed as sequences.\n\
+");
+
+PyTypeObject Column_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                      /* ob_size */
+	"_passover.Column" ,                    /* tp_name */
+	sizeof(ColumnObject),                   /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	(destructor)column_dealloc,             /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as_number */
+	&column_as_sequence,                    /* tp_as_sequence */
+	0,                                      /* tp_as_mapping */
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	&column_as_buffer,                      /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+	column_doc,                             /* tp_doc */
+	0,                                      /* tp_traverse */
+	0,                                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	0,                                      /* tp_methods */
+	0,                                      /* tp_members */
+	column_getset,                          /* tp_getset */
+};
+
+/***************************************************************************
+**                           TraceColumns
+***************************************************************************/
+static void tracecolumns_dealloc(TraceColumnsObject * self)
+{
+	decoder_columns_fini(&self->columns);
+	Py_XDECREF(self->tracefile);
+	self->tracefile = NULL;
+	PyObject_Del(self);
+}
+
+static Py_ssize_t tracecolumns_length(TraceColumnsObject * self)
+{
+	return self->columns.count;
+}
+
+static PyObject * tracecolumns_payload(TraceColumnsObject * self, PyObject * args)
+{
+	Py_ssize_t index;
+	decoder_record_t record;
+	decoder_columns_t * columns = &self->columns;
+
+	if (!PyArg_ParseTuple(args, "n:payload", &index)) {
+		return NULL;
+	}
+	if (index < 0 || index >= (Py_ssize_t)columns->count) {
+		PyErr_SetString(PyExc_IndexError, "record index out of range");
+		return NULL;
+	}
+	if (!self->payloads) {
+		PyErr_SetString(PyExc_ValueError, "the payloads were not read");
+		return NULL;
+	}
+	record.type = columns->types[index];
+	record.body = columns->heap + columns->payload_offsets[index];
+	record.body_size = columns->payload_offsets[index + 1] - columns->payload_offsets[index];
+	return _decoder_load_payload(self->tracefile, &record);
+}
+
+static PyObject * tracecolumns_get_type(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.types, self->columns.count,
+			sizeof(uint8_t), "B");
+}
+
+static PyObject * tracecolumns_get_depth(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.depths, self->columns.count,
+			sizeof(int32_t), "i");
+}
+
+static PyObject * tracecolumns_get_timestamp(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.timestamps, self->columns.count,
+			sizeof(uint64_t), "Q");
+}
+
+static PyObject * tracecolumns_get_codepoint(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.codepoints, self->columns.count,
+			sizeof(uint32_t), "I");
+}
+
+static PyObject * tracecolumns_get_payload_offset(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.payload_offsets,
+			self->columns.count + 1, sizeof(uint64_t), "Q");
+}
+
+static PyObject * tracecolumns_get_payload_heap(TraceColumnsObject * self, void * closure)
+{
+	return _column_new((PyObject *)self, self->columns.heap,
+			self->columns.payload_offsets[self->columns.count], sizeof(uint8_t), "B");
+}
+
+static PySequenceMethods tracecolumns_as_sequence = {
+	(lenfunc)tracecolumns_length,           /* sq_length */
+};
+
+static PyMethodDef tracecolumns_methods[] = {
+	{"payload", (PyCFunction)tracecolumns_payload, METH_VARARGS,
+	 PyDoc_STR("payload(index) -- decodes the payload of the record at index (see TraceFile)")},
+	{NULL, NULL}
+};
+
+static PyGetSetDef tracecolumns_getset[] = {
+	{"type", (getter)tracecolumns_get_type, NULL,
+	 PyDoc_STR("The record types (uint8)"), NULL},
+	{"depth", (getter)tracecolumns_get_depth, NULL,
+	 PyDoc_STR("The depths (int32)"), NULL},
+	{"timestamp", (getter)tracecolumns_get_timestamp, NULL,
+	 PyDoc_STR("The timestamps, in nsec of wall time (uint64)"), NULL},
+	{"codepoint", (getter)tracecolumns_get_codepoint, NULL,
+	 PyDoc_STR("The codepoint indexes (uint32)"), NULL},
+	{"payload_offset", (getter)tracecolumns_get_payload_offset, NULL,
+	 PyDoc_STR("len + 1 offsets into payload_heap (uint64); the payload of record i "
+	           "is payload_heap[payload_offset[i]:payload_offset[i + 1]]"), NULL},
+	{"payload_heap", (getter)tracecolumns_get_payload_heap, NULL,
+	 PyDoc_STR("The payloads as they are in the trace (uint8)"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(tracecolumns_doc, "\
+A batch of records, as returned by TraceFile.read_columns(): a Column per\n\
+field, and the payloads, undecoded, back to back in a heap.\n\
+");
+
+PyTypeObject TraceColumns_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,                                      /* ob_size */
+	"_passover.TraceColumns" ,              /* tp_name */
+	sizeof(TraceColumnsObject),             /* tp_basicsize */
+	0,                                      /* tp_itemsize */
+	(destructor)tracecolumns_dealloc,       /* tp_dealloc */
+	0,                                      /* tp_print */
+	0,                                      /* tp_getattr */
+	0,                                      /* tp_setattr */
+	0,                                      /* tp_compare */
+	0,                                      /* tp_repr */
+	0,                                      /* tp_as_number */
+	&tracecolumns_as_sequence,              /* tp_as_sequence */
+	0,                                      /* tp_as_mapping */
+	0,                                      /* tp_hash */
+	0,                                      /* tp_call */
+	0,                                      /* tp_str */
+	0,                                      /* tp_getattro */
+	0,                                      /* tp_setattro */
+	0,                                      /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+	tracecolumns_doc,                       /* tp_doc */
+	0,                                      /* tp_traverse */
+	0,                                      /* tp_clear */
+	0,                                      /* tp_richcompare */
+	0,                                      /* tp_weaklistoffset */
+	0,                                      /* tp_iter */
+	0,                                      /* tp_iternext */
+	tracecolumns_methods,                   /* tp_methods */
+	0,                                      /* tp_members */
+	tracecolumns_getset,                    /* tp_getset */
+};
+
+/***************************************************************************
+**                           codepoints and time index
+***************************************************************************/
+
+/*
+ * the counterpart of the codepoint savers in tracer.c
+ */
+static PyObject * _decoder_load_codepoint(sreader_t * stream)
+{
+	uint8_t type;
+	uint32_t lineno;
+	PyObject * first, * second;
+
+	if (IS_ERROR(sreader_load_uint8(stream, &type))) {
+		Py_RETURN_NONE;
+	}
+	if (type == TRACER_CODEPOINT_LOGLINE) {
+		first = _decoder_load_pstr(stream);
+		return (first == NULL) ? NULL : Py_BuildValue("(iN)", type, first);
+	}
+	if (type != TRACER_CODEPOINT_PYFUNC && type != TRACER_CODEPOINT_CFUNC) {
+		Py_RETURN_NONE;
+	}
+	first = _decoder_load_pstr(stream);
+	if (first == NULL) {
+		return NULL;
+	}
+	second = _decoder_load_pstr(stream);
+	if (second == NULL) {
+		Py_DECREF(first);
+		return NULL;
+	}
+	if (type == TRACER_CODEPOINT_CFUNC) {
+		return Py_BuildValue("(iNN)", type, first, second);
+	}
+	if (IS_ERROR(sreader_load_uint32(stream, &lineno))) {
+		Py_DECREF(first);
+		Py_DECREF(second);
+		return _decoder_raise(ERR_DECODER_CORRUPT_RECORD);
+	}
+	return Py_BuildValue("(iNNI)", type, first, second, lineno);
+}
+
+PyObject * decoder_load_codepoints(PyObject * self, PyObject * args)
+{
+	char * filename;
+	void * addr;
+	size_t size, pos = 0;
+	listfile_recsize_t length;
+	sreader_t stream;
+	PyObject * list, * cp;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTuple(args, "s:load_codepoints", &filename)) {
+		return NULL;
+	}
+	retcode = decoder_map_file(filename, &addr, &size);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	list = PyList_New(0);
+	if (list == NULL) {
+		goto cleanup;
+	}
+	// the file may still be written, so it ends at the first zero length
+	while (pos + sizeof(length) <= size) {
+		memcpy(&length, (char *)addr + pos, sizeof(length));
+		if (length == 0 || pos + sizeof(length) + length > size) {
+			break;
+		}
+		sreader_init(&stream, (char *)addr + pos + sizeof(length), length);
+		cp = _decoder_load_codepoint(&stream);
+		if (cp == NULL) {
+			Py_CLEAR(list);
+			break;
+		}
+		if (cp == Py_None) {
+			Py_DECREF(cp);
+			break;
+		}
+		if (PyList_Append(list, cp) != 0) {
+			Py_DECREF(cp);
+			Py_CLEAR(list);
+			break;
+		}
+		Py_DECREF(cp);
+		pos += sizeof(length) + length;
+	}
+
+cleanup:
+	decoder_unmap_file(addr, size);
+	return list;
+}
+
+/*
+ * the top index holds (base_offset, min_timestamp, max_timestamp) of every
+ * file (see rotrec.h). the original format was a listfile of (timestamp,
+ * offset) pairs
+ */
+PyObject * decoder_load_timeindex(PyObject * self, PyObject * args)
+{
+	char * filename;
+	void * addr;
+	size_t size, pos, count, i;
+	rotrec_topindex_header_t header;
+	rotrec_topindex_entry_t entry;
+	rotrec_index_entry_t oldentry;
+	listfile_recsize_t length;
+	PyObject * list, * item;
+	int version = 1;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTuple(args, "s:load_timeindex", &filename)) {
+		return NULL;
+	}
+	retcode = decoder_map_file(filename, &addr, &size);
+	if (IS_ERROR(retcode)) {
+		return _decoder_raise(retcode);
+	}
+	list = PyList_New(0);
+	if (list == NULL) {
+		goto cleanup;
+	}
+	if (size >= sizeof(header)) {
+		memcpy(&header, addr, sizeof(header));
+	}
+	if (size >= sizeof(header) && header.magic == ROTREC_TOPINDEX_MAGIC) {
+		version = header.version;
+		count = (header.count < header.capacity) ? header.count : header.capacity;
+		for (i = 0; i < count; i++) {
+			pos = sizeof(header) + i * sizeof(entry);
+			if (pos + sizeof(entry) > size) {
+				break;
+			}
+			memcpy(&entry, (char *)addr + pos, sizeof(entry));
+			item = Py_BuildValue("(KKK)", (unsigned PY_LONG_LONG)entry.base_offset,
+					(unsigned PY_LONG_LONG)entry.min_timestamp,
+					(unsigned PY_LONG_LONG)entry.max_timestamp);
+			if (item == NULL || PyList_Append(list, item) != 0) {
+				Py_XDECREF(item);
+				Py_CLEAR(list);
+				goto cleanup;
+			}
+			Py_DECREF(item);
+		}
+	}
+	else {
+		for (pos = 0; pos + sizeof(length) + sizeof(oldentry) <= size;
+				pos += sizeof(length) + length) {
+			memcpy(&length, (char *)addr + pos, sizeof(length));
+			if (length != sizeof(oldentry)) {
+				break;
+			}
+			memcpy(&oldentry, (char *)addr + pos + sizeof(length), sizeof(oldentry));
+			item = Py_BuildValue("(KK)", (unsigned PY_LONG_LONG)oldentry.timestamp,
+					(unsigned PY_LONG_LONG)oldentry.offset);
+			if (item == NULL || PyList_Append(list, item) != 0) {
+				Py_XDECREF(item);
+				Py_CLEAR(list);
+				goto cleanup;
+			}
+			Py_DECREF(item);
+		}
+	}
+
+cleanup:
+	decoder_unmap_file(addr, size);
+	if (list == NULL) {
+		return NULL;
+	}
+	return Py_BuildValue("(iN)", version, list);
+}
@@ -0,0 +1,45 @@
+#ifndef DECODER_OBJECT_H_INCLUDED
+#define DECODER_OBJECT_H_INCLUDED
+
+#include "python.h"
+#include "decoder.h"
+
+typedef struct
+{
+	PyObject_HEAD
+	int        opened;
+	decoder_t  decoder;
+	// what undumpable arguments decode to
+	PyObject * undumpable;
+} TraceFileObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	// for decoding the payloads
+	TraceFileObject * tracefile;
+	decoder_columns_t columns;
+	int        payloads;
+} TraceColumnsObject;
+
+// a read-only view of a single column, which exports it as a buffer
+typedef struct
+{
+	PyObject_HEAD
+	PyObject * owner;
+	void *     data;
+	Py_ssize_t length;
+	Py_ssize_t itemsize;
+	char *     format;
+} ColumnObject;
+
+
+extern PyTypeObject TraceFile_Type;
+extern PyTypeObject TraceColumns_Type;
+extern PyTypeObject Column_Type;
+
+PyObject * decoder_load_codepoints(PyObject * self, PyObject * args);
+PyObject * decoder_load_timeindex(PyObject * self, PyObject * args);
+
+
+#endif // DECODER_OBJECT_H_INCLUDED
@@ -0,0 +1,122 @@
+/*
+ * the flusher is a single native thread (per process) that drains the rings
+ * of all async tracers into their rotrecs. it never touches the GIL, so it
+ * keeps going while the traced threads run python code, and it's the one
+ * that takes the hit of opening, truncating and mapping files.
+ * the thread is started when the first tracer is added and stopped when
+ * the last one is removed. a forked child doesn't have the thread, nor
+ * does it own the tracers it inherited, so it starts from scratch.
+ */
+#include "flusher.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+
+static pthread_mutex_t _flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _flusher_once = PTHREAD_ONCE_INIT;
+static pthread_t _flusher_thread;
+static int _flusher_running = 0;
+// a thread exits once the epoch moves past the one it was started in, so a
+// thread that's being stopped never picks up work meant for its successor
+static long _flusher_epoch = 0;
+static tracer_t * _flusher_tracers = NULL;
+
+
+static void _flusher_atfork_child(void)
+{
+	pthread_mutex_init(&_flusher_mutex, NULL);
+	_flusher_running = 0;
+	_flusher_epoch += 1;
+	_flusher_tracers = NULL;
+}
+
+static void _flusher_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, _flusher_atfork_child);
+}
+
+static void * _flusher_main(void * arg)
+{
+	long epoch = (long)arg;
+	tracer_t * tracer;
+	int count, total;
+
+	while (1) {
+		total = 0;
+		pthread_mutex_lock(&_flusher_mutex);
+		if (epoch != _flusher_epoch) {
+			pthread_mutex_unlock(&_flusher_mutex);
+			break;
+		}
+		for (tracer = _flusher_tracers; tracer != NULL; tracer = tracer->next_flushed) {
+			if (IS_ERROR(tracer->flush_error)) {
+				continue; // reported to the tracing thread on its next record
+			}
+			count = 0;
+			tracer->flush_error = tracer_flush(tracer, &count);
+			total += count;
+		}
+		pthread_mutex_unlock(&_flusher_mutex);
+
+		if (total == 0) {
+			usleep(FLUSHER_IDLE_INTERVAL_USEC);
+		}
+	}
+
+	return NULL;
+}
+
+errcode_t flusher_add(tracer_t * tracer)
+{
+	errcode_t retcode = ERR_SUCCESS;
+
+	pthread_once(&_flusher_once, _flusher_register_atfork);
+	pthread_mutex_lock(&_flusher_mutex);
+	if (!_flusher_running) {
+		_flusher_running = 1;
+		if (pthread_create(&_flusher_thread, NULL, _flusher_main,
+				(void*)_flusher_epoch) != 0) {
+			_flusher_running = 0;
+			retcode = ERR_FLUSHER_THREAD_CREATE_FAILED;
+			goto cleanup;
+		}
+	}
+	tracer->next_flushed = _flusher_tracers;
+	_flusher_tracers = tracer;
+
+cleanup:
+	pthread_mutex_unlock(&_flusher_mutex);
+	return retcode;
+}
+
+/*
+ * once this returns, the flusher will not touch the tracer anymore
+ */
+errcode_t flusher_remove(tracer_t * tracer)
+{
+	tracer_t ** link;
+	pthread_t thread;
+	int stop = 0;
+
+	pthread_mutex_lock(&_flusher_mutex);
+	for (link = &_flusher_tracers; *link != NULL; link = &(*link)->next_flushed) {
+		if (*link == tracer) {
+			*link = tracer->next_flushed;
+			tracer->next_flushed = NULL;
+			break;
+		}
+	}
+	if (_flusher_tracers == NULL && _flusher_running) {
+		_flusher_running = 0;
+		_flusher_epoch += 1;
+		thread = _flusher_thread; // flusher_add may start a new one meanwhile
+		stop = 1;
+	}
+	pthread_mutex_unlock(&_flusher_mutex);
+
+	if (stop) {
+		pthread_join(thread, NULL);
+	}
+	RETURN_SUCCESSFUL;
+}
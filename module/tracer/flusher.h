@@ -0,0 +1,12 @@
+#ifndef FLUSHER_H_INCLUDED
+#define FLUSHER_H_INCLUDED
+
+#include "tracer.h"
+
+#define FLUSHER_IDLE_INTERVAL_USEC  (1000)
+
+errcode_t flusher_add(tracer_t * tracer);
+errcode_t flusher_remove(tracer_t * tracer);
+
+
+#endif // FLUSHER_H_INCLUDED
@@ -10,15 +10,54 @@
 
 static PyObject * passover_new(PyTypeObject *type, PyObject * args, PyObject * kw)
 {
-	static char * kwlist[] = {"rotdir", "filename_prefix", "map_size", "file_size", NULL};
+	static char * kwlist[] = {"rotdir", "filename_prefix", "map_size", "file_size",
+			"ring_size", "drop_when_full", "prealloc_percent", "map_flags", "raw_timestamps",
+			"sample_every", "sample_slice", "sample_period", "sample_depth", "max_call_rate",
+			"flight_size", "capture_threshold", "capture_size", "capture_depth", NULL};
 	PyObject * rotdirobj = NULL;
 	char * filename_prefix = NULL;
 	size_t map_size;
 	size_t file_size;
+	size_t ring_size = 0;
+	int drop_when_full = 0;
+	int prealloc_percent = 0;
+	int map_flags = 0;
+	int raw_timestamps = 0;
+	int sample_every = 0;
+	long sample_slice = 0;
+	long sample_period = 0;
+	int sample_depth = 1;
+	int max_call_rate = 0;
+	size_t flight_size = 0;
+	long capture_threshold = 0;
+	size_t capture_size = TRACER_DEFAULT_CAPTURE_SIZE;
+	int capture_depth = 1;
 	PassoverObject * self = NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw, "O!sll:Passover", kwlist,
-	        &Rotdir_Type, &rotdirobj, &filename_prefix, &map_size, &file_size)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "O!sll|liiiiilliillli:Passover", kwlist,
+	        &Rotdir_Type, &rotdirobj, &filename_prefix, &map_size, &file_size,
+	        &ring_size, &drop_when_full, &prealloc_percent, &map_flags, &raw_timestamps,
+	        &sample_every, &sample_slice, &sample_period, &sample_depth, &max_call_rate,
+	        &flight_size, &capture_threshold, &capture_size, &capture_depth)) {
+		return NULL;
+	}
+	if ((ring_size > 0) + (flight_size > 0) + (capture_threshold > 0) > 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"ring_size, flight_size and capture_threshold are mutually exclusive");
+		return NULL;
+	}
+	if (capture_threshold < 0 || capture_depth < 0) {
+		PyErr_SetString(PyExc_ValueError, "invalid capture parameters");
+		return NULL;
+	}
+	if (max_call_rate < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_call_rate must not be negative");
+		return NULL;
+	}
+	if (sample_every < 0 || sample_depth < 1 || sample_period < 0 || sample_slice < 0 ||
+			(sample_period == 0 && sample_slice > 0) ||
+			(sample_period > 0 && (sample_slice == 0 || sample_slice > sample_period))) {
+		PyErr_SetString(PyExc_ValueError, "invalid sampling parameters");
 		return NULL;
 	}
 
@@ -31,10 +70,26 @@ static PyObject * passover_new(PyTypeObject *type, PyObject * args, PyObject * k
 	self->pid = getpid();
 	self->depth = 0;
 	self->ignore_depth = 0;
+	self->sample_depth = (sample_every > 1 || sample_period > 0) ? sample_depth : 0;
+	self->sample_every = sample_every;
+	self->sample_countdown = 1;
+	self->sample_slice = sample_slice;
+	self->sample_period = sample_period;
+	self->sample_start = 0;
+	self->sampled_out = 0;
+	self->unsampled_calls = 0;
+	self->capture_depth = capture_depth;
+	self->capture_root = 0;
 	self->used = 0;
+	Py_INCREF(rotdirobj);
+	self->rotdir = rotdirobj;
 
 	errcode_t retcode = tracer_init(&self->info, &((RotdirObject*)rotdirobj)->rotdir,
-		filename_prefix, map_size, file_size);
+		&((RotdirObject*)rotdirobj)->codepoints,
+		((RotdirObject*)rotdirobj)->has_stats ? &((RotdirObject*)rotdirobj)->stats : NULL,
+		&_passover_ignore_rules, filename_prefix,
+		map_size, file_size, ring_size, drop_when_full, flight_size, capture_threshold,
+		capture_size, prealloc_percent, map_flags, raw_timestamps, max_call_rate);
 
 	if (IS_ERROR(retcode)) {
 		Py_DECREF(self);
@@ -46,24 +101,86 @@ static PyObject * passover_new(PyTypeObject *type, PyObject * args, PyObject * k
 }
 
 PyDoc_STRVAR(passover_doc, "\
-Passover(rotdir, filename_prefix, map_size, file_size)\n\
+Passover(rotdir, filename_prefix, map_size, file_size, ring_size = 0,\n\
+         drop_when_full = False, prealloc_percent = 0, map_flags = 0,\n\
+         raw_timestamps = False, sample_every = 0, sample_slice = 0,\n\
+         sample_period = 0, sample_depth = 1, max_call_rate = 0,\n\
+         flight_size = 0, capture_threshold = 0, capture_size = 4MB,\n\
+         capture_depth = 1)\n\
 \n\
 Creates a Passover tracer object. Use start() and stop().\n\
 \n\
+map_size (the size of the windows over the record files) must be at least\n\
+16KB + 2, and file_size at least 32KB, so that the largest record fits.\n\
+\n\
+If ring_size (a power of two) is given, records are queued in a ring of that\n\
+size (at least 64KB) and written to disk by a background thread. When the ring\n\
+is full, the traced thread waits for room, or if drop_when_full is set, drops\n\
+the record.\n\
+\n\
+If prealloc_percent is given, once a file is filled this much, the next one is\n\
+created, allocated and mapped in the background, so switching files doesn't\n\
+stall the traced thread.\n\
+\n\
+map_flags is a combination of the MAP_* constants, for how the record files\n\
+are mapped and what's done with the parts that were written.\n\
+\n\
+If raw_timestamps is set, records hold raw clock ticks (see clock_info()),\n\
+which are cheaper to take, and the trace carries clock syncs that the reader\n\
+uses to convert them to wall time.\n\
+\n\
+Sampling records whole subtrees of calls made at sample_depth (1 being the\n\
+calls made directly by the code that started the tracer): with sample_every,\n\
+one in every sample_every calls is recorded; with sample_period (usec), only\n\
+calls made during the first sample_slice usec of every period are. Skipped\n\
+subtrees cost next to nothing, and the trace records how many calls were\n\
+skipped before each sampled one.\n\
+\n\
+If max_call_rate is given, functions this thread calls more than this many\n\
+times a second are no longer recorded; instead, the trace gets a summary of\n\
+their calls (how many, and their total duration) every second.\n\
+\n\
+If flight_size is given, the tracer is a flight recorder: only the most recent\n\
+records (about flight_size bytes of them) are kept, in memory, and nothing is\n\
+written to disk until dump() is called. Can't be combined with ring_size.\n\
+\n\
+If capture_threshold (usec) is given, only slow subtrees are written: every\n\
+call made at capture_depth, and every call of a function flagged with\n\
+CO_PASSOVER_DETAILED (not already in a subtree), starts a subtree whose records\n\
+are held in a ring of capture_size bytes (a power of two), and written only if\n\
+it took at least capture_threshold. capture_depth 0 means only flagged\n\
+functions start subtrees. Records outside of subtrees are not written, and a\n\
+subtree that doesn't fit in the ring is written whatever its duration. Can't\n\
+be combined with ring_size or flight_size.\n\
 ");
 
-static inline int _passover_clear(PassoverObject * self)
+/*
+ * the tracer is finalized even if writing the skipped calls fails, and the
+ * first error is the one returned
+ */
+static inline errcode_t _passover_clear(PassoverObject * self)
 {
+	errcode_t retcode = ERR_SUCCESS;
+	errcode_t retcode2;
+
 	if (self->active) {
 		self->active = 0;
 		PyEval_SetProfile(NULL, NULL);
+		if (self->unsampled_calls > 0) {
+			// the calls skipped since the last sampled one
+			retcode = tracer_sample(&self->info, self->unsampled_calls);
+			self->unsampled_calls = 0;
+		}
 	}
-	return tracer_fini(&self->info);
+	retcode2 = tracer_fini(&self->info);
+	return IS_ERROR(retcode) ? retcode : retcode2;
 }
 
 static void passover_dealloc(PassoverObject * self)
 {
 	(void)(_passover_clear(self));
+	Py_XDECREF(self->rotdir);
+	self->rotdir = NULL;
 	self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -74,6 +191,7 @@ static PyObject * passover_start(PassoverObject * self, PyObject * noarg)
 		return NULL;
 	}
 	self->used = 1;
+	self->sample_start = hptime_get_time();
 	PyEval_SetProfile((Py_tracefunc)tracefunc, (PyObject*)self);
 	self->active = 1;
 	Py_RETURN_NONE;
@@ -101,15 +219,59 @@ PyDoc_STRVAR(passover_stop_doc, "\
 stop()\n\
     stops and finalizes the tracer; you cannot restart a stopped tracer object\n");
 
+PyObject * passover_dump(PassoverObject * self, PyObject * args, PyObject * kw)
+{
+	static char * kwlist[] = {"max_size", "max_age", NULL};
+	size_t max_size = 0;
+	long max_age = 0;
+	int count = 0;
+	errcode_t retcode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|ll:dump", kwlist, &max_size, &max_age)) {
+		return NULL;
+	}
+	if (max_age < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_age must not be negative");
+		return NULL;
+	}
+	retcode = tracer_dump(&self->info, max_size, max_age, &count);
+	if (IS_ERROR(retcode)) {
+		PyErr_SetString(ErrorObject, errcode_get_name(retcode));
+		return NULL;
+	}
+	return PyInt_FromLong(count);
+}
+
+PyDoc_STRVAR(passover_dump_doc, "\
+dump(max_size = 0, max_age = 0)\n\
+    writes the most recent records of a flight recorder to disk: at least\n\
+    max_size bytes of them, and only those of the last max_age usec (0 means\n\
+    no limit). records are kept in chunks of 256KB, and whole chunks are\n\
+    dumped. records that were already dumped are not dumped again. returns\n\
+    the number of records written\n");
+
 static PyMethodDef passover_methods[] = {
 	{"start",	(PyCFunction)passover_start,
 			METH_NOARGS | CO_PASSOVER_IGNORED_SINGLE, passover_start_doc},
 	{"stop",	(PyCFunction)passover_stop,
 			METH_NOARGS | CO_PASSOVER_IGNORED_SINGLE, passover_stop_doc},
+	{"dump",	(PyCFunction)passover_dump,
+			METH_VARARGS | METH_KEYWORDS, passover_dump_doc},
 	{NULL, NULL}
 };
 
 
+static PyMemberDef passover_members[] = {
+	{"dropped_records", T_ULONGLONG, offsetof(PassoverObject, info) + offsetof(tracer_t, dropped_records),
+	 READONLY, PyDoc_STR("The number of records dropped because the ring was full")},
+	{"captured_subtrees", T_ULONGLONG, offsetof(PassoverObject, info) + offsetof(tracer_t, captured_subtrees),
+	 READONLY, PyDoc_STR("The number of subtrees written in tail capture mode")},
+	{"discarded_subtrees", T_ULONGLONG, offsetof(PassoverObject, info) + offsetof(tracer_t, discarded_subtrees),
+	 READONLY, PyDoc_STR("The number of subtrees thrown away in tail capture mode")},
+	{0}
+};
+
+
 /***************************************************************************
 **                           the Passover type
 ***************************************************************************/
@@ -144,7 +306,7 @@ PyTypeObject Passover_Type = {
 	0,                                      /* tp_iter */
 	0,                                      /* tp_iternext */
 	passover_methods,                       /* tp_methods */
-	0,                                      /* tp_members */
+	passover_members,                       /* tp_members */
 	0,                                      /* tp_getset */
 	0,                                      /* tp_base */
 	0,                                      /* tp_dict */
@@ -10,6 +10,10 @@
 #define CO_PASSOVER_IGNORED_WHOLE    (CO_PASSOVER_IGNORED_SINGLE | CO_PASSOVER_IGNORED_CHILDREN)
 #define CO_PASSOVER_DETAILED         (0x08000000)
 
+// the ignore rules (of all tracers), whose flags add to those of the code
+// objects and builtin functions they match
+extern rules_t _passover_ignore_rules;
+
 
 typedef struct
 {
@@ -17,12 +21,33 @@ typedef struct
 	pid_t      pid;
 	int        depth;
 	int        ignore_depth;
+	// sampling: calls at sample_depth are either recorded with their whole
+	// subtree, or skipped with it (0 if every call is recorded)
+	int        sample_depth;
+	int        sample_every;
+	int        sample_countdown;
+	usec_t     sample_slice;
+	usec_t     sample_period;
+	usec_t     sample_start;
+	int        sampled_out;
+	uint64_t   unsampled_calls;
+	// tail capture: calls at capture_depth (and calls of CO_PASSOVER_DETAILED
+	// functions) start a subtree, unless one was started at capture_root
+	int        capture_depth;
+	int        capture_root;
 	int        active;
 	int        used;
+	// the rotdir must outlive the tracer (which uses its codepoints)
+	PyObject * rotdir;
 	tracer_t   info;
 } PassoverObject;
 
 extern PyTypeObject Passover_Type;
 
+// dump() takes keywords, and python only dispatches those to methods with
+// no other ml_flags, so unlike start() and stop(), it can't carry
+// CO_PASSOVER_IGNORED_SINGLE in its method table; tracefunc adds it instead
+PyObject * passover_dump(PassoverObject * self, PyObject * args, PyObject * kw);
+
 
 #endif // PASSOVEROBJECT_H_INCLUDED
@@ -5,6 +5,7 @@
 #include <frameobject.h>
 #include <code.h>
 #include <structmember.h>
+#include <longintrepr.h>
 
 
 extern PyObject * ErrorObject;
@@ -1,18 +1,33 @@
 #include "rotdir_object.h"
+#include "tracer.h"
 
 
 /***************************************************************************
 **                           Rotdir methods
 ***************************************************************************/
+// the codepoint registry holds the objects it's keyed by (see tracer.c)
+static void _pyrotdir_hold_codepoint(const void * key)
+{
+	Py_INCREF((PyObject *)key);
+}
+
+static void _pyrotdir_release_codepoint(const void * key)
+{
+	Py_DECREF((PyObject *)key);
+}
+
 static PyObject * pyrotdir_new(PyTypeObject *type, PyObject * args, PyObject * kw)
 {
-	static char * kwlist[] = {"path", "max_files", NULL};
+	static char * kwlist[] = {"path", "max_files", "compress", "stats", NULL};
 	char * path = NULL;
 	int max_files = 0;
+	int compress = 0;
+	int stats = 0;
+	char filename[PATH_MAX];
 	RotdirObject * self = NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw, "si:Rotdir", kwlist,
-	        &path, &max_files)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "si|ii:Rotdir", kwlist,
+	        &path, &max_files, &compress, &stats)) {
 		return NULL;
 	}
 
@@ -22,13 +37,37 @@ static PyObject * pyrotdir_new(PyTypeObject *type, PyObject * args, PyObject * k
 	}
 
 	self->inited = 0;
-	errcode_t retcode = rotdir_init(&self->rotdir, path, max_files);
+	self->has_stats = 0;
+	errcode_t retcode = rotdir_init(&self->rotdir, path, max_files, compress);
 
 	if (IS_ERROR(retcode)) {
 		Py_DECREF(self);
 		PyErr_SetString(ErrorObject, errcode_get_name(retcode));
 		return NULL;
 	}
+	snprintf(filename, sizeof(filename), "%s/%s", self->rotdir.path,
+			ROTDIR_CODEPOINTS_FILENAME);
+	retcode = registry_init(&self->codepoints, filename, TRACER_INITIAL_CODEPOINTS,
+			_pyrotdir_hold_codepoint, _pyrotdir_release_codepoint);
+	if (IS_ERROR(retcode)) {
+		rotdir_fini(&self->rotdir);
+		Py_DECREF(self);
+		PyErr_SetString(ErrorObject, errcode_get_name(retcode));
+		return NULL;
+	}
+	if (stats) {
+		snprintf(filename, sizeof(filename), "%s/%s", self->rotdir.path,
+				ROTDIR_STATS_FILENAME);
+		retcode = cpstats_open(&self->stats, filename);
+		if (IS_ERROR(retcode)) {
+			registry_fini(&self->codepoints);
+			rotdir_fini(&self->rotdir);
+			Py_DECREF(self);
+			PyErr_SetString(ErrorObject, errcode_get_name(retcode));
+			return NULL;
+		}
+		self->has_stats = 1;
+	}
 
 	self->inited = 1;
 	return (PyObject *)self;
@@ -38,6 +77,11 @@ static void pyrotdir_dealloc(RotdirObject * self)
 {
 	if (self->inited) {
 		self->inited = 0;
+		if (self->has_stats) {
+			self->has_stats = 0;
+			cpstats_close(&self->stats);
+		}
+		registry_fini(&self->codepoints);
 		rotdir_fini(&self->rotdir);
 	}
 
@@ -53,10 +97,21 @@ static PyMemberDef pyrotdir_members[] = {
 	 PyDoc_STR("The rotdir path")},
 	{"max_files", T_INT, offsetof(RotdirObject, rotdir) + offsetof(rotdir_t, max_files), READONLY,
 	 PyDoc_STR("The rotdir max_files")},
+	{"compress", T_INT, offsetof(RotdirObject, rotdir) + offsetof(rotdir_t, compress), READONLY,
+	 PyDoc_STR("Whether deallocated files are compressed in the background")},
+	{"stats", T_INT, offsetof(RotdirObject, has_stats), READONLY,
+	 PyDoc_STR("Whether the call stats of the codepoints are kept")},
 	{0}
 };
 
-PyDoc_STRVAR(pyrotdir_doc, "Rotdir(path, max_files)");
+PyDoc_STRVAR(pyrotdir_doc, "\
+Rotdir(path, max_files, compress = False, stats = False)\n\
+\n\
+If stats is set, the call count, inclusive and exclusive times and a\n\
+histogram of the durations of every codepoint are kept in the 'stats' file,\n\
+which other processes can map to watch them as the program runs. They're\n\
+off by default, as keeping them adds to the cost of every call and return.\n\
+");
 
 PyTypeObject Rotdir_Type = {
 	PyObject_HEAD_INIT(NULL)
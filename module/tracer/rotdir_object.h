@@ -2,13 +2,23 @@
 #define PYROTDIR_H_INCLUDED
 
 #include "python.h"
+#include "../lib/cpstats.h"
+#include "../lib/registry.h"
 #include "../lib/rotdir.h"
 
+#define ROTDIR_CODEPOINTS_FILENAME  "codepoints"
+#define ROTDIR_STATS_FILENAME       "stats"
+
 typedef struct
 {
 	PyObject_HEAD
-	int      inited;
-	rotdir_t rotdir;
+	int        inited;
+	rotdir_t   rotdir;
+	// the codepoints of all the tracers that write into this rotdir
+	registry_t codepoints;
+	// their call stats, if kept
+	int        has_stats;
+	cpstats_t  stats;
 } RotdirObject;
 
 
@@ -13,13 +13,57 @@
 	}
 
 
+/*
+ * whether a call at sample_depth is sampled (recorded, with its subtree):
+ * one in every sample_every calls, and only in the first sample_slice usec
+ * of every sample_period
+ */
+static inline int _tracefunc_is_sampled(PassoverObject * self)
+{
+	int sampled = 1;
+
+	if (self->sample_every > 1) {
+		self->sample_countdown -= 1;
+		if (self->sample_countdown > 0) {
+			sampled = 0;
+		}
+		else {
+			self->sample_countdown = self->sample_every;
+		}
+	}
+	if (self->sample_period > 0 &&
+			(hptime_get_time() - self->sample_start) % self->sample_period >= self->sample_slice) {
+		sampled = 0;
+	}
+	return sampled;
+}
+
+/*
+ * ignore_depth counts the frames of an ignored subtree. the frame that
+ * started it is either ignored itself (IGNORED_WHOLE or not sampled), or
+ * only its children are (IGNORED_CHILDREN), so its return is decided by
+ * its own flags
+ */
 static inline int _tracefunc_is_call_ignored(PassoverObject * self, int flags)
 {
+	int sampled;
+
 	if (self->ignore_depth > 0) {
 		// this function is already ignored
 		self->ignore_depth += 1;
 		return 1;
 	}
+	if (self->depth == self->sample_depth) {
+		sampled = _tracefunc_is_sampled(self);
+		tracer_count_sampled(&self->info, self->sample_depth, sampled);
+		if (!sampled) {
+			// this function and its children are skipped
+			self->unsampled_calls += 1;
+			self->sampled_out = 1;
+			self->ignore_depth = 1;
+			return 1;
+		}
+	}
 	if (flags & CO_PASSOVER_IGNORED_CHILDREN) {
 		// this function's children will be ignored
 		self->ignore_depth = 1;
@@ -33,11 +77,19 @@ static inline int _tracefunc_is_call_ignored(PassoverObject * self, int flags)
 
 static inline int _tracefunc_is_ret_ignored(PassoverObject * self, int flags)
 {
-	if (self->ignore_depth > 0) {
-		// this is the return of a recursive ignored function
+	if (self->ignore_depth > 1) {
+		// this is the return of a function in an ignored subtree
 		self->ignore_depth -= 1;
 		return 1;
 	}
+	if (self->ignore_depth == 1) {
+		// this is the return of the function that started the subtree
+		self->ignore_depth = 0;
+		if (self->sampled_out) {
+			self->sampled_out = 0;
+			return 1;
+		}
+	}
 	if (flags & CO_PASSOVER_IGNORED_SINGLE) {
 		// this is the return of an IGNORED_SINGLE, we ignore it anyway
 		return 1;
@@ -45,6 +97,76 @@ static inline int _tracefunc_is_ret_ignored(PassoverObject * self, int flags)
 	return 0;
 }
 
+/*
+ * the flags of a function are its own, and those the ignore rules give it.
+ * the rules aren't consulted inside an ignored subtree, except for the
+ * return of the function that started it
+ */
+static inline errcode_t _tracefunc_get_code_flags(PassoverObject * self,
+		PyFrameObject * frame, OUT int * outflags)
+{
+	int flags;
+
+	*outflags = frame->f_code->co_flags;
+	if (self->ignore_depth <= 1 && _passover_ignore_rules.count > 0) {
+		PROPAGATE(tracer_get_codeobj_flags(&self->info, frame->f_code, frame->f_globals, &flags));
+		*outflags |= flags;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracefunc_get_cfunc_flags(PassoverObject * self,
+		PyCFunctionObject * func, OUT int * outflags)
+{
+	int flags;
+
+	*outflags = func->m_ml->ml_flags;
+	if (func->m_ml->ml_meth == (PyCFunction)passover_dump) {
+		*outflags |= CO_PASSOVER_IGNORED_SINGLE;
+	}
+	if (self->ignore_depth <= 1 && _passover_ignore_rules.count > 0) {
+		PROPAGATE(tracer_get_cfunc_flags(&self->info, func, &flags));
+		*outflags |= flags;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * called before recording a call: if calls were skipped since the last
+ * sampled one, the trace has to say so
+ */
+static inline errcode_t _tracefunc_record_unsampled(PassoverObject * self)
+{
+	if (self->unsampled_calls > 0) {
+		PROPAGATE(tracer_sample(&self->info, self->unsampled_calls));
+		self->unsampled_calls = 0;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * in tail capture mode, a recorded call may start a subtree, which ends
+ * with its return (when self->depth is back to where it was before the call)
+ */
+static inline errcode_t _tracefunc_capture_call(PassoverObject * self, int flags)
+{
+	if (self->info.capture && self->capture_root == 0 &&
+			(self->depth == self->capture_depth || (flags & CO_PASSOVER_DETAILED))) {
+		self->capture_root = self->depth;
+		PROPAGATE(tracer_capture_begin(&self->info));
+	}
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracefunc_capture_return(PassoverObject * self)
+{
+	if (self->capture_root > 0 && self->depth < self->capture_root) {
+		self->capture_root = 0;
+		PROPAGATE(tracer_capture_end(&self->info));
+	}
+	RETURN_SUCCESSFUL;
+}
+
 static inline errcode_t _tracefunc_pycall_function(PassoverObject * self, PyFrameObject * frame)
 {
 	PyCodeObject * code = frame->f_code;
@@ -63,13 +185,19 @@ static inline errcode_t _tracefunc_pycall_function(PassoverObject * self, PyFram
 static inline int _tracefunc_pycall(PassoverObject * self, PyFrameObject * frame)
 {
 	PyCodeObject * code = frame->f_code;
+	int flags;
 
 	//printf("PYCALL\n");
 
 	// ??? should logs be emitted even if a function is ignored?
-	if (_tracefunc_is_call_ignored(self, code->co_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_code_flags(self, frame, &flags));
+	if (_tracefunc_is_call_ignored(self, flags)) {
 		return 0;
 	}
+	if (code != _passover_logfunc_code) {
+		ERRCODE_TO_PYEXC(_tracefunc_capture_call(self, flags));
+	}
+	ERRCODE_TO_PYEXC(_tracefunc_record_unsampled(self));
 
 	if (code == _passover_logfunc_code) {
 		/* this is not a normal trace call - it's the logger function
@@ -86,10 +214,14 @@ static inline int _tracefunc_pycall(PassoverObject * self, PyFrameObject * frame
 	return 0;
 }
 
-static inline int _tracefunc_pyret(PassoverObject * self, PyCodeObject * code, PyObject * retval)
+static inline int _tracefunc_pyret(PassoverObject * self, PyFrameObject * frame, PyObject * retval)
 {
+	PyCodeObject * code = frame->f_code;
+	int flags;
+
 	//printf("PYRET\n");
-	if (_tracefunc_is_ret_ignored(self, code->co_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_code_flags(self, frame, &flags));
+	if (_tracefunc_is_ret_ignored(self, flags)) {
 		return 0;
 	}
 
@@ -100,28 +232,39 @@ static inline int _tracefunc_pyret(PassoverObject * self, PyCodeObject * code, P
 
 	//if (code->co_flags & CO_PASSOVER_DETAILED) {
 	ERRCODE_TO_PYEXC(tracer_pyfunc_return(&self->info, code, retval));
+	ERRCODE_TO_PYEXC(_tracefunc_capture_return(self));
 	return 0;
 }
 
-static inline int _tracefunc_pyexc(PassoverObject * self, PyCodeObject * code, PyObject * excval)
+static inline int _tracefunc_pyexc(PassoverObject * self, PyFrameObject * frame, PyObject * excval)
 {
+	PyCodeObject * code = frame->f_code;
+	int flags;
+
 	//printf("PYEXC\n");
-	if (_tracefunc_is_ret_ignored(self, code->co_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_code_flags(self, frame, &flags));
+	if (_tracefunc_is_ret_ignored(self, flags)) {
 		return 0;
 	}
 
 	//if (code->co_flags & CO_PASSOVER_DETAILED) {
 	ERRCODE_TO_PYEXC(tracer_pyfunc_raise(&self->info, code, excval));
+	ERRCODE_TO_PYEXC(_tracefunc_capture_return(self));
 	return 0;
 }
 
 static inline int _tracefunc_ccall(PassoverObject * self, PyCFunctionObject * func)
 {
+	int flags;
+
 	//printf("CCALL\n");
 
-	if (_tracefunc_is_call_ignored(self, func->m_ml->ml_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_cfunc_flags(self, func, &flags));
+	if (_tracefunc_is_call_ignored(self, flags)) {
 		return 0;
 	}
+	ERRCODE_TO_PYEXC(_tracefunc_capture_call(self, flags));
+	ERRCODE_TO_PYEXC(_tracefunc_record_unsampled(self));
 
 	ERRCODE_TO_PYEXC(tracer_cfunc_call(&self->info, func));
 	return 0;
@@ -129,26 +272,34 @@ static inline int _tracefunc_ccall(PassoverObject * self, PyCFunctionObject * fu
 
 static inline int _tracefunc_cret(PassoverObject * self, PyCFunctionObject * func)
 {
+	int flags;
+
 	//printf("CRET\n");
 
-	if (_tracefunc_is_ret_ignored(self, func->m_ml->ml_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_cfunc_flags(self, func, &flags));
+	if (_tracefunc_is_ret_ignored(self, flags)) {
 		return 0;
 	}
 
 	ERRCODE_TO_PYEXC(tracer_cfunc_return(&self->info, func));
+	ERRCODE_TO_PYEXC(_tracefunc_capture_return(self));
 	return 0;
 }
 
 static inline int _tracefunc_cexc(PassoverObject * self, PyCFunctionObject * func, PyObject * excval)
 {
+	int flags;
+
 	//printf("CEXC\n");
 
-	if (_tracefunc_is_ret_ignored(self, func->m_ml->ml_flags)) {
+	ERRCODE_TO_PYEXC(_tracefunc_get_cfunc_flags(self, func, &flags));
+	if (_tracefunc_is_ret_ignored(self, flags)) {
 		return 0;
 	}
 
 	//if (func->m_ml->ml_flags & CO_PASSOVER_DETAILED) {
 	ERRCODE_TO_PYEXC(tracer_cfunc_raise(&self->info, func, excval));
+	ERRCODE_TO_PYEXC(_tracefunc_capture_return(self));
 	return 0;
 }
 
@@ -177,10 +328,10 @@ int tracefunc(PassoverObject * self, PyFrameObject * frame,
 			if (self->depth > 0) {
 				self->depth -= 1;
 				if (arg == NULL) {
-					return _tracefunc_pyexc(self, frame->f_code, TSTATE_EXCTYPE(frame));
+					return _tracefunc_pyexc(self, frame, TSTATE_EXCTYPE(frame));
 				}
 				else {
-					return _tracefunc_pyret(self, frame->f_code, arg);
+					return _tracefunc_pyret(self, frame, arg);
 				}
 			}
 			return 0; // shallow return
@@ -1,59 +1,262 @@
 #include "python.h"
+#include <sched.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "tracer.h"
+#include "flusher.h"
 
 
-typedef htable_value_t codepoint_t;
-
-
-errcode_t tracer_init(tracer_t * self, rotdir_t * dir, const char * prefix,
-		size_t map_size, size_t file_size)
+/*
+ * codepoints -- the registry of the rotdir's codepoints, shared by all of its
+ * tracers (and owned by the caller)
+ * map_size, file_size -- the size of the windows over the record files, and
+ * of the files; at least TRACER_MIN_MAP_SIZE and TRACER_MIN_FILE_SIZE
+ * stats -- if not NULL, the rotdir's codepoint stats, which every return
+ * updates (see _tracer_stats_return). owned by the caller, like codepoints
+ * rules -- the ignore rules (see tracer_get_codeobj_flags), owned by the
+ * caller
+ * ring_size -- if nonzero, the tracer runs in async mode: records are queued
+ * in a ring of this size (a power of two), and the flusher thread writes
+ * them to the rotrec. otherwise records are written directly.
+ * drop_when_full -- in async mode, what to do when the ring is full: drop
+ * the record (and count it), or wait for the flusher to make room.
+ * flight_size -- if nonzero, the tracer runs in flight recorder mode: the
+ * most recent records (about this many bytes of them) are kept in memory,
+ * and written to the rotrec only when tracer_dump() is called. can't be
+ * combined with ring_size.
+ * capture_threshold -- if nonzero, the tracer runs in tail capture mode:
+ * the records of a subtree (see tracer_capture_begin) are queued in a ring
+ * of capture_size bytes (a power of two), and written only if the subtree
+ * took at least this long (usec). records outside of subtrees are not
+ * written at all. can't be combined with ring_size or flight_size.
+ * prealloc_percent -- once a file is filled this much, the next one is
+ * prepared in the background (see rotrec_init)
+ * map_flags -- FMAP_* flags (advice) for the windows over the record files
+ * raw_time -- record raw hptime ticks instead of microseconds. sync records
+ * then carry a clock sync (see _tracer_reserve_record), which the reader
+ * uses to convert ticks to wall time
+ * max_call_rate -- if nonzero, codepoints called more than this many times a
+ * second (per thread) are no longer recorded. instead, a summary of their
+ * calls is written once every TRACER_GOVERNOR_WINDOW
+ */
+errcode_t tracer_init(tracer_t * self, rotdir_t * dir, registry_t * codepoints,
+		cpstats_t * stats, rules_t * rules, const char * prefix, size_t map_size,
+		size_t file_size, size_t ring_size, int drop_when_full, size_t flight_size,
+		usec_t capture_threshold, size_t capture_size, int prealloc_percent, int map_flags,
+		int raw_time, int max_call_rate)
 {
-	char tmpfilename[PATH_MAX];
 	errcode_t retcode = ERR_UNKNOWN;
 
+	self->pid = getpid();
 	self->depth = 0;
+	self->raw_time = raw_time;
+	self->timeindex_interval = raw_time ? hptime_usec_to_ticks(TRACER_TIMEINDEX_INTERVAL) :
+			TRACER_TIMEINDEX_INTERVAL;
 	self->next_timestamp = 0;
+	self->generation = 0;
+	self->last_depth = 0;
+	self->last_timestamp = 0;
+	self->record_depth = 0;
+	self->record_timestamp = 0;
+	self->codepoints = codepoints;
+	self->rules = rules;
+	memset(self->cpcache, 0, sizeof(self->cpcache));
+	self->stats = stats;
+	self->stats_frames = NULL;
+	self->stats_depth = 0;
+	self->stats_capacity = 0;
+	self->governed = 0;
+	self->async = 0;
+	self->drop_when_full = drop_when_full;
+	self->dropping = 0;
+	self->dropped_records = 0;
+	self->dropbuf = NULL;
+	self->flight = 0;
+	self->flight_generation = 0;
+	self->capture = 0;
+	self->capture_follows = 0;
+	self->capture_threshold = 0;
+	self->capturing = 0;
+	self->capture_overflowed = 0;
+	self->capture_start = 0;
+	self->capture_last_depth = 0;
+	self->capture_last_timestamp = 0;
+	self->captured_subtrees = 0;
+	self->discarded_subtrees = 0;
+	self->flush_error = ERR_SUCCESS;
+	self->flushed_depth = 0;
+	self->flushed_timestamp = 0;
+	self->next_flushed = NULL;
 
-	PROPAGATE_TO(error1, retcode = htable_init(&self->table, 65535));
-	PROPAGATE_TO(error2, retcode = swriter_init(&self->stream, NULL, 16*1024));
-	PROPAGATE_TO(error3, retcode = swriter_init(&self->cpstream, NULL, 16*1024));
-
-	sprintf(tmpfilename, "%s/%s.codepoints", dir->path, prefix);
-	PROPAGATE_TO(error4, retcode = listfile_open(&self->codepoints, tmpfilename));
-
-	sprintf(tmpfilename, "%s/%s.timeindex", dir->path, prefix);
-	PROPAGATE_TO(error5, retcode = listfile_open(&self->timeindex, tmpfilename));
+	if ((ring_size > 0) + (flight_size > 0) + (capture_threshold > 0) > 1) {
+		return ERR_TRACER_CONFLICTING_MODES;
+	}
+	if (map_size < TRACER_MIN_MAP_SIZE) {
+		return ERR_TRACER_MAP_SIZE_TOO_SMALL;
+	}
+	if (file_size < TRACER_MIN_FILE_SIZE) {
+		return ERR_TRACER_FILE_SIZE_TOO_SMALL;
+	}
+	if (stats != NULL) {
+		self->stats_frames = malloc(TRACER_INITIAL_STATS_FRAMES * sizeof(tracer_stats_frame_t));
+		if (self->stats_frames == NULL) {
+			return ERR_TRACER_MALLOC_FAILED;
+		}
+		self->stats_capacity = TRACER_INITIAL_STATS_FRAMES;
+	}
+	if (max_call_rate > 0) {
+		// rates are measured in the units of the timestamps
+		PROPAGATE_TO(error1, retcode = governor_init(&self->governor,
+				raw_time ? hptime_usec_to_ticks(TRACER_GOVERNOR_WINDOW) : TRACER_GOVERNOR_WINDOW,
+				(uint64_t)max_call_rate * TRACER_GOVERNOR_WINDOW / 1000000));
+		self->governed = 1;
+	}
+	PROPAGATE_TO(error2, retcode = rotrec_init(&self->records, dir, prefix, map_size, file_size,
+			TRACER_FORMAT_VERSION, prealloc_percent, map_flags));
 
-	PROPAGATE_TO(error6, retcode = rotrec_init(&self->records, dir, prefix, map_size, file_size));
+	if (ring_size > 0) {
+		if (ring_size < TRACER_MIN_RING_SIZE) {
+			retcode = ERR_TRACER_RING_TOO_SMALL;
+			goto error3;
+		}
+		PROPAGATE_TO(error3, retcode = spscring_init(&self->ring, ring_size));
+		if (drop_when_full) {
+			self->dropbuf = malloc(TRACER_MAX_RECORD_SIZE);
+			if (self->dropbuf == NULL) {
+				retcode = ERR_TRACER_MALLOC_FAILED;
+				goto error4;
+			}
+		}
+		self->async = 1;
+		PROPAGATE_TO(error5, retcode = flusher_add(self));
+	}
+	if (flight_size > 0) {
+		PROPAGATE_TO(error3, retcode = flightrec_init(&self->flightrec, flight_size,
+				TRACER_FLIGHT_CHUNK_SIZE));
+		self->flight = 1;
+	}
+	if (capture_threshold > 0) {
+		if (capture_size < TRACER_MIN_RING_SIZE) {
+			retcode = ERR_TRACER_RING_TOO_SMALL;
+			goto error3;
+		}
+		PROPAGATE_TO(error3, retcode = spscring_init(&self->capture_ring, capture_size));
+		// records outside of subtrees are encoded here and thrown away
+		self->dropbuf = malloc(TRACER_MAX_RECORD_SIZE);
+		if (self->dropbuf == NULL) {
+			spscring_fini(&self->capture_ring);
+			retcode = ERR_TRACER_MALLOC_FAILED;
+			goto error3;
+		}
+		self->capture_threshold = raw_time ? hptime_usec_to_ticks(capture_threshold) :
+				capture_threshold;
+		self->capture = 1;
+	}
 
 	RETURN_SUCCESSFUL;
 
-error6:
-	listfile_close(&self->timeindex);
 error5:
-	listfile_close(&self->codepoints);
+	self->async = 0;
+	free(self->dropbuf);
+	self->dropbuf = NULL;
 error4:
-	swriter_fini(&self->cpstream);
+	spscring_fini(&self->ring);
 error3:
-	swriter_fini(&self->stream);
+	rotrec_fini(&self->records);
 error2:
-	htable_fini(&self->table);
+	if (self->governed) {
+		governor_fini(&self->governor);
+		self->governed = 0;
+	}
 error1:
+	free(self->stats_frames);
+	self->stats_frames = NULL;
 	return retcode;
 }
 
+static errcode_t _tracer_write_suppressed(tracer_t * self, usec_t timestamp);
+
+/*
+ * in a forked child, the tracer's files are still being written by the
+ * parent, so nothing is written out: the rings and the summaries are just
+ * let go of, and the rotrec only unmaps and closes what it inherited. the
+ * flusher isn't running in the child either
+ */
+static void _tracer_release_inherited(tracer_t * self)
+{
+	if (self->governed) {
+		governor_fini(&self->governor);
+		self->governed = 0;
+	}
+	if (self->async) {
+		spscring_fini(&self->ring);
+		self->async = 0;
+	}
+	if (self->capture) {
+		spscring_fini(&self->capture_ring);
+		self->capturing = 0;
+		self->capture = 0;
+	}
+	free(self->dropbuf);
+	self->dropbuf = NULL;
+}
+
+/*
+ * cleans up all the way even if something fails along the way (like writing
+ * out what's left), and returns the first error
+ */
+#define KEEP_FIRST_ERROR(__expr) \
+	{errcode_t __code = __expr; if (!IS_ERROR(retcode)) retcode = __code;}
+
 errcode_t tracer_fini(tracer_t * self)
 {
-	PROPAGATE(rotrec_fini(&self->records));
-	PROPAGATE(listfile_fini(&self->timeindex));
-	PROPAGATE(listfile_fini(&self->codepoints));
-	PROPAGATE(swriter_fini(&self->cpstream));
-	PROPAGATE(swriter_fini(&self->stream));
-	PROPAGATE(htable_fini(&self->table));
-	RETURN_SUCCESSFUL;
+	errcode_t retcode = ERR_SUCCESS;
+
+	if (self->pid != getpid()) {
+		_tracer_release_inherited(self);
+	}
+	if (self->governed) {
+		// the last summaries, for the calls of the current window
+		self->governed = 0;
+		KEEP_FIRST_ERROR(_tracer_write_suppressed(self,
+				self->raw_time ? hptime_get_ticks() : hptime_get_time()));
+		KEEP_FIRST_ERROR(governor_fini(&self->governor));
+	}
+	if (self->async) {
+		// once removed, the flusher won't touch this tracer again, so we
+		// can write out whatever is left in the ring ourselves
+		KEEP_FIRST_ERROR(flusher_remove(self));
+		KEEP_FIRST_ERROR(tracer_flush(self, NULL));
+		KEEP_FIRST_ERROR(spscring_fini(&self->ring));
+		free(self->dropbuf);
+		self->dropbuf = NULL;
+		self->async = 0;
+	}
+	if (self->capture) {
+		if (self->capturing) {
+			// the subtree is cut short, but it's judged all the same
+			KEEP_FIRST_ERROR(tracer_capture_end(self));
+		}
+		KEEP_FIRST_ERROR(spscring_fini(&self->capture_ring));
+		free(self->dropbuf);
+		self->dropbuf = NULL;
+		self->capture = 0;
+	}
+	if (self->flight) {
+		// whatever wasn't dumped is gone
+		KEEP_FIRST_ERROR(flightrec_fini(&self->flightrec));
+		self->flight = 0;
+	}
+	KEEP_FIRST_ERROR(rotrec_fini(&self->records));
+	free(self->stats_frames);
+	self->stats_frames = NULL;
+	self->stats = NULL;
+	self->codepoints = NULL;
+	self->rules = NULL;
+	return retcode;
 }
 
 /****************************************************************************
@@ -72,19 +275,28 @@ errcode_t tracer_fini(tracer_t * self)
 #define DUMP_UI64(stream, num) \
 	PROPAGATE(swriter_dump_uint64(stream, num))
 
+#define DUMP_VARINT(stream, num) \
+	PROPAGATE(swriter_dump_varint(stream, num))
+
+#define DUMP_SVARINT(stream, num) \
+	PROPAGATE(swriter_dump_svarint(stream, num))
+
+#define DUMP_DOUBLE(stream, num) \
+	PROPAGATE(swriter_dump_double(stream, num))
+
 #define DUMP_CSTR(stream, str) \
 	PROPAGATE(swriter_dump_cstr(stream, str))
 
 #define DUMP_PYSTR(stream, obj) \
 	PROPAGATE(swriter_dump_pstr(stream, PyString_AS_STRING(obj), PyString_GET_SIZE(obj)))
 
-static inline int _tracer_hash_pyobject(void * obj)
+/*
+ * codepoint savers (see registry_saver_t)
+ */
+static errcode_t _tracer_save_codeobj(swriter_t * cpstream, void * obj)
 {
-	return ((int)((uintptr_t)obj)) >> 3;
-}
+	PyCodeObject * code = (PyCodeObject *)obj;
 
-static inline errcode_t _tracer_save_codeobj(swriter_t * cpstream, PyCodeObject * code)
-{
 	DUMP_UI8(cpstream, TRACER_CODEPOINT_PYFUNC);
 #ifdef TRACER_DUMP_ABSPATH
 	char * realpath = canonicalize_file_name(PyString_AS_STRING(code->co_filename));
@@ -105,20 +317,22 @@ static inline errcode_t _tracer_save_codeobj(swriter_t * cpstream, PyCodeObject
 	RETURN_SUCCESSFUL;
 }
 
-static inline errcode_t _tracer_save_cfunc(swriter_t * cpstream, PyCFunctionObject * func)
+static errcode_t _tracer_save_cfunc(swriter_t * cpstream, void * obj)
 {
+	PyCFunctionObject * func = (PyCFunctionObject *)obj;
+
 	DUMP_UI8(cpstream, TRACER_CODEPOINT_CFUNC);
 	if (func->m_module == NULL) {
 		DUMP_CSTR(cpstream, "");
 	}
 	else {
-		PyObject * obj = PyObject_Str(func->m_module);
-		if (obj == NULL) {
+		PyObject * strobj = PyObject_Str(func->m_module);
+		if (strobj == NULL) {
 			return -1;
 		}
-		errcode_t code = swriter_dump_pstr(cpstream, PyString_AS_STRING(obj),
-				PyString_GET_SIZE(obj));
-		Py_DECREF(obj);
+		errcode_t code = swriter_dump_pstr(cpstream, PyString_AS_STRING(strobj),
+				PyString_GET_SIZE(strobj));
+		Py_DECREF(strobj);
 		PROPAGATE(code);
 	}
 	DUMP_CSTR(cpstream, func->m_ml->ml_name);
@@ -126,53 +340,147 @@ static inline errcode_t _tracer_save_cfunc(swriter_t * cpstream, PyCFunctionObje
 	RETURN_SUCCESSFUL;
 }
 
-static inline errcode_t _tracer_save_logline(swriter_t * cpstream, PyObject * obj)
+static errcode_t _tracer_save_logline(swriter_t * cpstream, void * obj)
 {
-	if (!PyString_CheckExact(obj)) {
+	if (!PyString_CheckExact((PyObject *)obj)) {
 		return ERR_TRACER_LOGLINE_NOT_STRING;
 	}
 	DUMP_UI8(cpstream, TRACER_CODEPOINT_LOGLINE);
-	DUMP_PYSTR(cpstream, obj);
+	DUMP_PYSTR(cpstream, (PyObject *)obj);
 	RETURN_SUCCESSFUL;
 }
 
-#define TRACER_GET_CODEPOINT(SAVER) \
-	errcode_t retcode = ERR_UNKNOWN; \
-	int hash = _tracer_hash_pyobject(obj); \
-	\
-	retcode = htable_get(&self->table, hash, (htable_key_t)((uintptr_t)obj), outvalue); \
-	if (retcode == ERR_SUCCESS) { \
-		RETURN_SUCCESSFUL; \
-	} \
-	else if (retcode == ERR_HTABLE_GET_KEY_MISSING) { \
-		int index; \
-		PROPAGATE(swriter_clear(&self->cpstream)); \
-		PROPAGATE(SAVER(&self->cpstream, obj)); \
-		PROPAGATE(listfile_append(&self->codepoints, swriter_get_buffer(&self->cpstream), \
-				swriter_get_length(&self->cpstream), &index)); \
-		PROPAGATE(htable_set(&self->table, hash, (htable_key_t)((uintptr_t)obj), (htable_value_t)index)); \
-		*outvalue = (codepoint_t)index; \
-		RETURN_SUCCESSFUL; \
-	} \
-	else { \
-		return retcode; \
-	} \
+/*
+ * the codepoint of a code object, builtin function or log line is looked up
+ * in the tracer's cache, and only on a miss in the rotdir's registry, shared
+ * by all tracers. builtin functions are identified by their PyMethodDef: the
+ * function object of a bound method is created whenever the method is
+ * looked up, so its address says nothing about which method it is.
+ * code objects and log lines are their own keys, and the registry holds a
+ * reference to them, so their addresses are never reused by other objects
+ * (which would get their codepoints); PyMethodDefs are static
+ */
+static inline void _tracer_apply_tag(tracer_t * self, tracer_cpcache_entry_t * entry,
+		uint32_t tag)
+{
+	if (self->rules != NULL && (tag & TRACER_TAG_GENERATION_MASK) ==
+			(self->rules->generation & TRACER_TAG_GENERATION_MASK)) {
+		entry->flags = tag & ~TRACER_TAG_GENERATION_MASK;
+		entry->generation = self->rules->generation;
+	}
+	else {
+		entry->generation = 0;
+	}
+}
+
+static inline errcode_t _tracer_lookup(tracer_t * self, const void * key,
+		registry_saver_t saver, void * obj, OUT tracer_cpcache_entry_t ** outentry)
+{
+	// fibonacci hashing: the top bits of the product mix all bits of the key
+	tracer_cpcache_entry_t * entry = &self->cpcache[
+			((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - TRACER_CPCACHE_BITS)];
+	uint32_t tag;
+
+	if (entry->key != key) {
+		PROPAGATE(registry_get(self->codepoints, key, key == obj, saver, obj,
+				&entry->codepoint, &tag));
+		entry->key = key;
+		_tracer_apply_tag(self, entry, tag);
+	}
+	*outentry = entry;
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracer_get_codepoint(tracer_t * self, const void * key,
+		registry_saver_t saver, void * obj, codepoint_t * outvalue)
+{
+	tracer_cpcache_entry_t * entry;
+
+	PROPAGATE(_tracer_lookup(self, key, saver, obj, &entry));
+	*outvalue = entry->codepoint;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * the slow path of the ignore flags: the entry's flags are stale, but
+ * another tracer may have matched the rules already; if not, we do
+ */
+static errcode_t _tracer_match_rules(tracer_t * self, tracer_cpcache_entry_t * entry,
+		const char * filename, const char * module, const char * function)
+{
+	codepoint_t cp;
+	uint32_t tag;
+	uint32_t flags;
+
+	// keys are never removed, so the saver won't be needed
+	PROPAGATE(registry_get(self->codepoints, entry->key, 0, NULL, NULL, &cp, &tag));
+	_tracer_apply_tag(self, entry, tag);
+	if (entry->generation == self->rules->generation) {
+		RETURN_SUCCESSFUL;
+	}
+	flags = rules_match(self->rules, filename, module, function) & ~TRACER_TAG_GENERATION_MASK;
+	PROPAGATE(registry_set_tag(self->codepoints, entry->key,
+			flags | (self->rules->generation & TRACER_TAG_GENERATION_MASK)));
+	entry->flags = flags;
+	entry->generation = self->rules->generation;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * the flags the ignore rules give a function (to be or'ed with its own
+ * flags). rules are matched once per codepoint, and again only when they
+ * change; otherwise this is a lookup in the cache. globals are those of the
+ * function's frame, which tell its module
+ */
+errcode_t tracer_get_codeobj_flags(tracer_t * self, PyCodeObject * code,
+		PyObject * globals, OUT int * outflags)
+{
+	tracer_cpcache_entry_t * entry;
+	PyObject * name;
+
+	PROPAGATE(_tracer_lookup(self, code, _tracer_save_codeobj, code, &entry));
+	if (entry->generation != self->rules->generation) {
+		name = (globals != NULL) ? PyDict_GetItemString(globals, "__name__") : NULL;
+		PROPAGATE(_tracer_match_rules(self, entry, PyString_AS_STRING(code->co_filename),
+				(name != NULL && PyString_Check(name)) ? PyString_AS_STRING(name) : NULL,
+				PyString_AS_STRING(code->co_name)));
+	}
+	*outflags = entry->flags;
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t tracer_get_cfunc_flags(tracer_t * self, PyCFunctionObject * func,
+		OUT int * outflags)
+{
+	tracer_cpcache_entry_t * entry;
+	PyObject * module = func->m_module;
+
+	PROPAGATE(_tracer_lookup(self, func->m_ml, _tracer_save_cfunc, func, &entry));
+	if (entry->generation != self->rules->generation) {
+		PROPAGATE(_tracer_match_rules(self, entry, NULL,
+				(module != NULL && PyString_Check(module)) ? PyString_AS_STRING(module) : NULL,
+				func->m_ml->ml_name));
+	}
+	*outflags = entry->flags;
+	RETURN_SUCCESSFUL;
+}
 
 static inline errcode_t _tracer_get_codeobj_codepoint(tracer_t * self,
 		PyCodeObject * obj, codepoint_t * outvalue)
 {
-	TRACER_GET_CODEPOINT(_tracer_save_codeobj)
+	return _tracer_get_codepoint(self, obj, _tracer_save_codeobj, obj, outvalue);
 }
 
 static inline errcode_t _tracer_get_cfunc_codepoint(tracer_t * self,
 		PyCFunctionObject * obj, codepoint_t * outvalue)
 {
-	TRACER_GET_CODEPOINT(_tracer_save_cfunc)
+	return _tracer_get_codepoint(self, obj->m_ml, _tracer_save_cfunc, obj, outvalue);
 }
+
 static inline errcode_t _tracer_get_logline_codepoint(tracer_t * self,
 		PyObject * obj, codepoint_t * outvalue)
 {
-	TRACER_GET_CODEPOINT(_tracer_save_logline)
+	return _tracer_get_codepoint(self, obj, _tracer_save_logline, obj, outvalue);
 }
 
 #define TRACER_DUMP_OBJ(CONVERTOR, ERRCODE) \
@@ -200,6 +508,31 @@ static inline errcode_t _tracer_dump_obj_str(swriter_t * stream, PyObject * obj,
 	TRACER_DUMP_OBJ(PyObject_Str, ERR_TRACER_STRINGIFY_PYOBJECT_FAILED)
 }
 
+/*
+ * longs are dumped as they are represented internally: the signed number of
+ * limbs (negative for negative numbers), the number of bits per limb, and
+ * the limbs themselves, least significant first. longs that are too big
+ * fall back to their repr
+ */
+static inline errcode_t _tracer_dump_long(swriter_t * stream, PyLongObject * obj)
+{
+	Py_ssize_t size = Py_SIZE(obj);
+	Py_ssize_t i, count = (size < 0) ? -size : size;
+
+	if (count > TRACER_PYOBJ_MAX_LONG_LIMBS) {
+		DUMP_UI8(stream, TRACER_PYOBJ_LONG);
+		return _tracer_dump_obj_repr(stream, (PyObject*)obj, -1);
+	}
+
+	DUMP_UI8(stream, TRACER_PYOBJ_LONG_LIMBS);
+	DUMP_SVARINT(stream, size);
+	DUMP_UI8(stream, PyLong_SHIFT);
+	for (i = 0; i < count; i++) {
+		DUMP_VARINT(stream, obj->ob_digit[i]);
+	}
+	RETURN_SUCCESSFUL;
+}
+
 static inline errcode_t _tracer_dump_argument(tracer_t * self, PyObject * obj)
 {
 	if (obj == Py_None) {
@@ -219,17 +552,16 @@ static inline errcode_t _tracer_dump_argument(tracer_t * self, PyObject * obj)
 			DUMP_UI8(&self->stream, TRACER_PYOBJ_IMMINT_0 + val);
 		}
 		else {
-			DUMP_UI8(&self->stream, TRACER_PYOBJ_INT);
-			PROPAGATE(_tracer_dump_obj_repr(&self->stream, obj, -1));
+			DUMP_UI8(&self->stream, TRACER_PYOBJ_VARINT);
+			DUMP_SVARINT(&self->stream, val);
 		}
 	}
 	else if (PyLong_CheckExact(obj)) {
-		DUMP_UI8(&self->stream, TRACER_PYOBJ_LONG);
-		PROPAGATE(_tracer_dump_obj_repr(&self->stream, obj, -1));
+		PROPAGATE(_tracer_dump_long(&self->stream, (PyLongObject*)obj));
 	}
 	else if (PyFloat_CheckExact(obj)) {
-		DUMP_UI8(&self->stream, TRACER_PYOBJ_FLOAT);
-		PROPAGATE(_tracer_dump_obj_str(&self->stream, obj, 50));
+		DUMP_UI8(&self->stream, TRACER_PYOBJ_DOUBLE);
+		DUMP_DOUBLE(&self->stream, ((PyFloatObject*)obj)->ob_fval);
 	}
 	else if (PyString_CheckExact(obj)) {
 		DUMP_UI8(&self->stream, TRACER_PYOBJ_STR);
@@ -252,39 +584,648 @@ static inline errcode_t _tracer_dump_exception(tracer_t * self, PyObject * excty
  * Trace records
  ***************************************************************************/
 
-#define RECORD_HEADER(TYPE, GET_CP_FUNC, OBJ) \
-	usec_t _timestamp = hptime_get_time(); \
-	PROPAGATE(swriter_clear(&self->stream)); \
-    PROPAGATE(swriter_dump_uint8(&self->stream, TYPE)); \
-    PROPAGATE(swriter_dump_uint16(&self->stream, self->depth)); \
-	PROPAGATE(swriter_dump_uint64(&self->stream, _timestamp)); \
-	codepoint_t _cp; \
-	PROPAGATE(GET_CP_FUNC(self, OBJ, &_cp)); \
-	PROPAGATE(swriter_dump_uint16(&self->stream, _cp))
-
-static errcode_t _tracer_timeindex_dump(tracer_t * self, usec_t timestamp, off_t offset)
-{
-	if (timestamp >= self->next_timestamp) {
-		swriter_t stream;
-		char buffer[16];
-		PROPAGATE(swriter_init(&stream, buffer, sizeof(buffer)));
-		self->next_timestamp = timestamp + TRACER_TIMEINDEX_INTERVAL;
-		DUMP_UI64(&stream, (uint64_t)timestamp);
-		DUMP_UI64(&stream, (uint64_t)offset);
-		PROPAGATE(listfile_append(&self->timeindex, swriter_get_buffer(&self->stream),
-				swriter_get_length(&self->stream), NULL));
-		PROPAGATE(swriter_fini(&stream));
+/*
+ * record format (version 2). every record is
+ *
+ *     uint8    type (low 5 bits) | zigzag depth change (high 3 bits)
+ *     [svarint depth change, only if the high bits are all set]
+ *     svarint  timestamp change since the previous record
+ *     varint   codepoint
+ *     ...      type-specific body
+ *
+ * depth and timestamp are relative to the previous record, so they are only
+ * meaningful after a TRACER_RECORD_SYNC record, which carries the absolute
+ * values the next record is relative to. a sync record is written at the
+ * beginning of every rotrec file and every TRACER_TIMEINDEX_INTERVAL, and
+ * the time index in the file's footer points at these, so that a reader can
+ * start decoding from any of them. with raw_time, timestamps are hptime
+ * ticks, and every sync record also carries a clock sync: the ticks per
+ * second, and a reading of the ticks, CLOCK_MONOTONIC and CLOCK_REALTIME
+ * (in nsec) taken together.
+ *
+ * when sampling, a TRACER_RECORD_SAMPLE record (whose codepoint is unused)
+ * precedes a sampled call if calls were skipped since the previous one, and
+ * carries their number (a varint), so readers can scale counts back up.
+ *
+ * with a governor, the calls of codepoints that are called too often are not
+ * recorded. instead, a TRACER_RECORD_SUPPRESSED record of such a codepoint
+ * is written once every TRACER_GOVERNOR_WINDOW, carrying the number of
+ * calls since its previous one and their total duration (varints, the
+ * latter in the units of the timestamps).
+ *
+ * in async mode, records are encoded into a ring instead of the rotrec,
+ * and the flusher thread moves them over. sync records are always added by
+ * whoever writes into the rotrec, since only it knows when files rotate.
+ *
+ * in flight recorder mode, records are encoded into the flight recorder,
+ * every chunk of which starts with a sync record of its own. a dump moves
+ * records over like the flusher does, except that these sync records are
+ * not copied -- they only tell the dump where the records of the chunk are
+ * relative to, and force a new sync record in the rotrec.
+ *
+ * in tail capture mode, the records of a subtree are encoded into the
+ * capture ring. once the subtree ends, they are either moved over (again,
+ * like the flusher does) after a sync record carrying the depth and
+ * timestamp the subtree's first record is relative to, or thrown away.
+ * summaries (of suppressed and unsampled calls) are never thrown away: they
+ * account for calls that aren't in the trace, whichever subtree they fall
+ * in. outside of subtrees, they're written directly, and those of a subtree
+ * that's thrown away are moved over on their own.
+ */
+#define TRACER_MAX_SYNC_RECORD_SIZE  (1 + 6 * SWRITER_MAX_VARINT_SIZE)
+
+static inline errcode_t _tracer_encode_sync(tracer_t * self, void * buf, size_t size,
+		int last_depth, usec_t last_timestamp, OUT size_t * outlength)
+{
+	swriter_t sync;
+	hptime_clocksync_t clocksync;
+
+	PROPAGATE(swriter_init(&sync, buf, size));
+	DUMP_UI8(&sync, TRACER_RECORD_SYNC);
+	DUMP_SVARINT(&sync, last_depth);
+	DUMP_VARINT(&sync, last_timestamp);
+	if (self->raw_time) {
+		hptime_get_clocksync(&clocksync);
+		DUMP_VARINT(&sync, clocksync.ticks_per_sec);
+		DUMP_VARINT(&sync, clocksync.ticks);
+		DUMP_VARINT(&sync, clocksync.monotonic_ns);
+		DUMP_VARINT(&sync, clocksync.realtime_ns);
+	}
+	*outlength = swriter_get_length(&sync);
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * reserves `size` bytes in the rotrec for a record with the given timestamp.
+ * if this record starts a new file, or it's time for a new time index entry,
+ * a sync record is committed first, carrying the depth and timestamp that
+ * the record is relative to, and added to the file's time index
+ */
+static inline errcode_t _tracer_reserve_record(tracer_t * self, size_t size,
+		usec_t timestamp, int last_depth, usec_t last_timestamp, OUT void ** outbuf)
+{
+	off_t offset;
+	size_t length;
+
+	if (size < TRACER_MAX_SYNC_RECORD_SIZE) {
+		size = TRACER_MAX_SYNC_RECORD_SIZE;
+	}
+	while (1) {
+		PROPAGATE(rotrec_reserve(&self->records, size, outbuf, &offset));
+		if (self->generation == self->records.generation &&
+				timestamp < self->next_timestamp) {
+			break;
+		}
+		PROPAGATE(_tracer_encode_sync(self, *outbuf, size, last_depth, last_timestamp,
+				&length));
+		PROPAGATE(rotrec_commit(&self->records, length));
+		// the rotrec's time index is always in usec
+		PROPAGATE(rotrec_index(&self->records,
+				self->raw_time ? hptime_ticks_to_usec(timestamp) : timestamp, offset));
+		self->generation = self->records.generation;
+		self->next_timestamp = timestamp + self->timeindex_interval;
+		// committing the sync record can't rotate the file, but reserving
+		// room for the actual record might, so we go around again
+	}
+	// the file's footer records its time range
+	self->records.last_timestamp = self->raw_time ? hptime_ticks_to_usec(timestamp) :
+			timestamp;
+
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracer_reserve_async(tracer_t * self, OUT void ** outbuf)
+{
+	errcode_t retcode;
+
+	self->dropping = 0;
+	while ((retcode = spscring_reserve(&self->ring, TRACER_MAX_RECORD_SIZE, outbuf)) ==
+			ERR_SPSCRING_FULL) {
+		if (self->drop_when_full) {
+			// the record is encoded aside and thrown away
+			self->dropping = 1;
+			self->dropped_records += 1;
+			*outbuf = self->dropbuf;
+			RETURN_SUCCESSFUL;
+		}
+		// wait for the flusher to make room, unless it gave up on us
+		if (IS_ERROR(self->flush_error)) {
+			return self->flush_error;
+		}
+		sched_yield();
+	}
+	return retcode;
+}
+
+/*
+ * every chunk of the flight recorder starts with a sync record, carrying
+ * the depth and timestamp that the chunk's first record is relative to
+ */
+static inline errcode_t _tracer_reserve_flight(tracer_t * self, OUT void ** outbuf)
+{
+	size_t length;
+
+	while (1) {
+		PROPAGATE(flightrec_reserve(&self->flightrec, TRACER_MAX_RECORD_SIZE, outbuf));
+		if (self->flight_generation == self->flightrec.generation) {
+			break;
+		}
+		PROPAGATE(_tracer_encode_sync(self, *outbuf, TRACER_MAX_RECORD_SIZE,
+				self->last_depth, self->last_timestamp, &length));
+		PROPAGATE(flightrec_commit(&self->flightrec, length, self->last_timestamp));
+		self->flight_generation = self->flightrec.generation;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+static errcode_t _tracer_capture_write(tracer_t * self);
+
+static inline int _tracer_is_summary(int type)
+{
+	return type == TRACER_RECORD_SUPPRESSED || type == TRACER_RECORD_SAMPLE;
+}
+
+static inline errcode_t _tracer_reserve_capture(tracer_t * self, int type,
+		usec_t timestamp, OUT void ** outbuf)
+{
+	errcode_t retcode;
+
+	self->dropping = 0;
+	if (!self->capturing) {
+		if (!_tracer_is_summary(type)) {
+			self->dropping = 1;
+			*outbuf = self->dropbuf;
+			RETURN_SUCCESSFUL;
+		}
+		if (!self->capture_follows) {
+			// records were committed to the capture ring since
+			self->next_timestamp = 0;
+		}
+		return _tracer_reserve_record(self, TRACER_MAX_RECORD_SIZE, timestamp,
+				self->last_depth, self->last_timestamp, outbuf);
+	}
+	if (!self->capture_overflowed) {
+		retcode = spscring_reserve(&self->capture_ring, TRACER_MAX_RECORD_SIZE, outbuf);
+		if (retcode != ERR_SPSCRING_FULL) {
+			return retcode;
+		}
+		// the subtree is too big to be held back, so it's written as it
+		// goes, however long it takes
+		PROPAGATE(_tracer_capture_write(self));
+		self->capture_overflowed = 1;
+	}
+	return _tracer_reserve_record(self, TRACER_MAX_RECORD_SIZE, timestamp,
+			self->last_depth, self->last_timestamp, outbuf);
+}
+
+/*
+ * reserves room for a record, points self->stream at it, and encodes the
+ * record header
+ */
+static inline errcode_t _tracer_begin_record(tracer_t * self, int type,
+		usec_t timestamp, codepoint_t cp)
+{
+	void * buf;
+	int depth_change;
+	unsigned depth_code;
+
+	if (self->async) {
+		if (IS_ERROR(self->flush_error)) {
+			return self->flush_error;
+		}
+		PROPAGATE(_tracer_reserve_async(self, &buf));
+	}
+	else if (self->flight) {
+		PROPAGATE(_tracer_reserve_flight(self, &buf));
+	}
+	else if (self->capture) {
+		PROPAGATE(_tracer_reserve_capture(self, type, timestamp, &buf));
+	}
+	else {
+		PROPAGATE(_tracer_reserve_record(self, TRACER_MAX_RECORD_SIZE, timestamp,
+				self->last_depth, self->last_timestamp, &buf));
+	}
+	PROPAGATE(swriter_init(&self->stream, buf, TRACER_MAX_RECORD_SIZE));
+
+	depth_change = self->depth - self->last_depth;
+	depth_code = (((unsigned)depth_change) << 1) ^ (unsigned)(depth_change >> 31);
+	if (depth_code < TRACER_HEADER_DEPTH_ESCAPE) {
+		DUMP_UI8(&self->stream, type | (depth_code << TRACER_HEADER_DEPTH_SHIFT));
+	}
+	else {
+		DUMP_UI8(&self->stream, type | (TRACER_HEADER_DEPTH_ESCAPE << TRACER_HEADER_DEPTH_SHIFT));
+		DUMP_SVARINT(&self->stream, depth_change);
+	}
+	DUMP_SVARINT(&self->stream, (int64_t)(timestamp - self->last_timestamp));
+	DUMP_VARINT(&self->stream, cp);
+
+	self->record_depth = self->depth;
+	self->record_timestamp = timestamp;
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracer_commit_record(tracer_t * self)
+{
+	size_t length = swriter_get_length(&self->stream);
+
+	if (self->dropping) {
+		// a dropped record is never written, so the next one has to be
+		// relative to the one before it
+		RETURN_SUCCESSFUL;
+	}
+	// likewise a record whose body failed to encode, which is never
+	// committed
+	self->last_depth = self->record_depth;
+	self->last_timestamp = self->record_timestamp;
+	if (self->flight) {
+		return flightrec_commit(&self->flightrec, length, self->last_timestamp);
+	}
+	if (self->capture) {
+		self->capture_follows = !self->capturing || self->capture_overflowed;
+		if (!self->capture_follows) {
+			return spscring_commit(&self->capture_ring, length);
+		}
+	}
+	if (!self->async) {
+		return rotrec_commit(&self->records, length);
+	}
+	return spscring_commit(&self->ring, length);
+}
+
+static inline errcode_t _tracer_parse_header(const void * record, size_t size,
+		OUT int * depth_change, OUT int64_t * timestamp_change)
+{
+	sreader_t reader;
+	uint8_t header;
+	unsigned depth_code;
+	int64_t value;
+
+	PROPAGATE(sreader_init(&reader, record, size));
+	PROPAGATE(sreader_load_uint8(&reader, &header));
+	depth_code = header >> TRACER_HEADER_DEPTH_SHIFT;
+	if (depth_code == TRACER_HEADER_DEPTH_ESCAPE) {
+		PROPAGATE(sreader_load_svarint(&reader, &value));
+		*depth_change = (int)value;
+	}
+	else {
+		*depth_change = (int)(depth_code >> 1) ^ -(int)(depth_code & 1);
+	}
+	PROPAGATE(sreader_load_svarint(&reader, timestamp_change));
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracer_parse_sync(const void * record, size_t size,
+		OUT int * depth, OUT usec_t * timestamp)
+{
+	sreader_t reader;
+	uint8_t header;
+	int64_t value;
+	uint64_t uvalue;
+
+	PROPAGATE(sreader_init(&reader, record, size));
+	PROPAGATE(sreader_load_uint8(&reader, &header));
+	PROPAGATE(sreader_load_svarint(&reader, &value));
+	PROPAGATE(sreader_load_varint(&reader, &uvalue));
+	*depth = (int)value;
+	*timestamp = uvalue;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * writes a record that was encoded aside (in the ring or the flight
+ * recorder) into the rotrec. such records are relative to each other, so
+ * flushed_depth and flushed_timestamp follow them
+ */
+static inline errcode_t _tracer_move_record(tracer_t * self, const void * record,
+		size_t size)
+{
+	void * buf;
+	int depth_change;
+	int64_t timestamp_change;
+	usec_t timestamp;
+
+	if ((*((const uint8_t *)record) & TRACER_HEADER_TYPE_MASK) == TRACER_RECORD_SYNC) {
+		// the next record is relative to this one, and needs a sync record
+		// in the rotrec too
+		PROPAGATE(_tracer_parse_sync(record, size, &self->flushed_depth,
+				&self->flushed_timestamp));
+		self->next_timestamp = 0;
+		RETURN_SUCCESSFUL;
+	}
+	PROPAGATE(_tracer_parse_header(record, size, &depth_change, &timestamp_change));
+	timestamp = self->flushed_timestamp + timestamp_change;
+	PROPAGATE(_tracer_reserve_record(self, size, timestamp, self->flushed_depth,
+			self->flushed_timestamp, &buf));
+	memcpy(buf, record, size);
+	PROPAGATE(rotrec_commit(&self->records, size));
+	self->flushed_depth += depth_change;
+	self->flushed_timestamp = timestamp;
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * moves the records queued in the ring into the rotrec. this runs on the
+ * flusher thread (or in tracer_fini, once the flusher let go of the tracer),
+ * so it must not touch anything the tracing thread uses
+ */
+errcode_t tracer_flush(tracer_t * self, OUT int * outcount)
+{
+	void * record;
+	size_t size;
+	int count = 0;
+
+	while (spscring_peek(&self->ring, &record, &size) == ERR_SUCCESS) {
+		PROPAGATE(_tracer_move_record(self, record, size));
+		PROPAGATE(spscring_release(&self->ring));
+		count += 1;
+	}
+
+	if (outcount != NULL) {
+		*outcount = count;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * writes the most recent records of the flight recorder into the rotrec:
+ * at least max_size bytes of them, and as long as they're no older than
+ * max_age usec (0 means no limit), in whole chunks of the flight recorder.
+ * records that were already dumped are not dumped again. this runs on
+ * whatever thread holds the GIL, which keeps the tracing thread out
+ */
+errcode_t tracer_dump(tracer_t * self, size_t max_size, usec_t max_age, OUT int * outcount)
+{
+	errcode_t retcode;
+	flightrec_cursor_t cursor;
+	usec_t now;
+	usec_t min_timestamp = 0;
+	void * record;
+	size_t size;
+	int count = 0;
+
+	if (!self->flight) {
+		return ERR_TRACER_NOT_A_FLIGHT_RECORDER;
+	}
+	if (max_age > 0) {
+		now = self->raw_time ? hptime_get_ticks() : hptime_get_time();
+		if (self->raw_time) {
+			max_age = hptime_usec_to_ticks(max_age);
+		}
+		min_timestamp = (now > max_age) ? now - max_age : 1;
+	}
+	flightrec_select(&self->flightrec, max_size, min_timestamp, &cursor);
+	// unless the dump starts a new chunk (which has a sync record), it goes
+	// on from where the previous one ended, but not right after its records
+	self->next_timestamp = 0;
+	while ((retcode = flightrec_next(&self->flightrec, &cursor, &record, &size)) ==
+			ERR_SUCCESS) {
+		PROPAGATE(_tracer_move_record(self, record, size));
+		count += 1;
+	}
+	if (retcode != ERR_FLIGHTREC_END) {
+		return retcode;
+	}
+
+	if (outcount != NULL) {
+		*outcount = count;
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * moves the records of the current subtree from the capture ring into the
+ * rotrec
+ */
+static errcode_t _tracer_capture_write(tracer_t * self)
+{
+	void * record;
+	size_t size;
+
+	self->flushed_depth = self->capture_last_depth;
+	self->flushed_timestamp = self->capture_last_timestamp;
+	self->capture_follows = 0;
+	// the subtree doesn't follow the records before it
+	self->next_timestamp = 0;
+	while (spscring_peek(&self->capture_ring, &record, &size) == ERR_SUCCESS) {
+		PROPAGATE(_tracer_move_record(self, record, size));
+		PROPAGATE(spscring_release(&self->capture_ring));
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * throws away the records of the current subtree, except for summaries,
+ * which are moved into the rotrec. the records in between are only followed
+ * (through flushed_depth and flushed_timestamp), so a summary that doesn't
+ * come right after another gets a sync record
+ */
+static errcode_t _tracer_capture_discard(tracer_t * self)
+{
+	void * record;
+	size_t size;
+	int depth_change;
+	int64_t timestamp_change;
+	int skipped = 1;
+
+	self->flushed_depth = self->capture_last_depth;
+	self->flushed_timestamp = self->capture_last_timestamp;
+	self->capture_follows = 0;
+	while (spscring_peek(&self->capture_ring, &record, &size) == ERR_SUCCESS) {
+		if (_tracer_is_summary(*((const uint8_t *)record) & TRACER_HEADER_TYPE_MASK)) {
+			if (skipped) {
+				self->next_timestamp = 0;
+				skipped = 0;
+			}
+			PROPAGATE(_tracer_move_record(self, record, size));
+		}
+		else {
+			PROPAGATE(_tracer_parse_header(record, size, &depth_change, &timestamp_change));
+			self->flushed_depth += depth_change;
+			self->flushed_timestamp += timestamp_change;
+			skipped = 1;
+		}
+		PROPAGATE(spscring_release(&self->capture_ring));
+	}
+	RETURN_SUCCESSFUL;
+}
+
+/*
+ * in tail capture mode, starts a subtree: its records are held back until
+ * tracer_capture_end() decides whether it took long enough to be written.
+ * subtrees don't nest
+ */
+errcode_t tracer_capture_begin(tracer_t * self)
+{
+	if (!self->capture || self->capturing) {
+		RETURN_SUCCESSFUL;
+	}
+	self->capturing = 1;
+	self->capture_overflowed = 0;
+	self->capture_last_depth = self->last_depth;
+	self->capture_last_timestamp = self->last_timestamp;
+	self->capture_start = self->raw_time ? hptime_get_ticks() : hptime_get_time();
+	RETURN_SUCCESSFUL;
+}
+
+errcode_t tracer_capture_end(tracer_t * self)
+{
+	usec_t now;
+
+	if (!self->capturing) {
+		RETURN_SUCCESSFUL;
+	}
+	self->capturing = 0;
+	if (self->capture_overflowed) {
+		// already written
+		self->captured_subtrees += 1;
+		RETURN_SUCCESSFUL;
+	}
+	now = self->raw_time ? hptime_get_ticks() : hptime_get_time();
+	if (now - self->capture_start >= self->capture_threshold) {
+		self->captured_subtrees += 1;
+		return _tracer_capture_write(self);
+	}
+	self->discarded_subtrees += 1;
+	return _tracer_capture_discard(self);
+}
+
+/****************************************************************************
+ * Stats
+ ***************************************************************************/
+
+static inline errcode_t _tracer_stats_call(tracer_t * self, usec_t timestamp)
+{
+	tracer_stats_frame_t * frames;
+
+	if (self->stats_depth == self->stats_capacity) {
+		frames = realloc(self->stats_frames,
+				2 * self->stats_capacity * sizeof(tracer_stats_frame_t));
+		if (frames == NULL) {
+			return ERR_TRACER_MALLOC_FAILED;
+		}
+		self->stats_frames = frames;
+		self->stats_capacity *= 2;
 	}
+	self->stats_frames[self->stats_depth].start = timestamp;
+	self->stats_frames[self->stats_depth].children = 0;
+	self->stats_depth += 1;
 	RETURN_SUCCESSFUL;
 }
 
+/*
+ * accounts for the call that returned: its inclusive time is since it was
+ * made, and its exclusive time is that, less the inclusive times of the
+ * calls it made (which includes the tracer's own overhead in them)
+ */
+static inline errcode_t _tracer_stats_return(tracer_t * self, codepoint_t cp,
+		usec_t timestamp)
+{
+	tracer_stats_frame_t * frame;
+	uint64_t inclusive, exclusive;
+
+	if (self->stats_depth == 0) {
+		// the call was made before the tracer started
+		RETURN_SUCCESSFUL;
+	}
+	self->stats_depth -= 1;
+	frame = &self->stats_frames[self->stats_depth];
+	inclusive = (timestamp > frame->start) ? timestamp - frame->start : 0;
+	exclusive = (inclusive > frame->children) ? inclusive - frame->children : 0;
+	if (self->stats_depth > 0) {
+		self->stats_frames[self->stats_depth - 1].children += inclusive;
+	}
+	if (self->raw_time) {
+		inclusive = hptime_ticks_to_nsec(inclusive);
+		exclusive = hptime_ticks_to_nsec(exclusive);
+	}
+	else {
+		inclusive *= 1000;
+		exclusive *= 1000;
+	}
+	return cpstats_add(self->stats, cp, inclusive, exclusive);
+}
+
+/****************************************************************************
+ * Recording calls
+ ***************************************************************************/
+
+#define RECORD_CODEPOINT(GET_CP_FUNC, OBJ) \
+	usec_t _timestamp = self->raw_time ? hptime_get_ticks() : hptime_get_time(); \
+	codepoint_t _cp; \
+	PROPAGATE(GET_CP_FUNC(self, OBJ, &_cp))
+
+#define RECORD_BEGIN(TYPE) \
+	PROPAGATE(_tracer_begin_record(self, TYPE, _timestamp, _cp))
+
+#define RECORD_HEADER(TYPE, GET_CP_FUNC, OBJ) \
+	RECORD_CODEPOINT(GET_CP_FUNC, OBJ); \
+	RECORD_BEGIN(TYPE)
+
+// calls and returns of suppressed codepoints are not recorded (nor do they
+// change the depth)
+#define RECORD_GOVERN_CALL \
+	if (self->governed) { \
+		int _suppressed; \
+		PROPAGATE(_tracer_govern_call(self, _cp, _timestamp, &_suppressed)); \
+		if (_suppressed) { \
+			RETURN_SUCCESSFUL; \
+		} \
+	}
+
+#define RECORD_GOVERN_RETURN \
+	if (self->governed && governor_return(&self->governor, _cp, _timestamp)) { \
+		RETURN_SUCCESSFUL; \
+	}
+
+// every call and return is accounted for in the stats, even if it's
+// suppressed or not written
+#define RECORD_STATS_CALL \
+	if (self->stats != NULL) { \
+		PROPAGATE(_tracer_stats_call(self, _timestamp)); \
+	}
+
+#define RECORD_STATS_RETURN \
+	if (self->stats != NULL) { \
+		PROPAGATE(_tracer_stats_return(self, _cp, _timestamp)); \
+	}
+
 #define RECORD_FINALIZE \
-	off_t _offset; \
-	PROPAGATE(rotrec_write(&self->records, swriter_get_buffer(&self->stream), \
-				swriter_get_length(&self->stream), &_offset)); \
-	PROPAGATE(_tracer_timeindex_dump(self, _timestamp, _offset)); \
+	PROPAGATE(_tracer_commit_record(self)); \
 	RETURN_SUCCESSFUL
 
+/*
+ * writes a TRACER_RECORD_SUPPRESSED record for every suppressed codepoint
+ * that was called since its last one
+ */
+static errcode_t _tracer_write_suppressed(tracer_t * self, usec_t timestamp)
+{
+	uint32_t i;
+	codepoint_t cp;
+	uint64_t calls, time;
+
+	for (i = 0; governor_take_summary(&self->governor, i, &cp, &calls, &time); i++) {
+		if (calls == 0) {
+			continue;
+		}
+		PROPAGATE(_tracer_begin_record(self, TRACER_RECORD_SUPPRESSED, timestamp, cp));
+		DUMP_VARINT(&self->stream, calls);
+		DUMP_VARINT(&self->stream, time);
+		PROPAGATE(_tracer_commit_record(self));
+	}
+	RETURN_SUCCESSFUL;
+}
+
+static inline errcode_t _tracer_govern_call(tracer_t * self, codepoint_t cp,
+		usec_t timestamp, OUT int * outsuppressed)
+{
+	if (timestamp >= self->governor.window_end) {
+		// summaries are written once every window
+		PROPAGATE(_tracer_write_suppressed(self, timestamp));
+		governor_next_window(&self->governor, timestamp);
+	}
+	return governor_call(&self->governor, cp, timestamp, outsuppressed);
+}
+
 errcode_t tracer_log(tracer_t * self, PyObject * fmtstr, PyObject * argstuple)
 {
 	int i;
@@ -292,7 +1233,7 @@ errcode_t tracer_log(tracer_t * self, PyObject * fmtstr, PyObject * argstuple)
 	PyObject * item;
 
 	RECORD_HEADER(TRACER_RECORD_LOG, _tracer_get_logline_codepoint, fmtstr);
-	DUMP_UI16(&self->stream, count);
+	DUMP_VARINT(&self->stream, count);
 	for (i = 0; i < count; i++) {
 		item = PyTuple_GET_ITEM(argstuple, i);
 		PROPAGATE(_tracer_dump_obj_str(&self->stream, item, -1));
@@ -300,10 +1241,37 @@ errcode_t tracer_log(tracer_t * self, PyObject * fmtstr, PyObject * argstuple)
 	RECORD_FINALIZE;
 }
 
+/*
+ * records that `unsampled` calls (with their whole subtrees) were skipped
+ * since the previous sampled call
+ */
+errcode_t tracer_sample(tracer_t * self, uint64_t unsampled)
+{
+	usec_t timestamp = self->raw_time ? hptime_get_ticks() : hptime_get_time();
+
+	PROPAGATE(_tracer_begin_record(self, TRACER_RECORD_SAMPLE, timestamp, 0));
+	DUMP_VARINT(&self->stream, unsampled);
+	RECORD_FINALIZE;
+}
+
+/*
+ * counts a call made at the sampling depth in the stats, sampled or not, so
+ * readers can tell what share of the calls the stats cover
+ */
+void tracer_count_sampled(tracer_t * self, int sample_depth, int sampled)
+{
+	if (self->stats != NULL) {
+		cpstats_add_sampled(self->stats, sample_depth, sampled);
+	}
+}
+
 errcode_t tracer_pyfunc_call(tracer_t * self, PyCodeObject * code, int argcount, PyObject * args[])
 {
-	RECORD_HEADER(TRACER_RECORD_PYCALL, _tracer_get_codeobj_codepoint, code);
-	DUMP_UI16(&self->stream, argcount);
+	RECORD_CODEPOINT(_tracer_get_codeobj_codepoint, code);
+	RECORD_STATS_CALL;
+	RECORD_GOVERN_CALL;
+	RECORD_BEGIN(TRACER_RECORD_PYCALL);
+	DUMP_VARINT(&self->stream, argcount);
 	int i;
 	for (i = 0; i < argcount; i++) {
 		PROPAGATE(_tracer_dump_argument(self, args[i]));
@@ -315,47 +1283,60 @@ errcode_t tracer_pyfunc_call(tracer_t * self, PyCodeObject * code, int argcount,
 
 errcode_t tracer_pyfunc_return(tracer_t * self, PyCodeObject * code, PyObject * retval)
 {
+	RECORD_CODEPOINT(_tracer_get_codeobj_codepoint, code);
+	RECORD_STATS_RETURN;
+	RECORD_GOVERN_RETURN;
 	self->depth -= 1;
-	RECORD_HEADER(TRACER_RECORD_PYRET, _tracer_get_codeobj_codepoint, code);
+	RECORD_BEGIN(TRACER_RECORD_PYRET);
 	PROPAGATE(_tracer_dump_argument(self, retval));
 	RECORD_FINALIZE;
 }
 
+/*
+ * exctype isn't recorded, and may well be NULL (the thread state of a new
+ * thread doesn't have it set when the profile hook sees the exception)
+ */
 errcode_t tracer_pyfunc_raise(tracer_t * self, PyCodeObject * code,
 		PyObject * exctype)
 {
-	if (exctype == NULL) {
-		return ERR_TRACER_NO_EXCEPTION_SET;
-	}
-
-	RECORD_HEADER(TRACER_RECORD_PYRAISE, _tracer_get_codeobj_codepoint, code);
+	RECORD_CODEPOINT(_tracer_get_codeobj_codepoint, code);
+	RECORD_STATS_RETURN;
+	RECORD_GOVERN_RETURN;
+	// the function is left by the exception
+	self->depth -= 1;
+	RECORD_BEGIN(TRACER_RECORD_PYRAISE);
 	//PROPAGATE(_tracer_dump_exception(self, exctype));
 	RECORD_FINALIZE;
 }
 
 errcode_t tracer_cfunc_call(tracer_t * self, PyCFunctionObject * func)
 {
-	RECORD_HEADER(TRACER_RECORD_CCALL, _tracer_get_cfunc_codepoint, func);
+	RECORD_CODEPOINT(_tracer_get_cfunc_codepoint, func);
+	RECORD_STATS_CALL;
+	RECORD_GOVERN_CALL;
+	RECORD_BEGIN(TRACER_RECORD_CCALL);
 	self->depth += 1;
 	RECORD_FINALIZE;
 }
 
 errcode_t tracer_cfunc_return(tracer_t * self, PyCFunctionObject * func)
 {
+	RECORD_CODEPOINT(_tracer_get_cfunc_codepoint, func);
+	RECORD_STATS_RETURN;
+	RECORD_GOVERN_RETURN;
 	self->depth -= 1;
-	RECORD_HEADER(TRACER_RECORD_CRET, _tracer_get_cfunc_codepoint, func);
+	RECORD_BEGIN(TRACER_RECORD_CRET);
 	RECORD_FINALIZE;
 }
 
 errcode_t tracer_cfunc_raise(tracer_t * self, PyCFunctionObject * func,
 		PyObject * exctype)
 {
-	if (exctype == NULL) {
-		return ERR_TRACER_NO_EXCEPTION_SET;
-	}
+	RECORD_CODEPOINT(_tracer_get_cfunc_codepoint, func);
+	RECORD_STATS_RETURN;
+	RECORD_GOVERN_RETURN;
 	self->depth -= 1;
-
-	RECORD_HEADER(TRACER_RECORD_CRAISE, _tracer_get_cfunc_codepoint, func);
+	RECORD_BEGIN(TRACER_RECORD_CRAISE);
 	//PROPAGATE(_tracer_dump_exception(self, exctype));
 	RECORD_FINALIZE;
 }
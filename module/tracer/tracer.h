@@ -2,12 +2,17 @@
 #define TRACER_H_INCLUDED
 
 #include "python.h"
+#include "../lib/cpstats.h"
 #include "../lib/errors.h"
+#include "../lib/flightrec.h"
+#include "../lib/governor.h"
 #include "../lib/hptime.h"
-#include "../lib/htable.h"
-#include "../lib/listfile.h"
+#include "../lib/registry.h"
 #include "../lib/rotdir.h"
 #include "../lib/rotrec.h"
+#include "../lib/rules.h"
+#include "../lib/spscring.h"
+#include "../lib/sreader.h"
 #include "../lib/swriter.h"
 
 #define TRACER_RECORD_INVALID 0
@@ -18,6 +23,16 @@
 #define TRACER_RECORD_CRET    5
 #define TRACER_RECORD_CRAISE  6
 #define TRACER_RECORD_LOG     7
+#define TRACER_RECORD_SYNC    8
+#define TRACER_RECORD_SAMPLE  9
+#define TRACER_RECORD_SUPPRESSED 10
+
+// the first byte of a (version 2) record: the type, and the change in depth
+// since the previous record, zigzagged, or the escape if it doesn't fit (and
+// follows as an svarint). see "Trace records" in tracer.c
+#define TRACER_HEADER_TYPE_MASK      (0x1f)
+#define TRACER_HEADER_DEPTH_SHIFT    (5)
+#define TRACER_HEADER_DEPTH_ESCAPE   (7)
 
 #define TRACER_CODEPOINT_INVALID  0
 #define TRACER_CODEPOINT_LOGLINE  1
@@ -34,29 +49,155 @@
 #define TRACER_PYOBJ_STR        7
 #define TRACER_PYOBJ_TYPE       8
 #define TRACER_PYOBJ_OID        9
+#define TRACER_PYOBJ_VARINT     10
+#define TRACER_PYOBJ_LONG_LIMBS 11
+#define TRACER_PYOBJ_DOUBLE     12
 
 #define TRACER_PYOBJ_MIN_IMM_INT   (-20)
 #define TRACER_PYOBJ_MAX_IMM_INT   (30)
 #define TRACER_PYOBJ_IMMINT_0      50
+#define TRACER_PYOBJ_MAX_LONG_LIMBS  (8)
 
+#define TRACER_FORMAT_VERSION      (2)
 #define TRACER_TIMEINDEX_INTERVAL  (1000000)
+// every record reserves TRACER_MAX_RECORD_SIZE in the ring, so a smaller
+// ring would hardly ever have room
+#define TRACER_MIN_RING_SIZE       (4 * TRACER_MAX_RECORD_SIZE)
+#define TRACER_MAX_RECORD_SIZE     (16 * 1024)
+// the same goes for the rotrec: a window must hold a whole record (and its
+// length), and a file that and a bit more (its sync record and footer)
+#define TRACER_MIN_MAP_SIZE        (TRACER_MAX_RECORD_SIZE + sizeof(rotret_record_size_t))
+#define TRACER_MIN_FILE_SIZE       (2 * TRACER_MAX_RECORD_SIZE)
+// the window over which the governor measures call rates, in usec
+#define TRACER_GOVERNOR_WINDOW     (1000000)
+// the flight recorder's ring is made of chunks of this size, each of
+// which can be dumped on its own
+#define TRACER_FLIGHT_CHUNK_SIZE   (256 * 1024)
+// the size of the ring that holds back a subtree in tail capture mode
+#define TRACER_DEFAULT_CAPTURE_SIZE (4 * 1024 * 1024)
+// the codepoint registry grows as needed, this is just a starting point
+#define TRACER_INITIAL_CODEPOINTS  (4096)
+// as does the stack of calls whose times are accounted for in the stats
+#define TRACER_INITIAL_STATS_FRAMES (256)
+
+// codepoints are numbered by their order in the codepoints file, and are
+// written as varints, so the first 128 take a single byte
+typedef uint32_t codepoint_t;
+
+/*
+ * a direct-mapped cache of the codepoints a tracer has already looked up,
+ * in front of the (shared) registry. python 2.7 code objects and
+ * PyMethodDefs have no room to hold an ID of their own, so the cache is
+ * indexed by the key's address instead, and an entry is only used if its
+ * key matches. matching addresses are enough only because a key can't be
+ * freed and its address reused while it's cached: every key in the cache
+ * is in the registry, which holds the objects it's keyed by (PyMethodDefs
+ * are static), and the registry outlives the tracer. it also caches the
+ * flags the ignore rules gave the codepoint, which are only valid if the
+ * rules' generation didn't change
+ */
+#define TRACER_CPCACHE_BITS   (10)
+#define TRACER_CPCACHE_SIZE   (1 << TRACER_CPCACHE_BITS)
+
+typedef struct _tracer_cpcache_entry_t {
+	const void *  key;
+	codepoint_t   codepoint;
+	uint32_t      flags;
+	uint32_t      generation;
+} tracer_cpcache_entry_t;
 
-typedef struct {
+// the flags are also kept in the codepoint's registry tag, so they're only
+// matched once for all tracers: the tag holds the flags (which must not use
+// these bits) and the low bits of the generation they're of
+#define TRACER_TAG_GENERATION_MASK  (0x00ffffff)
+
+// a call in progress, for the stats: when it started, and how long the calls
+// it made took (so its exclusive time is what's left), in timestamp units
+typedef struct _tracer_stats_frame_t {
+	usec_t     start;
+	usec_t     children;
+} tracer_stats_frame_t;
+
+typedef struct _tracer_t {
+	// the process that created the tracer (see tracer_fini)
+	pid_t      pid;
 	int        depth;
+	// timestamps are in usec, or in hptime ticks if raw_time is set
+	int        raw_time;
+	usec_t     timeindex_interval;
 	usec_t     next_timestamp;
+	int        generation;
+	int        last_depth;
+	usec_t     last_timestamp;
+	// the depth and timestamp of the record being encoded, which become the
+	// last ones only once it's committed
+	int        record_depth;
+	usec_t     record_timestamp;
 	rotrec_t   records;
 	swriter_t  stream;
-	swriter_t  cpstream;
-	listfile_t codepoints;
-	listfile_t timeindex;
-	htable_t   table;
+	registry_t * codepoints;
+	rules_t *  rules;
+	tracer_cpcache_entry_t cpcache[TRACER_CPCACHE_SIZE];
+	// the rotdir's codepoint stats, if it keeps them (NULL otherwise)
+	cpstats_t * stats;
+	tracer_stats_frame_t * stats_frames;
+	int        stats_depth;
+	int        stats_capacity;
+	// suppresses codepoints that are called too often (if governed)
+	int        governed;
+	governor_t governor;
+
+	// async mode
+	int        async;
+	int        drop_when_full;
+	int        dropping;
+	uint64_t   dropped_records;
+	void *     dropbuf;
+	spscring_t ring;
+	// flight recorder mode
+	int        flight;
+	uint64_t   flight_generation;
+	flightrec_t flightrec;
+	// tail capture mode: only subtrees that took at least capture_threshold
+	// are written, the rest of the records are thrown away (except for
+	// summaries). capture_follows is set if the rotrec's last record is the
+	// last one committed, so the next can follow it without a sync record
+	int        capture;
+	int        capture_follows;
+	usec_t     capture_threshold;
+	int        capturing;
+	int        capture_overflowed;
+	usec_t     capture_start;
+	int        capture_last_depth;
+	usec_t     capture_last_timestamp;
+	spscring_t capture_ring;
+	uint64_t   captured_subtrees;
+	uint64_t   discarded_subtrees;
+	// used by the flusher thread (and by dumps of the flight recorder)
+	volatile errcode_t  flush_error;
+	int                 flushed_depth;
+	usec_t              flushed_timestamp;
+	struct _tracer_t *  next_flushed;
 } tracer_t;
 
 
-errcode_t tracer_init(tracer_t * self, rotdir_t * dir, const char * prefix,
-		size_t map_size, size_t file_size);
+errcode_t tracer_init(tracer_t * self, rotdir_t * dir, registry_t * codepoints,
+		cpstats_t * stats, rules_t * rules, const char * prefix, size_t map_size,
+		size_t file_size, size_t ring_size, int drop_when_full, size_t flight_size,
+		usec_t capture_threshold, size_t capture_size, int prealloc_percent, int map_flags,
+		int raw_time, int max_call_rate);
 errcode_t tracer_fini(tracer_t * self);
+errcode_t tracer_flush(tracer_t * self, OUT int * outcount);
+errcode_t tracer_dump(tracer_t * self, size_t max_size, usec_t max_age, OUT int * outcount);
+errcode_t tracer_capture_begin(tracer_t * self);
+errcode_t tracer_capture_end(tracer_t * self);
+errcode_t tracer_get_codeobj_flags(tracer_t * self, PyCodeObject * code,
+		PyObject * globals, OUT int * outflags);
+errcode_t tracer_get_cfunc_flags(tracer_t * self, PyCFunctionObject * func,
+		OUT int * outflags);
 errcode_t tracer_log(tracer_t * self, PyObject * fmtstr, PyObject * argstuple);
+errcode_t tracer_sample(tracer_t * self, uint64_t unsampled);
+void tracer_count_sampled(tracer_t * self, int sample_depth, int sampled);
 errcode_t tracer_pyfunc_call(tracer_t * self, PyCodeObject * code, int argcount,
 		PyObject * args[]);
 errcode_t tracer_pyfunc_return(tracer_t * self, PyCodeObject * code,
@@ -2,15 +2,39 @@
 passover filestructs: reading the codepoints file and the traces
 """
 import os
+import re
+import mmap
+import heapq
+import array
+import collections
+import multiprocessing
+from multiprocessing.pool import ThreadPool
 from cStringIO import StringIO
 from struct import Struct, error as StructError
+import lzblock
+try:
+    import _passover
+except ImportError:
+    _passover = None
 
 
 UINT8 = Struct("=B")
 UINT16 = Struct("=H")
 UINT32 = Struct("=L")
 UINT64 = Struct("=Q")
+DOUBLE = Struct("=d")
 TIMEINDEX_RECORD = Struct("=QQ")
+TOPINDEX_HEADER = Struct("=IHHII")
+TOPINDEX_ENTRY = Struct("=QQQ")
+TOPINDEX_MAGIC = 0x49545650
+TOPINDEX_DELETED = 0
+ROTREC_FOOTER = Struct("=QQIHH")
+ROTREC_FOOTER_MAGIC = 0x4650
+ROTREC_INDEX_ENTRY = Struct("=QQ")
+STATS_HEADER = Struct("=IHHIIIIQQI")
+STATS_MAGIC = 0x54535650
+STATS_VERSION = 2
+STATS_HEADER_SIZE = 4096
 
 class BinaryRecord(object):
     TYPE = None
@@ -33,17 +57,40 @@ class BinaryRecord(object):
     def read_str(cls, stream):
         length = cls.read_uint16(stream)
         return stream.read(length)
+    @classmethod
+    def read_double(cls, stream):
+        return DOUBLE.unpack(stream.read(DOUBLE.size))[0]
+    @classmethod
+    def read_varint(cls, stream):
+        value = 0
+        shift = 0
+        while True:
+            ch = stream.read(1)
+            if not ch:
+                raise StructError("truncated varint")
+            b = ord(ch)
+            value |= (b & 0x7f) << shift
+            if b < 0x80:
+                return value
+            shift += 7
+    @classmethod
+    def read_svarint(cls, stream):
+        value = cls.read_varint(stream)
+        return (value >> 1) ^ -(value & 1)
     
     def parse(self, stream):
         raise NotImplementedError()
     
     @classmethod
-    def load(cls, data):
-        assert not cls.TYPE
+    def concrete_record(cls, type):
         if not cls.CONCRETE_RECORDS:
             cls.CONCRETE_RECORDS = dict((subcls.TYPE, subcls) 
                 for subcls in cls.__subclasses__() if subcls.TYPE)
-
+        return cls.CONCRETE_RECORDS[type]
+    
+    @classmethod
+    def load(cls, data):
+        assert not cls.TYPE
         stream = StringIO(data)
         try:
             type = cls.read_uint8(stream)
@@ -51,7 +98,7 @@ class BinaryRecord(object):
             type = 0
         if type == 0:
             raise EOFError
-        inst = cls.CONCRETE_RECORDS[type]()
+        inst = cls.concrete_record(type)()
         inst.parse(stream)
         return inst
 
@@ -59,7 +106,13 @@ class BinaryRecord(object):
 # codepoints
 #===============================================================================
 class CodepointRecord(BinaryRecord):
-    pass
+    @classmethod
+    def from_native(cls, cp):
+        """builds a codepoint from what _passover.load_codepoints returns"""
+        inst = cls.concrete_record(cp[0])()
+        for name, value in zip(inst.__slots__, cp[1:]):
+            setattr(inst, name, value)
+        return inst
 
 class LoglineCodepoint(CodepointRecord):
     TYPE = 1
@@ -94,13 +147,51 @@ class Undumpable(object):
         return "Undumpable"
 Undumpable = Undumpable()
 
+class DecoderState(object):
+    """the running depth and timestamp of a version 2 trace, which records
+    only store as changes relative to the previous record. if the trace has
+    raw timestamps (clock ticks), sync records also carry a clock sync:
+    (ticks_per_sec, ticks, monotonic_ns, realtime_ns)"""
+    __slots__ = ["depth", "timestamp", "clock"]
+    
+    def __init__(self):
+        self.reset()
+    
+    def reset(self):
+        self.depth = None
+        self.timestamp = None
+        self.clock = None
+    
+    @property
+    def synced(self):
+        return self.timestamp is not None
+    
+    def get_time_ns(self):
+        """the current timestamp as nanoseconds of wall time"""
+        if self.clock is None:
+            return self.timestamp * 1000
+        ticks_per_sec, ticks, monotonic_ns, realtime_ns = self.clock
+        return realtime_ns + (self.timestamp - ticks) * 1000000000 // ticks_per_sec
+    
+    def get_duration_ns(self, duration):
+        """converts a duration in the units of the timestamps to nanoseconds"""
+        if self.clock is None:
+            return duration * 1000
+        return duration * 1000000000 // self.clock[0]
+
 class TraceRecord(BinaryRecord):
-    __slots__ = ["depth", "timestamp", "cpindex", "_codepoints"]
+    __slots__ = ["depth", "timestamp", "timestamp_ns", "cpindex", "version", 
+        "_codepoints"]
 
     MIN_IMM_INT = -20
     MAX_IMM_INT = 30
     IMMINT_0 = 50    
     
+    SYNC = 8
+    HEADER_TYPE_MASK = 0x1f
+    HEADER_DEPTH_SHIFT = 5
+    HEADER_DEPTH_ESCAPE = 7
+    
     ARGUMENT_READERS = {
         0: lambda cls, stream: None,
         1: lambda cls, stream: Undumpable,
@@ -110,22 +201,107 @@ class TraceRecord(BinaryRecord):
         5: lambda cls, stream: long(cls.read_str(stream)),
         6: lambda cls, stream: float(cls.read_str(stream)),
         7: lambda cls, stream: cls.read_str(stream),
+        10: lambda cls, stream: int(cls.read_svarint(stream)),
+        11: lambda cls, stream: cls.read_long_limbs(stream),
+        12: lambda cls, stream: cls.read_double(stream),
     }
     for i in range(MIN_IMM_INT, MAX_IMM_INT + 1):
         ARGUMENT_READERS[IMMINT_0 + i] = (lambda cls, stream, i = i: i)
     
     def parse_header(self, stream):
         self.depth = self.read_uint16(stream)
-        self.timestamp = self.read_uint64(stream) / 1000000.0 # in usecs
+        usecs = self.read_uint64(stream)
+        self.timestamp = usecs / 1000000.0
+        self.timestamp_ns = usecs * 1000
         self.cpindex = self.read_uint16(stream)
     
     def parse_body(self, stream):
         raise NotImplementedError()
     
+    def set_payload(self, payload):
+        """sets what a _passover.TraceFile decoded from the body"""
+        pass
+    
+    def get_payload(self):
+        return None
+    
+    def apply_state(self, state):
+        """called once a version 2 record is parsed, for anything in its 
+        body that depends on the decoder state"""
+        pass
+    
     def parse(self, stream):
         self.parse_header(stream)
         self.parse_body(stream)
     
+    @classmethod
+    def load(cls, data, version = 1, state = None):
+        """decodes a single record. version 2 records need the decoder state
+        of the trace they belong to; sync records (and any record that comes
+        before the first sync record) only update the state and return None
+        """
+        stream = StringIO(data)
+        try:
+            header = cls.read_uint8(stream)
+        except StructError:
+            header = 0
+        if version < 2:
+            type = header
+        else:
+            type = header & cls.HEADER_TYPE_MASK
+        if type == 0:
+            raise EOFError
+        if version < 2:
+            inst = cls.concrete_record(type)()
+            inst.version = version
+            inst.parse(stream)
+            return inst
+        
+        if type == cls.SYNC:
+            state.depth = cls.read_svarint(stream)
+            state.timestamp = cls.read_varint(stream)
+            if stream.tell() < len(data):
+                state.clock = tuple(cls.read_varint(stream) for i in range(4))
+            return None
+        if not state.synced:
+            return None
+        
+        depth_code = header >> cls.HEADER_DEPTH_SHIFT
+        if depth_code == cls.HEADER_DEPTH_ESCAPE:
+            state.depth += cls.read_svarint(stream)
+        else:
+            state.depth += (depth_code >> 1) ^ -(depth_code & 1)
+        state.timestamp += cls.read_svarint(stream)
+        
+        inst = cls.concrete_record(type)()
+        inst.version = version
+        inst.depth = state.depth
+        inst.timestamp_ns = state.get_time_ns()
+        inst.timestamp = inst.timestamp_ns / 1000000000.0
+        inst.cpindex = cls.read_varint(stream) # up to 32 bits
+        inst.parse_body(stream)
+        inst.apply_state(state)
+        return inst
+    
+    @classmethod
+    def from_native(cls, record, version, codepoints):
+        """builds a record from a _passover.TraceFile record, (type, depth, 
+        timestamp_ns, cpindex, payload)"""
+        type, depth, timestamp_ns, cpindex, payload = record
+        inst = cls.concrete_record(type)()
+        inst.version = version
+        inst.depth = depth
+        inst.timestamp_ns = timestamp_ns
+        inst.timestamp = timestamp_ns / 1000000000.0
+        inst.cpindex = cpindex
+        inst._codepoints = codepoints
+        inst.set_payload(payload)
+        return inst
+    
+    def to_native(self):
+        return (self.TYPE, self.depth, self.timestamp_ns, self.cpindex, 
+            self.get_payload())
+    
     @property
     def codepoint(self):
         try:
@@ -133,6 +309,21 @@ class TraceRecord(BinaryRecord):
         except IndexError:
             return None
     
+    def read_count(self, stream):
+        if self.version < 2:
+            return self.read_uint16(stream)
+        else:
+            return self.read_varint(stream)
+    
+    @classmethod
+    def read_long_limbs(cls, stream):
+        size = cls.read_svarint(stream)
+        shift = cls.read_uint8(stream)
+        value = 0L
+        for i in range(abs(size)):
+            value |= long(cls.read_varint(stream)) << (shift * i)
+        return -value if size < 0 else value
+    
     @classmethod
     def read_argument(cls, stream):
         type = cls.read_uint8(stream)
@@ -147,8 +338,14 @@ class PyFuncCall(TraceRecord):
     __slots__ = ["args"]
     
     def parse_body(self, stream):
-        count = self.read_uint16(stream)
+        count = self.read_count(stream)
         self.args = [self.read_argument(stream) for i in range(count)]
+    
+    def set_payload(self, payload):
+        self.args = payload
+    
+    def get_payload(self):
+        return tuple(self.args)
 
 class PyFuncRet(TraceRecord):
     TYPE = 2
@@ -156,6 +353,12 @@ class PyFuncRet(TraceRecord):
     
     def parse_body(self, stream):
         self.retval = self.read_argument(stream)
+    
+    def set_payload(self, payload):
+        self.retval = payload
+    
+    def get_payload(self):
+        return self.retval
 
 class PyFuncRaise(TraceRecord):
     TYPE = 3
@@ -192,8 +395,50 @@ class LogRecord(TraceRecord):
     __slots__ = ["args"]
     
     def parse_body(self, stream):
-        count = self.read_uint16(stream)
-        self.args = [self.read_str(stream) for i in range(count)]        
+        count = self.read_count(stream)
+        self.args = [self.read_str(stream) for i in range(count)]
+    
+    def set_payload(self, payload):
+        self.args = payload
+    
+    def get_payload(self):
+        return tuple(self.args)
+
+class SampleRecord(TraceRecord):
+    """precedes a sampled call, when `unsampled` calls (at the same depth, 
+    with their subtrees) were skipped since the previous sampled one"""
+    TYPE = 9
+    __slots__ = ["unsampled"]
+    
+    def parse_body(self, stream):
+        self.unsampled = self.read_varint(stream)
+    
+    def set_payload(self, payload):
+        self.unsampled = payload
+    
+    def get_payload(self):
+        return self.unsampled
+
+class SuppressedRecord(TraceRecord):
+    """a summary of the calls of a codepoint that the tracer stopped recording
+    because it was called too often: the number of calls since the previous
+    summary, and their total duration (in seconds)"""
+    TYPE = 10
+    __slots__ = ["calls", "total_time"]
+    
+    def parse_body(self, stream):
+        self.calls = self.read_varint(stream)
+        self.total_time = self.read_varint(stream)
+    
+    def apply_state(self, state):
+        self.total_time = state.get_duration_ns(self.total_time) / 1000000000.0
+    
+    def set_payload(self, payload):
+        self.calls, total_ns = payload
+        self.total_time = total_ns / 1000000000.0
+    
+    def get_payload(self):
+        return (self.calls, int(round(self.total_time * 1000000000)))
 
 #===============================================================================
 # Files
@@ -207,26 +452,28 @@ def recfile_reader(file):
         yield file.read(length)
 
 def bisect(data, value, keyfunc = lambda obj: obj, lo = 0, hi = None):
+    """returns the index after the last item whose key is <= value's key"""
     if hi is None:
-        hi = len(a)
+        hi = len(data)
     key = keyfunc(value)
     while lo < hi:
         mid = (lo + hi) // 2
         mkey = keyfunc(data[mid])
-        if mkey < key:
-            lo = mid + 1
-        elif mkey > key: 
+        if key < mkey:
             hi = mid
+        else:
+            lo = mid + 1
     return lo
 
 class RotdirFile(object):
-    __slots__ = ["file", "index", "min_offset", "max_offset"]
+    __slots__ = ["file", "index", "min_offset", "max_offset", "version"]
     
-    def __init__(self, file, index, min_offset, max_offset):
+    def __init__(self, file, index, min_offset, max_offset, version):
         self.file = file
         self.index = index
         self.min_offset = min_offset
         self.max_offset = max_offset
+        self.version = version
     
     def __contains__(self, offset):
         return self.min_offset <= offset < self.max_offset
@@ -237,10 +484,128 @@ class RotdirFile(object):
     def read(self, count):
         return self.file.read(count)
 
-ROTREC_HEADER = UINT64
+ROTREC_HEADER_V1 = UINT64
+ROTREC_HEADER_V2 = Struct("=QHHHH")
+ROTREC_MAGIC = 0x5650
+ROTREC_HEADER_COMPRESSED = 0x0001
+ROTZIP_HEADER = Struct("=IIQ")
+
+def read_rotrec_header(file):
+    """returns (base_offset, version, header_size, flags) of a rotrec file. 
+    version 1 files start with a bare base offset; later versions follow it 
+    with a zero marker, a magic, the version number and flags"""
+    data = file.read(ROTREC_HEADER_V2.size)
+    if len(data) < ROTREC_HEADER_V1.size:
+        return None
+    if len(data) == ROTREC_HEADER_V2.size:
+        base_offset, marker, magic, version, flags = ROTREC_HEADER_V2.unpack(data)
+        if marker == 0 and magic == ROTREC_MAGIC:
+            return base_offset, version, ROTREC_HEADER_V2.size, flags
+    base_offset, = ROTREC_HEADER_V1.unpack(data[:ROTREC_HEADER_V1.size])
+    return base_offset, 1, ROTREC_HEADER_V1.size, 0
+
+class RotzipFile(object):
+    """a read-only file-like view of a compressed rotrec file, that looks like
+    the original (uncompressed) file. only the blocks that are actually read
+    are decompressed"""
+    __slots__ = ["file", "header_size", "block_size", "data_size", "offsets", 
+        "pos", "block_index", "block"]
+    
+    def __init__(self, file, header_size):
+        self.file = file
+        self.header_size = header_size
+        file.seek(header_size)
+        self.block_size, count, self.data_size = ROTZIP_HEADER.unpack(
+            file.read(ROTZIP_HEADER.size))
+        table = Struct("=%dQ" % (count + 1,))
+        self.offsets = table.unpack(file.read(table.size))
+        self.pos = 0
+        self.block_index = None
+        self.block = None
+    
+    @property
+    def size(self):
+        """the size of the original file (without its zero-filled tail)"""
+        return self.header_size + self.data_size
+    
+    def _load_block(self, index):
+        if index != self.block_index:
+            start, end = self.offsets[index], self.offsets[index + 1]
+            size = min(self.block_size, self.data_size - index * self.block_size)
+            self.file.seek(start)
+            data = self.file.read(end - start)
+            if len(data) == size:
+                self.block = data # stored uncompressed
+            else:
+                self.block = lzblock.decompress(data, size)
+            self.block_index = index
+        return self.block
+    
+    def close(self):
+        self.file.close()
+    
+    def seek(self, pos):
+        self.pos = pos
+    
+    def read(self, count):
+        chunks = []
+        while count > 0:
+            data_pos = self.pos - self.header_size
+            if data_pos < 0 or data_pos >= self.data_size:
+                break
+            index, start = divmod(data_pos, self.block_size)
+            chunk = self._load_block(index)[start:start + count]
+            chunks.append(chunk)
+            self.pos += len(chunk)
+            count -= len(chunk)
+        return "".join(chunks)
+
+def open_rotrec_file(filename):
+    """returns (base_offset, version, header_size, file) of a rotrec file, 
+    where file is positioned at the first record, or None if it's not a 
+    rotrec file"""
+    file = open(filename, "rb")
+    header = read_rotrec_header(file)
+    if not header:
+        file.close()
+        return None
+    base_offset, version, header_size, flags = header
+    if flags & ROTREC_HEADER_COMPRESSED:
+        file = RotzipFile(file, header_size)
+    file.seek(header_size)
+    return base_offset, version, header_size, file
+
+def read_rotrec_footer(filename):
+    """returns (min_timestamp, max_timestamp, index) of a sealed rotrec file,
+    where index is a list of (timestamp, offset) pairs in ascending order, or
+    None if the file has no footer (it's still being written)"""
+    f = open(filename, "rb")
+    try:
+        size = os.fstat(f.fileno()).st_size
+        if size < ROTREC_FOOTER.size:
+            return None
+        f.seek(size - ROTREC_FOOTER.size)
+        min_ts, max_ts, count, magic, version = ROTREC_FOOTER.unpack(
+            f.read(ROTREC_FOOTER.size))
+        index_size = count * ROTREC_INDEX_ENTRY.size
+        if magic != ROTREC_FOOTER_MAGIC or index_size + ROTREC_FOOTER.size > size:
+            return None
+        f.seek(size - ROTREC_FOOTER.size - index_size)
+        data = f.read(index_size)
+        index = [ROTREC_INDEX_ENTRY.unpack_from(data, i * ROTREC_INDEX_ENTRY.size)
+            for i in range(count)]
+        return min_ts, max_ts, index
+    finally:
+        f.close()
+
+def get_rotrec_file_size(file):
+    if isinstance(file, RotzipFile):
+        return file.size
+    return os.fstat(file.fileno()).st_size
 
 class RotdirReader(object):
-    __slots__ = ["path", "files", "min_offset", "max_offset", "curr_file", "curr_offset"]
+    __slots__ = ["path", "files", "min_offset", "max_offset", "curr_file", "curr_offset",
+        "curr_native"]
     
     def __init__(self, path, prefix):
         self.path = path
@@ -249,19 +614,23 @@ class RotdirReader(object):
         self.files = []
         for fn in files:
             fn = os.path.join(self.path, fn)
-            data = open(fn, "rb").read(ROTREC_HEADER.size)
-            if len(data) != ROTREC_HEADER.size:
-                break
-            base_offset, = ROTREC_HEADER.unpack(data)
-            self.files.append((base_offset, fn))
+            info = open_rotrec_file(fn)
+            if not info:
+                continue
+            base_offset, version, header_size, file = info
+            self.files.append((base_offset, fn, version, header_size))
+            file.close()
         if not self.files:
             raise ValueError("")
         self.files.sort(key = lambda obj: obj[0])
         self.min_offset = self.files[0][0]
-        last_base, last_fn = self.files[-1]
-        self.max_offset = last_base + os.stat(last_fn).st_size
+        last_base, last_fn, _, _ = self.files[-1]
+        _, _, _, file = open_rotrec_file(last_fn)
+        self.max_offset = last_base + get_rotrec_file_size(file)
+        file.close()
         self.curr_file = None
         self.curr_offset = None
+        self.curr_native = None
     
     def _get_file_index(self, offset):
         if offset < self.min_offset or offset > self.max_offset:
@@ -271,21 +640,41 @@ class RotdirReader(object):
         assert i > 0
         return i - 1
 
+    def find_timestamp(self, base_offset, timestamp):
+        """returns the offset of the last indexed record of the file at
+        base_offset whose timestamp is <= the given one (or the file's
+        first record)"""
+        i = bisect(self.files, [base_offset], keyfunc = lambda obj: obj[0])
+        if i == 0 or self.files[i - 1][0] != base_offset:
+            raise ValueError("no file at offset %r" % (base_offset,))
+        _, fn, _, header_size = self.files[i - 1]
+        footer = read_rotrec_footer(fn)
+        if footer:
+            _, _, index = footer
+            j = bisect(index, [timestamp], keyfunc = lambda obj: obj[0])
+            if j > 0:
+                return index[j - 1][1]
+        return base_offset + header_size
+
     def _select(self, index):
-        base, fn = self.files[index]
+        base, fn, version, header_size = self.files[index]
         if index == len(self.files) - 1:
             max = self.max_offset
         else:
-            max, _ = self.files[index + 1]
-        file = open(fn, "rb")
-        file.seek(ROTREC_HEADER.size)
-        self.curr_file = RotdirFile(file, index, base, max)
+            max = self.files[index + 1][0]
+        # the file may have been compressed since we listed the directory
+        _, _, _, file = open_rotrec_file(fn)
+        self.curr_file = RotdirFile(file, index, base, max, version)
     
     def _select_next(self):
-        if self.curr_file.index + 1 > len(self.files):
+        if self.curr_file.index + 1 >= len(self.files):
             raise EOFError()
         self._select(self.curr_file.index + 1)
     
+    @property
+    def version(self):
+        return self.curr_file.version
+    
     def seek(self, offset):
         self._select(self._get_file_index(offset))
         self.curr_file.seek(offset)
@@ -295,6 +684,9 @@ class RotdirReader(object):
             length, = UINT16.unpack(self.curr_file.read(UINT16.size))
         except StructError:
             raise EOFError()
+        if length == 0:
+            # the rest of the file is zero-filled
+            raise EOFError()
         data = self.curr_file.read(length)
         #if len(data) != length:
         #    raise EOFError()
@@ -303,21 +695,165 @@ class RotdirReader(object):
     def read_record(self):
         if self.curr_file is None:
             self._select(0)
+        while True:
+            try:
+                return self._read_record()
+            except EOFError:
+                self._select_next()
+    
+    #
+    # native decoding (_passover.TraceFile), where records come already 
+    # decoded, as (type, depth, timestamp_ns, cpindex, payload)
+    #
+    def _select_native(self, index):
+        base, fn, version, header_size = self.files[index]
+        self.curr_native = (index, _passover.TraceFile(fn, Undumpable))
+    
+    @property
+    def native_version(self):
+        return self.curr_native[1].version
+    
+    def seek_native(self, offset):
+        index = self._get_file_index(offset)
+        self._select_native(index)
+        self.curr_native[1].seek(offset - self.files[index][0])
+    
+    def _read_native(self, read, *args):
+        """calls read (a TraceFile method) on the current file, moving on to 
+        the next file while it returns nothing; raises EOFError at the end"""
+        if self.curr_native is None:
+            self._select_native(0)
+        while True:
+            index, tracefile = self.curr_native
+            res = read(tracefile, *args)
+            if len(res):
+                return res
+            if index + 1 >= len(self.files):
+                raise EOFError()
+            self._select_native(index + 1)
+    
+    def read_native(self):
+        if self.curr_native is None:
+            self._select_native(0)
+        while True:
+            index, tracefile = self.curr_native
+            try:
+                return tracefile.read()
+            except EOFError:
+                if index + 1 >= len(self.files):
+                    raise
+                self._select_native(index + 1)
+    
+    def read_native_batch(self, count, payloads = True):
+        """returns a list of up to count records (of a single file)"""
+        return self._read_native(_passover.TraceFile.read_batch, count, payloads)
+    
+    def read_native_columns(self, count, payloads = True):
+        """returns up to count records (of a single file) as TraceColumns"""
+        return self._read_native(_passover.TraceFile.read_columns, count, payloads)
+
+COLUMNS_SIZE = 100000
+
+class ColumnBatch(object):
+    """the pure python counterpart of _passover.TraceColumns, without the 
+    payload heap"""
+    __slots__ = ["type", "depth", "timestamp", "codepoint", "payloads"]
+    
+    def __init__(self, batch, payloads = True):
+        self.type = array.array("B", (rec[0] for rec in batch))
+        self.depth = array.array("i", (rec[1] for rec in batch))
+        self.timestamp = array.array("L", (rec[2] for rec in batch))
+        self.codepoint = array.array("I", (rec[3] for rec in batch))
+        self.payloads = [rec[4] for rec in batch] if payloads else None
+    
+    def __len__(self):
+        return len(self.type)
+    
+    def payload(self, index):
+        if self.payloads is None:
+            raise ValueError("the payloads were not read")
+        return self.payloads[index]
+
+def read_file_columns(filename, count = COLUMNS_SIZE, payloads = True):
+    """decodes a whole trace (.rot) file into a list of columns of up to count
+    records each. every file starts with a sync record, so any file can be 
+    decoded on its own"""
+    chunks = []
+    if _passover is None:
+        base_offset, version, header_size, file = open_rotrec_file(filename)
+        state = DecoderState()
+        batch = []
         try:
-            return self._read_record()
+            for data in recfile_reader(file):
+                rec = TraceRecord.load(data, version, state)
+                if rec is None:
+                    continue
+                batch.append(rec.to_native())
+                if len(batch) >= count:
+                    chunks.append(ColumnBatch(batch, payloads))
+                    batch = []
         except EOFError:
-            self._select_next()
-            return self._read_record()
+            pass
+        finally:
+            file.close()
+        if batch:
+            chunks.append(ColumnBatch(batch, payloads))
+        return chunks
+    tracefile = _passover.TraceFile(filename, Undumpable)
+    while True:
+        columns = tracefile.read_columns(count, payloads)
+        if not len(columns):
+            break
+        chunks.append(columns)
+    return chunks
+
+def _file_chunks(base_offset, chunks):
+    return chunks
+
+def _map_file(args):
+    func, filename, base_offset, count, payloads = args
+    return func(base_offset, read_file_columns(filename, count, payloads))
+
+def _ordered_map(pool, func, items, window):
+    """like pool.imap, but with at most `window` items in flight"""
+    pending = collections.deque()
+    for item in items:
+        pending.append(pool.apply_async(func, (item,)))
+        if len(pending) >= window:
+            yield pending.popleft().get()
+    while pending:
+        yield pending.popleft().get()
 
 class TraceReader(object):
-    __slots__ = ["rotdir", "codepoints", "timeindex"]
-    def __init__(self, path, prefix):
+    """reads the records of a trace, in order. records are decoded natively 
+    (by _passover) when it's available, or by the classes above otherwise; 
+    pass native = False to force the latter"""
+    __slots__ = ["rotdir", "codepoints", "timeindex", "timeindex_version", "state",
+        "native", "eof"]
+    BATCH_SIZE = 1000
+    COLUMNS_SIZE = COLUMNS_SIZE
+    
+    def __init__(self, path, prefix, native = None):
+        if native is None:
+            native = _passover is not None
+        self.native = native
         self.rotdir = RotdirReader(path, prefix)
-        self.codepoints = self._load_codepoints(os.path.join(path, prefix + ".codepoints"))
-        self.timeindex = self._load_timeindex(os.path.join(path, prefix + ".timeindex"))
+        self.state = DecoderState()
+        self.eof = False
+        # the codepoints are shared by all the traces in the directory;
+        # older tracers wrote a codepoints file per trace
+        cpfile = os.path.join(path, prefix + ".codepoints")
+        if not os.path.exists(cpfile):
+            cpfile = os.path.join(path, "codepoints")
+        self.codepoints = self._load_codepoints(cpfile, native)
+        self.timeindex_version, self.timeindex = self._load_timeindex(
+            os.path.join(path, prefix + ".timeindex"), self.rotdir, native)
 
     @classmethod
-    def _load_codepoints(cls, filename):
+    def _load_codepoints(cls, filename, native = False):
+        if native:
+            return [CodepointRecord.from_native(cp) 
+                for cp in _passover.load_codepoints(filename)]
         codepoints = []
         for data in recfile_reader(open(filename, "rb")):
             try:
@@ -328,33 +864,167 @@ class TraceReader(object):
         return codepoints
 
     @classmethod
-    def _load_timeindex(cls, filename):
+    def _load_timeindex(cls, filename, rotdir, native = False):
+        """returns (version, timeindex), where timeindex is a list of 
+        (timestamp, offset) pairs in ascending order. in version 1, these 
+        point at sync records; in version 2, they are the first timestamp and
+        base offset of every file, and the file's footer points at the records
+        """
+        if native:
+            version, entries = _passover.load_timeindex(filename)
+            if version < 2:
+                return version, entries
+            existing = set(obj[0] for obj in rotdir.files)
+            timeindex = sorted((min_ts, base) for base, min_ts, max_ts in entries
+                if max_ts != TOPINDEX_DELETED and base in existing)
+            return version, timeindex
         f = open(filename, "rb")
+        data = f.read(TOPINDEX_HEADER.size)
+        if len(data) == TOPINDEX_HEADER.size:
+            magic, version, _, capacity, count = TOPINDEX_HEADER.unpack(data)
+            if magic == TOPINDEX_MAGIC:
+                data = f.read(TOPINDEX_ENTRY.size * min(count, capacity))
+                f.close()
+                existing = set(obj[0] for obj in rotdir.files)
+                timeindex = []
+                for i in range(len(data) // TOPINDEX_ENTRY.size):
+                    base, min_ts, max_ts = TOPINDEX_ENTRY.unpack_from(data, 
+                        i * TOPINDEX_ENTRY.size)
+                    # slots of deleted files are cleared, but a file may be
+                    # deleted between listing the rotdir and reading this
+                    if max_ts != TOPINDEX_DELETED and base in existing:
+                        timeindex.append((min_ts, base))
+                timeindex.sort()
+                return version, timeindex
+        f.seek(0)
         timeindex = []
-        while True:
-            data = f.read(TIMEINDEX_RECORD.size)
+        for data in recfile_reader(f):
             if len(data) != TIMEINDEX_RECORD.size:
                 break
             timestamp, offset = TIMEINDEX_RECORD.unpack(data)
             timeindex.append((timestamp, offset))
         f.close()
-        return timeindex
+        return 1, timeindex
     
     #
     # APIs
     #
+    @property
+    def version(self):
+        """the format version of the file being read"""
+        if self.native:
+            return self.rotdir.native_version
+        return self.rotdir.version
+    
     def seek_to_offset(self, offset):
-        self.rotdir.seek(offset)
+        """seeks to the given offset. for version 2 traces, records are only
+        returned starting at the first sync record at or after the offset;
+        the offsets in the timeindex are always sync records"""
+        if self.native:
+            self.rotdir.seek_native(offset)
+        else:
+            self.rotdir.seek(offset)
+            self.state.reset()
+            self.eof = False
     
     def seek_to_timestamp(self, timestamp):
+        """seeks to the last indexed sync record whose timestamp (usec) is <= 
+        the given one, or to the first record if there's none. in version 2 
+        of the timeindex, this is two bisections: of the files, then of the 
+        file's own index"""
         i = bisect(self.timeindex, [timestamp], keyfunc = lambda obj: obj[0])
-        assert i > 0
+        if i == 0:
+            base_offset, fn, version, header_size = self.rotdir.files[0]
+            self.seek_to_offset(base_offset + header_size)
+            return
         ts, offset = self.timeindex[i - 1]
+        if self.timeindex_version >= 2:
+            offset = self.rotdir.find_timestamp(offset, timestamp)
         self.seek_to_offset(offset)
     
+    def read_batch(self, count = BATCH_SIZE, payloads = True):
+        """returns a list of up to count records as (type, depth, timestamp_ns,
+        cpindex, payload) tuples, where the payload is what the record holds
+        (see _passover.TraceFile), or None if payloads is False. this is
+        much cheaper than building record objects. raises EOFError at the end
+        """
+        if not self.native:
+            if self.eof:
+                raise EOFError()
+            batch = []
+            try:
+                while len(batch) < count:
+                    rec = self.read().to_native()
+                    batch.append(rec if payloads else rec[:4] + (None,))
+            except EOFError:
+                # reading on would go past the end of the last file
+                self.eof = True
+                if not batch:
+                    raise
+            return batch
+        return self.rotdir.read_native_batch(count, payloads)
+    
+    def iter_batches(self, count = BATCH_SIZE, payloads = True):
+        try:
+            while True:
+                yield self.read_batch(count, payloads)
+        except EOFError:
+            pass
+    
+    def read_columns(self, count = COLUMNS_SIZE, payloads = True):
+        """returns up to count records as columns (_passover.TraceColumns, or
+        ColumnBatch without _passover): arrays of the types, depths, 
+        timestamps (nsec) and codepoint indexes, that support the buffer 
+        protocol, and payload(i). raises EOFError at the end"""
+        if not self.native:
+            return ColumnBatch(self.read_batch(count, payloads), payloads)
+        return self.rotdir.read_native_columns(count, payloads)
+    
+    def iter_columns(self, count = COLUMNS_SIZE, payloads = True):
+        try:
+            while True:
+                yield self.read_columns(count, payloads)
+        except EOFError:
+            pass
+    
+    def map_files(self, func, workers = None, processes = False, 
+            count = COLUMNS_SIZE, payloads = True):
+        """calls func(base_offset, chunks) for every file of the trace, where
+        chunks are the file's records as columns (see read_file_columns), on
+        a pool of workers, and yields the results in the order of the files.
+        at most 2 * workers files are decoded or held at a time.
+        
+        decoding columns doesn't hold the GIL, so threads (the default) do 
+        when func is cheap. with processes, func (a module level function) 
+        and its results must be picklable"""
+        if workers is None:
+            workers = multiprocessing.cpu_count()
+        pool = multiprocessing.Pool(workers) if processes else ThreadPool(workers)
+        try:
+            tasks = ((func, fn, base, count, payloads) 
+                for base, fn, version, header_size in self.rotdir.files)
+            for res in _ordered_map(pool, _map_file, tasks, 2 * workers):
+                yield res
+        finally:
+            pool.terminate()
+            pool.join()
+    
+    def iter_columns_parallel(self, workers = None, count = COLUMNS_SIZE, 
+            payloads = True):
+        """like iter_columns, from the start of the trace, but the files are
+        decoded by a pool of threads"""
+        for chunks in self.map_files(_file_chunks, workers, False, count, payloads):
+            for columns in chunks:
+                yield columns
+    
     def read(self):
-        data = self.rotdir.read_record()
-        rec = TraceRecord.load(data)
+        if self.native:
+            return TraceRecord.from_native(self.rotdir.read_native(), self.version, 
+                self.codepoints)
+        rec = None
+        while rec is None:
+            data = self.rotdir.read_record()
+            rec = TraceRecord.load(data, self.rotdir.version, self.state)
         rec._codepoints = self.codepoints
         return rec
     
@@ -365,6 +1035,234 @@ class TraceReader(object):
         except EOFError:
             pass
 
+#===============================================================================
+# Merging threads
+#===============================================================================
+def list_prefixes(path):
+    """returns the prefixes (threads) of the traces in the rotdir, in order"""
+    prefixes = set(fn.rsplit(".", 2)[0] for fn in os.listdir(path) 
+        if fn.endswith(".rot"))
+    return sorted(prefixes, key = lambda prefix: [int(part) if part.isdigit() else part
+        for part in re.split(r"(\d+)", prefix)])
+
+class MergeCursor(object):
+    """the position of a thread's trace in the merge, which reads ahead only
+    a batch of records"""
+    __slots__ = ["prefix", "reader", "batch", "pos", "batch_size"]
+    
+    def __init__(self, prefix, reader, batch_size):
+        self.prefix = prefix
+        self.reader = reader
+        self.batch = []
+        self.pos = 0
+        self.batch_size = batch_size
+    
+    def seek_to_timestamp(self, timestamp_ns):
+        self.reader.seek_to_timestamp(timestamp_ns // 1000)
+        self.batch = []
+        self.pos = 0
+    
+    def next(self):
+        """returns the next record (as in TraceReader.read_batch), or None"""
+        if self.pos >= len(self.batch):
+            try:
+                self.batch = self.reader.read_batch(self.batch_size)
+            except EOFError:
+                return None
+            self.pos = 0
+        rec = self.batch[self.pos]
+        self.pos += 1
+        return rec
+
+class MergedTraceReader(object):
+    """reads the traces of several threads of a rotdir (all of them, by 
+    default) as a single stream of records, ordered by time, and tagged by 
+    the prefix of the thread. the threads' traces are merged by a heap with 
+    an entry per thread, so reading N records of T threads takes 
+    O(N log T), and only a batch of records per thread is held"""
+    __slots__ = ["path", "cursors", "heap", "start_ns"]
+    BATCH_SIZE = 1000
+    
+    def __init__(self, path, prefixes = None, native = None, batch_size = BATCH_SIZE):
+        self.path = path
+        if prefixes is None:
+            prefixes = list_prefixes(path)
+        self.cursors = [MergeCursor(prefix, TraceReader(path, prefix, native), batch_size)
+            for prefix in prefixes]
+        self.heap = None
+        self.start_ns = None
+    
+    @property
+    def prefixes(self):
+        return [cursor.prefix for cursor in self.cursors]
+    
+    def seek_to_timestamp(self, timestamp_ns):
+        """starts every thread at the first of its records whose timestamp is
+        >= the given one, using the thread's timeindex"""
+        for cursor in self.cursors:
+            cursor.seek_to_timestamp(timestamp_ns)
+        self.heap = None
+        self.start_ns = timestamp_ns
+    
+    def _fill(self):
+        self.heap = []
+        for i, cursor in enumerate(self.cursors):
+            rec = cursor.next()
+            while rec is not None and self.start_ns is not None and rec[2] < self.start_ns:
+                rec = cursor.next()
+            if rec is not None:
+                self.heap.append((rec[2], i, rec))
+        heapq.heapify(self.heap)
+    
+    def read_raw(self):
+        """returns the next (prefix, record), where the record is as in 
+        TraceReader.read_batch. raises EOFError at the end"""
+        if self.heap is None:
+            self._fill()
+        if not self.heap:
+            raise EOFError()
+        timestamp_ns, i, rec = self.heap[0]
+        nextrec = self.cursors[i].next()
+        if nextrec is None:
+            heapq.heappop(self.heap)
+        else:
+            heapq.heapreplace(self.heap, (nextrec[2], i, nextrec))
+        return self.cursors[i].prefix, rec
+    
+    def read(self):
+        """returns the next (prefix, record), where the record is as in 
+        TraceReader.read"""
+        if self.heap is None:
+            self._fill()
+        if not self.heap:
+            raise EOFError()
+        i = self.heap[0][1]
+        prefix, rec = self.read_raw()
+        reader = self.cursors[i].reader
+        return prefix, TraceRecord.from_native(rec, reader.version, reader.codepoints)
+    
+    def iter_raw(self):
+        try:
+            while True:
+                yield self.read_raw()
+        except EOFError:
+            pass
+    
+    def __iter__(self):
+        try:
+            while True:
+                yield self.read()
+        except EOFError:
+            pass
+
+#===============================================================================
+# Stats
+#===============================================================================
+class CodepointStats(object):
+    """the stats of a codepoint (times are in nsec). histogram[i] counts the
+    calls whose inclusive time was in bucket i (see StatsReader.bucket_bounds)
+    """
+    __slots__ = ["index", "calls", "inclusive", "exclusive", "max_inclusive",
+        "histogram", "codepoint", "_bounds"]
+    
+    def percentile(self, fraction):
+        """an upper bound on the inclusive time of the given fraction (0..1) 
+        of the calls"""
+        target = fraction * self.calls
+        seen = 0
+        for i, count in enumerate(self.histogram):
+            seen += count
+            if count and seen >= target:
+                return min(self._bounds(i)[1], self.max_inclusive)
+        return self.max_inclusive
+    
+    def __repr__(self):
+        return "<CodepointStats %s calls=%d inclusive=%d exclusive=%d>" % (
+            self.codepoint, self.calls, self.inclusive, self.exclusive)
+
+class StatsReader(object):
+    """reads the call stats of a rotdir's codepoints. the file is written
+    while the program runs, so every read() sees the current numbers; 
+    refresh() picks up codepoints that were added since.
+    
+    when calls were sampled, the stats only cover the sampled calls made at
+    sample_depth (and their subtrees), while calls made above it are all 
+    accounted for. sampling() tells how many calls at sample_depth were 
+    sampled and skipped, so the numbers of the functions called there can be
+    scaled by (sampled + skipped) / sampled"""
+    __slots__ = ["path", "file", "map", "capacity", "entry", "sub_bucket_bits", 
+        "codepoints"]
+    
+    def __init__(self, path):
+        self.path = path
+        self.file = open(os.path.join(path, "stats"), "rb")
+        self.map = None
+        self.capacity = 0
+        self.codepoints = []
+        header = STATS_HEADER.unpack(self.file.read(STATS_HEADER.size))
+        magic, version, self.sub_bucket_bits, buckets, entry_size = header[:5]
+        if magic != STATS_MAGIC:
+            raise ValueError("not a stats file")
+        if version != STATS_VERSION:
+            raise ValueError("unsupported stats file version %d" % (version,))
+        self.entry = Struct("=QQQQ%dQ" % (buckets,))
+        assert self.entry.size == entry_size
+        self.refresh()
+    
+    def close(self):
+        if self.map is not None:
+            self.map.close()
+            self.map = None
+        self.file.close()
+    
+    def refresh(self):
+        self.map = mmap.mmap(self.file.fileno(), 0, access = mmap.ACCESS_READ)
+        capacity = STATS_HEADER.unpack_from(self.map, 0)[6]
+        # the capacity is updated only after the file grows
+        self.capacity = min(capacity, 
+            (len(self.map) - STATS_HEADER_SIZE) // self.entry.size)
+        self.codepoints = TraceReader._load_codepoints(
+            os.path.join(self.path, "codepoints"))
+    
+    def sampling(self):
+        """(sample_depth, sampled_calls, skipped_calls), as of now. 
+        sample_depth is 0 if nothing was sampled"""
+        _, _, _, _, _, _, _, sampled, skipped, depth = STATS_HEADER.unpack_from(
+            self.map, 0)
+        return depth, sampled, skipped
+    
+    def bucket_bounds(self, index):
+        """the (low, high) inclusive time of the calls in a bucket"""
+        sub_buckets = 1 << self.sub_bucket_bits
+        if index < sub_buckets:
+            return index, index + 1
+        shift = (index >> self.sub_bucket_bits) - 1
+        low = (sub_buckets + (index & (sub_buckets - 1))) << shift
+        return low, low + (1 << shift)
+    
+    def read(self, index):
+        """the stats of the codepoint, or None if it wasn't called"""
+        if index >= self.capacity:
+            return None
+        values = self.entry.unpack_from(self.map, 
+            STATS_HEADER_SIZE + index * self.entry.size)
+        if values[0] == 0:
+            return None
+        stats = CodepointStats()
+        stats.index = index
+        stats.calls, stats.inclusive, stats.exclusive, stats.max_inclusive = values[:4]
+        stats.histogram = values[4:]
+        stats.codepoint = self.codepoints[index] if index < len(self.codepoints) else None
+        stats._bounds = self.bucket_bounds
+        return stats
+    
+    def __iter__(self):
+        for i in xrange(self.capacity):
+            stats = self.read(i)
+            if stats is not None:
+                yield stats
+
+
 if __name__ == "__main__":
     reader = TraceReader("../test/tmp", "thread-0")
     for rec in reader:
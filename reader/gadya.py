@@ -70,9 +70,24 @@ def dump_LogRecord(rec):
     else:
         return "LOG (no codepoint)"
 
-def dump(rec):
+@dumper(filestructs.SampleRecord)
+def dump_SampleRecord(rec):
+    return "... %d calls not sampled" % (rec.unsampled,)
+
+@dumper(filestructs.SuppressedRecord)
+def dump_SuppressedRecord(rec):
+    if rec.codepoint:
+        name = rec.codepoint.name
+    else:
+        name = "(no codepoint)"
+    return "... %s: %d calls not recorded, total %.6f sec" % (name, rec.calls, 
+        rec.total_time)
+
+def dump(rec, prefix = None):
     t = time.strftime("%m/%d %H:%M:%S", time.localtime(rec.timestamp))
     rectext = _records[type(rec)](rec)
+    if prefix is not None:
+        return "%s [%s] %s%s" % (t, prefix, "  " * rec.depth, rectext)
     return "%s %s%s" % (t, "  " * rec.depth, rectext)
 
 def main(path, prefix):
@@ -81,12 +96,24 @@ def main(path, prefix):
     for rec in reader:
         print dump(rec)
 
+def main_merged(path, start = None):
+    """dumps all the threads of the rotdir, interleaved in time order, 
+    starting at `start` (seconds since the epoch)"""
+    reader = filestructs.MergedTraceReader(path)
+    if start is not None:
+        reader.seek_to_timestamp(int(start * 1000000000))
+    for prefix, rec in reader:
+        print dump(rec, prefix)
+
 if __name__ == "__main__":
-    try:
-        path, prefix  = sys.argv[1:]
-    except ValueError:
-        sys.exit("Usage: gadya /local/tlib/passover thread-0")
-    main(path, prefix)
+    args = sys.argv[1:]
+    if len(args) == 2 and args[1] != "--all":
+        main(*args)
+    elif len(args) in (1, 2, 3) and args[1:2] in ([], ["--all"]):
+        main_merged(args[0], float(args[2]) if len(args) == 3 else None)
+    else:
+        sys.exit("Usage: gadya /local/tlib/passover thread-0\n"
+            "       gadya /local/tlib/passover [--all [start_time]]")
     
 
 
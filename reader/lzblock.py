@@ -0,0 +1,60 @@
+"""
+lzblock: decompression of the LZ4-format blocks written by the tracer's
+rotzip (see module/lib/lzblock.c)
+"""
+
+MIN_MATCH = 4
+
+
+class CorruptBlock(Exception):
+    pass
+
+def _read_length(data, pos, length):
+    while True:
+        if pos >= len(data):
+            raise CorruptBlock("truncated length")
+        b = ord(data[pos])
+        pos += 1
+        length += b
+        if b != 255:
+            return pos, length
+
+def decompress(data, size):
+    """decompresses a block whose original size is `size` bytes"""
+    out = bytearray()
+    pos = 0
+    end = len(data)
+    while pos < end:
+        token = ord(data[pos])
+        pos += 1
+
+        length = token >> 4
+        if length == 15:
+            pos, length = _read_length(data, pos, length)
+        if pos + length > end:
+            raise CorruptBlock("literals past the end of the block")
+        out += data[pos:pos + length]
+        pos += length
+        if pos == end:
+            break # the last sequence has no match
+
+        if pos + 2 > end:
+            raise CorruptBlock("truncated match")
+        offset = ord(data[pos]) | (ord(data[pos + 1]) << 8)
+        pos += 2
+        if offset == 0 or offset > len(out):
+            raise CorruptBlock("bad match offset")
+        length = token & 15
+        if length == 15:
+            pos, length = _read_length(data, pos, length)
+        length += MIN_MATCH
+        start = len(out) - offset
+        if length <= offset:
+            out += out[start:start + length]
+        else:
+            # the match overlaps itself, i.e., repeats the last `offset` bytes
+            pattern = out[start:]
+            out += (pattern * (length // offset + 1))[:length]
+    if len(out) != size:
+        raise CorruptBlock("expected %d bytes, got %d" % (size, len(out)))
+    return str(out)
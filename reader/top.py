@@ -0,0 +1,408 @@
+"""
+passover-top: a live view of what a traced process is doing
+
+attaches (read-only) to a rotdir that's being written, follows the current
+file of every thread, and every few seconds shows the functions that took
+the most time since the last refresh, and what every thread is up to.
+
+only the headers of the records are decoded (type, depth, timestamp and
+codepoint), and the tails are read with plain reads rather than mapped:
+the writer trims a file when it's done with it, and touching a map past
+the new end would kill us with SIGBUS. nothing here takes a lock or writes
+anything, so the traced process can't tell we're here.
+
+Usage: top.py [options] /path/to/rotdir
+"""
+import sys
+import os
+import time
+from optparse import OptionParser
+import filestructs
+from filestructs import TraceRecord, UINT16, DecoderState
+
+
+READ_SIZE = 4 * 1024 * 1024
+
+PYCALL, PYRET, PYRAISE, CCALL, CRET, CRAISE = 1, 2, 3, 4, 5, 6
+SYNC, SUPPRESSED = 8, 10
+CALLS = (PYCALL, CCALL)
+RETURNS = (PYRET, PYRAISE, CRET, CRAISE)
+
+
+def read_varint(data, i):
+    """returns (value, index after it)"""
+    value = 0
+    shift = 0
+    while True:
+        b = ord(data[i])
+        i += 1
+        value |= (b & 0x7f) << shift
+        if b < 0x80:
+            return value, i
+        shift += 7
+
+def list_threads(path):
+    """returns {prefix: [(base_offset, filename), ...]} of the uncompressed
+    trace files in the rotdir, sorted by base offset"""
+    threads = {}
+    for fn in os.listdir(path):
+        if not fn.endswith(".rot"):
+            continue
+        prefix = fn.rsplit(".", 2)[0]
+        threads.setdefault(prefix, []).append(fn)
+    for prefix, files in threads.items():
+        infos = []
+        for fn in files:
+            fn = os.path.join(path, fn)
+            try:
+                info = filestructs.open_rotrec_file(fn)
+            except (IOError, OSError):
+                continue # rotated out since we listed the directory
+            if not info:
+                continue
+            base_offset, version, header_size, file = info
+            file.close()
+            if version >= 2 and not isinstance(file, filestructs.RotzipFile):
+                infos.append((base_offset, fn))
+        infos.sort()
+        threads[prefix] = infos
+    return threads
+
+
+class Codepoints(object):
+    """the rotdir's codepoints, read as far as the records need them. a
+    codepoint is written before any record that refers to it, so reading
+    up to the highest index we've seen never runs into one that's only half
+    written"""
+    __slots__ = ["file", "pos", "codepoints"]
+
+    def __init__(self, path):
+        self.file = open(os.path.join(path, "codepoints"), "rb")
+        self.pos = 0
+        self.codepoints = []
+
+    def get(self, index):
+        if index >= len(self.codepoints):
+            self._read_up_to(index)
+        if index < len(self.codepoints):
+            return self.codepoints[index]
+        return None
+
+    def _read_up_to(self, index):
+        self.file.seek(self.pos)
+        data = self.file.read(READ_SIZE)
+        i = 0
+        while len(self.codepoints) <= index and i + UINT16.size <= len(data):
+            length, = UINT16.unpack_from(data, i)
+            if length == 0 or i + UINT16.size + length > len(data):
+                break
+            try:
+                cp = filestructs.CodepointRecord.load(
+                    data[i + UINT16.size:i + UINT16.size + length])
+            except EOFError:
+                break
+            self.codepoints.append(cp)
+            i += UINT16.size + length
+        self.pos += i
+
+
+class FunctionStats(object):
+    __slots__ = ["calls", "inclusive", "exclusive"]
+    def __init__(self):
+        self.calls = 0
+        self.inclusive = 0
+        self.exclusive = 0
+
+
+class ThreadTail(object):
+    """follows the records of a thread as they're written. the first poll
+    skips to the last sync record (hopping over the records by their length,
+    without decoding them), since records are only relative to the ones
+    before them. calls that were made before we got there have no start
+    time, so their returns are ignored.
+
+    stats are in the units of the timestamps (see duration_ns) and are
+    collected until take_stats()"""
+    __slots__ = ["prefix", "filename", "base_offset", "file", "pos", "state",
+        "stack", "stats", "events", "attached"]
+
+    def __init__(self, prefix, base_offset, filename):
+        self.prefix = prefix
+        self.state = DecoderState()
+        self.stack = []
+        self.stats = {}
+        self.events = 0
+        self.attached = False
+        self._open(base_offset, filename)
+
+    def _open(self, base_offset, filename):
+        self.base_offset = base_offset
+        self.filename = filename
+        _, _, header_size, self.file = filestructs.open_rotrec_file(filename)
+        self.pos = header_size
+
+    def close(self):
+        self.file.close()
+
+    @property
+    def depth(self):
+        return self.state.depth
+
+    def duration_ns(self, duration):
+        return self.state.get_duration_ns(duration)
+
+    def take_stats(self):
+        stats, events = self.stats, self.events
+        self.stats = {}
+        self.events = 0
+        return stats, events
+
+    def poll(self, files):
+        """reads whatever was written since the last poll. files are the
+        thread's files (see list_threads), for when the current one is done
+        """
+        while True:
+            if not self.attached:
+                self._attach()
+            while self._read():
+                pass
+            if not self._sealed():
+                return
+            # everything in the file was read by now
+            later = [info for info in files if info[0] > self.base_offset]
+            if not later:
+                return
+            self.file.close()
+            self._open(*later[0])
+
+    def _sealed(self):
+        """whether the writer is done with the file (it has a footer). our
+        own descriptor is checked, since the file may have been compressed
+        or rotated out by now"""
+        size = os.fstat(self.file.fileno()).st_size
+        if size < filestructs.ROTREC_FOOTER.size:
+            return False
+        self.file.seek(size - filestructs.ROTREC_FOOTER.size)
+        footer = filestructs.ROTREC_FOOTER.unpack(
+            self.file.read(filestructs.ROTREC_FOOTER.size))
+        return footer[3] == filestructs.ROTREC_FOOTER_MAGIC
+
+    def _attach(self):
+        last_sync = None
+        while True:
+            self.file.seek(self.pos)
+            data = self.file.read(READ_SIZE)
+            i = 0
+            while i + UINT16.size < len(data):
+                length, = UINT16.unpack_from(data, i)
+                if length == 0 or i + UINT16.size + length > len(data):
+                    break
+                if ord(data[i + UINT16.size]) & TraceRecord.HEADER_TYPE_MASK == SYNC:
+                    last_sync = self.pos + i
+                i += UINT16.size + length
+            self.pos += i
+            if i == 0 or len(data) < READ_SIZE:
+                break
+        if last_sync is not None:
+            self.pos = last_sync
+        self.attached = True
+
+    def _read(self):
+        """decodes the records in the next READ_SIZE bytes, returning
+        whether there may be more"""
+        self.file.seek(self.pos)
+        data = self.file.read(READ_SIZE)
+        state = self.state
+        stack = self.stack
+        stats = self.stats
+        n = len(data)
+        i = 0
+        count = 0
+        while i + UINT16.size < n:
+            length, = UINT16.unpack_from(data, i)
+            start = i + UINT16.size
+            end = start + length
+            if length == 0 or end > n:
+                break
+            i = end
+            count += 1
+            header = ord(data[start])
+            type = header & 0x1f
+            if type == SYNC or not state.synced:
+                TraceRecord.load(data[start:end], 2, state)
+                continue
+            depth_code = header >> 5
+            j = start + 1
+            if depth_code == TraceRecord.HEADER_DEPTH_ESCAPE:
+                value, j = read_varint(data, j)
+                state.depth += (value >> 1) ^ -(value & 1)
+            else:
+                state.depth += (depth_code >> 1) ^ -(depth_code & 1)
+            value, j = read_varint(data, j)
+            state.timestamp += (value >> 1) ^ -(value & 1)
+            if type in CALLS:
+                cpindex, j = read_varint(data, j)
+                stack.append([cpindex, state.timestamp, 0])
+            elif type in RETURNS:
+                if not stack:
+                    continue
+                cpindex, start_ts, children = stack.pop()
+                inclusive = state.timestamp - start_ts
+                if stack:
+                    stack[-1][2] += inclusive
+                fs = stats.get(cpindex)
+                if fs is None:
+                    fs = stats[cpindex] = FunctionStats()
+                fs.calls += 1
+                fs.inclusive += inclusive
+                fs.exclusive += inclusive - children
+            elif type == SUPPRESSED:
+                # the calls and total time of a governed function; its
+                # callers already counted that time as their own
+                cpindex, j = read_varint(data, j)
+                calls, j = read_varint(data, j)
+                total, j = read_varint(data, j)
+                fs = stats.get(cpindex)
+                if fs is None:
+                    fs = stats[cpindex] = FunctionStats()
+                fs.calls += calls
+                fs.inclusive += total
+        self.pos += i
+        self.events += count
+        return i > 0 and n == READ_SIZE
+
+
+def describe(cp):
+    if isinstance(cp, filestructs.PyFuncCodepoint):
+        return cp.name, "%s:%s" % (cp.filename, cp.lineno)
+    if isinstance(cp, filestructs.CFuncCodepoint):
+        return cp.name, cp.module
+    if isinstance(cp, filestructs.LoglineCodepoint):
+        return "(log)", cp.format
+    return "(unknown)", ""
+
+class Top(object):
+    SORT_KEYS = ("calls", "inclusive", "exclusive")
+
+    def __init__(self, path, count = 20, sort_key = "exclusive"):
+        self.path = path
+        self.count = count
+        self.sort_key = sort_key
+        self.codepoints = Codepoints(path)
+        self.threads = {}
+        self.last_time = time.time()
+
+    def poll(self, files):
+        """files is the listing of the rotdir (see list_threads), which is
+        only taken once every refresh"""
+        for prefix, thread_files in files.items():
+            if not thread_files:
+                continue
+            tail = self.threads.get(prefix)
+            if tail is None:
+                base_offset, fn = thread_files[-1]
+                try:
+                    tail = self.threads[prefix] = ThreadTail(prefix, base_offset, fn)
+                except (IOError, OSError):
+                    continue # rotated out already
+            try:
+                tail.poll(thread_files)
+            except (IOError, OSError):
+                # we fell behind, and the next file was rotated out before
+                # we got to it; start over from the thread's current file
+                tail.close()
+                del self.threads[prefix]
+
+    def collect(self):
+        """returns (elapsed, functions, threads): the functions' stats (in
+        nsec) summed over all threads, and (prefix, events, calls, depth,
+        busiest cpindex) of every thread"""
+        now = time.time()
+        elapsed = max(now - self.last_time, 1e-6)
+        self.last_time = now
+        functions = {}
+        threads = []
+        for prefix, tail in sorted(self.threads.items()):
+            stats, events = tail.take_stats()
+            calls = 0
+            busiest = None
+            for cpindex, fs in stats.iteritems():
+                total = functions.get(cpindex)
+                if total is None:
+                    total = functions[cpindex] = FunctionStats()
+                total.calls += fs.calls
+                total.inclusive += tail.duration_ns(fs.inclusive)
+                total.exclusive += tail.duration_ns(fs.exclusive)
+                calls += fs.calls
+                if busiest is None or fs.exclusive > stats[busiest].exclusive:
+                    busiest = cpindex
+            threads.append((prefix, events, calls, tail.depth, busiest))
+        return elapsed, functions, threads
+
+    def render(self, elapsed, functions, threads):
+        lines = []
+        events = sum(t[1] for t in threads)
+        lines.append("passover-top: %s -- %d threads, %d events/sec" % (self.path,
+            len(threads), events / elapsed))
+        lines.append("")
+        lines.append("%10s %8s %8s %10s  %-30s %s" % ("CALLS/S", "INCL%", "EXCL%",
+            "AVG(us)", "FUNCTION", "WHERE"))
+        top = sorted(functions.items(), key = lambda item: getattr(item[1],
+            self.sort_key), reverse = True)[:self.count]
+        for cpindex, fs in top:
+            name, where = describe(self.codepoints.get(cpindex))
+            lines.append("%10d %8.1f %8.1f %10.1f  %-30s %s" % (fs.calls / elapsed,
+                fs.inclusive / (elapsed * 1e7), fs.exclusive / (elapsed * 1e7),
+                fs.inclusive / (fs.calls * 1000.0) if fs.calls else 0, name[:30],
+                where))
+        lines.append("")
+        lines.append("%-20s %10s %10s %6s  %s" % ("THREAD", "EVENTS/S", "CALLS/S",
+            "DEPTH", "BUSIEST"))
+        for prefix, events, calls, depth, busiest in threads:
+            name = describe(self.codepoints.get(busiest))[0] if busiest is not None else ""
+            lines.append("%-20s %10d %10d %6s  %s" % (prefix[:20], events / elapsed,
+                calls / elapsed, depth if depth is not None else "?", name))
+        return "\n".join(lines)
+
+    def run(self, interval, iterations = None):
+        self.poll(list_threads(self.path))
+        self.collect() # whatever came before we attached
+        while iterations is None or iterations > 0:
+            deadline = time.time() + interval
+            files = list_threads(self.path)
+            while True:
+                self.poll(files)
+                if time.time() >= deadline:
+                    break
+                time.sleep(min(0.1, max(deadline - time.time(), 0)))
+            text = self.render(*self.collect())
+            if sys.stdout.isatty():
+                sys.stdout.write("\x1b[H\x1b[2J")
+            sys.stdout.write(text + "\n")
+            sys.stdout.flush()
+            if iterations is not None:
+                iterations -= 1
+
+
+def main(argv):
+    parser = OptionParser(usage = "%prog [options] ROTDIR")
+    parser.add_option("-n", "--count", type = "int", default = 20,
+        help = "how many functions to show")
+    parser.add_option("-i", "--interval", type = "float", default = 2.0,
+        help = "seconds between refreshes")
+    parser.add_option("-s", "--sort", choices = Top.SORT_KEYS, default = "exclusive",
+        help = "sort by calls, inclusive or exclusive time")
+    parser.add_option("-c", "--iterations", type = "int", default = None,
+        help = "quit after this many refreshes")
+    options, args = parser.parse_args(argv)
+    if len(args) != 1:
+        parser.error("expected the path of a rotdir")
+    top = Top(args[0], options.count, options.sort)
+    try:
+        top.run(options.interval, options.iterations)
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
+
@@ -0,0 +1,60 @@
+from __future__ import with_statement
+import sys
+import os
+import time
+import resource
+import subprocess
+import passover
+
+#
+# runs the same workload traced with different map_flags, each in a fresh
+# process, and prints the minor/major page faults and the time it took.
+# usage: python bench_mapflags.py [iterations] [path]
+#
+
+CONFIGS = [
+    ("default", 0),
+    ("sequential", passover.MAP_SEQUENTIAL),
+    ("populate", passover.MAP_POPULATE),
+    ("dontneed-retired", passover.MAP_DONTNEED_RETIRED),
+    ("cold-retired", passover.MAP_COLD_RETIRED),
+]
+
+def leaf(a, b):
+    return a + b
+
+def work(n):
+    s = 0
+    for i in xrange(n):
+        s = leaf(s, i)
+        len("x" * (i % 7))
+    return s
+
+def run_one(map_flags, iterations, path):
+    r0 = resource.getrusage(resource.RUSAGE_SELF)
+    t0 = time.time()
+    with passover.traced(path, max_files = 10, map_size = 4 * passover.wrappers.MB,
+            file_size = 64 * passover.wrappers.MB, map_flags = map_flags):
+        work(iterations)
+    t1 = time.time()
+    r1 = resource.getrusage(resource.RUSAGE_SELF)
+    print r1.ru_minflt - r0.ru_minflt, r1.ru_majflt - r0.ru_majflt, t1 - t0
+
+def main():
+    iterations = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+    path = sys.argv[2] if len(sys.argv) > 2 else "bench-tmp"
+    print "%-22s %10s %8s %10s %12s" % ("map_flags", "minflt", "majflt", "time", "calls/sec")
+    for name, flags in CONFIGS:
+        out = subprocess.check_output([sys.executable, __file__, "--one",
+            str(flags), str(iterations), path])
+        minflt, majflt, elapsed = out.split()
+        elapsed = float(elapsed)
+        print "%-22s %10s %8s %9.3fs %12d" % (name, minflt, majflt, elapsed,
+            (2 * iterations) / elapsed)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1 and sys.argv[1] == "--one":
+        run_one(int(sys.argv[2]), int(sys.argv[3]), sys.argv[4])
+    else:
+        main()
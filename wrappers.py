@@ -1,11 +1,11 @@
 from __future__ import with_statement
 import sys
 import os
-import gc
 import itertools
 import thread
 import shutil
-from types import FunctionType, BuiltinFunctionType
+import signal
+from types import BuiltinFunctionType
 from contextlib import contextmanager
 import _passover
 
@@ -45,51 +45,46 @@ def _clear_flag(func, flag):
         _passover._clear_code_flags(_get_code(func), flag)
     return func
 
-def _get_all_functions(codepred, bltpred):
-    for obj in gc.get_objects():
-        if isinstance(obj, FunctionType) and codepred(obj):
-            yield obj
-        elif isinstance(obj, BuiltinFunctionType) and bltpred(obj):
-            yield obj
-
 #===============================================================================
 # ignore function, module and package
 #===============================================================================
 SINGLE = _passover.CO_PASSOVER_IGNORED_SINGLE
 CHILDREN = _passover.CO_PASSOVER_IGNORED_CHILDREN
 WHOLE = _passover.CO_PASSOVER_IGNORED_WHOLE
-#DETAILED = _passover.CO_PASSOVER_DETAILED
+DETAILED = _passover.CO_PASSOVER_DETAILED
 
 def ignore_function(func, mode = CHILDREN):
     return _set_flag(func, mode)
 
+def ignore_functions_named(pattern, mode = CHILDREN):
+    """ignores all functions whose name matches the glob pattern"""
+    _passover.add_ignore_rule(_passover.IGNORE_FUNCTION, pattern, mode)
+
 def ignore_module(module, mode = WHOLE):
-    fn = module.__file__.rsplit(".", 1)[0]
-    def codepred(obj, fn = fn):
-        return obj.func_code.co_filename.startswith(fn)
-    def bltpred(obj, modname = module.__name__):
-        return obj.__module__ == modname
-    for func in (codepred, bltpred):
-        ignore_function(func, mode)
+    """ignores the functions of the module, including those it defines (or
+    that are loaded) later"""
+    if getattr(module, "__file__", None):
+        fn = module.__file__.rsplit(".", 1)[0]
+        _passover.add_ignore_rule(_passover.IGNORE_FILENAME, fn, mode)
+    if not hasattr(module, "__path__"):
+        # the module rule would cover the whole package
+        _passover.add_ignore_rule(_passover.IGNORE_MODULE, module.__name__, mode)
 
 def ignore_package(module, mode = WHOLE):
-    if hasattr(module, "__path__"):
-        fn = module.__path__[0]
-    elif hasattr(module, "__file__"):
-        fn = module.__file__.rsplit(".", 1)[0]
-    else:
-        fn = None
-    if fn:
-        def codepred(obj, fn = fn):
-            return obj.func_code.co_filename.startswith(fn)
-    else:
-        def codepred(obj):
-            return False
-    def bltpred(obj, modname = module.__name__):
-        return obj.__module__ and obj.__module__.startswith(modname)
-    
-    for func in _get_all_functions(codepred, bltpred):
-        ignore_function(func, mode)
+    """ignores the functions of the package and everything in it, including
+    modules that are imported later"""
+    if not hasattr(module, "__path__"):
+        return ignore_module(module, mode)
+    _passover.add_ignore_rule(_passover.IGNORE_FILENAME,
+        os.path.join(module.__path__[0], ""), mode)
+    _passover.add_ignore_rule(_passover.IGNORE_MODULE, module.__name__, mode)
+
+clear_ignore_rules = _passover.clear_ignore_rules
+
+def capture_function(func):
+    """in tail capture mode (see traced()), every call of func starts a 
+    subtree of its own"""
+    return _set_flag(func, DETAILED)
 
 #===============================================================================
 # threading
@@ -99,41 +94,61 @@ _thread_counter = itertools.count()
 _orig_start_new_thread = thread.start_new_thread
 _orig_start_new = thread.start_new
 _per_thread = thread._local()
+# the live flight recorders, by thread counter
+_flight_recorders = {}
 
-def _thread_wrapper(func, args, kwargs):
-    with _traced(_per_thread.rotdir, template = _per_thread.template, 
-            map_size = _per_thread.map_size, file_size = _per_thread.file_size):
+def _thread_wrapper(rotdir, template, trace_children, options, func, args, kwargs):
+    with _traced(rotdir, template = template, trace_children = trace_children,
+            **options):
         return func(*args, **kwargs)
 
 def _start_new_thread(func, args, kwargs = {}):
-    if _per_thread.traced and _per_thread.trace_children:
-        return _orig_start_new_thread(_thread_wrapper, (func, args, kwargs))
+    # _per_thread is thread-local, so the new thread is given the settings of
+    # the thread that started it
+    if getattr(_per_thread, "traced", False) and _per_thread.trace_children:
+        return _orig_start_new_thread(_thread_wrapper, (_per_thread.rotdir,
+            _per_thread.template, _per_thread.trace_children,
+            _per_thread.options, func, args, kwargs))
     else:
         return _orig_start_new_thread(func, args, kwargs)
 
 thread.start_new_thread = thread.start_new = _start_new_thread
 
 @contextmanager
-def _traced(rotdir, template, trace_children, map_size, file_size):
+def _traced(rotdir, template, trace_children, **options):
+    # options are passed as-is to Passover (map_size, file_size, etc.)
     tid = _thread_counter.next()
     _per_thread.tid = tid
     _per_thread.traced = False
     
     _per_thread.rotdir = rotdir
-    _per_thread.map_size = map_size
-    _per_thread.file_size = file_size
+    _per_thread.options = options
     _per_thread.template = template
     _per_thread.trace_children = trace_children
     
     prefix = template % (tid,)
 
-    po = _passover.Passover(rotdir, prefix, map_size, file_size)
+    po = _passover.Passover(rotdir, prefix, **options)
     po.start()
-    _per_thread.traced = False
+    _per_thread.traced = True
+    if options.get("flight_size"):
+        _flight_recorders[tid] = po
     try:
         yield po
+    except Exception:
+        # an exception that gets this far is what flight recorders are for.
+        # if dumping fails too, it's the original exception that's raised
+        # (in python 2, a bare raise would raise the dump's instead)
+        exc_info = sys.exc_info()
+        if tid in _flight_recorders:
+            try:
+                po.dump()
+            except Exception:
+                pass
+        raise exc_info[0], exc_info[1], exc_info[2]
     finally:
         _per_thread.traced = False
+        _flight_recorders.pop(tid, None)
         po.stop()
 
 
@@ -142,12 +157,70 @@ def _traced(rotdir, template, trace_children, map_size, file_size):
 #===============================================================================
 MB = 1024 * 1024
 
+MAP_POPULATE = _passover.MAP_POPULATE
+MAP_LOCKED = _passover.MAP_LOCKED
+MAP_SEQUENTIAL = _passover.MAP_SEQUENTIAL
+MAP_MSYNC_RETIRED = _passover.MAP_MSYNC_RETIRED
+MAP_DONTNEED_RETIRED = _passover.MAP_DONTNEED_RETIRED
+MAP_COLD_RETIRED = _passover.MAP_COLD_RETIRED
+
 log = _passover.log
 
+def dump(seconds = 0, megabytes = 0):
+    """dumps the most recent records of all flight recorders (see traced())
+    to disk: those of the last `seconds`, or at least `megabytes` of them
+    per thread (0 means no limit). returns the number of records written"""
+    return sum(po.dump(int(megabytes * MB), int(seconds * 1000000))
+        for po in _flight_recorders.values())
+
+def dump_on_signal(signum = signal.SIGUSR2, seconds = 0, megabytes = 0):
+    """installs a handler that dumps the flight recorders when the process
+    gets the given signal"""
+    def handler(signum, frame):
+        dump(seconds, megabytes)
+    signal.signal(signum, handler)
+
 @contextmanager
 def traced(path, max_files = 100, delete_path_if_exists = True, 
         template = "thread-%d", trace_threads = True, map_size = 2 * MB, 
-        file_size = 100 * MB):
+        file_size = 100 * MB, ring_size = 0, drop_when_full = False,
+        prealloc_percent = 0, map_flags = 0, compress = False,
+        raw_timestamps = False, sample_every = 0, sample_slice = 0,
+        sample_period = 0, sample_depth = 1, max_call_rate = 0, flight_size = 0,
+        capture_threshold = 0, capture_size = 4 * MB, capture_depth = 1,
+        stats = False):
+    """traces the current thread (and the threads it starts, if trace_threads
+    is set) into the rotdir at `path`.
+    
+    ring_size -- if nonzero (a power of two), the traced threads only queue
+    their records, and a background thread writes them to disk. 
+    drop_when_full -- when the ring is full, drop records instead of waiting
+    prealloc_percent -- once a file is filled this much, the next one is 
+    prepared in the background (e.g., 75). the default, 0, creates files
+    only when needed
+    map_flags -- a combination of MAP_* (e.g., MAP_SEQUENTIAL | MAP_COLD_RETIRED)
+    compress -- compress the trace files in the background once they're full
+    raw_timestamps -- record raw clock ticks, which the reader converts to 
+    wall time (see _passover.clock_info())
+    sample_every -- record only one in every sample_every calls made at 
+    sample_depth (each with its whole subtree)
+    sample_slice, sample_period -- record only the calls (at sample_depth) 
+    made during the first sample_slice usec of every sample_period usec
+    max_call_rate -- functions called more often than this (per second, per
+    thread) are only summarized (SuppressedRecord) instead of recorded
+    flight_size -- if nonzero, records are kept in memory (about this many 
+    bytes of the most recent ones, per thread) and written to disk only by 
+    dump(), or when an exception propagates out of the traced block
+    capture_threshold -- if nonzero, only subtrees that take at least this 
+    many usec are written: those of calls made at capture_depth (0 for none),
+    and of functions passed to capture_function(). each is held back in a 
+    ring of capture_size bytes until it's done
+    stats -- keep the call count, inclusive and exclusive times and a 
+    histogram of the durations of every function in the rotdir's `stats`
+    file, which can be read while the program runs (see StatsReader). with
+    sampling, calls that were skipped aren't accounted for in it. off by
+    default, since it adds to the cost of every call and return
+    """
     path = os.path.abspath(path)
     if path not in _rotdirs:
         if os.path.exists(path):
@@ -157,7 +230,7 @@ def traced(path, max_files = 100, delete_path_if_exists = True,
                 raise TracerPathError("path already exists")
             shutil.rmtree(path)
         os.makedirs(path)
-        _rotdirs[path] = _passover.Rotdir(path, max_files)
+        _rotdirs[path] = _passover.Rotdir(path, max_files, compress, stats)
     
     rotdir = _rotdirs[path]
     if max_files != rotdir.max_files:
@@ -165,7 +238,14 @@ def traced(path, max_files = 100, delete_path_if_exists = True,
             "number of max_files")
     
     with _traced(rotdir, template = template, trace_children = trace_threads, 
-            map_size = map_size, file_size = file_size) as po:
+            map_size = map_size, file_size = file_size, ring_size = ring_size,
+            drop_when_full = drop_when_full, 
+            prealloc_percent = prealloc_percent, map_flags = map_flags,
+            raw_timestamps = raw_timestamps, sample_every = sample_every,
+            sample_slice = sample_slice, sample_period = sample_period,
+            sample_depth = sample_depth, max_call_rate = max_call_rate,
+            flight_size = flight_size, capture_threshold = capture_threshold,
+            capture_size = capture_size, capture_depth = capture_depth) as po:
         yield po
 
 